@@ -0,0 +1,435 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <itkTimeProbe.h>
+#include <itkMultiThreader.h>
+#include <itkImageRegionIterator.h>
+#include <itkImageRegionConstIterator.h>
+
+#include <tclap/CmdLine.h>
+#include <rpiCommonTools.hxx>
+
+#include "SyntheticData.h"
+#include "ReferenceConfiguration.h"
+#include "itkDemonsCommandIterationUpdate.h"
+#include "itkLCCDeformableRegistrationFilter.h"
+#include "rpiLCClogDemons.hxx"
+
+
+/*
+ * Accuracy versus speed validation of alternative (fast) configurations of
+ * the LCC log-Demons against the reference configuration. Both are run on
+ * synthetic pairs with a known ground truth (see SyntheticData.h), and the
+ * final displacement fields are compared to the true field with the metrics
+ * of DemonsCommandIterationUpdate: RMS distance to the true field, RMS
+ * distance of the Jacobians and fraction of voxels with |Jac|<=0.
+ *
+ * A mode is given as "name:key=value,key=value,..." with the keys
+ *
+ *   prefetch=0|1            compute the next pyramid level during the current one
+ *   time-budget=<s>         wall-clock budget of the registration
+ *   metric-tolerance=<t>    convergence tolerance on the LCC metric
+ *   rms-tolerance=<t>       convergence tolerance on the RMS of the update
+ *   convergence-window=<n>  number of iterations of the convergence test
+ *   min-iterations=<n>      iterations of each level before the convergence is tested
+ *   bch-expansion=<n>       number of terms of the BCH expansion
+ *   iterations=<axbxc>      iterations per level
+ *   threads=<n>             number of threads
+ *   planar=0|1              smooth and update the fields on planar fields
+ *
+ * and the tolerances of the mode, which override the command line ones:
+ *
+ *   field-tolerance=<r>     relative increase of the distance to the true field
+ *   jacobian-tolerance=<r>  relative increase of the distance of the Jacobians
+ *   folding-tolerance=<f>   increase of the fraction of voxels with |Jac|<=0
+ *
+ * The program fails if a mode exceeds one of its tolerances on average.
+ */
+
+
+typedef synthetic::ImageType                                      ImageType;
+typedef synthetic::FieldType                                      FieldType;
+typedef synthetic::RegistrationType                               RegistrationType;
+typedef RegistrationType::DisplacementFieldTransformType::VectorFieldType
+                                                                  DisplacementFieldType;
+typedef itk::LCCDeformableRegistrationFilter<ImageType,ImageType,DisplacementFieldType>
+                                                                  BaseRegistrationFilterType;
+typedef DemonsCommandIterationUpdate<BaseRegistrationFilterType,
+                                     RegistrationType::LCCRegistrationFilterType,
+                                     double, 3>                   MetricsType;
+
+
+/**
+ * Structure containing the input parameters.
+ */
+struct Param{
+    std::string               sizes;
+    unsigned int              numberOfPairs;
+    double                    maximumNorm;
+    std::string               iterations;
+    std::vector<std::string>  modes;
+    double                    fieldTolerance;
+    double                    jacobianTolerance;
+    double                    foldingTolerance;
+};
+
+
+/**
+ * Configuration of the registration and tolerances of a mode.
+ */
+struct Mode{
+    std::string                         name;
+    std::map<std::string,std::string>   options;
+    double                              fieldTolerance;
+    double                              jacobianTolerance;
+    double                              foldingTolerance;
+};
+
+
+/**
+ * Time and errors of a registration.
+ */
+struct Run{
+    double  seconds;
+    double  fieldDistance;
+    double  jacobianDistance;
+    double  folding;
+};
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Accuracy versus speed of alternative configurations of the LCC log-Demons with respect to ";
+    description += "the reference configuration, on synthetic pairs with a known true field. ";
+    description += "Modes are given as name:key=value,key=value (see the source for the keys).";
+
+    std::string des_sizes             = "Image sizes (voxels per axis) separated by \"x\" (default 64).";
+    std::string des_numberOfPairs     = "Number of synthetic pairs per size (default 3).";
+    std::string des_maximumNorm       = "Maximum norm of the synthetic velocity fields in voxels, at size 64 (default 3).";
+    std::string des_iterations        = "Iterations per level of the reference, from coarse to fine (default 15x10x5).";
+    std::string des_modes             = "Alternative mode; may be repeated (default prefetch and early convergence modes).";
+    std::string des_fieldTolerance    = "Maximum relative increase of the distance to the true field (default 0.05).";
+    std::string des_jacobianTolerance = "Maximum relative increase of the distance of the Jacobians (default 0.05).";
+    std::string des_foldingTolerance  = "Maximum increase of the fraction of voxels with |Jac|<=0 (default 0.0001).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+
+        TCLAP::ValueArg<std::string>   arg_sizes( "s", "sizes", des_sizes, false, "64", "uintx...xuint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_numberOfPairs( "p", "pairs", des_numberOfPairs, false, 3, "uint", cmd );
+        TCLAP::ValueArg<double>        arg_maximumNorm( "", "max-norm", des_maximumNorm, false, 3.0, "double", cmd );
+        TCLAP::ValueArg<std::string>   arg_iterations( "a", "iterations", des_iterations, false, "15x10x5", "uintx...xuint", cmd );
+        TCLAP::MultiArg<std::string>   arg_modes( "m", "mode", des_modes, false, "name:key=value,...", cmd );
+        TCLAP::ValueArg<double>        arg_fieldTolerance( "", "field-tolerance", des_fieldTolerance, false, 0.05, "double", cmd );
+        TCLAP::ValueArg<double>        arg_jacobianTolerance( "", "jacobian-tolerance", des_jacobianTolerance, false, 0.05, "double", cmd );
+        TCLAP::ValueArg<double>        arg_foldingTolerance( "", "folding-tolerance", des_foldingTolerance, false, 0.0001, "double", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.sizes              = arg_sizes.getValue();
+        param.numberOfPairs      = std::max( 1u, arg_numberOfPairs.getValue() );
+        param.maximumNorm        = arg_maximumNorm.getValue();
+        param.iterations         = arg_iterations.getValue();
+        param.modes              = arg_modes.getValue();
+        param.fieldTolerance     = arg_fieldTolerance.getValue();
+        param.jacobianTolerance  = arg_jacobianTolerance.getValue();
+        param.foldingTolerance   = arg_foldingTolerance.getValue();
+
+        if ( param.modes.empty() )
+        {
+            param.modes.push_back( "prefetch:prefetch=1" );
+            param.modes.push_back( "converge:metric-tolerance=0.001,convergence-window=5,min-iterations=5" );
+        }
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+/**
+ * Parses a mode "name:key=value,key=value".
+ * @param  text   mode description
+ * @param  param  parameters giving the default tolerances
+ * @return mode
+ */
+Mode ParseMode( const std::string & text, const Param & param )
+{
+    Mode mode;
+    mode.fieldTolerance    = param.fieldTolerance;
+    mode.jacobianTolerance = param.jacobianTolerance;
+    mode.foldingTolerance  = param.foldingTolerance;
+
+    const std::string::size_type colon = text.find( ':' );
+    mode.name = text.substr( 0, colon );
+    if ( mode.name.empty() )
+        throw std::runtime_error( "Mode without name: " + text );
+
+    std::istringstream stream( colon == std::string::npos ? std::string() : text.substr( colon + 1 ) );
+    std::string option;
+    while ( std::getline( stream, option, ',' ) )
+    {
+        const std::string::size_type equal = option.find( '=' );
+        if ( equal == std::string::npos )
+            throw std::runtime_error( "Invalid option \"" + option + "\" in mode " + mode.name );
+        const std::string key   = option.substr( 0, equal );
+        const std::string value = option.substr( equal + 1 );
+
+        if ( key == "field-tolerance" )
+            mode.fieldTolerance = atof( value.c_str() );
+        else if ( key == "jacobian-tolerance" )
+            mode.jacobianTolerance = atof( value.c_str() );
+        else if ( key == "folding-tolerance" )
+            mode.foldingTolerance = atof( value.c_str() );
+        else if ( key == "prefetch" || key == "time-budget" || key == "metric-tolerance" ||
+                  key == "rms-tolerance" || key == "convergence-window" || key == "min-iterations" ||
+                  key == "bch-expansion" || key == "iterations" || key == "threads" ||
+                  key == "planar" )
+            mode.options[key] = value;
+        else
+            throw std::runtime_error( "Unknown option \"" + key + "\" in mode " + mode.name );
+    }
+    return mode;
+}
+
+
+/**
+ * Converts a field to the scalar type of the registration output.
+ * @param  field  input field
+ * @return converted field
+ */
+DisplacementFieldType::Pointer ConvertField( const FieldType * field )
+{
+    DisplacementFieldType::Pointer output = DisplacementFieldType::New();
+    output->CopyInformation( field );
+    output->SetRegions( field->GetLargestPossibleRegion() );
+    output->Allocate();
+
+    itk::ImageRegionConstIterator<FieldType>        in( field, field->GetLargestPossibleRegion() );
+    itk::ImageRegionIterator<DisplacementFieldType> out( output, output->GetLargestPossibleRegion() );
+    for ( in.GoToBegin(), out.GoToBegin(); !in.IsAtEnd(); ++in, ++out )
+    {
+        DisplacementFieldType::PixelType v;
+        for ( unsigned int d=0; d<3; d++ )
+            v[d] = in.Get()[d];
+        out.Set( v );
+    }
+    return output;
+}
+
+
+/**
+ * Registers a synthetic pair with the reference configuration modified by
+ * the options of a mode, and measures the errors of the result.
+ * @param  pair        synthetic pair
+ * @param  trueField   true field, converted to the output type
+ * @param  param       parameters
+ * @param  options     options of the mode (empty for the reference)
+ * @return time and errors
+ */
+Run RunRegistration( const synthetic::Pair & pair,
+                     const DisplacementFieldType * trueField,
+                     const Param & param,
+                     const std::map<std::string,std::string> & options )
+{
+    // Reference configuration (see ReferenceConfiguration.h)
+    RegistrationType registration;
+    synthetic::SetReferenceConfiguration( registration, param.iterations );
+    registration.SetFixedImage(  pair.fixed );
+    registration.SetMovingImage( pair.moving );
+
+    // Options of the mode
+    const int defaultNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    std::map<std::string,std::string>::const_iterator it;
+    for ( it = options.begin(); it != options.end(); ++it )
+    {
+        const char * value = it->second.c_str();
+        if ( it->first == "prefetch" )
+            registration.SetPrefetchPyramidLevels( atoi( value ) != 0 );
+        else if ( it->first == "time-budget" )
+            registration.SetTimeBudget( atof( value ) );
+        else if ( it->first == "metric-tolerance" )
+            registration.SetMetricConvergenceTolerance( atof( value ) );
+        else if ( it->first == "rms-tolerance" )
+            registration.SetRMSChangeConvergenceTolerance( atof( value ) );
+        else if ( it->first == "convergence-window" )
+            registration.SetConvergenceWindowSize( atoi( value ) );
+        else if ( it->first == "min-iterations" )
+            registration.SetMinimumNumberOfIterations( atoi( value ) );
+        else if ( it->first == "bch-expansion" )
+            registration.SetNumberOfTermsBCHExpansion( atoi( value ) );
+        else if ( it->first == "iterations" )
+            registration.SetNumberOfIterations( rpi::StringToVector<unsigned int>( it->second ) );
+        else if ( it->first == "threads" )
+            itk::MultiThreader::SetGlobalDefaultNumberOfThreads( atoi( value ) );
+        else if ( it->first == "planar" )
+            registration.SetUsePlanarFields( atoi( value ) != 0 );
+    }
+
+    itk::TimeProbe probe;
+    probe.Start();
+    try
+    {
+        registration.StartRegistration();
+    }
+    catch( ... )
+    {
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( defaultNumberOfThreads );
+        throw;
+    }
+    probe.Stop();
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads( defaultNumberOfThreads );
+
+    // Errors with respect to the true field
+    const MetricsType::FieldMetrics metrics = MetricsType::ComputeFieldMetrics(
+            registration.GetDisplacementFieldTransformation()->GetParametersAsVectorField(), trueField );
+
+    Run run;
+    run.seconds          = probe.GetMean();
+    run.fieldDistance    = metrics.FieldDistance;
+    run.jacobianDistance = metrics.FieldGradientDistance;
+    run.folding          = metrics.JacobianBelowZero;
+    return run;
+}
+
+
+/**
+ * Relative difference of an error with respect to the reference.
+ */
+double RelativeIncrease( double value, double reference )
+{
+    return reference > 0.0 ? ( value - reference ) / reference : value - reference;
+}
+
+
+int main( int argc, char** argv )
+{
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters( argc, argv, param );
+
+        std::vector<Mode> modes;
+        for ( unsigned int m=0; m<param.modes.size(); m++ )
+            modes.push_back( ParseMode( param.modes[m], param ) );
+
+        // Sums over the pairs of the reference and of each mode
+        const std::vector<unsigned int> sizes = rpi::StringToVector<unsigned int>( param.sizes );
+        Run reference = { 0.0, 0.0, 0.0, 0.0 };
+        std::vector<Run> sums( modes.size(), reference );
+        unsigned int numberOfRuns = 0;
+
+        std::cout << std::left  << std::setw(14) << "MODE"
+                  << std::right << std::setw(6)  << "SIZE"
+                  << std::setw(6)  << "PAIR"
+                  << std::setw(12) << "TIME (s)"
+                  << std::setw(12) << "d(.,true)"
+                  << std::setw(14) << "d(Jac,true)"
+                  << std::setw(14) << "|Jac|<=0" << std::endl;
+
+        for ( unsigned int s=0; s<sizes.size(); s++ )
+        {
+            for ( unsigned int p=0; p<param.numberOfPairs; p++ )
+            {
+                const unsigned int size = sizes[s];
+                synthetic::Pair pair = synthetic::CreatePair( size, param.maximumNorm * size / 64.0, p + 1 );
+                DisplacementFieldType::Pointer trueField = ConvertField( pair.trueField );
+
+                std::vector<Run> runs;
+                runs.push_back( RunRegistration( pair, trueField, param, std::map<std::string,std::string>() ) );
+                for ( unsigned int m=0; m<modes.size(); m++ )
+                    runs.push_back( RunRegistration( pair, trueField, param, modes[m].options ) );
+
+                for ( unsigned int r=0; r<runs.size(); r++ )
+                {
+                    std::cout << std::left  << std::setw(14) << ( r == 0 ? std::string( "reference" ) : modes[r-1].name )
+                              << std::right << std::setw(6)  << size
+                              << std::setw(6)  << p
+                              << std::setw(12) << std::fixed << std::setprecision(3) << runs[r].seconds
+                              << std::setw(12) << std::setprecision(4) << runs[r].fieldDistance
+                              << std::setw(14) << runs[r].jacobianDistance
+                              << std::setw(14) << std::scientific << std::setprecision(2) << runs[r].folding
+                              << std::endl;
+
+                    Run & sum = ( r == 0 ) ? reference : sums[r-1];
+                    sum.seconds          += runs[r].seconds;
+                    sum.fieldDistance    += runs[r].fieldDistance;
+                    sum.jacobianDistance += runs[r].jacobianDistance;
+                    sum.folding          += runs[r].folding;
+                }
+                numberOfRuns++;
+            }
+        }
+
+        // Speedup and error deltas of each mode, averaged over the pairs
+        std::cout << std::endl;
+        std::cout << std::left  << std::setw(14) << "MODE"
+                  << std::right << std::setw(10) << "SPEEDUP"
+                  << std::setw(14) << "d(.,true)"
+                  << std::setw(14) << "d(Jac,true)"
+                  << std::setw(14) << "|Jac|<=0"
+                  << "  RESULT" << std::endl;
+
+        bool passed = true;
+        for ( unsigned int m=0; m<modes.size(); m++ )
+        {
+            const double speedup       = sums[m].seconds > 0.0 ? reference.seconds / sums[m].seconds : 0.0;
+            const double fieldDelta    = RelativeIncrease( sums[m].fieldDistance, reference.fieldDistance );
+            const double jacobianDelta = RelativeIncrease( sums[m].jacobianDistance, reference.jacobianDistance );
+            const double foldingDelta  = ( sums[m].folding - reference.folding ) / numberOfRuns;
+
+            const bool modePassed = fieldDelta    <= modes[m].fieldTolerance &&
+                                    jacobianDelta <= modes[m].jacobianTolerance &&
+                                    foldingDelta  <= modes[m].foldingTolerance;
+            passed = passed && modePassed;
+
+            std::cout << std::left  << std::setw(14) << modes[m].name
+                      << std::right << std::setw(9)  << std::fixed << std::setprecision(2) << speedup << "x"
+                      << std::setw(13) << std::showpos << 100.0 * fieldDelta << "%"
+                      << std::setw(13) << 100.0 * jacobianDelta << "%"
+                      << std::setw(14) << std::scientific << foldingDelta << std::noshowpos
+                      << ( modePassed ? "  ok" : "  FAILED" ) << std::endl;
+        }
+
+        if ( !passed )
+        {
+            std::cerr << "Some modes exceed their tolerances." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <itkMultiThreader.h>
+#include <itkImageRegionIterator.h>
+#include <itksys/SystemTools.hxx>
+
+#include <tclap/CmdLine.h>
+
+#include "SyntheticData.h"
+#include "ReferenceConfiguration.h"
+
+
+/*
+ * Test of the batch registration of rpi::LCClogDemons. Several synthetic
+ * moving images are registered to the same fixed image with a mask, once
+ * one after the other with StartRegistration (reference) and once with
+ * StartBatchRegistration running several registrations at the same time,
+ * each with the same number of threads as the reference. The batch shares
+ * the fixed and mask pyramids between its registration threads.
+ *
+ * The test fails if a batch displacement field differs from the reference
+ * by more than the tolerance, or if the verbose diagnostics of the batch
+ * did not go to the csv files of the registration threads
+ * (metricvalues_<thread>.csv, in the current directory).
+ */
+
+
+typedef synthetic::ImageType                                           ImageType;
+typedef synthetic::RegistrationType                                    RegistrationType;
+typedef RegistrationType::DisplacementFieldTransformType::VectorFieldType
+                                                                       DisplacementFieldType;
+
+
+/**
+ * Structure containing the input parameters.
+ */
+struct Param{
+    unsigned int  size;
+    unsigned int  numberOfImages;
+    unsigned int  concurrentRegistrations;
+    unsigned int  threadsPerRegistration;
+    std::string   iterations;
+    double        tolerance;
+};
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Registers synthetic moving images to one fixed image with a mask, one after the other and with ";
+    description += "the concurrent batch registration, and compares the displacement fields.";
+
+    std::string des_size                    = "Size of the synthetic images in voxels per axis (default 48).";
+    std::string des_numberOfImages          = "Number of moving images (default 6).";
+    std::string des_concurrentRegistrations = "Number of registrations of the batch run at the same time (default 3).";
+    std::string des_threadsPerRegistration  = "Number of threads of each registration (default 1).";
+    std::string des_iterations              = "Iterations per level, from coarse to fine (default 10x5).";
+    std::string des_tolerance               = "Maximum norm of the difference between a batch field and its reference (default 1e-4).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+
+        TCLAP::ValueArg<unsigned int>  arg_size( "s", "size", des_size, false, 48, "uint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_numberOfImages( "n", "images", des_numberOfImages, false, 6, "uint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_concurrentRegistrations( "c", "concurrent-registrations", des_concurrentRegistrations, false, 3, "uint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_threadsPerRegistration( "t", "threads-per-registration", des_threadsPerRegistration, false, 1, "uint", cmd );
+        TCLAP::ValueArg<std::string>   arg_iterations( "a", "iterations", des_iterations, false, "10x5", "uintx...xuint", cmd );
+        TCLAP::ValueArg<double>        arg_tolerance( "", "tolerance", des_tolerance, false, 1e-4, "double", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.size                    = arg_size.getValue();
+        param.numberOfImages          = std::max( 1u, arg_numberOfImages.getValue() );
+        param.concurrentRegistrations = std::max( 1u, arg_concurrentRegistrations.getValue() );
+        param.threadsPerRegistration  = std::max( 1u, arg_threadsPerRegistration.getValue() );
+        param.iterations              = arg_iterations.getValue();
+        param.tolerance               = arg_tolerance.getValue();
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+/**
+ * Creates a binary mask of the head of the phantom.
+ * @param  fixed  phantom
+ * @return mask
+ */
+ImageType::Pointer CreateMask( ImageType * fixed )
+{
+    ImageType::Pointer mask = synthetic::CreateImage<ImageType>( fixed->GetLargestPossibleRegion().GetSize()[0] );
+    itk::ImageRegionConstIterator<ImageType> in( fixed, fixed->GetLargestPossibleRegion() );
+    itk::ImageRegionIterator<ImageType>      out( mask, mask->GetLargestPossibleRegion() );
+    for ( in.GoToBegin(), out.GoToBegin(); !in.IsAtEnd(); ++in, ++out )
+        out.Set( in.Get() > 20.0f ? 1.0f : 0.0f );
+    return mask;
+}
+
+
+/**
+ * Counts the lines of a file, 0 if it does not exist.
+ */
+unsigned int CountLines( const std::string & path )
+{
+    std::ifstream file( path.c_str() );
+    unsigned int numberOfLines = 0;
+    std::string line;
+    while ( std::getline( file, line ) )
+        numberOfLines++;
+    return numberOfLines;
+}
+
+
+int main( int argc, char** argv )
+{
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters( argc, argv, param );
+
+        // Fixed image, mask and moving images
+        std::vector<ImageType::Pointer> movingImages;
+        ImageType::Pointer fixed;
+        for ( unsigned int i=0; i<param.numberOfImages; i++ )
+        {
+            synthetic::Pair pair = synthetic::CreatePair( param.size, 3.0 * param.size / 64.0, i + 1 );
+            movingImages.push_back( pair.moving );
+            if ( i == 0 )
+                fixed = pair.fixed;
+        }
+        ImageType::Pointer mask = CreateMask( fixed );
+
+        // Reference: one registration after the other
+        const int defaultNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( param.threadsPerRegistration );
+        std::vector<DisplacementFieldType::ConstPointer> references;
+        for ( unsigned int i=0; i<param.numberOfImages; i++ )
+        {
+            RegistrationType registration;
+            synthetic::SetReferenceConfiguration( registration, param.iterations );
+            registration.SetFixedImage(  fixed );
+            registration.SetMovingImage( movingImages[i] );
+            registration.UseMask(        true );
+            registration.SetMaskImage(   mask );
+            registration.StartRegistration();
+            references.push_back( registration.GetDisplacementFieldTransformation()->GetParametersAsVectorField() );
+        }
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( defaultNumberOfThreads );
+
+        // Batch, with the diagnostics of each registration thread in its own file
+        itksys::SystemTools::RemoveFile( "metricvalues.csv" );
+        for ( unsigned int i=0; i<param.concurrentRegistrations; i++ )
+        {
+            std::ostringstream fileName;
+            fileName << "metricvalues_" << i << ".csv";
+            itksys::SystemTools::RemoveFile( fileName.str().c_str() );
+        }
+
+        RegistrationType batch;
+        synthetic::SetReferenceConfiguration( batch, param.iterations );
+        batch.SetFixedImage(                      fixed );
+        batch.UseMask(                            true );
+        batch.SetMaskImage(                       mask );
+        batch.SetVerbosity(                       true );
+        batch.SetNumberOfConcurrentRegistrations( param.concurrentRegistrations );
+        batch.SetNumberOfThreadsPerRegistration(  param.threadsPerRegistration );
+        batch.StartBatchRegistration( movingImages );
+
+        // Comparison with the reference
+        std::cout << std::endl;
+        std::cout << std::left  << std::setw(8) << "IMAGE"
+                  << std::right << std::setw(16) << "max |diff|" << "  RESULT" << std::endl;
+
+        bool passed = true;
+        for ( unsigned int i=0; i<param.numberOfImages; i++ )
+        {
+            const double difference = synthetic::MaximumDifference<DisplacementFieldType>(
+                    batch.GetBatchDisplacementFieldTransformation( i )->GetParametersAsVectorField(), references[i] );
+            const bool imagePassed = difference <= param.tolerance;
+            passed = passed && imagePassed;
+            std::cout << std::left  << std::setw(8) << i
+                      << std::right << std::setw(16) << std::scientific << std::setprecision(3) << difference
+                      << ( imagePassed ? "  ok" : "  FAILED" ) << std::endl;
+        }
+
+        // A registration thread may get no image if the others took them
+        // all, but every registration must have reported its iterations
+        unsigned int numberOfRows = 0;
+        for ( unsigned int i=0; i<param.concurrentRegistrations; i++ )
+        {
+            std::ostringstream fileName;
+            fileName << "metricvalues_" << i << ".csv";
+            const unsigned int numberOfLines = CountLines( fileName.str() );
+            if ( numberOfLines > 0 )
+                numberOfRows += numberOfLines - 1;
+        }
+        const bool separateFiles = numberOfRows >= param.numberOfImages &&
+                                   !itksys::SystemTools::FileExists( "metricvalues.csv", true );
+        passed = passed && separateFiles;
+        std::cout << std::endl << "Diagnostics rows in metricvalues_<thread>.csv: " << numberOfRows
+                  << ( separateFiles ? "  ok" : "  FAILED" ) << std::endl;
+
+        if ( !passed )
+        {
+            std::cerr << "The batch registration differs from the reference." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
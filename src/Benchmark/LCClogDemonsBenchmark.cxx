@@ -0,0 +1,726 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include <itkTimeProbe.h>
+#include <itkWarpImageFilter.h>
+#include <itkGaussianOperator.h>
+#include <itkVectorNeighborhoodOperatorImageFilter.h>
+
+#include <tclap/CmdLine.h>
+#include <rpiCommonTools.hxx>
+
+#include "SyntheticData.h"
+#include "ReferenceConfiguration.h"
+#include "SVFLogJacobian.h"
+#include "itkLocalCriteriaOptimizer.h"
+#include "itkExponentialDeformationFieldImageFilter2.h"
+#include "itkVelocityFieldLieBracketFilter.h"
+#include "itkVelocityFieldBCHCompositionFilter.h"
+#include "itkDisplacementFieldCompositionFilter.h"
+#include "itkRegistrationThreadPool.h"
+#include "rpiLCClogDemons.hxx"
+
+
+/*
+ * Benchmarks of the LCC log-Demons kernels and registrations on synthetic
+ * data generated in memory (see SyntheticData.h). Each kernel is timed in
+ * isolation on a registration pair of each requested size; the best time of
+ * the repetitions is kept. The throughput (voxels/s) and the peak resident
+ * set size of the process are reported, and compared to a baseline file if
+ * one is given:
+ *
+ *   rpiLCClogDemonsBenchmark --save-baseline baseline.txt      (reference machine / build)
+ *   rpiLCClogDemonsBenchmark --baseline baseline.txt           (after a change)
+ *
+ * The program fails if a kernel is slower than its baseline by more than the
+ * tolerance. The peak RSS is the high-water mark of the whole process, so it
+ * only grows from one kernel to the next.
+ *
+ * The ForkJoin report times registrations in the reference configuration
+ * with the RegistrationThreadPool and without it (--no-thread-pool), and
+ * gives the time per iteration before and after the pool.
+ */
+
+
+typedef synthetic::ImageType    ImageType;
+typedef synthetic::FieldType    FieldType;
+
+
+/**
+ * Structure containing the input parameters.
+ */
+struct Param{
+    std::string               sizes;
+    std::vector<std::string>  kernels;
+    unsigned int              repetitions;
+    std::string               iterations;
+    unsigned int              maxRegistrationSize;
+    double                    maximumNorm;
+    int                       seed;
+    std::string               baselinePath;
+    std::string               saveBaselinePath;
+    double                    tolerance;
+};
+
+
+/**
+ * Timing of a kernel on one size.
+ */
+struct Result{
+    std::string    kernel;
+    unsigned int   size;
+    double         seconds;
+    double         voxelsPerSecond;
+    unsigned long  peakRSS;      // in kB
+};
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Benchmarks of the LCC log-Demons kernels and registrations on synthetic data. ";
+    description += "Kernels: LCCStatistics, VectorSmoothing, Exponential, InverseExponential, LieBracket, ";
+    description += "BCHComposition, ImageWarp, FieldComposition, SVFLogJacobian, Registration, ForkJoin.";
+
+    std::string des_sizes               = "Image sizes (voxels per axis) separated by \"x\" (default 64x128x256).";
+    std::string des_kernels             = "Kernel to run; may be repeated (default all).";
+    std::string des_repetitions         = "Number of runs of each kernel, the best time is kept (default 3).";
+    std::string des_iterations          = "Iterations per level of the registrations, from coarse to fine (default 10x5x2).";
+    std::string des_maxRegistrationSize = "Largest size on which full registrations are run (default 128).";
+    std::string des_maximumNorm         = "Maximum norm of the synthetic velocity fields in voxels, at size 64 (default 3).";
+    std::string des_seed                = "Seed of the synthetic velocity fields (default 1).";
+    std::string des_baseline            = "Baseline file to compare the throughputs to.";
+    std::string des_saveBaseline        = "File where the throughputs are saved as a new baseline.";
+    std::string des_tolerance           = "Relative slowdown with respect to the baseline above which the benchmark fails (default 0.1).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+
+        TCLAP::ValueArg<std::string>   arg_sizes( "s", "sizes", des_sizes, false, "64x128x256", "uintx...xuint", cmd );
+        TCLAP::MultiArg<std::string>   arg_kernels( "k", "kernel", des_kernels, false, "string", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_repetitions( "n", "repetitions", des_repetitions, false, 3, "uint", cmd );
+        TCLAP::ValueArg<std::string>   arg_iterations( "a", "iterations", des_iterations, false, "10x5x2", "uintx...xuint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_maxRegistrationSize( "", "max-registration-size", des_maxRegistrationSize, false, 128, "uint", cmd );
+        TCLAP::ValueArg<double>        arg_maximumNorm( "", "max-norm", des_maximumNorm, false, 3.0, "double", cmd );
+        TCLAP::ValueArg<int>           arg_seed( "", "seed", des_seed, false, 1, "int", cmd );
+        TCLAP::ValueArg<std::string>   arg_baseline( "b", "baseline", des_baseline, false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>   arg_saveBaseline( "", "save-baseline", des_saveBaseline, false, "", "string", cmd );
+        TCLAP::ValueArg<double>        arg_tolerance( "t", "tolerance", des_tolerance, false, 0.1, "double", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.sizes                = arg_sizes.getValue();
+        param.kernels              = arg_kernels.getValue();
+        param.repetitions          = std::max( 1u, arg_repetitions.getValue() );
+        param.iterations           = arg_iterations.getValue();
+        param.maxRegistrationSize  = arg_maxRegistrationSize.getValue();
+        param.maximumNorm          = arg_maximumNorm.getValue();
+        param.seed                 = arg_seed.getValue();
+        param.baselinePath         = arg_baseline.getValue();
+        param.saveBaselinePath     = arg_saveBaseline.getValue();
+        param.tolerance            = arg_tolerance.getValue();
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+/**
+ * Gets the peak resident set size of the process.
+ * @return peak RSS in kB (0 if not available)
+ */
+unsigned long GetPeakRSS()
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+
+/**
+ * A kernel timed by the benchmark. Initialize() prepares the inputs from a
+ * synthetic pair and is not timed, Run() is timed.
+ */
+class Kernel
+{
+public:
+    virtual ~Kernel() {}
+    virtual const char * GetName() const = 0;
+    virtual void Initialize( const synthetic::Pair & pair ) = 0;
+    virtual void Run() = 0;
+    virtual void Release() = 0;
+    /** Full registrations are only run up to a given size. */
+    virtual bool IsRegistration() const { return false; }
+};
+
+
+/**
+ * Local statistics of the LCC criterion: warps of both images and high order
+ * terms, as computed at the start of each iteration.
+ */
+class LCCStatisticsKernel : public Kernel
+{
+public:
+    typedef itk::LocalCriteriaOptimizer<ImageType,ImageType,FieldType> FunctionType;
+
+    const char * GetName() const { return "LCCStatistics"; }
+
+    void Initialize( const synthetic::Pair & pair )
+    {
+        m_Function = FunctionType::New();
+        m_Function->SetFixedImage( pair.fixed );
+        m_Function->SetMovingImage( pair.moving );
+#if (ITK_VERSION_MAJOR < 4)
+        m_Function->SetDeformationField( synthetic::Exponential( pair.velocity, false ) );
+#else
+        m_Function->SetDisplacementField( synthetic::Exponential( pair.velocity, false ) );
+#endif
+        m_Function->SetInverseDeformationField( synthetic::Exponential( pair.velocity, true ) );
+        const double sigma[3] = { 3.0, 3.0, 3.0 };
+        m_Function->SetSigma( sigma );
+    }
+
+    void Run()     { m_Function->InitializeIteration(); }
+    void Release() { m_Function = NULL; }
+
+private:
+    FunctionType::Pointer m_Function;
+};
+
+
+/**
+ * Separable Gaussian smoothing of a vector field, as used for the
+ * regularization of the velocity and update fields.
+ */
+class VectorSmoothingKernel : public Kernel
+{
+public:
+    typedef itk::GaussianOperator<float,3>                                      OperatorType;
+    typedef itk::VectorNeighborhoodOperatorImageFilter<FieldType,FieldType>     SmootherType;
+
+    const char * GetName() const { return "VectorSmoothing"; }
+
+    void Initialize( const synthetic::Pair & pair )
+    {
+        FieldType * input = pair.velocity;
+        for ( unsigned int j=0; j<3; j++ )
+        {
+            m_Operators[j].SetDirection( j );
+            m_Operators[j].SetVariance( 1.5 * 1.5 );
+            m_Operators[j].SetMaximumError( 0.1 );
+            m_Operators[j].SetMaximumKernelWidth( 30 );
+            m_Operators[j].CreateDirectional();
+
+            m_Smoothers[j] = SmootherType::New();
+            m_Smoothers[j]->SetOperator( m_Operators[j] );
+            m_Smoothers[j]->SetInput( input );
+            input = m_Smoothers[j]->GetOutput();
+        }
+    }
+
+    void Run()
+    {
+        m_Smoothers[0]->Modified();
+        m_Smoothers[2]->Update();
+    }
+
+    void Release()
+    {
+        for ( unsigned int j=0; j<3; j++ )
+            m_Smoothers[j] = NULL;
+    }
+
+private:
+    OperatorType          m_Operators[3];
+    SmootherType::Pointer m_Smoothers[3];
+};
+
+
+/**
+ * Exponential (scaling and squaring) of the velocity field, or of its opposite.
+ */
+class ExponentialKernel : public Kernel
+{
+public:
+    typedef itk::ExponentialDeformationFieldImageFilter<FieldType,FieldType> ExponentiatorType;
+
+    ExponentialKernel( bool inverse ) : m_Inverse( inverse ) {}
+
+    const char * GetName() const { return m_Inverse ? "InverseExponential" : "Exponential"; }
+
+    void Initialize( const synthetic::Pair & pair )
+    {
+        m_Exponentiator = ExponentiatorType::New();
+        m_Exponentiator->SetInput( pair.velocity );
+        m_Exponentiator->AutomaticNumberOfIterationsOn();
+        m_Exponentiator->SetComputeInverse( m_Inverse );
+    }
+
+    void Run()
+    {
+        m_Exponentiator->Modified();
+        m_Exponentiator->Update();
+    }
+
+    void Release() { m_Exponentiator = NULL; }
+
+private:
+    bool                       m_Inverse;
+    ExponentiatorType::Pointer m_Exponentiator;
+};
+
+
+/**
+ * Lie bracket of two velocity fields, or their BCH composition with the
+ * first order bracket term (as for the update of the velocity field).
+ */
+class BCHKernel : public Kernel
+{
+public:
+    typedef itk::VelocityFieldLieBracketFilter<FieldType,FieldType>      LieBracketType;
+    typedef itk::VelocityFieldBCHCompositionFilter<FieldType,FieldType>  BCHType;
+
+    BCHKernel( bool bracketOnly, double maximumNorm, int seed ) :
+        m_BracketOnly( bracketOnly ), m_MaximumNorm( maximumNorm ), m_Seed( seed ) {}
+
+    const char * GetName() const { return m_BracketOnly ? "LieBracket" : "BCHComposition"; }
+
+    void Initialize( const synthetic::Pair & pair )
+    {
+        // A small update field
+        const unsigned int size = pair.velocity->GetLargestPossibleRegion().GetSize()[0];
+        FieldType::Pointer update = synthetic::CreateVelocityField( size, 0.1 * m_MaximumNorm, m_Seed + 1 );
+
+        if ( m_BracketOnly )
+        {
+            m_Filter = LieBracketType::New();
+        }
+        else
+        {
+            BCHType::Pointer bch = BCHType::New();
+            bch->SetNumberOfApproximationTerms( 3 );
+            m_Filter = bch;
+        }
+        m_Filter->SetInput( 0, pair.velocity );
+        m_Filter->SetInput( 1, update );
+    }
+
+    void Run()
+    {
+        m_Filter->Modified();
+        m_Filter->Update();
+    }
+
+    void Release() { m_Filter = NULL; }
+
+private:
+    bool                                                   m_BracketOnly;
+    double                                                 m_MaximumNorm;
+    int                                                    m_Seed;
+    itk::ImageToImageFilter<FieldType,FieldType>::Pointer  m_Filter;
+};
+
+
+/**
+ * Warp of the moving image, or composition of two displacement fields.
+ */
+class WarpKernel : public Kernel
+{
+public:
+    typedef itk::WarpImageFilter<ImageType,ImageType,FieldType>               WarperType;
+    typedef itk::DisplacementFieldCompositionFilter<FieldType,FieldType>      ComposerType;
+
+    WarpKernel( bool composition ) : m_Composition( composition ) {}
+
+    const char * GetName() const { return m_Composition ? "FieldComposition" : "ImageWarp"; }
+
+    void Initialize( const synthetic::Pair & pair )
+    {
+        FieldType::Pointer displacement = synthetic::Exponential( pair.velocity, false );
+        if ( m_Composition )
+        {
+            ComposerType::Pointer composer = ComposerType::New();
+            composer->SetInput( 0, displacement );
+            composer->SetInput( 1, pair.trueField );
+            m_Filter = composer;
+        }
+        else
+        {
+            WarperType::Pointer warper = WarperType::New();
+            warper->SetInput( pair.moving );
+            warper->SetOutputParametersFromImage( pair.fixed );
+#if (ITK_VERSION_MAJOR < 4)
+            warper->SetDeformationField( displacement );
+#else
+            warper->SetDisplacementField( displacement );
+#endif
+            m_Filter = warper;
+        }
+    }
+
+    void Run()
+    {
+        m_Filter->Modified();
+        m_Filter->Update();
+    }
+
+    void Release() { m_Filter = NULL; }
+
+private:
+    bool                        m_Composition;
+    itk::ProcessObject::Pointer m_Filter;
+};
+
+
+/**
+ * Log-Jacobian map of the velocity field (scaling and squaring scheme).
+ */
+class SVFLogJacobianKernel : public Kernel
+{
+public:
+    const char * GetName() const { return "SVFLogJacobian"; }
+    void Initialize( const synthetic::Pair & pair ) { m_Velocity = pair.velocity; }
+    void Run()     { m_Computer.Compute( m_Velocity, NULL, 1.0, false ); }
+    void Release() { m_Velocity = NULL; }
+
+private:
+    FieldType::Pointer     m_Velocity;
+    SVFLogJacobianComputer m_Computer;
+};
+
+
+/**
+ * Full multi-resolution LCC registration with the default parameters of
+ * the command line tool.
+ */
+class RegistrationKernel : public Kernel
+{
+public:
+    typedef synthetic::RegistrationType RegistrationType;
+
+    RegistrationKernel( const std::string & iterations ) : m_Iterations( iterations ) {}
+
+    const char * GetName() const { return "Registration"; }
+    bool IsRegistration() const  { return true; }
+
+    void Initialize( const synthetic::Pair & pair )
+    {
+        m_Fixed  = pair.fixed;
+        m_Moving = pair.moving;
+    }
+
+    void Run()     { RegistrationKernel::Register( m_Fixed, m_Moving, m_Iterations, false ); }
+
+    /** Registration with the parameters of the kernel. */
+    static void Register( ImageType * fixed, ImageType * moving, const std::string & iterations, bool planarFields )
+    {
+        RegistrationType registration;
+        synthetic::SetReferenceConfiguration( registration, iterations );
+        registration.SetFixedImage(     fixed );
+        registration.SetMovingImage(    moving );
+        registration.SetUsePlanarFields( planarFields );
+        registration.StartRegistration();
+    }
+
+    void Release()
+    {
+        m_Fixed  = NULL;
+        m_Moving = NULL;
+    }
+
+private:
+    std::string         m_Iterations;
+    ImageType::Pointer  m_Fixed;
+    ImageType::Pointer  m_Moving;
+};
+
+
+/**
+ * Times registrations with the thread pool enabled or disabled.
+ * @param  pair         synthetic pair
+ * @param  param        parameters
+ * @param  pool         whether the parallel loops run on the thread pool
+ * @param  loops        number of parallel loops of one registration
+ * @return minimum time of a registration over the repetitions, in seconds
+ */
+double MeasureRegistration( const synthetic::Pair & pair, const Param & param, bool pool, unsigned long & loops )
+{
+    itk::RegistrationThreadPool * threadPool = itk::RegistrationThreadPool::GetGlobalPool();
+    const bool enabled = itk::RegistrationThreadPool::GetGlobalEnabled();
+    itk::RegistrationThreadPool::SetGlobalEnabled( pool );
+
+    double minimum = itk::NumericTraits<double>::max();
+    for ( unsigned int r=0; r<param.repetitions; r++ )
+    {
+        const unsigned long loopsBefore = threadPool->GetNumberOfPoolLoops() + threadPool->GetNumberOfForkJoinLoops();
+        itk::TimeProbe probe;
+        probe.Start();
+        RegistrationKernel::Register( pair.fixed, pair.moving, param.iterations, false );
+        probe.Stop();
+        loops   = threadPool->GetNumberOfPoolLoops() + threadPool->GetNumberOfForkJoinLoops() - loopsBefore;
+        minimum = std::min( minimum, static_cast<double>( probe.GetTotal() ) );
+    }
+
+    itk::RegistrationThreadPool::SetGlobalEnabled( enabled );
+    return minimum;
+}
+
+
+/**
+ * Prints the time per iteration of a registration in the reference
+ * configuration with the thread pool and with the threads created at each
+ * parallel loop (--no-thread-pool), on the smallest size.
+ * @param  param  parameters
+ */
+void ReportForkJoin( const Param & param )
+{
+    const std::vector<unsigned int> sizes      = rpi::StringToVector<unsigned int>( param.sizes );
+    const std::vector<unsigned int> iterations = rpi::StringToVector<unsigned int>( param.iterations );
+    const unsigned int size = std::min( *std::min_element( sizes.begin(), sizes.end() ), param.maxRegistrationSize );
+    unsigned int numberOfIterations = 0;
+    for ( unsigned int i=0; i<iterations.size(); i++ )
+        numberOfIterations += iterations[i];
+    numberOfIterations = std::max( 1u, numberOfIterations );
+
+    synthetic::Pair pair = synthetic::CreatePair( size, param.maximumNorm * size / 64.0, param.seed );
+
+    // The workers of the pool are created by the first registration
+    unsigned long loops = 0;
+    RegistrationKernel::Register( pair.fixed, pair.moving, param.iterations, false );
+    const double forkJoin = MeasureRegistration( pair, param, false, loops );
+    const double pool     = MeasureRegistration( pair, param, true,  loops );
+
+    std::cout << std::endl;
+    std::cout << "FORK/JOIN OVERHEAD (" << itk::MultiThreader::GetGlobalDefaultNumberOfThreads()
+              << " threads, size " << size << ", " << param.iterations << " iterations)" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "  Parallel loops of the project per iteration : "
+              << static_cast<double>( loops ) / numberOfIterations << std::endl;
+    std::cout << std::setprecision(3);
+    std::cout << "  --no-thread-pool                            : " << forkJoin / numberOfIterations * 1e3 << " ms per iteration" << std::endl;
+    std::cout << "  Thread pool                                 : " << pool / numberOfIterations * 1e3 << " ms per iteration" << std::endl;
+    std::cout << std::setprecision(2);
+    std::cout << "  Speedup                                     : " << ( pool > 0.0 ? forkJoin / pool : 0.0 ) << std::endl;
+}
+
+
+/**
+ * Reads a baseline file. Each line holds a kernel name, a size and a
+ * throughput in voxels/s; lines starting with # are ignored.
+ * @param  fileName  path of the baseline
+ * @return throughputs indexed by kernel name and size
+ */
+std::map< std::pair<std::string,unsigned int>, double > ReadBaseline( const std::string & fileName )
+{
+    std::ifstream file( fileName.c_str() );
+    if ( !file )
+        throw std::runtime_error( "Could not read the baseline " + fileName + "." );
+
+    std::map< std::pair<std::string,unsigned int>, double > baseline;
+    std::string line;
+    while ( std::getline( file, line ) )
+    {
+        if ( line.empty() || line[0] == '#' )
+            continue;
+        std::istringstream stream( line );
+        std::string  kernel;
+        unsigned int size;
+        double       voxelsPerSecond;
+        if ( stream >> kernel >> size >> voxelsPerSecond )
+            baseline[ std::make_pair( kernel, size ) ] = voxelsPerSecond;
+    }
+    return baseline;
+}
+
+
+/**
+ * Writes the results as a baseline file.
+ * @param  fileName  path of the baseline
+ * @param  results   timings of the kernels
+ */
+void WriteBaseline( const std::string & fileName, const std::vector<Result> & results )
+{
+    std::ofstream file( fileName.c_str() );
+    file << "# kernel size voxels_per_second peak_rss_kb" << std::endl;
+    for ( unsigned int i=0; i<results.size(); i++ )
+        file << results[i].kernel << " " << results[i].size << " "
+             << results[i].voxelsPerSecond << " " << results[i].peakRSS << std::endl;
+    if ( !file )
+        throw std::runtime_error( "Could not write the baseline " + fileName + "." );
+}
+
+
+/**
+ * Runs the selected kernels on each size and prints the timings.
+ * @param  param  parameters
+ * @return true if no kernel is slower than its baseline by more than the tolerance
+ */
+bool RunBenchmarks( const Param & param )
+{
+    // Kernels
+    std::vector<Kernel *> kernels;
+    kernels.push_back( new LCCStatisticsKernel );
+    kernels.push_back( new VectorSmoothingKernel );
+    kernels.push_back( new ExponentialKernel( false ) );
+    kernels.push_back( new ExponentialKernel( true ) );
+    kernels.push_back( new BCHKernel( true,  param.maximumNorm, param.seed ) );
+    kernels.push_back( new BCHKernel( false, param.maximumNorm, param.seed ) );
+    kernels.push_back( new WarpKernel( false ) );
+    kernels.push_back( new WarpKernel( true ) );
+    kernels.push_back( new SVFLogJacobianKernel );
+    kernels.push_back( new RegistrationKernel( param.iterations ) );
+
+    std::map< std::pair<std::string,unsigned int>, double > baseline;
+    if ( !param.baselinePath.empty() )
+        baseline = ReadBaseline( param.baselinePath );
+
+    std::cout << std::left  << std::setw(20) << "KERNEL"
+              << std::right << std::setw(6)  << "SIZE"
+              << std::setw(14) << "TIME (s)"
+              << std::setw(16) << "VOXELS/S"
+              << std::setw(16) << "PEAK RSS (MB)"
+              << std::setw(12) << "BASELINE" << std::endl;
+
+    std::vector<Result> results;
+    bool passed = true;
+    const std::vector<unsigned int> sizes = rpi::StringToVector<unsigned int>( param.sizes );
+
+    for ( unsigned int s=0; s<sizes.size(); s++ )
+    {
+        // The velocity fields are scaled with the image so that the
+        // deformations are comparable across sizes
+        const unsigned int size = sizes[s];
+        synthetic::Pair pair = synthetic::CreatePair( size, param.maximumNorm * size / 64.0, param.seed );
+        const double numberOfVoxels = static_cast<double>( size ) * size * size;
+
+        for ( unsigned int k=0; k<kernels.size(); k++ )
+        {
+            Kernel * kernel = kernels[k];
+            if ( !param.kernels.empty() &&
+                 std::find( param.kernels.begin(), param.kernels.end(), kernel->GetName() ) == param.kernels.end() )
+                continue;
+            if ( kernel->IsRegistration() && size > param.maxRegistrationSize )
+                continue;
+
+            // Best time of the repetitions (a single run for registrations)
+            kernel->Initialize( pair );
+            const unsigned int repetitions = kernel->IsRegistration() ? 1 : param.repetitions;
+            double seconds = 0.0;
+            for ( unsigned int r=0; r<repetitions; r++ )
+            {
+                itk::TimeProbe probe;
+                probe.Start();
+                kernel->Run();
+                probe.Stop();
+                seconds = ( r == 0 ) ? probe.GetMean() : std::min( seconds, static_cast<double>( probe.GetMean() ) );
+            }
+            kernel->Release();
+
+            Result result;
+            result.kernel          = kernel->GetName();
+            result.size            = size;
+            result.seconds         = seconds;
+            result.voxelsPerSecond = seconds > 0.0 ? numberOfVoxels / seconds : 0.0;
+            result.peakRSS         = GetPeakRSS();
+            results.push_back( result );
+
+            std::cout << std::left  << std::setw(20) << result.kernel
+                      << std::right << std::setw(6)  << result.size
+                      << std::setw(14) << std::fixed << std::setprecision(4) << result.seconds
+                      << std::setw(16) << std::scientific << std::setprecision(3) << result.voxelsPerSecond
+                      << std::setw(16) << std::fixed << std::setprecision(1) << result.peakRSS / 1024.0;
+
+            // Comparison to the baseline
+            std::map< std::pair<std::string,unsigned int>, double >::const_iterator it =
+                    baseline.find( std::make_pair( result.kernel, result.size ) );
+            if ( it != baseline.end() && it->second > 0.0 )
+            {
+                const double ratio = result.voxelsPerSecond / it->second;
+                std::cout << std::setw(11) << std::setprecision(2) << ratio << "x";
+                if ( ratio < 1.0 - param.tolerance )
+                {
+                    std::cout << "  REGRESSION";
+                    passed = false;
+                }
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    for ( unsigned int k=0; k<kernels.size(); k++ )
+        delete kernels[k];
+
+    if ( !param.saveBaselinePath.empty() )
+        WriteBaseline( param.saveBaselinePath, results );
+
+    if ( param.kernels.empty() ||
+         std::find( param.kernels.begin(), param.kernels.end(), "ForkJoin" ) != param.kernels.end() )
+        ReportForkJoin( param );
+
+    return passed;
+}
+
+
+int main( int argc, char** argv )
+{
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters( argc, argv, param );
+
+        if ( !RunBenchmarks( param ) )
+        {
+            std::cerr << "Some kernels are slower than the baseline." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,381 @@
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#include <itkImageFileWriter.h>
+#include <itksys/SystemTools.hxx>
+
+#include <tclap/CmdLine.h>
+
+#include "SyntheticData.h"
+
+
+/*
+ * End-to-end test of the server mode of rpiLCClogDemons. The program writes
+ * a small synthetic pair, starts the server on a UNIX socket, and sends it
+ * jobs as a client would:
+ *
+ *   - a valid job, answered by "OK <seconds> <outputs>" with the outputs written,
+ *   - a job whose moving image does not exist, answered by "ERROR <message>",
+ *   - a job with an unknown argument, answered by "ERROR <message>",
+ *   - "shutdown", after which the server must exit with EXIT_SUCCESS.
+ *
+ * It also checks that an invalid server command line makes the executable
+ * exit with EXIT_FAILURE instead of aborting.
+ */
+
+
+/**
+ * Structure containing the input parameters.
+ */
+struct Param{
+    std::string   executable;
+    std::string   directory;
+    unsigned int  size;
+    double        timeout;
+};
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Starts rpiLCClogDemons in server mode on a UNIX socket, sends it jobs as a client and ";
+    description += "checks the OK / ERROR responses and the outputs.";
+
+    std::string des_executable = "Path of the rpiLCClogDemons executable.";
+    std::string des_directory  = "Directory receiving the socket, the images and the outputs (default current directory).";
+    std::string des_size       = "Size of the synthetic images in voxels per axis (default 32).";
+    std::string des_timeout    = "Maximum time in seconds waited for the server to listen (default 30).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+
+        TCLAP::ValueArg<std::string>   arg_executable( "e", "executable", des_executable, true, "", "string", cmd );
+        TCLAP::ValueArg<std::string>   arg_directory( "d", "directory", des_directory, false, ".", "string", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_size( "s", "size", des_size, false, 32, "uint", cmd );
+        TCLAP::ValueArg<double>        arg_timeout( "", "timeout", des_timeout, false, 30.0, "double", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.executable = arg_executable.getValue();
+        param.directory  = arg_directory.getValue();
+        param.size       = arg_size.getValue();
+        param.timeout    = arg_timeout.getValue();
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+#ifndef _WIN32
+
+/**
+ * Starts a process.
+ * @param  arguments  path of the executable followed by its arguments
+ * @return process identifier
+ */
+pid_t StartProcess( const std::vector<std::string> & arguments )
+{
+    std::vector<char *> argv;
+    for ( unsigned int i=0; i<arguments.size(); i++ )
+        argv.push_back( const_cast<char *>( arguments[i].c_str() ) );
+    argv.push_back( NULL );
+
+    const pid_t pid = fork();
+    if ( pid < 0 )
+        throw std::runtime_error( "Could not start " + arguments[0] + "." );
+    if ( pid == 0 )
+    {
+        execv( argv[0], &argv[0] );
+        _exit( 127 );
+    }
+    return pid;
+}
+
+
+/**
+ * Waits for a process and returns its exit status.
+ * @param  pid  process identifier
+ * @return exit status, or -1 if the process did not exit normally
+ */
+int WaitProcess( pid_t pid )
+{
+    int status = 0;
+    while ( waitpid( pid, &status, 0 ) < 0 )
+        if ( errno != EINTR )
+            return -1;
+    return WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+}
+
+
+/**
+ * Client of the registration server.
+ */
+class ServerClient
+{
+
+public:
+
+    ServerClient(void) : m_Socket(-1)
+    {
+    }
+
+    ~ServerClient(void)
+    {
+        if ( m_Socket >= 0 )
+            close( m_Socket );
+    }
+
+    /**
+     * Connects to the server, retrying until it listens.
+     * @param  path     path of the socket
+     * @param  timeout  maximum waiting time in seconds
+     * @param  server   process of the server, which must not exit meanwhile
+     */
+    void Connect( const std::string & path, double timeout, pid_t server )
+    {
+        struct sockaddr_un address;
+        std::memset( &address, 0, sizeof(address) );
+        address.sun_family = AF_UNIX;
+        if ( path.size() >= sizeof(address.sun_path) )
+            throw std::runtime_error( "The socket path is too long." );
+        std::strncpy( address.sun_path, path.c_str(), sizeof(address.sun_path)-1 );
+
+        for ( double waited = 0.0; waited < timeout; waited += 0.1 )
+        {
+            m_Socket = socket( AF_UNIX, SOCK_STREAM, 0 );
+            if ( m_Socket < 0 )
+                throw std::runtime_error( "Could not create the socket." );
+            if ( connect( m_Socket, reinterpret_cast<struct sockaddr *>( &address ), sizeof(address) ) == 0 )
+                return;
+            close( m_Socket );
+            m_Socket = -1;
+
+            int status;
+            if ( waitpid( server, &status, WNOHANG ) == server )
+                throw std::runtime_error( "The server exited before listening." );
+            usleep( 100000 );
+        }
+        throw std::runtime_error( "The server does not listen on " + path + "." );
+    }
+
+    /**
+     * Sends a line and returns the response line.
+     * @param  line  line to send, without end of line
+     * @return response, without end of line
+     */
+    std::string Request( const std::string & line )
+    {
+        this->Send( line );
+
+        std::string::size_type end;
+        while ( ( end = m_Pending.find( '\n' ) ) == std::string::npos )
+        {
+            char buffer[4096];
+            const ssize_t length = recv( m_Socket, buffer, sizeof(buffer), 0 );
+            if ( length <= 0 )
+                throw std::runtime_error( "The server closed the connection." );
+            m_Pending.append( buffer, length );
+        }
+        const std::string response = m_Pending.substr( 0, end );
+        m_Pending.erase( 0, end+1 );
+        return response;
+    }
+
+    /**
+     * Sends a line without waiting for a response.
+     * @param  line  line to send, without end of line
+     */
+    void Send( const std::string & line )
+    {
+        const std::string message = line + '\n';
+        if ( send( m_Socket, message.c_str(), message.size(), 0 ) < 0 )
+            throw std::runtime_error( "Could not send the job to the server." );
+    }
+
+private:
+
+    int          m_Socket;
+    std::string  m_Pending;
+
+};
+
+
+/**
+ * Checks a condition and reports it.
+ * @param  condition  condition
+ * @param  name       name of the check
+ * @param  detail     detail printed on failure
+ * @return condition
+ */
+bool Check( bool condition, const std::string & name, const std::string & detail )
+{
+    std::cout << "  " << name << ": " << ( condition ? "ok" : "FAILED" );
+    if ( !condition && !detail.empty() )
+        std::cout << " (" << detail << ")";
+    std::cout << std::endl;
+    return condition;
+}
+
+
+/**
+ * Writes an image.
+ */
+void WriteImage( synthetic::ImageType * image, const std::string & path )
+{
+    typedef itk::ImageFileWriter<synthetic::ImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput( image );
+    writer->SetFileName( path );
+    writer->Update();
+}
+
+
+int RunTest( const Param & param )
+{
+    // A closed server must not kill the client
+    signal( SIGPIPE, SIG_IGN );
+
+    const std::string directory = itksys::SystemTools::CollapseFullPath( param.directory.c_str() );
+    itksys::SystemTools::MakeDirectory( directory.c_str() );
+    const std::string socketPath    = directory + "/rpiLCClogDemonsServerTest.sock";
+    const std::string fixedPath     = directory + "/server_fixed.mha";
+    const std::string movingPath    = directory + "/server_moving.mha";
+    const std::string imagePath     = directory + "/server_output_image.mha";
+    const std::string transformPath = directory + "/server_output_svf.mha";
+    const std::string fieldPath     = directory + "/server_output_displacement.mha";
+
+    synthetic::Pair pair = synthetic::CreatePair( param.size, 2.0 * param.size / 64.0, 1 );
+    WriteImage( pair.fixed,  fixedPath );
+    WriteImage( pair.moving, movingPath );
+    itksys::SystemTools::RemoveFile( imagePath.c_str() );
+    itksys::SystemTools::RemoveFile( transformPath.c_str() );
+    itksys::SystemTools::RemoveFile( fieldPath.c_str() );
+
+    bool passed = true;
+
+    // Invalid server command line
+    std::cout << "Invalid command line" << std::endl;
+    {
+        std::vector<std::string> arguments;
+        arguments.push_back( param.executable );
+        arguments.push_back( "--server" );
+        arguments.push_back( socketPath );
+        arguments.push_back( "--cache-size" );
+        arguments.push_back( "not-a-number" );
+        const int status = WaitProcess( StartProcess( arguments ) );
+        std::ostringstream detail;
+        detail << "exit status " << status;
+        passed &= Check( status == EXIT_FAILURE, "exits with EXIT_FAILURE", detail.str() );
+    }
+
+    // Jobs sent over the socket
+    std::cout << "Server on " << socketPath << std::endl;
+    std::vector<std::string> arguments;
+    arguments.push_back( param.executable );
+    arguments.push_back( "--server" );
+    arguments.push_back( socketPath );
+    const pid_t server = StartProcess( arguments );
+
+    try
+    {
+        ServerClient client;
+        client.Connect( socketPath, param.timeout, server );
+
+        const std::string job = "-f \"" + fixedPath + "\" -m \"" + movingPath + "\" -r 2 -a 3x2" +
+                                " -i \"" + imagePath + "\" -t \"" + transformPath + "\"" +
+                                " --output-displacement-field \"" + fieldPath + "\"";
+        std::string response = client.Request( job );
+        passed &= Check( response.compare( 0, 3, "OK " ) == 0, "valid job answered OK", response );
+        passed &= Check( itksys::SystemTools::FileExists( imagePath.c_str(), true ) &&
+                         itksys::SystemTools::FileExists( transformPath.c_str(), true ) &&
+                         itksys::SystemTools::FileExists( fieldPath.c_str(), true ),
+                         "outputs written", "" );
+
+        response = client.Request( "-f \"" + fixedPath + "\" -m \"" + directory + "/missing.mha\" -r 2 -a 1" );
+        passed &= Check( response.compare( 0, 6, "ERROR " ) == 0, "missing image answered ERROR", response );
+
+        response = client.Request( "-f \"" + fixedPath + "\" -m \"" + movingPath + "\" --no-such-option" );
+        passed &= Check( response.compare( 0, 6, "ERROR " ) == 0, "invalid job answered ERROR", response );
+
+        client.Send( "shutdown" );
+    }
+    catch( ... )
+    {
+        kill( server, SIGTERM );
+        WaitProcess( server );
+        throw;
+    }
+
+    const int status = WaitProcess( server );
+    std::ostringstream detail;
+    detail << "exit status " << status;
+    passed &= Check( status == EXIT_SUCCESS, "server stops on shutdown", detail.str() );
+
+    if ( !passed )
+    {
+        std::cerr << "The server test failed." << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "The server test passed." << std::endl;
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+
+int main( int argc, char** argv )
+{
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters( argc, argv, param );
+
+#ifndef _WIN32
+        return RunTest( param );
+#else
+        std::cout << "UNIX sockets are not supported on this platform, the server test is skipped." << std::endl;
+#endif
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
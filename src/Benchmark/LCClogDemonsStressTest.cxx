@@ -0,0 +1,253 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <itkMultiThreader.h>
+
+#include <tclap/CmdLine.h>
+
+#include "SyntheticData.h"
+#include "ReferenceConfiguration.h"
+
+
+/*
+ * Stress test of the re-entrancy of the LCC registration filters. Several
+ * independent rpi::LCClogDemons objects, each with its own pair of images and
+ * its own similarity standard deviation, are run one after the other
+ * (reference), then all at the same time, each in its own thread and with the
+ * same number of threads as the reference.
+ *
+ * The test fails if a concurrent displacement field differs from its
+ * reference by more than the tolerance (0 by default: the registrations must
+ * not share any mutable state, so the results are identical).
+ */
+
+
+typedef synthetic::ImageType                                           ImageType;
+typedef synthetic::RegistrationType                                    RegistrationType;
+typedef RegistrationType::DisplacementFieldTransformType::VectorFieldType
+                                                                       DisplacementFieldType;
+
+
+/**
+ * Structure containing the input parameters.
+ */
+struct Param{
+    unsigned int  size;
+    unsigned int  numberOfRegistrations;
+    unsigned int  threadsPerRegistration;
+    std::string   iterations;
+    double        tolerance;
+};
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Runs independent registrations one after the other and all at the same time in separate ";
+    description += "threads, and compares the displacement fields.";
+
+    std::string des_size                   = "Size of the synthetic images in voxels per axis (default 48).";
+    std::string des_numberOfRegistrations  = "Number of registrations, run in as many threads (default 8).";
+    std::string des_threadsPerRegistration = "Number of threads of each registration (default 1).";
+    std::string des_iterations             = "Iterations per level, from coarse to fine (default 10x5).";
+    std::string des_tolerance              = "Maximum norm of the difference between a concurrent field and its reference (default 0).";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+
+        TCLAP::ValueArg<unsigned int>  arg_size( "s", "size", des_size, false, 48, "uint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_numberOfRegistrations( "n", "registrations", des_numberOfRegistrations, false, 8, "uint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_threadsPerRegistration( "t", "threads-per-registration", des_threadsPerRegistration, false, 1, "uint", cmd );
+        TCLAP::ValueArg<std::string>   arg_iterations( "a", "iterations", des_iterations, false, "10x5", "uintx...xuint", cmd );
+        TCLAP::ValueArg<double>        arg_tolerance( "", "tolerance", des_tolerance, false, 0.0, "double", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.size                   = arg_size.getValue();
+        param.numberOfRegistrations  = std::max( 1u, arg_numberOfRegistrations.getValue() );
+        param.threadsPerRegistration = std::max( 1u, arg_threadsPerRegistration.getValue() );
+        param.iterations             = arg_iterations.getValue();
+        param.tolerance              = arg_tolerance.getValue();
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+/**
+ * One registration of the test and its result.
+ */
+struct Job
+{
+    synthetic::Pair                     pair;
+    double                              sigma;
+    std::string                         iterations;
+    DisplacementFieldType::ConstPointer field;
+    std::string                         error;
+};
+
+
+/**
+ * Runs the registration of a job and stores its displacement field, or the
+ * error message if it failed.
+ * @param  job  job
+ */
+void RunJob( Job & job )
+{
+    try
+    {
+        RegistrationType registration;
+        synthetic::SetReferenceConfiguration( registration, job.iterations );
+        registration.SetSimilarityCriteriaStandardDeviation( job.sigma );
+
+        // Every option is set here, so that the serial and concurrent runs
+        // do not depend on the defaults of the registration object
+        registration.SetGradientType(                     RegistrationType::GRADIENT_SYMMETRIZED );
+        registration.SetRegularizationType(               0 );
+        registration.SetNumberOfTermsBCHExpansion(        2 );
+        registration.SetUseHistogramMatching(             false );
+        registration.UseMask(                             false );
+        registration.SetBoundaryCheck(                    true );
+        registration.SetComputeLogJacobian(               false );
+        registration.SetUsePlanarFields(                  false );
+        registration.SetPrefetchPyramidLevels(            false );
+        registration.SetTimeBudget(                       0.0 );
+        registration.SetConvergenceWindowSize(            5 );
+        registration.SetMetricConvergenceTolerance(       0.0 );
+        registration.SetRMSChangeConvergenceTolerance(    0.0 );
+        registration.SetMinimumNumberOfIterations(        0 );
+        registration.SetCheckpointFileName(               "" );
+        registration.SetResumeFromCheckpoint(             false );
+        registration.SetProfileFileName(                  "" );
+        registration.SetVerbosity(                        false );
+        registration.SetFixedImage(  job.pair.fixed );
+        registration.SetMovingImage( job.pair.moving );
+        registration.StartRegistration();
+        job.field = registration.GetDisplacementFieldTransformation()->GetParametersAsVectorField();
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        job.error = err.GetDescription();
+    }
+    catch( std::exception& e )
+    {
+        job.error = e.what();
+    }
+}
+
+
+/**
+ * Entry point of the threads of the concurrent run.
+ */
+ITK_THREAD_RETURN_TYPE JobCallback( void * arg )
+{
+    itk::MultiThreader::ThreadInfoStruct * info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    RunJob( *static_cast<Job *>( info->UserData ) );
+    return ITK_THREAD_RETURN_VALUE;
+}
+
+
+int main( int argc, char** argv )
+{
+    try
+    {
+        // Parse parameters
+        struct Param param;
+        parseParameters( argc, argv, param );
+
+        // One pair and one similarity standard deviation per registration, so
+        // that shared state between the filters changes the results. The
+        // concurrent registrations get their own copies of the images: only
+        // the filters are under test, not the pipeline of shared inputs.
+        std::vector<Job> serial( param.numberOfRegistrations );
+        std::vector<Job> concurrent( param.numberOfRegistrations );
+        for ( unsigned int i=0; i<param.numberOfRegistrations; i++ )
+        {
+            serial[i].pair           = synthetic::CreatePair( param.size, 3.0 * param.size / 64.0, i + 1 );
+            serial[i].sigma          = 2.0 + 0.5 * i;
+            serial[i].iterations     = param.iterations;
+            concurrent[i].pair       = synthetic::CreatePair( param.size, 3.0 * param.size / 64.0, i + 1 );
+            concurrent[i].sigma      = serial[i].sigma;
+            concurrent[i].iterations = param.iterations;
+        }
+
+        const int defaultNumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( param.threadsPerRegistration );
+
+        // Reference: one registration after the other
+        for ( unsigned int i=0; i<param.numberOfRegistrations; i++ )
+            RunJob( serial[i] );
+
+        // All the registrations at the same time
+        itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+        std::vector<int> threadIds;
+        for ( unsigned int i=0; i<param.numberOfRegistrations; i++ )
+            threadIds.push_back( threader->SpawnThread( JobCallback, &concurrent[i] ) );
+        for ( unsigned int i=0; i<threadIds.size(); i++ )
+            threader->TerminateThread( threadIds[i] );
+
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( defaultNumberOfThreads );
+
+        // Comparison with the reference
+        std::cout << std::left  << std::setw(14) << "REGISTRATION"
+                  << std::right << std::setw(8)  << "sigma"
+                  << std::setw(16) << "max |diff|" << "  RESULT" << std::endl;
+
+        bool passed = true;
+        for ( unsigned int i=0; i<param.numberOfRegistrations; i++ )
+        {
+            std::cout << std::left  << std::setw(14) << i
+                      << std::right << std::setw(8) << std::fixed << std::setprecision(1) << serial[i].sigma;
+            if ( !serial[i].error.empty() || !concurrent[i].error.empty() )
+            {
+                std::cout << std::setw(16) << "-" << "  FAILED ("
+                          << ( serial[i].error.empty() ? concurrent[i].error : serial[i].error ) << ")" << std::endl;
+                passed = false;
+                continue;
+            }
+            const double difference = synthetic::MaximumDifference<DisplacementFieldType>( concurrent[i].field, serial[i].field );
+            const bool registrationPassed = difference <= param.tolerance;
+            passed = passed && registrationPassed;
+            std::cout << std::setw(16) << std::scientific << std::setprecision(3) << difference
+                      << ( registrationPassed ? "  ok" : "  FAILED" ) << std::endl;
+        }
+
+        if ( !passed )
+        {
+            std::cerr << "The concurrent registrations differ from the serial ones." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
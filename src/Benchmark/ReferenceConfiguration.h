@@ -0,0 +1,46 @@
+#ifndef __ReferenceConfiguration_h
+#define __ReferenceConfiguration_h
+
+#include <string>
+
+#include <rpiCommonTools.hxx>
+
+#include "SyntheticData.h"
+#include "rpiLCClogDemons.hxx"
+
+/*
+ * Reference configuration of the LCC log-Demons used by the benchmarks,
+ * the accuracy validation and the tests: the default parameters of the
+ * command line tool with the LCC similarity, without mask, histogram
+ * matching or diagnostics. The programs change the parameters they study on
+ * top of it.
+ */
+
+namespace synthetic
+{
+
+typedef rpi::LCClogDemons<ImageType,ImageType,double>   RegistrationType;
+
+
+/**
+ * Sets the parameters of the reference configuration. The images are not set.
+ * @param  registration  registration object
+ * @param  iterations    iterations per level, from coarse to fine (e.g. "15x10x5")
+ */
+inline void SetReferenceConfiguration( RegistrationType & registration, const std::string & iterations )
+{
+    registration.SetNumberOfIterations(                       rpi::StringToVector<unsigned int>( iterations ) );
+    registration.SetUpdateRule(                               RegistrationType::UPDATE_SYMMETRIC_LOCAL_LOG_DOMAIN );
+    registration.SetSimilarityCriteriaStandardDeviation(      3.0 );
+    registration.SetSigmaI(                                   0.15 );
+    registration.SetStationaryVelocityFieldStandardDeviation( 1.5 );
+    registration.SetUpdateFieldStandardDeviation(             0.0 );
+    registration.SetMaximumUpdateStepLength(                  2.0 );
+    registration.SetUseHistogramMatching(                     false );
+    registration.UseMask(                                     false );
+    registration.SetVerbosity(                                false );
+}
+
+} // end namespace synthetic
+
+#endif // __ReferenceConfiguration_h
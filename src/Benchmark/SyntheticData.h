@@ -0,0 +1,285 @@
+#ifndef __SyntheticData_h
+#define __SyntheticData_h
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <itkImage.h>
+#include <itkVector.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkWarpImageFilter.h>
+#include <itkLinearInterpolateImageFunction.h>
+#include <itkMersenneTwisterRandomVariateGenerator.h>
+#include <vnl/vnl_math.h>
+
+#include "itkExponentialDeformationFieldImageFilter2.h"
+
+/*
+ * Synthetic 3D data generated in memory for the benchmarks: an analytic
+ * phantom (nested ellipsoids, spheres and a smooth bias) and smooth random
+ * stationary velocity fields. The phantom deformed by the exponential of a
+ * velocity field gives a registration pair with a known ground truth.
+ *
+ * All the data are deterministic for a given seed, so that timings and
+ * errors are comparable between runs.
+ */
+
+namespace synthetic
+{
+
+typedef itk::Image<float,3>                   ImageType;
+typedef itk::Vector<float,3>                  VectorType;
+typedef itk::Image<VectorType,3>              FieldType;
+
+
+/**
+ * Synthetic registration pair: moving = fixed o exp(velocity). The
+ * registration of the moving image on the fixed image is expected to
+ * recover exp(-velocity), given by trueField.
+ */
+struct Pair
+{
+    ImageType::Pointer  fixed;
+    ImageType::Pointer  moving;
+    FieldType::Pointer  velocity;
+    FieldType::Pointer  trueField;
+};
+
+
+/**
+ * Creates an image of size^3 voxels of 1 mm centered on the origin.
+ * @param  size  number of voxels along each axis
+ * @return allocated image
+ */
+template <class TImage>
+typename TImage::Pointer CreateImage( unsigned int size )
+{
+    typename TImage::RegionType region;
+    region.SetSize( 0, size );
+    region.SetSize( 1, size );
+    region.SetSize( 2, size );
+
+    typename TImage::PointType origin;
+    origin.Fill( -0.5 * ( size - 1.0 ) );
+
+    typename TImage::Pointer image = TImage::New();
+    image->SetRegions( region );
+    image->SetOrigin( origin );
+    image->Allocate();
+    return image;
+}
+
+
+/**
+ * Smooth step from 0 (outside) to 1 (inside) of a shape whose normalized
+ * distance to the center is r (1 on the boundary).
+ */
+inline double Inside( double r, double width )
+{
+    return 0.5 * ( 1.0 - std::tanh( ( r - 1.0 ) / width ) );
+}
+
+
+/**
+ * Creates the phantom: a head-like ellipsoid with an inner ellipsoid, two
+ * ventricle-like cavities and a few bright spheres, under a smooth
+ * multiplicative bias. Boundaries are smooth over about one voxel.
+ * @param  size  number of voxels along each axis
+ * @return phantom image
+ */
+inline ImageType::Pointer CreatePhantom( unsigned int size )
+{
+    ImageType::Pointer image = CreateImage<ImageType>( size );
+    const double h     = 0.5 * size;   // half width in voxels
+    const double width = 1.0 / h;      // boundary width (normalized units)
+
+    // Spheres: center (normalized units), radius, intensity
+    const double spheres[4][5] = {
+        {  0.35,  0.30,  0.10, 0.12, 60.0 },
+        { -0.40,  0.25, -0.15, 0.10, 50.0 },
+        {  0.10, -0.45,  0.20, 0.08, 70.0 },
+        { -0.15, -0.30, -0.35, 0.14, 40.0 } };
+
+    itk::ImageRegionIteratorWithIndex<ImageType> it( image, image->GetLargestPossibleRegion() );
+    for ( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+        ImageType::PointType p;
+        image->TransformIndexToPhysicalPoint( it.GetIndex(), p );
+        const double x = p[0] / h, y = p[1] / h, z = p[2] / h;
+
+        const double outer = std::sqrt( vnl_math_sqr(x/0.85) + vnl_math_sqr(y/0.75) + vnl_math_sqr(z/0.70) );
+        const double inner = std::sqrt( vnl_math_sqr(x/0.70) + vnl_math_sqr(y/0.60) + vnl_math_sqr(z/0.55) );
+        const double left  = std::sqrt( vnl_math_sqr((x+0.12)/0.08) + vnl_math_sqr(y/0.30) + vnl_math_sqr(z/0.15) );
+        const double right = std::sqrt( vnl_math_sqr((x-0.12)/0.08) + vnl_math_sqr(y/0.30) + vnl_math_sqr(z/0.15) );
+
+        double value = 40.0 * Inside( outer, width ) + 60.0 * Inside( inner, width );
+        value -= 70.0 * ( Inside( left, width ) + Inside( right, width ) );
+        for ( unsigned int s=0; s<4; s++ )
+        {
+            const double r = std::sqrt( vnl_math_sqr(x-spheres[s][0]) + vnl_math_sqr(y-spheres[s][1]) +
+                                        vnl_math_sqr(z-spheres[s][2]) ) / spheres[s][3];
+            value += spheres[s][4] * Inside( r, width / spheres[s][3] );
+        }
+
+        // Smooth multiplicative bias
+        const double bias = 1.0 + 0.15 * x - 0.10 * y + 0.05 * z;
+        it.Set( static_cast<float>( value * bias ) );
+    }
+    return image;
+}
+
+
+/**
+ * Creates a smooth random stationary velocity field as a sum of low
+ * frequency sine modes, damped towards the image boundaries.
+ * @param  size          number of voxels along each axis
+ * @param  maximumNorm   maximum norm of the field in voxels
+ * @param  seed          seed of the random generator
+ * @return velocity field
+ */
+inline FieldType::Pointer CreateVelocityField( unsigned int size, double maximumNorm, int seed )
+{
+    typedef itk::Statistics::MersenneTwisterRandomVariateGenerator GeneratorType;
+    GeneratorType::Pointer generator = GeneratorType::New();
+    generator->Initialize( seed );
+
+    // Modes: frequency (cycles per image), phase, amplitude for each component
+    const unsigned int numberOfModes = 6;
+    double frequency[numberOfModes][3], phase[numberOfModes][3], amplitude[numberOfModes][3];
+    for ( unsigned int m=0; m<numberOfModes; m++ )
+        for ( unsigned int d=0; d<3; d++ )
+        {
+            frequency[m][d] = 0.5 + 1.5 * generator->GetVariateWithClosedRange();
+            phase[m][d]     = 2.0 * vnl_math::pi * generator->GetVariateWithClosedRange();
+            amplitude[m][d] = generator->GetNormalVariate();
+        }
+
+    FieldType::Pointer field = CreateImage<FieldType>( size );
+    const double h = 0.5 * size;
+    double maxNorm2 = 0.0;
+
+    itk::ImageRegionIteratorWithIndex<FieldType> it( field, field->GetLargestPossibleRegion() );
+    for ( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+        FieldType::PointType p;
+        field->TransformIndexToPhysicalPoint( it.GetIndex(), p );
+        const double x[3] = { p[0] / h, p[1] / h, p[2] / h };
+        const double damping = ( 1.0 - x[0]*x[0] ) * ( 1.0 - x[1]*x[1] ) * ( 1.0 - x[2]*x[2] );
+
+        VectorType v;
+        for ( unsigned int d=0; d<3; d++ )
+        {
+            double value = 0.0;
+            for ( unsigned int m=0; m<numberOfModes; m++ )
+            {
+                const double a = vnl_math::pi * ( frequency[m][0] * x[0] + frequency[m][1] * x[1] +
+                                                  frequency[m][2] * x[2] ) + phase[m][d];
+                value += amplitude[m][d] * std::sin( a );
+            }
+            v[d] = static_cast<float>( damping * value );
+        }
+        maxNorm2 = std::max( maxNorm2, static_cast<double>( v.GetSquaredNorm() ) );
+        it.Set( v );
+    }
+
+    // Scale to the requested maximum norm
+    const float scale = maxNorm2 > 0.0 ? static_cast<float>( maximumNorm / std::sqrt( maxNorm2 ) ) : 0.0f;
+    for ( it.GoToBegin(); !it.IsAtEnd(); ++it )
+        it.Set( it.Get() * scale );
+
+    return field;
+}
+
+
+/**
+ * Computes the displacement field exp(velocity), or exp(-velocity).
+ * @param  velocity  stationary velocity field
+ * @param  inverse   true to compute the inverse
+ * @return displacement field
+ */
+inline FieldType::Pointer Exponential( FieldType * velocity, bool inverse )
+{
+    typedef itk::ExponentialDeformationFieldImageFilter<FieldType,FieldType> ExponentiatorType;
+    ExponentiatorType::Pointer exponentiator = ExponentiatorType::New();
+    exponentiator->SetInput( velocity );
+    exponentiator->AutomaticNumberOfIterationsOn();
+    exponentiator->SetComputeInverse( inverse );
+    exponentiator->Update();
+
+    FieldType::Pointer field = exponentiator->GetOutput();
+    field->DisconnectPipeline();
+    return field;
+}
+
+
+/**
+ * Warps an image with a displacement field (linear interpolation).
+ * @param  image         input image
+ * @param  displacement  displacement field
+ * @return warped image
+ */
+inline ImageType::Pointer Warp( ImageType * image, FieldType * displacement )
+{
+    typedef itk::WarpImageFilter<ImageType,ImageType,FieldType> WarperType;
+    WarperType::Pointer warper = WarperType::New();
+    warper->SetInput( image );
+    warper->SetOutputParametersFromImage( image );
+#if (ITK_VERSION_MAJOR < 4)
+    warper->SetDeformationField( displacement );
+#else
+    warper->SetDisplacementField( displacement );
+#endif
+    warper->SetEdgePaddingValue( 0 );
+    warper->Update();
+
+    ImageType::Pointer warped = warper->GetOutput();
+    warped->DisconnectPipeline();
+    return warped;
+}
+
+
+/**
+ * Creates a registration pair of size^3 voxels whose moving image is the
+ * phantom deformed by a random diffeomorphism.
+ * @param  size         number of voxels along each axis
+ * @param  maximumNorm  maximum norm of the velocity field in voxels
+ * @param  seed         seed of the random generator
+ * @return registration pair
+ */
+inline Pair CreatePair( unsigned int size, double maximumNorm, int seed )
+{
+    Pair pair;
+    pair.fixed     = CreatePhantom( size );
+    pair.velocity  = CreateVelocityField( size, maximumNorm, seed );
+    FieldType::Pointer forward = Exponential( pair.velocity, false );
+    pair.moving    = Warp( pair.fixed, forward );
+    pair.trueField = Exponential( pair.velocity, true );
+    return pair;
+}
+
+/**
+ * Maximum norm of the difference of two fields on the same grid, used to
+ * compare the results of registrations run in different ways.
+ * @param  field1  first field
+ * @param  field2  second field
+ * @return maximum norm of the difference
+ */
+template <class TField>
+double MaximumDifference( const TField * field1, const TField * field2 )
+{
+    if ( field1->GetLargestPossibleRegion() != field2->GetLargestPossibleRegion() )
+        return itk::NumericTraits<double>::max();
+
+    itk::ImageRegionConstIterator<TField> it1( field1, field1->GetLargestPossibleRegion() );
+    itk::ImageRegionConstIterator<TField> it2( field2, field2->GetLargestPossibleRegion() );
+    double maximum = 0.0;
+    for ( it1.GoToBegin(), it2.GoToBegin(); !it1.IsAtEnd(); ++it1, ++it2 )
+        maximum = std::max( maximum, static_cast<double>( ( it1.Get() - it2.Get() ).GetNorm() ) );
+    return maximum;
+}
+
+} // end namespace synthetic
+
+#endif // __SyntheticData_h
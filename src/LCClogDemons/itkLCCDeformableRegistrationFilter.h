@@ -4,6 +4,12 @@
 #include "itkDenseFiniteDifferenceImageFilter.h"
 #include "itkExponentialDeformationFieldImageFilter2.h"
 #include "itkPDEDeformableRegistrationFunction.h"
+#include "itkFixedArray.h"
+#include "itkPlanarVectorField.h"
+#include "itkRegistrationThreadPool.h"
+#include "itkRegistrationProfiler.h"
+
+#include <deque>
 
 namespace itk {
 
@@ -33,6 +39,12 @@ namespace itk {
  * The output deformation field can be obtained via method GetDeformationField.
  *
  * The PDE-like algorithm is run for a user defined number of iterations.
+ * It may stop earlier when it has converged, i.e. after at least
+ * MinimumNumberOfIterations iterations, as soon as the relative change of
+ * the metric over the last ConvergenceWindowSize iterations is below
+ * MetricConvergenceTolerance, or the RMS change of the last update is below
+ * RMSChangeConvergenceTolerance. A tolerance of 0 disables the corresponding
+ * test.
  * Typically the PDE-like algorithm requires period Gaussian smoothing of the
  * velocity field to enforce an elastic-like condition. The amount
  * of smoothing is governed by a set of user defined standard deviations
@@ -98,6 +110,8 @@ public:
   /** FiniteDifferenceFunction type. */
   typedef typename Superclass::FiniteDifferenceFunctionType
      FiniteDifferenceFunctionType;
+  typedef typename
+    FiniteDifferenceFunctionType::TimeStepType    TimeStepType;
 
   /** PDEDeformableRegistrationFunction type. */
   typedef PDEDeformableRegistrationFunction<FixedImageType,MovingImageType,
@@ -143,6 +157,11 @@ public:
   /** Get output inverse deformation field. */
   DeformationFieldPointer GetInverseDeformationField();
 
+  /** Get the deformation field computed by the last call to
+   * GetDeformationField if the velocity field has not been updated since,
+   * or NULL otherwise. Nothing is computed. */
+  DeformationFieldPointer GetCurrentDeformationField();
+
   /** Get the number of valid inputs.  For LCCDeformableRegistration,
    * this checks whether the fixed and moving images have been
    * set. While LCCDeformableRegistration can take a third input as an
@@ -323,9 +342,13 @@ public:
   virtual void SetSimilarityCriteriaStandardDeviationsVoxelUnit( double value[] );
 
 
-  /** Get the Gaussian smoothing standard deviations used for
-   * smoothing the update field. */
-  const double * GetSimilarityCriteriaStandardDeviations(void) const;
+  /** Standard deviations of the similarity criteria smoothing. */
+  typedef FixedArray<double, itkGetStaticConstMacro(ImageDimension)> StandardDeviationsType;
+
+  /** Get the standard deviations (voxel unit) of the Gaussian smoothing of
+   * the similarity criteria. They are returned by value, so that several
+   * filters can be used at the same time. */
+  StandardDeviationsType GetSimilarityCriteriaStandardDeviations(void) const;
 
   /**
    * Sets the trade-off coefficient
@@ -342,6 +365,41 @@ public:
   virtual void StopRegistration()
     { m_StopRegistrationFlag = true; }
 
+  /** Set/Get the number of iterations over which the relative change of
+   * the metric is measured (default 5). */
+  itkSetMacro( ConvergenceWindowSize, unsigned int );
+  itkGetConstMacro( ConvergenceWindowSize, unsigned int );
+
+  /** Set/Get the relative change of the metric over the convergence window
+   * below which the registration has converged (default 0: not used). */
+  itkSetMacro( MetricConvergenceTolerance, double );
+  itkGetConstMacro( MetricConvergenceTolerance, double );
+
+  /** Set/Get the RMS change of the velocity field below which the
+   * registration has converged (default 0: not used). */
+  itkSetMacro( RMSChangeConvergenceTolerance, double );
+  itkGetConstMacro( RMSChangeConvergenceTolerance, double );
+
+  /** Set/Get the number of iterations performed before the convergence
+   * is tested (default 0). */
+  itkSetMacro( MinimumNumberOfIterations, unsigned int );
+  itkGetConstMacro( MinimumNumberOfIterations, unsigned int );
+
+  /** Return true if the last run stopped because it converged. */
+  itkGetConstMacro( Converged, bool );
+
+  /** Set/Get the profiler recording the time spent in the stages of the
+   * registration (default: none). */
+  itkSetObjectMacro( Profiler, RegistrationProfiler );
+  itkGetObjectMacro( Profiler, RegistrationProfiler );
+
+  /** Set/Get whether the smoothing and the update of the fields are
+   * computed on planar fields (one contiguous plane per component, see
+   * PlanarVectorField) instead of the interleaved ITK fields (default off). */
+  itkSetMacro( UsePlanarFields, bool );
+  itkGetConstMacro( UsePlanarFields, bool );
+  itkBooleanMacro( UsePlanarFields );
+
   /** Set/Get the desired maximum error of the Gaussian kernel approximate. 
    * \sa GaussianOperator. */
   itkSetMacro( MaximumError, double );
@@ -390,18 +448,35 @@ protected:
   itkSetObjectMacro( Exponentiator, FieldExponentiatorType );
   itkGetObjectMacro( Exponentiator, FieldExponentiatorType );
 
+  /** Planar field type */
+  typedef PlanarVectorField< VelocityFieldType >   PlanarFieldType;
+  typedef typename PlanarFieldType::Pointer        PlanarFieldPointer;
+
+  /** Planar buffers of the smoothing and of the update, kept between
+   * iterations and released after the registration. */
+  PlanarFieldType * GetPlanarField() { return m_PlanarField; }
+  PlanarFieldType * GetPlanarUpdate() { return m_PlanarUpdate; }
+
+  /** Variances (voxel unit) of the Gaussian kernel of given standard deviations. */
+  void GetSmoothingVariances( const VelocityFieldType * field, const double StandardDeviations[ImageDimension],
+                              double variances[ImageDimension] ) const;
+
   /** Supplies the halting criteria for this class of filters.  The
-   * algorithm will stop after a user-specified number of iterations. */
-  virtual bool Halt()
-    {
+   * algorithm will stop after a user-specified number of iterations,
+   * or earlier if it has converged. */
+  virtual bool Halt();
+
+  /** Return true if the convergence criteria are met. */
+  virtual bool HasConverged();
 
-    if ( m_StopRegistrationFlag )
-      {
-      return true;
-      }
+  /** Compute the update buffer, timed by the profiler if any. The output
+   * region is divided in several pieces per thread, computed by
+   * ThreadedCalculateChange on the global RegistrationThreadPool (or by the
+   * MultiThreader of the filter if the pool is disabled). */
+  virtual TimeStepType CalculateChange();
 
-    return this->Superclass::Halt();
-    }
+  /** Body of the parallel loop of CalculateChange over the pieces. */
+  static void CalculateChangeCallback( void * data, SizeValueType begin, SizeValueType end, ThreadIdType threadId );
 
   /** A simple method to copy the data from the input to the output.
    * If the input does not exist, a zero field is written to the output. */
@@ -466,6 +541,11 @@ private:
   /** Temporary field used for smoothing the velocity field. */
   VelocityFieldPointer      m_TempField;
 
+  /** Planar fields used for smoothing and updating the velocity field. */
+  bool                      m_UsePlanarFields;
+  PlanarFieldPointer        m_PlanarField;
+  PlanarFieldPointer        m_PlanarUpdate;
+
   /** Maximum error for Gaussian operator approximation. */
   double                    m_MaximumError;
 
@@ -501,6 +581,31 @@ private:
    */
   bool                      m_BoundaryCheck;
 
+  /**
+   * Convergence criteria and metric values of the last iterations
+   */
+  unsigned int              m_ConvergenceWindowSize;
+  double                    m_MetricConvergenceTolerance;
+  double                    m_RMSChangeConvergenceTolerance;
+  unsigned int              m_MinimumNumberOfIterations;
+  bool                      m_Converged;
+  std::deque<double>        m_MetricHistory;
+  unsigned int              m_LastRecordedIteration;
+
+  /**
+   * Iteration at which the deformation field was last computed
+   */
+  bool                      m_DeformationFieldComputed;
+  unsigned int              m_DeformationFieldIteration;
+
+  /** Profiler of the stages, may be NULL. */
+  RegistrationProfiler::Pointer m_Profiler;
+
+  /** Pieces of the output region and their time steps in CalculateChange. */
+  std::vector<typename VelocityFieldType::RegionType> m_CalculateChangeRegions;
+  std::vector<TimeStepType>                           m_CalculateChangeTimeSteps;
+  std::vector<unsigned char>                          m_CalculateChangeValid;
+
 };
 
 
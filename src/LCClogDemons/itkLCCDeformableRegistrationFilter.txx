@@ -50,6 +50,9 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
     m_StandardDeviationWorldUnit = true;
 
     m_TempField = VelocityFieldType::New();
+    m_UsePlanarFields = false;
+    m_PlanarField = PlanarFieldType::New();
+    m_PlanarUpdate = PlanarFieldType::New();
     m_MaximumError = 0.1;
     m_MaximumKernelWidth = 30;
     m_StopRegistrationFlag = false;
@@ -65,6 +68,17 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 
     m_BoundaryCheck     = true;
 
+    m_ConvergenceWindowSize         = 5;
+    m_MetricConvergenceTolerance    = 0.0;
+    m_RMSChangeConvergenceTolerance = 0.0;
+    m_MinimumNumberOfIterations     = 0;
+    m_Converged                     = false;
+    m_LastRecordedIteration         = 0;
+
+    m_DeformationFieldComputed      = false;
+    m_DeformationFieldIteration     = 0;
+    m_Profiler                      = NULL;
+
 }
 
 template <class TFixedImage, class TMovingImage, class TField>
@@ -623,30 +637,25 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 
 
 template <class TFixedImage, class TMovingImage, class TField>
-const double *
+typename LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>::StandardDeviationsType
 LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::GetSimilarityCriteriaStandardDeviations( ) const
-{   
-        static double stDev[ImageDimension] ;
-   for( unsigned int j = 0; j < ImageDimension; j++ )
+{
+  StandardDeviationsType stDev;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    // Computation of the standard deviation (voxel unit) of the Gaussian kernel for the similarity criteria
+    if ( m_StandardDeviationWorldUnit )
       {
+      double s = this->GetFixedImage()->GetSpacing()[j];
+      stDev[j] =  this->m_SimilarityCriteriaStandardDeviations[j] / (s);
+      }
+    else
+      stDev[j] =  this->m_SimilarityCriteriaStandardDeviations[j] ;
+    }
 
-          // Computation of the standard deviation (voxel unit) of the Gaussian kernel for the similarity criteria
-        if ( m_StandardDeviationWorldUnit )
-        {   
-	    double s = this->GetFixedImage()->GetSpacing()[j];
-            stDev[j] =  this->m_SimilarityCriteriaStandardDeviations[j] / (s);
-           // stDev[j] = s*s*this->m_SimilarityCriteriaStandardDeviations[j];
-
-        }
-        else
-            stDev[j] =  this->m_SimilarityCriteriaStandardDeviations[j] ;
-     }
-
-      //std::cout<<"Std Dev: "<<stDev[1]<<std::endl;
-
-      return(static_cast<const double*> (stDev)); 
-  }
+  return stDev;
+}
 
 template <class TFixedImage, class TMovingImage, class TField>
 void
@@ -699,10 +708,20 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 
   os << indent << "StopRegistrationFlag: ";
   os << m_StopRegistrationFlag << std::endl;
+  os << indent << "ConvergenceWindowSize: ";
+  os << m_ConvergenceWindowSize << std::endl;
+  os << indent << "MetricConvergenceTolerance: ";
+  os << m_MetricConvergenceTolerance << std::endl;
+  os << indent << "RMSChangeConvergenceTolerance: ";
+  os << m_RMSChangeConvergenceTolerance << std::endl;
+  os << indent << "MinimumNumberOfIterations: ";
+  os << m_MinimumNumberOfIterations << std::endl;
   os << indent << "MaximumError: ";
   os << m_MaximumError << std::endl;
   os << indent << "MaximumKernelWidth: ";
   os << m_MaximumKernelWidth << std::endl;
+  os << indent << "UsePlanarFields: ";
+  os << m_UsePlanarFields << std::endl;
   os << indent << "Exponentiator: ";
   os << m_Exponentiator << std::endl;
   os << indent << "InverseExponentiator: ";
@@ -739,11 +758,74 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
   f->SetFixedImage( fixedPtr );
   f->SetMovingImage( movingPtr );
 
+  // The internal filters run with the threads of this filter
+  const int numberOfThreads = this->GetNumberOfThreads();
+  m_Exponentiator->SetNumberOfThreads( numberOfThreads );
+  m_InverseExponentiator->SetNumberOfThreads( numberOfThreads );
+
   this->Superclass::InitializeIteration();
 
 }
 
 
+// Compute the update buffer on all the threads
+template <class TFixedImage, class TMovingImage, class TField>
+typename LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>::TimeStepType
+LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
+::CalculateChange()
+{
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "ThreadedCalculateChange" );
+  if ( !RegistrationThreadPool::GetGlobalEnabled() )
+    {
+    return this->Superclass::CalculateChange();
+    }
+
+  // Several pieces per thread, so that the pool can balance the image borders
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+  typename VelocityFieldType::RegionType piece;
+  const unsigned int numberOfPieces = this->SplitRequestedRegion( 0, 4 * numberOfThreads, piece );
+  m_CalculateChangeRegions.resize( numberOfPieces );
+  for ( unsigned int i = 0; i < numberOfPieces; i++ )
+    {
+    this->SplitRequestedRegion( i, 4 * numberOfThreads, m_CalculateChangeRegions[i] );
+    }
+  m_CalculateChangeTimeSteps.assign( numberOfPieces, NumericTraits<TimeStepType>::Zero );
+  m_CalculateChangeValid.assign( numberOfPieces, 0 );
+
+  RegistrationThreadPool::GetGlobalPool()->ParallelFor( numberOfPieces, numberOfThreads,
+                                                        Self::CalculateChangeCallback, this, 1 );
+
+#if (ITK_VERSION_MAJOR < 4)
+  bool * valid = new bool[numberOfPieces];
+  for ( unsigned int i = 0; i < numberOfPieces; i++ )
+    {
+    valid[i] = m_CalculateChangeValid[i] != 0;
+    }
+  const TimeStepType dt = this->ResolveTimeStep( &m_CalculateChangeTimeSteps[0], valid, numberOfPieces );
+  delete [] valid;
+  return dt;
+#else
+  const std::vector<bool> valid( m_CalculateChangeValid.begin(), m_CalculateChangeValid.end() );
+  return this->ResolveTimeStep( m_CalculateChangeTimeSteps, valid );
+#endif
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
+::CalculateChangeCallback(void * data, SizeValueType begin, SizeValueType end, ThreadIdType threadId)
+{
+  Self * filter = static_cast<Self *>( data );
+  for ( SizeValueType i = begin; i < end; i++ )
+    {
+    filter->m_CalculateChangeTimeSteps[i] =
+      filter->ThreadedCalculateChange( filter->m_CalculateChangeRegions[i], threadId );
+    filter->m_CalculateChangeValid[i] = 1;
+    }
+}
+
+
 /* Override the default implementation for the case when the 
  * initial velocity is not set.
  * If the initial velocity is not set, the output is
@@ -873,6 +955,8 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 {
   this->Superclass::PostProcessOutput();
   m_TempField->Initialize();
+  m_PlanarField = PlanarFieldType::New();
+  m_PlanarUpdate = PlanarFieldType::New();
 }
 
 
@@ -885,6 +969,83 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
   //std::cout<<"LCCDeformableRegistrationFilter::Initialize"<<std::endl;
   this->Superclass::Initialize();
   m_StopRegistrationFlag = false;
+  m_Converged = false;
+  m_MetricHistory.clear();
+  m_LastRecordedIteration = 0;
+  m_DeformationFieldComputed = false;
+}
+
+
+// Halting criteria
+template <class TFixedImage, class TMovingImage, class TField>
+bool
+LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
+::Halt()
+{
+  if ( m_StopRegistrationFlag )
+    {
+    return true;
+    }
+
+  if ( this->HasConverged() )
+    {
+    m_Converged = true;
+    return true;
+    }
+
+  return this->Superclass::Halt();
+}
+
+
+// Convergence test, called before each iteration
+template <class TFixedImage, class TMovingImage, class TField>
+bool
+LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
+::HasConverged()
+{
+  const unsigned int elapsedIterations = this->GetElapsedIterations();
+
+  // Keep the metric of the last ConvergenceWindowSize+1 iterations
+  if ( elapsedIterations > m_LastRecordedIteration )
+    {
+    m_LastRecordedIteration = elapsedIterations;
+
+    const double metric = this->GetMetric();
+    if ( vnl_math_isfinite( metric ) && metric != NumericTraits<double>::max() )
+      {
+      m_MetricHistory.push_back( metric );
+      while ( m_MetricHistory.size() > m_ConvergenceWindowSize + 1 )
+        m_MetricHistory.pop_front();
+      }
+    }
+
+  if ( elapsedIterations == 0 || elapsedIterations < m_MinimumNumberOfIterations )
+    {
+    return false;
+    }
+
+  // Relative change of the metric over the window
+  if ( m_MetricConvergenceTolerance > 0.0 && m_ConvergenceWindowSize > 0 &&
+       m_MetricHistory.size() == m_ConvergenceWindowSize + 1 )
+    {
+    const double first  = m_MetricHistory.front();
+    const double last   = m_MetricHistory.back();
+    const double change = vnl_math_abs( last - first ) /
+                          vnl_math_max( vnl_math_abs( first ), NumericTraits<double>::epsilon() );
+    if ( change < m_MetricConvergenceTolerance )
+      {
+      return true;
+      }
+    }
+
+  // RMS change of the last update
+  if ( m_RMSChangeConvergenceTolerance > 0.0 &&
+       this->GetRMSChange() < m_RMSChangeConvergenceTolerance )
+    {
+    return true;
+    }
+
+  return false;
 }
 
 
@@ -954,6 +1115,19 @@ void
 LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::SmoothGivenField(VelocityFieldType * field, const double StandardDeviations[ImageDimension])
 {
+    RegistrationProfiler::ScopedTimer timer( m_Profiler, "SmoothGivenField" );
+
+    if ( m_UsePlanarFields )
+    {
+        double variances[ImageDimension];
+        this->GetSmoothingVariances( field, StandardDeviations, variances );
+
+        m_PlanarField->SetNumberOfThreads( this->GetNumberOfThreads() );
+        m_PlanarField->Scatter( field );
+        m_PlanarField->Smooth( variances, m_MaximumError, m_MaximumKernelWidth );
+        m_PlanarField->Gather( field );
+        return;
+    }
 
     // copy field to TempField
     m_TempField->SetOrigin( field->GetOrigin() );
@@ -975,6 +1149,7 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 
     OperatorType * oper = new OperatorType;
     typename SmootherType::Pointer smoother = SmootherType::New();
+    smoother->SetNumberOfThreads( this->GetNumberOfThreads() );
 
     typedef typename VelocityFieldType::PixelContainerPointer
             PixelContainerPointer;
@@ -983,24 +1158,16 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
     // graft the output field onto the mini-pipeline
     smoother->GraftOutput( m_TempField );
 
+    double variances[ImageDimension];
+    this->GetSmoothingVariances( field, StandardDeviations, variances );
+
     for( unsigned int j = 0; j < ImageDimension; j++ )
     {
         // smooth along this dimension
         oper->SetDirection( j );
 
-        // Computation of the variance (voxel unit) of the Gaussian kernel
-        double variance;
-        if ( this->m_StandardDeviationWorldUnit )
-        {   double s = field->GetSpacing()[j];
-            variance = vnl_math_sqr( StandardDeviations[j] ) / (s*s);
-        }
-        else
-            variance = vnl_math_sqr( StandardDeviations[j] );
-
-        //std::cout << "Standard deviation : " << StandardDeviations[j] << std::endl;
-
         // Set other parameters
-        oper->SetVariance( variance );
+        oper->SetVariance( variances[j] );
         oper->SetMaximumError( m_MaximumError );
         oper->SetMaximumKernelWidth( m_MaximumKernelWidth );
         oper->CreateDirectional();
@@ -1036,6 +1203,25 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 }
 
 
+// Variances (voxel unit) of the Gaussian kernel
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
+::GetSmoothingVariances(const VelocityFieldType * field, const double StandardDeviations[ImageDimension],
+                        double variances[ImageDimension]) const
+{
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+        if ( this->m_StandardDeviationWorldUnit )
+        {   double s = field->GetSpacing()[j];
+            variances[j] = vnl_math_sqr( StandardDeviations[j] ) / (s*s);
+        }
+        else
+            variances[j] = vnl_math_sqr( StandardDeviations[j] );
+    }
+}
+
+
 template <class TFixedImage, class TMovingImage, class TField>
 typename LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::DeformationFieldPointer
@@ -1044,13 +1230,37 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 { 
 
   //std::cout<<"LCCDeformableRegistration::GetDeformationField"<<std::endl;
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "Exponential" );
   m_Exponentiator->SetInput( this->GetVelocityField() );
   m_Exponentiator->GetOutput()->SetRequestedRegion( this->GetVelocityField()->GetRequestedRegion() );
   m_Exponentiator->Update();
+  timer.AddAllocatedImage( m_Exponentiator->GetOutput() );
+
+  // The velocity field only changes when an iteration is applied
+  m_DeformationFieldComputed  = true;
+  m_DeformationFieldIteration = this->GetElapsedIterations();
+
   return m_Exponentiator->GetOutput();
 }
 
 
+template <class TFixedImage, class TMovingImage, class TField>
+typename LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
+::DeformationFieldPointer
+LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
+::GetCurrentDeformationField()
+{
+  DeformationFieldPointer field = m_Exponentiator->GetOutput();
+  if ( !m_DeformationFieldComputed ||
+       m_DeformationFieldIteration != this->GetElapsedIterations() ||
+       !field->GetBufferPointer() )
+    {
+    return NULL;
+    }
+  return field;
+}
+
+
 template <class TFixedImage, class TMovingImage, class TField>
 typename LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::DeformationFieldPointer
@@ -1058,9 +1268,11 @@ LCCDeformableRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::GetInverseDeformationField()
 {
   //std::cout<<"LCCDeformableRegistration::GetInverseDeformationField"<<std::endl;
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "InverseExponential" );
   m_InverseExponentiator->SetInput( this->GetVelocityField() );
   m_InverseExponentiator->GetOutput()->SetRequestedRegion( this->GetVelocityField()->GetRequestedRegion() );
   m_InverseExponentiator->Update();
+  timer.AddAllocatedImage( m_InverseExponentiator->GetOutput() );
   return m_InverseExponentiator->GetOutput();
 }
 
@@ -71,6 +71,9 @@ LCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::InitializeIteration()
 {
     //std::cout<<"LCClogDemonsRegistrationFilter::InitializeIteration"<<std::endl;
+    if ( this->GetProfiler() )
+        this->GetProfiler()->BeginIteration( this->GetElapsedIterations() );
+
     // update variables in the equation object
     DemonsRegistrationFunctionType *f = this->DownCastDifferenceFunctionType();
 
@@ -80,6 +83,10 @@ LCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
   f->SetDisplacementField( this->GetDeformationField() );
 #endif
 
+    // The internal filters run with the threads of this filter
+    m_Multiplier->SetNumberOfThreads( this->GetNumberOfThreads() );
+    m_BCHFilter->SetNumberOfThreads( this->GetNumberOfThreads() );
+
     // call the superclass  implementation ( initializes f )
     Superclass::InitializeIteration();
 }
@@ -200,6 +207,7 @@ LCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
 #endif
 {
     //std::cout<<"LCClogDemonsRegistrationFilter::ApplyUpdate"<<std::endl;
+    RegistrationProfiler::ScopedTimer timer( this->GetProfiler(), "ApplyUpdate" );
     // If we smooth the update buffer before applying it, then the are
     // approximating a viscuous problem as opposed to an elastic problem
     /*if ( this->GetSmoothUpdateField() )
@@ -235,6 +243,7 @@ LCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
         m_BCHFilter->GraftOutput( DeformationFieldType::New() );
     }
     m_BCHFilter->GetOutput()->SetRequestedRegion( this->GetOutput()->GetRequestedRegion() );
+    m_BCHFilter->SetUsePlanarFields( this->GetUsePlanarFields() );
 
     // Triggers in place update
     m_BCHFilter->Update();
@@ -9,6 +9,7 @@
 #include "itkMultiplyImageFilter.h"
 #include "itkImageIterator.h"
 #include "itkImage.h"
+#include "itkRegistrationProfiler.h"
 
 namespace itk
 {
@@ -116,6 +117,24 @@ class ITK_EXPORT LocalCriteriaOptimizer :
              m_UseMask=flag;
              }
 
+        /** Set the profiler timing the warps of the iteration (not owned). */
+        void SetProfiler( RegistrationProfiler * profiler )
+            {
+             m_Profiler=profiler;
+             }
+
+        /** Set/Get the number of threads of the internal filters (warps,
+         *  smoothings and gradients) of each iteration. */
+        void SetNumberOfThreads( int numberOfThreads )
+            {
+             m_NumberOfThreads=numberOfThreads;
+             }
+
+        int GetNumberOfThreads() const
+            {
+             return m_NumberOfThreads;
+             }
+
 		FixedImagePointer GetMaskImage( )
 			{
 			return(m_MaskImage);
@@ -256,6 +275,10 @@ class ITK_EXPORT LocalCriteriaOptimizer :
         bool                            m_UseMask;
 
         bool                            m_BoundaryCheck;
+
+        RegistrationProfiler *          m_Profiler;
+
+        int                             m_NumberOfThreads;
        	};
 
 } // end namespace itk
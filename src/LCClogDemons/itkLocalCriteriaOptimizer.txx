@@ -188,7 +188,7 @@ itk::SmartPointer<TImageType1> Sqrt(itk::SmartPointer<TImageType1> Image1)
 
 
 template<class TImageType>
-itk::SmartPointer<TImageType> SmoothGivenField(itk::SmartPointer<TImageType> InputImage,double Sigma[3])
+itk::SmartPointer<TImageType> SmoothGivenField(itk::SmartPointer<TImageType> InputImage,double Sigma[3],int NumberOfThreads)
 {
 typedef itk::ImageDuplicator< TImageType > DuplicatorType;
  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
@@ -214,6 +214,10 @@ typedef itk::ImageDuplicator< TImageType > DuplicatorType;
  DGF1->SetDirection(1);
  DGF2->SetDirection(2);
 
+ DGF0->SetNumberOfThreads(NumberOfThreads);
+ DGF1->SetNumberOfThreads(NumberOfThreads);
+ DGF2->SetNumberOfThreads(NumberOfThreads);
+
   DGF0->SetInput(duplicator->GetOutput());
   DGF0->Update();
   DGF1->SetInput(DGF0->GetOutput());
@@ -225,7 +229,7 @@ typedef itk::ImageDuplicator< TImageType > DuplicatorType;
 }
 
 template<class TImageType1>
-itk::SmartPointer<TImageType1> BoundarySmoothing(itk::SmartPointer<TImageType1> Image, bool BoundaryCheck)
+itk::SmartPointer<TImageType1> BoundarySmoothing(itk::SmartPointer<TImageType1> Image, bool BoundaryCheck, int NumberOfThreads)
 {
   if (BoundaryCheck)
     {
@@ -233,6 +237,7 @@ itk::SmartPointer<TImageType1> BoundarySmoothing(itk::SmartPointer<TImageType1>
      typename ScalerFilterType::Pointer scaler = ScalerFilterType::New();
      scaler->SetOutputMinimum(0 );
      scaler->SetOutputMaximum( 1 );
+     scaler->SetNumberOfThreads( NumberOfThreads );
      scaler->SetInput(Image);
      scaler->Update();
 
@@ -375,6 +380,8 @@ m_FixedImageWarper->SetEdgePaddingValue( NumericTraits<MovingImagePixelType>::ma
   m_UseMask = false;
 
   m_BoundaryCheck  = true;
+  m_Profiler = NULL;
+  m_NumberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
 }
 
 
@@ -451,26 +458,33 @@ LocalCriteriaOptimizer<TFixedImage,TMovingImage,TDeformationField>
   m_MovingImageDirection = this->GetMovingImage()->GetDirection();
  
   // Compute warped moving image
+  RegistrationProfiler::ScopedTimer movingTimer( m_Profiler, "MovingImageWarp" );
   m_MovingImageWarper->SetOutputOrigin( this->m_FixedImageOrigin );
   m_MovingImageWarper->SetOutputSpacing( this->m_FixedImageSpacing );
   m_MovingImageWarper->SetOutputDirection( this->m_FixedImageDirection );
   m_MovingImageWarper->SetInput( this->GetMovingImage() );
   m_MovingImageWarper->SetEdgePaddingValue( 0 );
+  m_MovingImageWarper->SetNumberOfThreads( m_NumberOfThreads );
   m_MovingImageWarper->SetDisplacementField( this->GetDisplacementField() );
   m_MovingImageWarper->GetOutput()->SetRequestedRegion( this->GetDisplacementField()->GetRequestedRegion() );
   m_MovingImageWarper->Update();
+  movingTimer.Stop();
  
+  RegistrationProfiler::ScopedTimer fixedTimer( m_Profiler, "FixedImageWarp" );
   m_FixedImageWarper->SetOutputOrigin( this->m_FixedImageOrigin );
   m_FixedImageWarper->SetOutputSpacing( this->m_FixedImageSpacing );
   m_FixedImageWarper->SetOutputDirection( this->m_FixedImageDirection );
   m_FixedImageWarper->SetInput( this->GetFixedImage() );
   m_FixedImageWarper->SetEdgePaddingValue( 0 );
+  m_FixedImageWarper->SetNumberOfThreads( m_NumberOfThreads );
   m_FixedImageWarper->SetDisplacementField( this->GetInverseDeformationField() );
   m_FixedImageWarper->GetOutput()->SetRequestedRegion( this->GetInverseDeformationField()->GetRequestedRegion() );
   m_FixedImageWarper->Update();
+  fixedTimer.Stop();
 
   if (m_UseMask==true)
    {
+      RegistrationProfiler::ScopedTimer maskTimer( m_Profiler, "MaskImageWarp" );
       m_MaskImageWarper = WarperType::New();
       m_MaskImageWarper->SetInterpolator( m_MovingImageInterpolator );
       m_MaskImageWarper->SetOutputOrigin( this->m_MovingImageOrigin );
@@ -478,6 +492,7 @@ LocalCriteriaOptimizer<TFixedImage,TMovingImage,TDeformationField>
       m_MaskImageWarper->SetOutputDirection( this->m_MovingImageDirection );
       m_MaskImageWarper->SetInput( m_MaskImage );
       m_MaskImageWarper->SetEdgePaddingValue( 0 );
+      m_MaskImageWarper->SetNumberOfThreads( m_NumberOfThreads );
       m_MaskImageWarper->SetDisplacementField( this->GetDisplacementField() );
       m_MaskImageWarper->GetOutput()->SetRequestedRegion( this->GetDisplacementField()->GetRequestedRegion() );
       m_MaskImageWarper->Update();
@@ -488,6 +503,7 @@ LocalCriteriaOptimizer<TFixedImage,TMovingImage,TDeformationField>
   m_MovingImageInterpolator->SetInputImage( this->GetMovingImage() );
   
 
+  RegistrationProfiler::ScopedTimer termsTimer( m_Profiler, "EvaluateHighOrderTerms" );
   this->EvaluateHighOrderTerms();
  }
 
@@ -515,22 +531,22 @@ LocalCriteriaOptimizer<TFixedImage,TMovingImage,TDeformationField>
   FixedImagePointer  Fix2= Operation<TFixedImage,TFixedImage>(FixImage,FixImage,2);
   MovingImagePointer  Mov2= Operation<TMovingImage,TMovingImage>(MovImage,MovImage,2);
 
-  FixedImagePointer  GFix2=BoundarySmoothing<TFixedImage>(SmoothGivenField <TFixedImage> (Fix2,m_Sigma),this->m_BoundaryCheck);
-  MovingImagePointer GMov2=BoundarySmoothing<TMovingImage>(SmoothGivenField <TMovingImage>(Mov2,m_Sigma),this->m_BoundaryCheck);
+  FixedImagePointer  GFix2=BoundarySmoothing<TFixedImage>(SmoothGivenField <TFixedImage> (Fix2,m_Sigma,m_NumberOfThreads),this->m_BoundaryCheck,m_NumberOfThreads);
+  MovingImagePointer GMov2=BoundarySmoothing<TMovingImage>(SmoothGivenField <TMovingImage>(Mov2,m_Sigma,m_NumberOfThreads),this->m_BoundaryCheck,m_NumberOfThreads);
 
   FixedImagePointer  SqGFix2=Sqrt<TFixedImage> (GFix2);
   MovingImagePointer SqGMov2=Sqrt<TMovingImage>(GMov2);
   
   FixedImagePointer FixMov=Operation<TFixedImage,TMovingImage> (FixImage,MovImage,2);
-  FixedImagePointer GFixMov=BoundarySmoothing<TFixedImage>(SmoothGivenField <TFixedImage> (FixMov,m_Sigma),this->m_BoundaryCheck);
+  FixedImagePointer GFixMov=BoundarySmoothing<TFixedImage>(SmoothGivenField <TFixedImage> (FixMov,m_Sigma,m_NumberOfThreads),this->m_BoundaryCheck,m_NumberOfThreads);
   
-  FixedImagePointer Denom=BoundarySmoothing<TFixedImage>(Operation<TFixedImage,TMovingImage> (SqGFix2,SqGMov2,2),this->m_BoundaryCheck);
+  FixedImagePointer Denom=BoundarySmoothing<TFixedImage>(Operation<TFixedImage,TMovingImage> (SqGFix2,SqGMov2,2),this->m_BoundaryCheck,m_NumberOfThreads);
   
   FixedImagePointer Corr=Division<TFixedImage,TFixedImage>(GFixMov,Denom);
   
 
-  FixedImagePointer  GFix=BoundarySmoothing<TFixedImage>(SmoothGivenField <TFixedImage> (FixImage,m_Sigma),this->m_BoundaryCheck);
-  MovingImagePointer GMov=BoundarySmoothing<TMovingImage>(SmoothGivenField <TMovingImage>(MovImage,m_Sigma),this->m_BoundaryCheck);
+  FixedImagePointer  GFix=BoundarySmoothing<TFixedImage>(SmoothGivenField <TFixedImage> (FixImage,m_Sigma,m_NumberOfThreads),this->m_BoundaryCheck,m_NumberOfThreads);
+  MovingImagePointer GMov=BoundarySmoothing<TMovingImage>(SmoothGivenField <TMovingImage>(MovImage,m_Sigma,m_NumberOfThreads),this->m_BoundaryCheck,m_NumberOfThreads);
 
 
 /**
@@ -539,11 +555,13 @@ LocalCriteriaOptimizer<TFixedImage,TMovingImage,TDeformationField>
 typedef  itk::GradientImageFilter<MovingImageType> GradientMType;
 typename GradientMType::Pointer GradientM = GradientMType::New();
 GradientM->SetInput(MovImage);
+GradientM->SetNumberOfThreads(m_NumberOfThreads);
 GradientM->Update();
 
 typedef  itk::GradientImageFilter<FixedImageType> GradientFType;
 typename GradientFType::Pointer GradientF = GradientFType::New();
 GradientF->SetInput(FixImage);
+GradientF->SetNumberOfThreads(m_NumberOfThreads);
 GradientF->Update();
 
 
@@ -595,15 +613,15 @@ typename VectorImageType::Pointer FGradMov=Operation<VectorImageType,FixedImageT
 
 typename VectorImageType::Pointer Num1=OperationV<VectorImageType,VectorImageType>(FGradMov,MGradFix,1,FixedImageDimension);
 
-typename VectorImageType::Pointer GNum1=SmoothGivenField<VectorImageType> (Num1,m_Sigma);
+typename VectorImageType::Pointer GNum1=SmoothGivenField<VectorImageType> (Num1,m_Sigma,m_NumberOfThreads);
 
 typename VectorImageType::Pointer Term1=DivisionV<VectorImageType,FixedImageType>(GNum1,Denom,FixedImageDimension);
 
 typename VectorImageType::Pointer FGradFix=Operation<VectorImageType,FixedImageType>(GradFix,FixImage,2);
 typename VectorImageType::Pointer MGradMov=Operation<VectorImageType,MovingImageType>(GradMov,MovImage,2);
 
-typename VectorImageType::Pointer GFGradFix=SmoothGivenField<VectorImageType> (FGradFix,m_Sigma);
-typename VectorImageType::Pointer GMGradMov=SmoothGivenField<VectorImageType> (MGradMov,m_Sigma);
+typename VectorImageType::Pointer GFGradFix=SmoothGivenField<VectorImageType> (FGradFix,m_Sigma,m_NumberOfThreads);
+typename VectorImageType::Pointer GMGradMov=SmoothGivenField<VectorImageType> (MGradMov,m_Sigma,m_NumberOfThreads);
 
 typename VectorImageType::Pointer Term2a=DivisionV<VectorImageType,FixedImageType>(GFGradFix,GFix2,FixedImageDimension);
 typename VectorImageType::Pointer Term2b=DivisionV<VectorImageType,MovingImageType>(GMGradMov,GMov2,FixedImageDimension);
@@ -8,7 +8,13 @@
 #include "itkSymmetricLCClogDemonsRegistrationFilter.h"
 #include "itkMultiResolutionPyramidImageFilter.h"
 #include "itkVectorResampleImageFilter.h"
-#include "itkShrinkImageFilter.h"
+#include "itkVelocityFieldUpsampleImageFilter.h"
+#include "itkTransformToVelocityFieldSource.h"
+#include "itkRunLengthMaskImage.h"
+#include "itkMultiThreader.h"
+#include "itkMultiResolutionIterationScheduler.h"
+#include "itkCommand.h"
+#include "itkRegistrationProfiler.h"
 
 
 #include <vector>
@@ -43,12 +49,55 @@ namespace itk
  * has the same characteristics as the input images), an initial velocity
  * field can still be set via SetArbitraryInitialVelocityField or
  * SetInput. The filter will then take care of mathching the coarsest level
- * characteristics. If no initial field is set a zero field is used as the
- * initial condition.
+ * characteristics. An initial linear transform can be set instead via
+ * SetInitialLinearTransform: its velocity field (matrix logarithm) is then
+ * generated directly on the grid of the coarsest level by a
+ * TransformToVelocityFieldSource, without building a full resolution field.
+ * If no initial field is set a zero field is used as the initial condition.
  *
  * MultiResolutionPyramidImageFilters are used to downsample the fixed
- * and moving images. A VectorExpandImageFilter is used to upsample
- * the velocity field as we move from a coarse to fine solution.
+ * and moving images. When the spacing ratio between two levels is a power
+ * of two on each axis and the directions are the same, a
+ * VelocityFieldUpsampleImageFilter is used to upsample the velocity field as
+ * we move from a coarse to fine solution. Otherwise, the field expander
+ * (a VectorResampleImageFilter) is used.
+ *
+ * With GeneratePyramidLevelsOnDemand on (default: off), the pyramids set with
+ * SetFixedImagePyramid and SetMovingImagePyramid only provide the
+ * schedule: each level is computed just before it is registered by a
+ * single-level copy of the pyramid, so that only the current level is held
+ * in memory. If PrefetchNextPyramidLevel is on, the next level is computed
+ * on a background thread while the current one is being registered.
+ *
+ * With KeepFixedImagePyramid on, all the levels of the fixed pyramid are
+ * computed once and kept as long as the fixed image and the schedule do not
+ * change, so that several moving images can be registered to the same fixed
+ * image without recomputing them. The kept levels can be shared with other
+ * filters registering the same fixed image through ShareFixedImagePyramid.
+ *
+ * The mask pyramid is built once per registration with the schedule of the
+ * moving image pyramid, so that the mask is smoothed and subsampled exactly
+ * like the moving image. It can be shared with the other filters using the
+ * same mask through ShareMaskPyramid. With CompressMaskPyramid on, each
+ * level is thresholded at MaskThreshold and held as a RunLengthMaskImage,
+ * and is only expanded to an image while its level is registered. The registration then
+ * sees binary masks (0 or 1) instead of smoothed ones, so that the voxels at
+ * the border of the mask are weighted differently and the result may differ
+ * slightly from the uncompressed pyramid.
+ *
+ * The number of iterations of each level is given by a
+ * MultiResolutionIterationScheduler, that can share a time budget between
+ * the levels according to their measured cost and metric improvements, and
+ * stop a level that would overrun it.
+ *
+ * If a CheckpointFileName is set, the velocity field and the position of the
+ * registration (level and iteration within the level) are saved after each
+ * level and, if CheckpointInterval is not 0, every CheckpointInterval
+ * iterations. The checkpoint file is a small text file pointing to the saved
+ * velocity field; it is replaced only once the field is written. With
+ * ResumeFromCheckpoint on, the registration restarts from the saved level and
+ * iteration instead of the initial velocity field, without recomputing the
+ * earlier levels.
  *
  * This class is templated over the fixed image type, the moving image type,
  * and the velocity/deformation Field type.
@@ -110,6 +159,7 @@ public:
 
   /** Internal float image type. */
   typedef Image<TRealType,itkGetStaticConstMacro(ImageDimension)> FloatImageType;
+  typedef typename FloatImageType::Pointer                         FloatImagePointer;
 
   /** The internal registration type. */
   typedef LCCDeformableRegistrationFilter<FloatImageType, FloatImageType, VelocityFieldType >
@@ -135,10 +185,31 @@ public:
                                                FieldExpanderType;
   typedef typename FieldExpanderType::Pointer  FieldExpanderPointer;
 
-   /** The image expander type. */
-  typedef ShrinkImageFilter< MovingImageType,MovingImageType >
-                                               ImageExpanderType;
-  typedef typename ImageExpanderType::Pointer  ImageExpanderPointer;
+  /** The iteration scheduler type. */
+  typedef MultiResolutionIterationScheduler    SchedulerType;
+  typedef SchedulerType::Pointer               SchedulerPointer;
+
+  /** The initial linear transform type and the source of its velocity field. */
+  typedef Transform<double, itkGetStaticConstMacro(ImageDimension),
+                    itkGetStaticConstMacro(ImageDimension)>
+                                               InitialTransformType;
+  typedef TransformToVelocityFieldSource<VelocityFieldType, double>
+                                               TransformToVelocityFieldSourceType;
+
+  /** The velocity field upsampler type, used between dyadic levels. */
+  typedef VelocityFieldUpsampleImageFilter<VelocityFieldType, VelocityFieldType >
+                                               FieldUpsamplerType;
+  typedef typename FieldUpsamplerType::Pointer FieldUpsamplerPointer;
+
+  /** The mask pyramid type. The mask lives in the moving image space and
+   * follows the schedule of the moving image pyramid. */
+  typedef MultiResolutionPyramidImageFilter<MovingImageType, FloatImageType >
+                                               MaskPyramidType;
+  typedef typename MaskPyramidType::Pointer    MaskPyramidPointer;
+
+  /** The compact mask type. */
+  typedef RunLengthMaskImage<FloatImageType>   RunLengthMaskType;
+  typedef typename RunLengthMaskType::Pointer  RunLengthMaskPointer;
 
 
 
@@ -185,12 +256,29 @@ public:
 #endif
     }
 
+  /** Set/Get an initial linear transform. Its velocity field is generated
+   * on the grid of the coarsest level of the pyramid. */
+  itkSetConstObjectMacro( InitialLinearTransform, InitialTransformType );
+  itkGetConstObjectMacro( InitialLinearTransform, InitialTransformType );
+
   /** Get output velocity field. */
   VelocityFieldType * GetVelocityField() { return this->GetOutput(); }
 
-  /** Get output deformation field. */
+  /** Get output deformation field. The field is computed once per
+   * output velocity field. If the registration filter had already computed
+   * the exponential of its final velocity field at full resolution, it is
+   * composed with itself instead of exponentiating the output again. */
   DeformationFieldPointer GetDeformationField();
 
+  /** Compose the exponential of the final velocity field of the
+   * registration filter at the end of the registration (default: on). Turn
+   * it off when the deformation field is computed by another filter, e.g.
+   * with the log-Jacobian map; GetDeformationField then exponentiates the
+   * output. */
+  itkSetMacro( ComposeFinalDeformationField, bool );
+  itkGetConstMacro( ComposeFinalDeformationField, bool );
+  itkBooleanMacro( ComposeFinalDeformationField );
+
   /** Get output inverse deformation field. */
   DeformationFieldPointer GetInverseDeformationField();
 
@@ -241,6 +329,90 @@ public:
   virtual const unsigned int * GetNumberOfIterations() const
   { return &(m_NumberOfIterations[0]); }
 
+  /** Compute each pyramid level just before it is needed instead of
+   * updating the whole pyramids beforehand (default: off). */
+  itkSetMacro( GeneratePyramidLevelsOnDemand, bool );
+  itkGetConstMacro( GeneratePyramidLevelsOnDemand, bool );
+  itkBooleanMacro( GeneratePyramidLevelsOnDemand );
+
+  /** Compute the next pyramid level on a background thread while the
+   * current level is registered (default: off). Only used when
+   * GeneratePyramidLevelsOnDemand is on. */
+  itkSetMacro( PrefetchNextPyramidLevel, bool );
+  itkGetConstMacro( PrefetchNextPyramidLevel, bool );
+  itkBooleanMacro( PrefetchNextPyramidLevel );
+
+  /** Keep all the levels of the fixed image pyramid between registrations
+   * (default: off). Only used when GeneratePyramidLevelsOnDemand is on. */
+  itkSetMacro( KeepFixedImagePyramid, bool );
+  itkGetConstMacro( KeepFixedImagePyramid, bool );
+  itkBooleanMacro( KeepFixedImagePyramid );
+
+  /** Compute the kept levels of the fixed image pyramid if the fixed image
+   * or the schedule changed since they were computed. */
+  virtual void UpdateFixedImagePyramid();
+
+  /** Use the fixed pyramid levels kept by another filter, which must have
+   * the same fixed image and fixed schedule. The levels are shared, not
+   * copied. Turns KeepFixedImagePyramid on. */
+  void ShareFixedImagePyramid( const Self * other );
+
+  /** Build the mask pyramid if the mask or the schedule changed since the
+   * last build. Called by the registration; can be called beforehand to
+   * share the pyramid through ShareMaskPyramid. */
+  virtual void UpdateMaskPyramid();
+
+  /** Use the mask pyramid built by another filter, which must have the same
+   * mask, moving schedule and CompressMaskPyramid setting. The levels are
+   * shared, not copied: each registration gets its own image object on the
+   * shared buffers, so that the filters can run at the same time. */
+  void ShareMaskPyramid( const Self * other );
+
+  /** Store the levels of the mask pyramid as run-length encoded binary
+   * masks instead of images (default: off). The levels are binarized at
+   * MaskThreshold: unlike the smoothed levels of the uncompressed pyramid,
+   * their values are 0 or 1, which may change the registration result near
+   * the border of the mask. */
+  itkSetMacro( CompressMaskPyramid, bool );
+  itkGetConstMacro( CompressMaskPyramid, bool );
+  itkBooleanMacro( CompressMaskPyramid );
+
+  /** Threshold used to binarize the smoothed mask levels when
+   * CompressMaskPyramid is on (default: 0.5). */
+  itkSetMacro( MaskThreshold, TRealType );
+  itkGetConstMacro( MaskThreshold, TRealType );
+
+  /** Use the VelocityFieldUpsampleImageFilter for dyadic schedules instead
+   * of the field expander (default: on). */
+  itkSetMacro( UseDyadicFieldUpsampler, bool );
+  itkGetConstMacro( UseDyadicFieldUpsampler, bool );
+  itkBooleanMacro( UseDyadicFieldUpsampler );
+
+  /** Set/Get the profiler recording the time spent in each level and in the
+   * stages of the registration (default: none). It is passed on to the
+   * registration filter. */
+  itkSetObjectMacro( Profiler, RegistrationProfiler );
+  itkGetObjectMacro( Profiler, RegistrationProfiler );
+
+  /** Set/Get the scheduler that fits the iterations of each level into a
+   * wall-clock time budget. */
+  itkSetObjectMacro( Scheduler, SchedulerType );
+  itkGetObjectMacro( Scheduler, SchedulerType );
+
+  /** Set/Get the checkpoint file (default: empty, no checkpoint). */
+  itkSetStringMacro( CheckpointFileName );
+  itkGetStringMacro( CheckpointFileName );
+
+  /** Set/Get the number of iterations between two checkpoints within a
+   * level (default: 0, checkpoints at the end of each level only). */
+  itkSetMacro( CheckpointInterval, unsigned int );
+  itkGetConstMacro( CheckpointInterval, unsigned int );
+
+  /** Restart the registration from the checkpoint file (default: off). */
+  itkSetMacro( ResumeFromCheckpoint, bool );
+  itkGetConstMacro( ResumeFromCheckpoint, bool );
+  itkBooleanMacro( ResumeFromCheckpoint );
+
   /** Stop the registration after the current iteration. */
   virtual void StopRegistration();
 
@@ -466,6 +638,58 @@ protected:
    * terminate at the current resolution level. */
   virtual bool Halt();
 
+  /** Called after each iteration of the registration filter to let the
+   * scheduler stop the current level. */
+  virtual void RegistrationIterationUpdate();
+
+  /** Number of voxels of each level of the fixed image pyramid. */
+  std::vector<double> GetNumberOfVoxelsPerLevel() const;
+
+  /** Make the fixed and moving images of the given levels available in
+   * m_FixedLevelImage and m_MovingLevelImage. */
+  virtual void AcquirePyramidLevel( unsigned int fixedLevel, unsigned int movingLevel );
+
+  /** Compute a single level of the fixed and moving pyramids of the given
+   * images. */
+  virtual void GeneratePyramidLevel( unsigned int fixedLevel, unsigned int movingLevel,
+                                     const FixedImageType * fixedImage,
+                                     const MovingImageType * movingImage,
+                                     FloatImagePointer & fixedLevelImage,
+                                     FloatImagePointer & movingLevelImage );
+
+  /** Start computing the given levels on a background thread. */
+  void StartPyramidLevelPrefetch( unsigned int fixedLevel, unsigned int movingLevel );
+
+  /** Wait for the background thread started by StartPyramidLevelPrefetch. */
+  void WaitForPyramidLevelPrefetch();
+
+  /** Entry point of the prefetch thread. */
+  static ITK_THREAD_RETURN_TYPE PyramidLevelPrefetchCallback( void *arg );
+
+  /** Get the mask of the given moving pyramid level. */
+  FloatImagePointer GetMaskLevel( unsigned int movingLevel ) const;
+
+  /** Resample the velocity field onto the grid of the given image and
+   * multiply it by the scale. */
+  VelocityFieldPointer ExpandVelocityField( VelocityFieldType * field,
+                                            const ImageBase<ImageDimension> * grid,
+                                            double scale );
+
+  /** Return true if the field upsampler can be used to resample the field
+   * onto the grid of the given image. */
+  bool IsDyadicExpansion( const VelocityFieldType * field,
+                          const ImageBase<ImageDimension> * grid ) const;
+
+  /** Save the velocity field reached at the given iteration of the given
+   * level in the checkpoint. */
+  virtual void WriteCheckpoint( const VelocityFieldType * field,
+                                unsigned int level, unsigned int iteration );
+
+  /** Read the checkpoint and return its velocity field, level and
+   * iteration. */
+  virtual VelocityFieldPointer ReadCheckpoint( unsigned int & level,
+                                               unsigned int & iteration );
+
 private:
   MultiResolutionLCCDeformableRegistration(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
@@ -474,8 +698,10 @@ private:
   FixedImagePyramidPointer   m_FixedImagePyramid;
   MovingImagePyramidPointer  m_MovingImagePyramid;
   FieldExpanderPointer       m_FieldExpander;
+  FieldUpsamplerPointer      m_FieldUpsampler;
+  bool                       m_UseDyadicFieldUpsampler;
   VelocityFieldPointer       m_InitialVelocityField;
-  ImageExpanderPointer       m_ImageExpander;
+  typename InitialTransformType::ConstPointer m_InitialLinearTransform;
 
   unsigned int               m_NumberOfLevels;
   unsigned int               m_CurrentLevel;
@@ -486,6 +712,18 @@ private:
 
   FieldExponentiatorPointer m_Exponentiator;
 
+  /**
+   * Deformation field of the output and the output buffer it comes from
+   */
+  DeformationFieldPointer   m_DeformationField;
+  typename VelocityFieldType::PixelContainerConstPointer m_DeformationFieldVelocityContainer;
+  bool                      m_ComposeFinalDeformationField;
+
+  /**
+   * Iteration scheduler
+   */
+  SchedulerPointer          m_Scheduler;
+
   /**
    * Regularization type.
    */
@@ -548,11 +786,63 @@ private:
    */
   MovingImageConstPointer   m_MaskImage;
 
+  /**
+   * Cached mask pyramid, stored as images or as run-length encoded masks
+   */
+  bool                              m_CompressMaskPyramid;
+  TRealType                         m_MaskThreshold;
+  std::vector<FloatImagePointer>    m_MaskLevels;
+  std::vector<RunLengthMaskPointer> m_RunLengthMaskLevels;
+  typename MaskPyramidType::ScheduleType m_MaskSchedule;
+  TimeStamp                         m_MaskPyramidTime;
+
+  /**
+   * Kept fixed pyramid, shared between filters registering the same fixed image
+   */
+  bool                              m_KeepFixedImagePyramid;
+  std::vector<FloatImagePointer>    m_FixedLevels;
+  typename FixedImagePyramidType::ScheduleType m_FixedLevelsSchedule;
+  const FixedImageType *            m_FixedLevelsSource;
+  TimeStamp                         m_FixedLevelsTime;
+
+  /**
+   * Profiler of the levels and stages, may be NULL
+   */
+  RegistrationProfiler::Pointer     m_Profiler;
+
   /**
    * Boundary checking
    */
   bool                      m_BoundaryCheck;
 
+  /**
+   * Pyramid levels generated on demand and their prefetching
+   */
+  bool                      m_GeneratePyramidLevelsOnDemand;
+  bool                      m_PrefetchNextPyramidLevel;
+
+  FloatImagePointer         m_FixedLevelImage;
+  FloatImagePointer         m_MovingLevelImage;
+
+  MultiThreader::Pointer    m_PrefetchThreader;
+  int                       m_PrefetchThreadId;
+  unsigned int              m_PrefetchFixedLevel;
+  unsigned int              m_PrefetchMovingLevel;
+  FloatImagePointer         m_PrefetchedFixedImage;
+  FloatImagePointer         m_PrefetchedMovingImage;
+  FixedImagePointer         m_PrefetchFixedInput;
+  MovingImagePointer        m_PrefetchMovingInput;
+  std::string               m_PrefetchError;
+
+  /**
+   * Checkpoints
+   */
+  std::string               m_CheckpointFileName;
+  std::string               m_CheckpointFieldFileName;
+  unsigned int              m_CheckpointInterval;
+  bool                      m_ResumeFromCheckpoint;
+  unsigned int              m_LevelIterationOffset;
+
 
 };
 
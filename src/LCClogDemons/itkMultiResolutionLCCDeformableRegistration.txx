@@ -8,6 +8,13 @@
 #include "vnl/vnl_math.h"
 #include "itkMultiplyByConstantImageFilter.h"
 #include "itkNearestNeighborInterpolateImageFunction.h"
+#include "itkDisplacementFieldCompositionFilter.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 
 namespace itk {
 
@@ -61,7 +68,8 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
     m_MovingImagePyramid   = ActualMovingImagePyramidType::New();
     m_FixedImagePyramid    = ActualFixedImagePyramidType::New();
     m_FieldExpander        = FieldExpanderType::New();
-    m_ImageExpander        = ImageExpanderType::New();
+    m_FieldUpsampler       = FieldUpsamplerType::New();
+    m_UseDyadicFieldUpsampler = true;
     m_InitialVelocityField = NULL;
 
     m_NumberOfLevels       = 3;
@@ -75,6 +83,28 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
     m_CurrentLevel         = 0;
     m_StopRegistrationFlag = false;
     m_Exponentiator        = FieldExponentiatorType::New();
+    m_Scheduler            = SchedulerType::New();
+
+    m_GeneratePyramidLevelsOnDemand = false;
+    m_PrefetchNextPyramidLevel      = false;
+    m_PrefetchThreader              = MultiThreader::New();
+    m_PrefetchThreadId              = -1;
+    m_PrefetchFixedLevel            = 0;
+    m_PrefetchMovingLevel           = 0;
+
+    m_CompressMaskPyramid           = false;
+    m_MaskThreshold                 = 0.5;
+
+    m_KeepFixedImagePyramid         = false;
+    m_FixedLevelsSource             = NULL;
+
+    m_ComposeFinalDeformationField  = true;
+
+    m_Profiler                      = NULL;
+
+    m_CheckpointInterval            = 0;
+    m_ResumeFromCheckpoint          = false;
+    m_LevelIterationOffset          = 0;
 }
 
 
@@ -571,9 +601,35 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
 
   os << indent << "FieldExpander: ";
   os << m_FieldExpander.GetPointer() << std::endl;
+  os << indent << "InitialLinearTransform: ";
+  os << m_InitialLinearTransform.GetPointer() << std::endl;
 
   os << indent << "StopRegistrationFlag: ";
   os << m_StopRegistrationFlag << std::endl;
+  os << indent << "Scheduler: ";
+  os << m_Scheduler.GetPointer() << std::endl;
+  os << indent << "GeneratePyramidLevelsOnDemand: ";
+  os << m_GeneratePyramidLevelsOnDemand << std::endl;
+  os << indent << "PrefetchNextPyramidLevel: ";
+  os << m_PrefetchNextPyramidLevel << std::endl;
+  os << indent << "UseDyadicFieldUpsampler: ";
+  os << m_UseDyadicFieldUpsampler << std::endl;
+  os << indent << "KeepFixedImagePyramid: ";
+  os << m_KeepFixedImagePyramid << std::endl;
+  os << indent << "ComposeFinalDeformationField: ";
+  os << m_ComposeFinalDeformationField << std::endl;
+  os << indent << "CompressMaskPyramid: ";
+  os << m_CompressMaskPyramid << std::endl;
+  os << indent << "MaskThreshold: ";
+  os << m_MaskThreshold << std::endl;
+  os << indent << "CheckpointFileName: ";
+  os << m_CheckpointFileName << std::endl;
+  os << indent << "Profiler: ";
+  os << m_Profiler.GetPointer() << std::endl;
+  os << indent << "CheckpointInterval: ";
+  os << m_CheckpointInterval << std::endl;
+  os << indent << "ResumeFromCheckpoint: ";
+  os << m_ResumeFromCheckpoint << std::endl;
   
   os << indent << "Exponentiator: ";
   os << m_Exponentiator << std::endl;
@@ -625,17 +681,60 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
                            << "cunjunction with SetArbitraryInitialVelocityField "
                            << "or SetInput.");
     }
+#if (ITK_VERSION_MAJOR < 4)
+    if( this->m_InitialLinearTransform && ( this->m_InitialVelocityField || this->GetInput(0) ) )
+#else
+    if( this->m_InitialLinearTransform && ( this->m_InitialVelocityField || this->GetInput(VELOCITYFIELD_IMAGE_CODE) ) )
+#endif
+    {
+        itkExceptionMacro( << "Only one initial velocity can be given. "
+                           << "SetInitialLinearTransform should not be used in "
+                           << "cunjunction with an initial velocity field.");
+    }
 
-    // Create the image pyramids.
+    // The internal filters, and the registration filter, run with the
+    // threads of this filter
+    const int numberOfThreads = this->GetNumberOfThreads();
+    m_RegistrationFilter->SetNumberOfThreads( numberOfThreads );
+    m_MovingImagePyramid->SetNumberOfThreads( numberOfThreads );
+    m_FixedImagePyramid->SetNumberOfThreads( numberOfThreads );
+    m_FieldExpander->SetNumberOfThreads( numberOfThreads );
+    m_FieldUpsampler->SetNumberOfThreads( numberOfThreads );
+    m_Exponentiator->SetNumberOfThreads( numberOfThreads );
+
+    // Create the image pyramids. When levels are generated on demand,
+    // the pyramids only provide the schedule.
     m_MovingImagePyramid->SetInput( movingImage );
-    m_MovingImagePyramid->UpdateLargestPossibleRegion();
-
     m_FixedImagePyramid->SetInput( fixedImage );
-    m_FixedImagePyramid->UpdateLargestPossibleRegion();
+    if ( !m_GeneratePyramidLevelsOnDemand )
+    {
+        m_MovingImagePyramid->UpdateLargestPossibleRegion();
+        m_FixedImagePyramid->UpdateLargestPossibleRegion();
+    }
+    else if ( m_KeepFixedImagePyramid )
+    {
+        this->UpdateFixedImagePyramid();
+    }
 
     // Initializations
     m_CurrentLevel = 0;
     m_StopRegistrationFlag = false;
+    m_LevelIterationOffset = 0;
+    m_DeformationField = NULL;
+    m_DeformationFieldVelocityContainer = NULL;
+
+    VelocityFieldPointer tempField = NULL;
+    bool resumed = false;
+
+    // Restart from the level and iteration of the checkpoint
+    if ( m_ResumeFromCheckpoint )
+    {
+        unsigned int level = 0, iteration = 0;
+        tempField = this->ReadCheckpoint( level, iteration );
+        m_CurrentLevel         = level;
+        m_LevelIterationOffset = iteration;
+        resumed = true;
+    }
 
     unsigned int movingLevel = vnl_math_min( (int) m_CurrentLevel,
                                              (int) m_MovingImagePyramid->GetNumberOfLevels() );
@@ -643,7 +742,14 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
     unsigned int fixedLevel = vnl_math_min( (int) m_CurrentLevel,
                                             (int) m_FixedImagePyramid->GetNumberOfLevels() );
 
-    VelocityFieldPointer tempField = NULL;
+    m_RegistrationFilter->SetProfiler( m_Profiler );
+
+    if ( m_CurrentLevel < m_NumberOfLevels )
+    {
+        if ( m_Profiler )
+            m_Profiler->BeginLevel( m_CurrentLevel );
+        this->AcquirePyramidLevel( fixedLevel, movingLevel );
+    }
 
     VelocityFieldPointer inputPtr =
 #if (ITK_VERSION_MAJOR < 4)
@@ -652,10 +758,34 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
     const_cast<VelocityFieldType *>( this->GetInput(VELOCITYFIELD_IMAGE_CODE) );
 #endif
 
-    if ( this->m_InitialVelocityField )
+    if ( resumed )
+    {
+        // The checkpoint replaces the initial velocity field
+    }
+    else if ( this->m_InitialVelocityField )
     {
         tempField = this->m_InitialVelocityField;
     }
+    else if ( this->m_InitialLinearTransform )
+    {
+        // Generate the velocity field of the transform on the grid of the
+        // coarsest level
+        typename TransformToVelocityFieldSourceType::Pointer fieldSource =
+            TransformToVelocityFieldSourceType::New();
+        fieldSource->SetTransform( this->m_InitialLinearTransform );
+        fieldSource->SetNumberOfThreads( numberOfThreads );
+        fieldSource->SetOutputParametersFromImage( m_FixedLevelImage );
+        fieldSource->UpdateLargestPossibleRegion();
+
+        tempField = fieldSource->GetOutput();
+        tempField->DisconnectPipeline();
+
+        // The registration filter estimates half of the velocity field,
+        // which is doubled at the end
+        ImageRegionIterator<VelocityFieldType> it( tempField, tempField->GetLargestPossibleRegion() );
+        for ( it.GoToBegin(); !it.IsAtEnd(); ++it )
+            it.Set( it.Get() * 0.5 );
+    }
     else if( inputPtr )
     {
         // Arbitrary initial velocity field is set.
@@ -666,6 +796,7 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
 
         typedef RecursiveGaussianImageFilter< VelocityFieldType, VelocityFieldType> GaussianFilterType;
         typename GaussianFilterType::Pointer smoother = GaussianFilterType::New();
+        smoother->SetNumberOfThreads( numberOfThreads );
 
         for (unsigned int dim=0; dim<VelocityFieldType::ImageDimension; ++dim)
         {
@@ -689,7 +820,7 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
         // Now resample
         m_FieldExpander->SetInput( tempField );
 	//std::cout<<"Fixed Level "<<fixedLevel<<std::endl;
-        typename FloatImageType::Pointer fi = m_FixedImagePyramid->GetOutput( fixedLevel );
+        typename FloatImageType::Pointer fi = m_FixedLevelImage;
         m_FieldExpander->SetSize(             fi->GetLargestPossibleRegion().GetSize() );
         m_FieldExpander->SetOutputStartIndex( fi->GetLargestPossibleRegion().GetIndex() );
         m_FieldExpander->SetOutputOrigin(     fi->GetOrigin() );
@@ -701,18 +832,30 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
         tempField->DisconnectPipeline();
     }
 
-    if (m_UseMask)
+    if (m_UseMask && m_CurrentLevel < m_NumberOfLevels)
       {
-       m_ImageExpander->SetInput( m_MaskImage );
-       m_ImageExpander->SetShrinkFactors(pow(2,m_MovingImagePyramid->GetNumberOfLevels()-movingLevel-1));
-       m_ImageExpander->Update();
+       this->UpdateMaskPyramid();
        m_RegistrationFilter->UseMask(m_UseMask);
-       m_RegistrationFilter->SetMaskImage(m_ImageExpander->GetOutput() );
+       m_RegistrationFilter->SetMaskImage( this->GetMaskLevel( movingLevel ) );
       }
     else m_RegistrationFilter->UseMask(m_UseMask);
 
     bool lastShrinkFactorsAllOnes = false;
 
+    // Shrink factors of the level of the checkpoint field, in case there is
+    // no level left to register
+    if ( resumed && m_CurrentLevel > 0 )
+    {
+        const unsigned int lastLevel = vnl_math_min( m_CurrentLevel - 1,
+                                                     m_FixedImagePyramid->GetNumberOfLevels() - 1 );
+        lastShrinkFactorsAllOnes = true;
+        for( unsigned int idim = 0; idim < ImageDimension; idim++ )
+        {
+            if ( m_FixedImagePyramid->GetSchedule()[lastLevel][idim] > 1 )
+                lastShrinkFactorsAllOnes = false;
+        }
+    }
+
     m_RegistrationFilter->SetRegularizationType(this->m_RegularizationType);
 
     if (m_RegularizationType==0)
@@ -754,7 +897,17 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
     m_RegistrationFilter->SetSigmaI( this->m_SigmaI );
 
     m_RegistrationFilter->SetBoundaryCheck(this->m_BoundaryCheck);
+    // The scheduler gives the number of iterations of each level and is
+    // notified of each iteration of the registration filter
+    m_Scheduler->Start( m_NumberOfIterations, this->GetNumberOfVoxelsPerLevel() );
+
+    typedef SimpleMemberCommand<Self> SchedulerCommandType;
+    typename SchedulerCommandType::Pointer schedulerCommand = SchedulerCommandType::New();
+    schedulerCommand->SetCallbackFunction( this, &Self::RegistrationIterationUpdate );
+    unsigned long schedulerTag = m_RegistrationFilter->AddObserver( IterationEvent(), schedulerCommand );
+
     // Loop
+    bool levelRegistered = false;
     while ( !this->Halt() )
     {
 
@@ -765,39 +918,16 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
         else
         {
             // Resample the field to be the same size as the fixed image at the current level
-            m_FieldExpander->SetInput( tempField );
-
-            typename FloatImageType::Pointer fi = m_FixedImagePyramid->GetOutput( fixedLevel );
-            m_FieldExpander->SetSize(             fi->GetLargestPossibleRegion().GetSize() );
-            m_FieldExpander->SetOutputStartIndex( fi->GetLargestPossibleRegion().GetIndex() );
-            m_FieldExpander->SetOutputOrigin(     fi->GetOrigin() );
-            m_FieldExpander->SetOutputSpacing(    fi->GetSpacing());
-            m_FieldExpander->SetOutputDirection(  fi->GetDirection());
-
-            m_FieldExpander->UpdateLargestPossibleRegion();
-            tempField = m_FieldExpander->GetOutput();
-            tempField->DisconnectPipeline();
+            tempField = this->ExpandVelocityField( tempField, m_FixedLevelImage, 1.0 );
 
 	    
             m_RegistrationFilter->SetInitialVelocityField( tempField );
 
-            // Resample the mask image to be the same size as the fixed image at the current level
+            // Take the mask of the current level from the cached mask pyramid
             if (m_UseMask)
-
             {
-              m_ImageExpander->SetInput( m_MaskImage );
-
-    /*        m_ImageExpander->SetSize(             fi->GetLargestPossibleRegion().GetSize() );
-              m_ImageExpander->SetOutputStartIndex( fi->GetLargestPossibleRegion().GetIndex() );
-              m_ImageExpander->SetOutputOrigin(     fi->GetOrigin() );
-              m_ImageExpander->SetOutputSpacing(    fi->GetSpacing());
-              m_ImageExpander->SetOutputDirection(  fi->GetDirection());
-*/
-              m_ImageExpander->SetShrinkFactors(pow(2,m_MovingImagePyramid->GetNumberOfLevels()-movingLevel-1));
-              m_ImageExpander->UpdateLargestPossibleRegion();
-           
               m_RegistrationFilter->UseMask( m_UseMask );
-              m_RegistrationFilter->SetMaskImage( m_ImageExpander->GetOutput() );
+              m_RegistrationFilter->SetMaskImage( this->GetMaskLevel( movingLevel ) );
             }
             else
               m_RegistrationFilter->UseMask( m_UseMask );
@@ -806,9 +936,12 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
 
 
         // Setup registration filter and pyramids
-        m_RegistrationFilter->SetMovingImage(        m_MovingImagePyramid->GetOutput(movingLevel) );
-        m_RegistrationFilter->SetFixedImage(         m_FixedImagePyramid->GetOutput(fixedLevel) );
-        m_RegistrationFilter->SetNumberOfIterations( m_NumberOfIterations[m_CurrentLevel] );
+        m_RegistrationFilter->SetMovingImage(        m_MovingLevelImage );
+        m_RegistrationFilter->SetFixedImage(         m_FixedLevelImage );
+        // A level resumed from a checkpoint only runs its remaining iterations
+        unsigned int numberOfIterations = m_Scheduler->StartLevel( m_CurrentLevel );
+        numberOfIterations -= vnl_math_min( numberOfIterations, m_LevelIterationOffset );
+        m_RegistrationFilter->SetNumberOfIterations( numberOfIterations );
 
 
         // Resolution
@@ -816,7 +949,7 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
         for (int i=0; i<ImageDimension; i++)
         {
             double s1  = fixedImage->GetLargestPossibleRegion().GetSize()[i];
-            double s2  = m_FixedImagePyramid->GetOutput(movingLevel)->GetLargestPossibleRegion().GetSize()[i];
+            double s2  = m_FixedLevelImage->GetLargestPossibleRegion().GetSize()[i];
             resolution = std::max( resolution, s1/s2 );
         }
 
@@ -863,8 +996,35 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
             }
         }
 
+        // Compute the next pyramid level while this one is registered
+        if ( m_GeneratePyramidLevelsOnDemand && m_PrefetchNextPyramidLevel &&
+             m_CurrentLevel + 1 < m_NumberOfLevels )
+        {
+            this->StartPyramidLevelPrefetch(
+                    vnl_math_min( (int) m_CurrentLevel + 1, (int) m_FixedImagePyramid->GetNumberOfLevels() ),
+                    vnl_math_min( (int) m_CurrentLevel + 1, (int) m_MovingImagePyramid->GetNumberOfLevels() ) );
+        }
+
         // compute new velocity field
-        m_RegistrationFilter->UpdateLargestPossibleRegion();
+        try
+        {
+            m_RegistrationFilter->UpdateLargestPossibleRegion();
+        }
+        catch( ... )
+        {
+            m_RegistrationFilter->RemoveObserver( schedulerTag );
+            this->WaitForPyramidLevelPrefetch();
+            throw;
+        }
+
+        levelRegistered = true;
+
+        // Skip the remaining levels once the time budget is spent
+        m_Scheduler->EndLevel();
+        if ( m_Scheduler->IsTimeBudgetExhausted() )
+        {
+            m_StopRegistrationFlag = true;
+        }
        // std::cout<<"Smoothing velocity!"<<std::endl;
        // m_RegistrationFilter->SmoothVelocityField();
 
@@ -877,6 +1037,15 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
 	
         // Increment level counter.
         m_CurrentLevel++;
+        m_LevelIterationOffset = 0;
+        if ( m_Profiler )
+            m_Profiler->EndLevel();
+
+        // Save the field to start the next level from
+        if ( !m_CheckpointFileName.empty() )
+        {
+            this->WriteCheckpoint( tempField, m_CurrentLevel, 0 );
+        }
         movingLevel = vnl_math_min( (int) m_CurrentLevel,
                                     (int) m_MovingImagePyramid->GetNumberOfLevels() );
         fixedLevel = vnl_math_min( (int) m_CurrentLevel,
@@ -886,17 +1055,40 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
         this->InvokeEvent( IterationEvent() );
 
         // We can release data from pyramid which are no longer required.
-        if ( movingLevel > 0 )
+        if ( !m_GeneratePyramidLevelsOnDemand )
         {
-            m_MovingImagePyramid->GetOutput( movingLevel - 1 )->ReleaseData();
+            if ( movingLevel > 0 )
+            {
+                m_MovingImagePyramid->GetOutput( movingLevel - 1 )->ReleaseData();
+            }
+            if( fixedLevel > 0 )
+            {
+                m_FixedImagePyramid->GetOutput( fixedLevel - 1 )->ReleaseData();
+            }
         }
-        if( fixedLevel > 0 )
+
+        // Get the images of the next level
+        if ( m_CurrentLevel < m_NumberOfLevels && !m_StopRegistrationFlag )
         {
-            m_FixedImagePyramid->GetOutput( fixedLevel - 1 )->ReleaseData();
+            if ( m_Profiler )
+                m_Profiler->BeginLevel( m_CurrentLevel );
+            this->AcquirePyramidLevel( fixedLevel, movingLevel );
         }
 
     } // while not Halt()
 
+    if ( m_Profiler )
+        m_Profiler->EndLevel();
+
+    m_RegistrationFilter->RemoveObserver( schedulerTag );
+
+    // Drop the last level images and a possibly unused prefetched level
+    this->WaitForPyramidLevelPrefetch();
+    m_PrefetchedFixedImage  = NULL;
+    m_PrefetchedMovingImage = NULL;
+    m_FixedLevelImage       = NULL;
+    m_MovingLevelImage      = NULL;
+
     if( !lastShrinkFactorsAllOnes )
     {
         // Some of the last shrink factors are not one
@@ -904,26 +1096,10 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
         // to output of this filter
 
         // resample the field to the same size as the fixed image
-        m_FieldExpander->SetInput( tempField );
-        m_FieldExpander->SetSize(
-                fixedImage->GetLargestPossibleRegion().GetSize() );
-        m_FieldExpander->SetOutputStartIndex(
-                fixedImage->GetLargestPossibleRegion().GetIndex() );
-        m_FieldExpander->SetOutputOrigin( fixedImage->GetOrigin() );
-        m_FieldExpander->SetOutputSpacing( fixedImage->GetSpacing());
-        m_FieldExpander->SetOutputDirection( fixedImage->GetDirection());
+        // and apply the final factor 2 in the same pass
+        tempField = this->ExpandVelocityField( tempField, fixedImage, 2.0 );
 
-        m_FieldExpander->UpdateLargestPossibleRegion();
-////MINE
-	typedef typename itk::MultiplyByConstantImageFilter<VelocityFieldType,float, VelocityFieldType> VelocityMultiplierType;
-	    typename VelocityMultiplierType::Pointer VelocityMultiplier=VelocityMultiplierType::New();
-	    
-	    VelocityMultiplier->SetInput(m_FieldExpander->GetOutput() );
-	    VelocityMultiplier->SetConstant(2);
-	    VelocityMultiplier->UpdateLargestPossibleRegion();	
-
-
-        this->GraftOutput( VelocityMultiplier->GetOutput() );
+        this->GraftOutput( tempField );
     }
     else
     {
@@ -936,23 +1112,608 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
 	    
 	    VelocityMultiplier->SetInput(tempField);
 	    VelocityMultiplier->SetConstant(2);
+	    VelocityMultiplier->SetNumberOfThreads( numberOfThreads );
 	    VelocityMultiplier->UpdateLargestPossibleRegion();	
 
             tempField = VelocityMultiplier->GetOutput();
             tempField->DisconnectPipeline();
 
         this->GraftOutput( tempField );
+
+        // exp(2v) = exp(v) o exp(v): reuse the exponential of the last
+        // velocity field if the registration filter has already computed it
+        DeformationFieldPointer halfField;
+        if ( levelRegistered && m_ComposeFinalDeformationField )
+            halfField = m_RegistrationFilter->GetCurrentDeformationField();
+        if ( halfField )
+        {
+            RegistrationProfiler::ScopedTimer timer( m_Profiler, "FinalExponential" );
+            halfField->DisconnectPipeline();
+
+            typedef DisplacementFieldCompositionFilter<DeformationFieldType, DeformationFieldType> ComposerType;
+            typename ComposerType::Pointer composer = ComposerType::New();
+            composer->SetInput( 0, halfField );
+            composer->SetInput( 1, halfField );
+            composer->SetNumberOfThreads( numberOfThreads );
+            composer->UpdateLargestPossibleRegion();
+
+            m_DeformationField = composer->GetOutput();
+            m_DeformationField->DisconnectPipeline();
+            timer.AddAllocatedImage( m_DeformationField.GetPointer() );
+            m_DeformationFieldVelocityContainer = this->GetOutput()->GetPixelContainer();
+        }
     }
 
     // Release memory
     m_FieldExpander->SetInput( NULL );
     m_FieldExpander->GetOutput()->ReleaseData();
+    m_FieldUpsampler->SetInput( NULL );
+    m_FieldUpsampler->GetOutput()->ReleaseData();
     m_RegistrationFilter->SetInput( NULL );
     m_RegistrationFilter->GetOutput()->ReleaseData();
 
 }
 
 
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::AcquirePyramidLevel( unsigned int fixedLevel, unsigned int movingLevel )
+{
+    if ( !m_GeneratePyramidLevelsOnDemand )
+    {
+        m_FixedLevelImage  = m_FixedImagePyramid->GetOutput( fixedLevel );
+        m_MovingLevelImage = m_MovingImagePyramid->GetOutput( movingLevel );
+        return;
+    }
+
+    // Use the prefetched level if it is the right one
+    this->WaitForPyramidLevelPrefetch();
+    if ( m_PrefetchedFixedImage.IsNotNull() && m_PrefetchedMovingImage.IsNotNull() &&
+         m_PrefetchFixedLevel == fixedLevel && m_PrefetchMovingLevel == movingLevel )
+    {
+        m_FixedLevelImage  = m_PrefetchedFixedImage;
+        m_MovingLevelImage = m_PrefetchedMovingImage;
+    }
+    else
+    {
+        // Release the current level before computing the next one
+        m_FixedLevelImage  = NULL;
+        m_MovingLevelImage = NULL;
+        this->GeneratePyramidLevel( fixedLevel, movingLevel, this->GetFixedImage(), this->GetMovingImage(),
+                                    m_FixedLevelImage, m_MovingLevelImage );
+    }
+    m_PrefetchedFixedImage  = NULL;
+    m_PrefetchedMovingImage = NULL;
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::GeneratePyramidLevel( unsigned int fixedLevel, unsigned int movingLevel,
+                        const FixedImageType * fixedImage,
+                        const MovingImageType * movingImage,
+                        FloatImagePointer & fixedLevelImage,
+                        FloatImagePointer & movingLevelImage )
+{
+    RegistrationProfiler::ScopedTimer timer( m_Profiler, "PyramidLevel" );
+
+    // A single-level copy of each pyramid, using the shrink factors of
+    // the requested level, produces the same image as the full pyramid
+    typename FixedImagePyramidType::Pointer fixedPyramid =
+            dynamic_cast<FixedImagePyramidType *>( m_FixedImagePyramid->CreateAnother().GetPointer() );
+    typename MovingImagePyramidType::Pointer movingPyramid =
+            dynamic_cast<MovingImagePyramidType *>( m_MovingImagePyramid->CreateAnother().GetPointer() );
+    fixedPyramid->SetNumberOfThreads( this->GetNumberOfThreads() );
+    movingPyramid->SetNumberOfThreads( this->GetNumberOfThreads() );
+
+    typename FixedImagePyramidType::ScheduleType fixedSchedule( 1, ImageDimension );
+    typename MovingImagePyramidType::ScheduleType movingSchedule( 1, ImageDimension );
+    for( unsigned int idim = 0; idim < ImageDimension; idim++ )
+    {
+        fixedSchedule[0][idim]  = m_FixedImagePyramid->GetSchedule()[fixedLevel][idim];
+        movingSchedule[0][idim] = m_MovingImagePyramid->GetSchedule()[movingLevel][idim];
+    }
+
+    if ( m_KeepFixedImagePyramid && fixedLevel < m_FixedLevels.size() )
+    {
+        // The kept level may be used by other filters at the same time: the
+        // registration gets its own image object on the shared buffer
+        fixedLevelImage = FloatImageType::New();
+        fixedLevelImage->Graft( m_FixedLevels[fixedLevel] );
+    }
+    else
+    {
+        fixedPyramid->SetNumberOfLevels( 1 );
+        fixedPyramid->SetSchedule( fixedSchedule );
+        fixedPyramid->SetMaximumError( m_FixedImagePyramid->GetMaximumError() );
+        fixedPyramid->SetInput( fixedImage );
+        fixedPyramid->UpdateLargestPossibleRegion();
+        fixedLevelImage = fixedPyramid->GetOutput( 0 );
+        fixedLevelImage->DisconnectPipeline();
+        timer.AddAllocatedImage( fixedLevelImage.GetPointer() );
+    }
+
+    movingPyramid->SetNumberOfLevels( 1 );
+    movingPyramid->SetSchedule( movingSchedule );
+    movingPyramid->SetMaximumError( m_MovingImagePyramid->GetMaximumError() );
+    movingPyramid->SetInput( movingImage );
+    movingPyramid->UpdateLargestPossibleRegion();
+    movingLevelImage = movingPyramid->GetOutput( 0 );
+    movingLevelImage->DisconnectPipeline();
+    timer.AddAllocatedImage( movingLevelImage.GetPointer() );
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::StartPyramidLevelPrefetch( unsigned int fixedLevel, unsigned int movingLevel )
+{
+    this->WaitForPyramidLevelPrefetch();
+
+    m_PrefetchFixedLevel    = fixedLevel;
+    m_PrefetchMovingLevel   = movingLevel;
+    m_PrefetchedFixedImage  = NULL;
+    m_PrefetchedMovingImage = NULL;
+    m_PrefetchError         = "";
+
+    // The pyramids of the background thread propagate their requested
+    // regions to their inputs, while the main thread uses the inputs of this
+    // filter: the thread gets its own image objects, without source, on the
+    // buffers of the inputs, which are only read.
+    m_PrefetchFixedInput = FixedImageType::New();
+    m_PrefetchFixedInput->Graft( this->GetFixedImage() );
+    m_PrefetchMovingInput = MovingImageType::New();
+    m_PrefetchMovingInput->Graft( this->GetMovingImage() );
+
+    m_PrefetchThreadId      = m_PrefetchThreader->SpawnThread( PyramidLevelPrefetchCallback, this );
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::WaitForPyramidLevelPrefetch()
+{
+    if ( m_PrefetchThreadId < 0 )
+        return;
+
+    // Joins the prefetch thread
+    m_PrefetchThreader->TerminateThread( m_PrefetchThreadId );
+    m_PrefetchThreadId = -1;
+    m_PrefetchFixedInput  = NULL;
+    m_PrefetchMovingInput = NULL;
+
+    if ( !m_PrefetchError.empty() )
+    {
+        m_PrefetchedFixedImage  = NULL;
+        m_PrefetchedMovingImage = NULL;
+        itkExceptionMacro( << "Could not compute pyramid level: " << m_PrefetchError );
+    }
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+ITK_THREAD_RETURN_TYPE
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::PyramidLevelPrefetchCallback( void *arg )
+{
+    MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+    Self * self = static_cast<Self *>( info->UserData );
+
+    try
+    {
+        self->GeneratePyramidLevel( self->m_PrefetchFixedLevel, self->m_PrefetchMovingLevel,
+                                    self->m_PrefetchFixedInput, self->m_PrefetchMovingInput,
+                                    self->m_PrefetchedFixedImage, self->m_PrefetchedMovingImage );
+    }
+    catch( itk::ExceptionObject & err )
+    {
+        self->m_PrefetchError = err.GetDescription();
+    }
+    catch( std::exception & err )
+    {
+        self->m_PrefetchError = err.what();
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::UpdateFixedImagePyramid()
+{
+    FixedImageConstPointer fixedImage = this->GetFixedImage();
+    if ( !fixedImage )
+    {
+        itkExceptionMacro( << "Fixed image not set" );
+    }
+
+    // The levels are kept as long as the fixed image and the schedule do not change
+    const typename FixedImagePyramidType::ScheduleType & schedule = m_FixedImagePyramid->GetSchedule();
+    const unsigned int numberOfLevels = m_FixedImagePyramid->GetNumberOfLevels();
+
+    if ( m_FixedLevels.size() == numberOfLevels && m_FixedLevelsSchedule == schedule &&
+         m_FixedLevelsSource == fixedImage.GetPointer() &&
+         fixedImage->GetMTime() < m_FixedLevelsTime.GetMTime() )
+        return;
+
+    FixedImagePyramidPointer fixedPyramid =
+            dynamic_cast<FixedImagePyramidType *>( m_FixedImagePyramid->CreateAnother().GetPointer() );
+    fixedPyramid->SetNumberOfLevels( numberOfLevels );
+    fixedPyramid->SetSchedule( schedule );
+    fixedPyramid->SetNumberOfThreads( this->GetNumberOfThreads() );
+    fixedPyramid->SetMaximumError( m_FixedImagePyramid->GetMaximumError() );
+    fixedPyramid->SetInput( fixedImage );
+    fixedPyramid->UpdateLargestPossibleRegion();
+
+    m_FixedLevels.clear();
+    for ( unsigned int level = 0; level < numberOfLevels; level++ )
+    {
+        FloatImagePointer fixedLevel = fixedPyramid->GetOutput( level );
+        fixedLevel->DisconnectPipeline();
+        m_FixedLevels.push_back( fixedLevel );
+    }
+
+    m_FixedLevelsSchedule = schedule;
+    m_FixedLevelsSource   = fixedImage.GetPointer();
+    m_FixedLevelsTime.Modified();
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::ShareFixedImagePyramid( const Self * other )
+{
+    if ( other->GetFixedImage() != this->GetFixedImage() )
+    {
+        itkExceptionMacro( << "The fixed pyramid can only be shared between filters with the same fixed image" );
+    }
+
+    m_KeepFixedImagePyramid = true;
+    m_FixedLevels           = other->m_FixedLevels;
+    m_FixedLevelsSchedule   = other->m_FixedLevelsSchedule;
+    m_FixedLevelsSource     = other->m_FixedLevelsSource;
+    m_FixedLevelsTime.Modified();
+    this->Modified();
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::ShareMaskPyramid( const Self * other )
+{
+    if ( other->m_MaskImage != m_MaskImage || other->m_MaskImage.IsNull() )
+    {
+        itkExceptionMacro( << "The mask pyramid can only be shared between filters with the same mask" );
+    }
+    if ( other->m_CompressMaskPyramid != m_CompressMaskPyramid ||
+         other->m_MaskSchedule != m_MovingImagePyramid->GetSchedule() )
+    {
+        itkExceptionMacro( << "The mask pyramid can only be shared between filters with the same moving "
+                           << "schedule and CompressMaskPyramid setting" );
+    }
+
+    m_MaskLevels          = other->m_MaskLevels;
+    m_RunLengthMaskLevels = other->m_RunLengthMaskLevels;
+    m_MaskSchedule        = other->m_MaskSchedule;
+    m_MaskPyramidTime.Modified();
+    this->Modified();
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::UpdateMaskPyramid()
+{
+    RegistrationProfiler::ScopedTimer timer( m_Profiler, "MaskPyramid" );
+
+    if ( m_MaskImage.IsNull() )
+    {
+        itkExceptionMacro( << "UseMask is on but no mask image is set" );
+    }
+
+    // The pyramid is kept as long as the mask and the schedule do not change
+    const typename MovingImagePyramidType::ScheduleType & schedule = m_MovingImagePyramid->GetSchedule();
+    const unsigned int numberOfLevels = m_MovingImagePyramid->GetNumberOfLevels();
+    const unsigned int numberOfCachedLevels =
+            m_CompressMaskPyramid ? m_RunLengthMaskLevels.size() : m_MaskLevels.size();
+
+    if ( numberOfCachedLevels == numberOfLevels && m_MaskSchedule == schedule &&
+         m_MaskImage->GetMTime() < m_MaskPyramidTime.GetMTime() )
+        return;
+
+    MaskPyramidPointer maskPyramid = MaskPyramidType::New();
+    maskPyramid->SetNumberOfLevels( numberOfLevels );
+    maskPyramid->SetSchedule( schedule );
+    maskPyramid->SetNumberOfThreads( this->GetNumberOfThreads() );
+    maskPyramid->SetMaximumError( m_MovingImagePyramid->GetMaximumError() );
+    maskPyramid->SetInput( m_MaskImage );
+    maskPyramid->UpdateLargestPossibleRegion();
+
+    m_MaskLevels.clear();
+    m_RunLengthMaskLevels.clear();
+    for ( unsigned int level = 0; level < numberOfLevels; level++ )
+    {
+        FloatImagePointer maskLevel = maskPyramid->GetOutput( level );
+        maskLevel->DisconnectPipeline();
+
+        if ( m_CompressMaskPyramid )
+        {
+            RunLengthMaskPointer compressedLevel = RunLengthMaskType::New();
+            compressedLevel->Encode( maskLevel, m_MaskThreshold );
+            m_RunLengthMaskLevels.push_back( compressedLevel );
+        }
+        else
+            m_MaskLevels.push_back( maskLevel );
+    }
+
+    m_MaskSchedule = schedule;
+    m_MaskPyramidTime.Modified();
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+typename MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>::FloatImagePointer
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::GetMaskLevel( unsigned int movingLevel ) const
+{
+    if ( m_CompressMaskPyramid )
+        return m_RunLengthMaskLevels[movingLevel]->Decode();
+
+    // The level may be shared with other filters (see ShareMaskPyramid): the
+    // registration gets its own image object on the shared buffer
+    FloatImagePointer maskLevel = FloatImageType::New();
+    maskLevel->Graft( m_MaskLevels[movingLevel] );
+    return maskLevel;
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+bool
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::IsDyadicExpansion( const VelocityFieldType * field,
+                     const ImageBase<ImageDimension> * grid ) const
+{
+    if ( !m_UseDyadicFieldUpsampler || !FieldUpsamplerType::CanResample( field, grid ) )
+        return false;
+
+    // The spacing must be divided by a power of two along each axis
+    for ( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+        const double ratio = field->GetSpacing()[i] / grid->GetSpacing()[i];
+        const double power = vcl_floor( vcl_log( ratio ) / vcl_log( 2.0 ) + 0.5 );
+        if ( power < 0.0 || vnl_math_abs( ratio - vcl_pow( 2.0, power ) ) > 1e-6 * ratio )
+            return false;
+    }
+    return true;
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+typename MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>::VelocityFieldPointer
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::ExpandVelocityField( VelocityFieldType * field,
+                       const ImageBase<ImageDimension> * grid,
+                       double scale )
+{
+    RegistrationProfiler::ScopedTimer timer( m_Profiler, "FieldExpansion" );
+    VelocityFieldPointer expandedField;
+
+    if ( this->IsDyadicExpansion( field, grid ) )
+    {
+        // Separable resampling and scaling in a single threaded pass
+        m_FieldUpsampler->SetInput( field );
+        m_FieldUpsampler->SetOutputParametersFromImage( grid );
+        m_FieldUpsampler->SetScale( scale );
+        m_FieldUpsampler->UpdateLargestPossibleRegion();
+
+        expandedField = m_FieldUpsampler->GetOutput();
+        expandedField->DisconnectPipeline();
+        timer.AddAllocatedImage( expandedField.GetPointer() );
+        return expandedField;
+    }
+
+    // Generic resampling for non-dyadic schedules
+    m_FieldExpander->SetInput( field );
+    m_FieldExpander->SetSize(             grid->GetLargestPossibleRegion().GetSize() );
+    m_FieldExpander->SetOutputStartIndex( grid->GetLargestPossibleRegion().GetIndex() );
+    m_FieldExpander->SetOutputOrigin(     grid->GetOrigin() );
+    m_FieldExpander->SetOutputSpacing(    grid->GetSpacing() );
+    m_FieldExpander->SetOutputDirection(  grid->GetDirection() );
+    m_FieldExpander->UpdateLargestPossibleRegion();
+
+    expandedField = m_FieldExpander->GetOutput();
+    expandedField->DisconnectPipeline();
+
+    if ( scale != 1.0 )
+    {
+        typedef typename itk::MultiplyByConstantImageFilter<VelocityFieldType,float, VelocityFieldType> VelocityMultiplierType;
+        typename VelocityMultiplierType::Pointer VelocityMultiplier=VelocityMultiplierType::New();
+
+        VelocityMultiplier->SetInput( expandedField );
+        VelocityMultiplier->SetConstant( scale );
+        VelocityMultiplier->SetNumberOfThreads( this->GetNumberOfThreads() );
+        VelocityMultiplier->UpdateLargestPossibleRegion();
+
+        expandedField = VelocityMultiplier->GetOutput();
+        expandedField->DisconnectPipeline();
+    }
+
+    timer.AddAllocatedImage( expandedField.GetPointer() );
+    return expandedField;
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::RegistrationIterationUpdate()
+{
+    // Stop the current level if it would overrun the time budget
+    if( m_Scheduler->IterationDone( m_RegistrationFilter->GetMetric() ) )
+      {
+      m_RegistrationFilter->StopRegistration();
+      }
+
+    // Save the current velocity field every CheckpointInterval iterations
+    if ( !m_CheckpointFileName.empty() && m_CheckpointInterval > 0 )
+      {
+      const unsigned int iteration =
+        m_LevelIterationOffset + m_RegistrationFilter->GetElapsedIterations();
+      if ( iteration % m_CheckpointInterval == 0 )
+        {
+        // The output of the registration filter is being updated: copy it
+        // instead of connecting it to the writer
+        const VelocityFieldType * field = m_RegistrationFilter->GetOutput();
+        VelocityFieldPointer copy = VelocityFieldType::New();
+        copy->CopyInformation( field );
+        copy->SetRegions( field->GetLargestPossibleRegion() );
+        copy->Allocate();
+
+        ImageRegionConstIterator<VelocityFieldType> inIt( field, field->GetLargestPossibleRegion() );
+        ImageRegionIterator<VelocityFieldType> outIt( copy, copy->GetLargestPossibleRegion() );
+        for ( inIt.GoToBegin(), outIt.GoToBegin(); !inIt.IsAtEnd(); ++inIt, ++outIt )
+          outIt.Set( inIt.Get() );
+
+        this->WriteCheckpoint( copy, m_CurrentLevel, iteration );
+        }
+      }
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::WriteCheckpoint( const VelocityFieldType * field, unsigned int level, unsigned int iteration )
+{
+    // Write the field under a new name, so that the previous checkpoint
+    // stays valid until the checkpoint file points to the new one
+    std::ostringstream fieldFileName;
+    fieldFileName << m_CheckpointFileName << ".L" << level << ".I" << iteration << ".mha";
+
+    typedef ImageFileWriter<VelocityFieldType> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName( fieldFileName.str() );
+    writer->SetInput( field );
+    writer->Update();
+
+    const std::string tempFileName = m_CheckpointFileName + ".tmp";
+    {
+        std::ofstream file( tempFileName.c_str() );
+        file << "NumberOfLevels " << m_NumberOfLevels << std::endl;
+        file << "Level "          << level            << std::endl;
+        file << "Iteration "      << iteration        << std::endl;
+        file << "VelocityField "  << fieldFileName.str() << std::endl;
+        if ( !file )
+        {
+            itkExceptionMacro( << "Could not write checkpoint file " << tempFileName );
+        }
+    }
+
+    // rename() replaces the previous checkpoint file atomically on POSIX
+    // systems, so that a valid checkpoint exists at any time. It does not
+    // replace an existing file on Windows.
+#if defined(_WIN32)
+    std::remove( m_CheckpointFileName.c_str() );
+#endif
+    if ( std::rename( tempFileName.c_str(), m_CheckpointFileName.c_str() ) != 0 )
+    {
+        itkExceptionMacro( << "Could not write checkpoint file " << m_CheckpointFileName );
+    }
+
+    // The previous field is no longer referenced
+    if ( !m_CheckpointFieldFileName.empty() && m_CheckpointFieldFileName != fieldFileName.str() )
+    {
+        std::remove( m_CheckpointFieldFileName.c_str() );
+    }
+    m_CheckpointFieldFileName = fieldFileName.str();
+}
+
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+typename MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>::VelocityFieldPointer
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::ReadCheckpoint( unsigned int & level, unsigned int & iteration )
+{
+    if ( m_CheckpointFileName.empty() )
+    {
+        itkExceptionMacro( << "ResumeFromCheckpoint is on but no checkpoint file is set" );
+    }
+
+    std::ifstream file( m_CheckpointFileName.c_str() );
+    if ( !file )
+    {
+        itkExceptionMacro( << "Could not read checkpoint file " << m_CheckpointFileName );
+    }
+
+    unsigned int numberOfLevels = 0;
+    std::string  fieldFileName;
+    std::string  key;
+    bool         complete = false;
+    while ( file >> key )
+    {
+        if ( key == "NumberOfLevels" )
+            file >> numberOfLevels;
+        else if ( key == "Level" )
+            file >> level;
+        else if ( key == "Iteration" )
+            file >> iteration;
+        else if ( key == "VelocityField" )
+        {
+            std::getline( file >> std::ws, fieldFileName );
+            complete = true;
+        }
+        else
+            itkExceptionMacro( << "Unknown entry " << key << " in checkpoint file " << m_CheckpointFileName );
+    }
+
+    if ( !complete || numberOfLevels != m_NumberOfLevels || level > m_NumberOfLevels )
+    {
+        itkExceptionMacro( << "Checkpoint file " << m_CheckpointFileName
+                           << " does not match a registration with " << m_NumberOfLevels << " levels" );
+    }
+
+    typedef ImageFileReader<VelocityFieldType> ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( fieldFileName );
+    reader->Update();
+
+    m_CheckpointFieldFileName = fieldFileName;
+
+    VelocityFieldPointer field = reader->GetOutput();
+    field->DisconnectPipeline();
+    return field;
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+std::vector<double>
+MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
+::GetNumberOfVoxelsPerLevel() const
+{
+    const typename FixedImageType::SizeType & size =
+      this->GetFixedImage()->GetLargestPossibleRegion().GetSize();
+
+    std::vector<double> numberOfVoxels( m_NumberOfLevels, 1.0 );
+    for( unsigned int level = 0; level < m_NumberOfLevels; level++ )
+      {
+      const unsigned int fixedLevel = vnl_math_min( level, m_FixedImagePyramid->GetNumberOfLevels() - 1 );
+      for( unsigned int idim = 0; idim < ImageDimension; idim++ )
+        {
+        const double factor = m_FixedImagePyramid->GetSchedule()[fixedLevel][idim];
+        numberOfVoxels[level] *= vnl_math_max( 1.0, vcl_floor( size[idim] / factor ) );
+        }
+      }
+    return numberOfVoxels;
+}
+
 template <class TFixedImage, class TMovingImage, class TField, class TRealType>
 void
 MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealType>
@@ -1098,11 +1859,24 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
 ::GetDeformationField()
 {
   //std::cout<<"MultiResolutionLCCDeformableRegistration::GetDeformationField"<<std::endl;
+  // Computed once per output velocity field
+  if ( m_DeformationField &&
+       m_DeformationFieldVelocityContainer == this->GetVelocityField()->GetPixelContainer() )
+    {
+    return m_DeformationField;
+    }
+
+  RegistrationProfiler::ScopedTimer timer( m_Profiler, "FinalExponential" );
+  m_Exponentiator->SetNumberOfThreads( this->GetNumberOfThreads() );
   m_Exponentiator->SetInput( this->GetVelocityField() );
   m_Exponentiator->ComputeInverseOff();
   m_Exponentiator->Update();
   DeformationFieldPointer field = m_Exponentiator->GetOutput();
   field->DisconnectPipeline();
+  timer.AddAllocatedImage( field.GetPointer() );
+
+  m_DeformationField = field;
+  m_DeformationFieldVelocityContainer = this->GetVelocityField()->GetPixelContainer();
   return field;
 }
 
@@ -1114,6 +1888,7 @@ MultiResolutionLCCDeformableRegistration<TFixedImage,TMovingImage,TField,TRealTy
 ::GetInverseDeformationField()
 {
   //std::cout<<"MultiResolutionLCCDeformableRegistration::GetInverseDeformationField"<<std::endl;
+  m_Exponentiator->SetNumberOfThreads( this->GetNumberOfThreads() );
   m_Exponentiator->SetInput( this->GetVelocityField() );
   m_Exponentiator->ComputeInverseOn();
   m_Exponentiator->Update();
@@ -0,0 +1,380 @@
+#ifndef __itkRegistrationProfiler_h
+#define __itkRegistrationProfiler_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkRealTimeClock.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+/**
+ * \class RegistrationProfiler
+ * \brief Collects the time spent in the stages of a multi-resolution
+ * registration and writes it as a JSON report.
+ *
+ * The registration filters record their hot stages (image warps, high order
+ * terms of the LCC, update computation, smoothing, exponentials, pyramid
+ * levels, field expansion...) with a ScopedTimer, which measures the wall
+ * clock and CPU time of its scope. A stage may also report the bytes of the
+ * buffers it allocates with AddAllocatedBytes().
+ *
+ * The multi-resolution filter calls BeginLevel() and EndLevel() around each
+ * level, and the registration filter calls BeginIteration() at the start of
+ * each iteration. Each stage is accounted to the current iteration, if any,
+ * to the current level, if any, and to the totals. The CPU time is the
+ * processor time of the whole process, so it includes the worker threads of
+ * the stage.
+ *
+ * Stages may be recorded from several threads (e.g. pyramid prefetching).
+ */
+class RegistrationProfiler : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef RegistrationProfiler       Self;
+  typedef Object                     Superclass;
+  typedef SmartPointer<Self>         Pointer;
+  typedef SmartPointer<const Self>   ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( RegistrationProfiler, Object );
+
+  /** Time, CPU time, number of calls and allocated bytes of a stage. */
+  struct StageRecord
+  {
+    StageRecord() : Count(0), WallTime(0.0), CPUTime(0.0), AllocatedBytes(0) {}
+    unsigned long  Count;
+    double         WallTime;
+    double         CPUTime;
+    unsigned long  AllocatedBytes;
+  };
+  typedef std::map<std::string, StageRecord> StageMapType;
+
+  /** Record of an iteration or a level. */
+  struct PeriodRecord
+  {
+    PeriodRecord() : Index(0), WallTime(0.0), CPUTime(0.0), AllocatedBytes(0) {}
+    unsigned int               Index;
+    double                     WallTime;
+    double                     CPUTime;
+    unsigned long              AllocatedBytes;
+    StageMapType               Stages;
+    std::vector<PeriodRecord>  Iterations;
+  };
+
+  /**
+   * Measures a stage from its construction to its destruction. Does nothing
+   * if the profiler is NULL.
+   */
+  class ScopedTimer
+  {
+  public:
+    ScopedTimer( RegistrationProfiler * profiler, const char * stage ) :
+      m_Profiler( profiler ), m_Stage( stage ), m_AllocatedBytes( 0 )
+    {
+      if ( m_Profiler )
+      {
+        m_StartWallTime = m_Profiler->GetWallTime();
+        m_StartCPUTime  = RegistrationProfiler::GetCPUTime();
+      }
+    }
+
+    ~ScopedTimer() { this->Stop(); }
+
+    /** Record the stage now rather than at the end of the scope. */
+    void Stop()
+    {
+      if ( m_Profiler )
+        m_Profiler->AddStage( m_Stage,
+                              m_Profiler->GetWallTime() - m_StartWallTime,
+                              RegistrationProfiler::GetCPUTime() - m_StartCPUTime,
+                              m_AllocatedBytes );
+      m_Profiler = NULL;
+    }
+
+    /** Report the bytes of a buffer allocated by the stage. */
+    void AddAllocatedBytes( unsigned long bytes ) { m_AllocatedBytes += bytes; }
+
+    /** Report the buffer of an image allocated by the stage. */
+    template <class TImage>
+    void AddAllocatedImage( const TImage * image )
+    {
+      if ( image )
+        m_AllocatedBytes += image->GetBufferedRegion().GetNumberOfPixels() *
+                            sizeof( typename TImage::PixelType );
+    }
+
+  private:
+    ScopedTimer(const ScopedTimer &); //purposely not implemented
+    void operator=(const ScopedTimer &); //purposely not implemented
+
+    RegistrationProfiler * m_Profiler;
+    const char *           m_Stage;
+    double                 m_StartWallTime;
+    double                 m_StartCPUTime;
+    unsigned long          m_AllocatedBytes;
+  };
+
+  /** Clear the records and restart the clock. */
+  void Reset()
+  {
+    m_Lock.Lock();
+    m_Levels.clear();
+    m_Total = PeriodRecord();
+    m_InLevel     = false;
+    m_InIteration = false;
+    m_StartWallTime = this->GetWallTime();
+    m_StartCPUTime  = GetCPUTime();
+    m_Lock.Unlock();
+  }
+
+  /** Start a level (ends the current one, if any). */
+  void BeginLevel( unsigned int level )
+  {
+    m_Lock.Lock();
+    this->CloseLevel();
+    m_Levels.push_back( PeriodRecord() );
+    m_Levels.back().Index = level;
+    m_InLevel = true;
+    m_LevelStartWallTime = this->GetWallTime();
+    m_LevelStartCPUTime  = GetCPUTime();
+    m_Lock.Unlock();
+  }
+
+  /** End the current level. */
+  void EndLevel()
+  {
+    m_Lock.Lock();
+    this->CloseLevel();
+    m_Lock.Unlock();
+  }
+
+  /** Start an iteration of the current level (ends the current one, if any). */
+  void BeginIteration( unsigned int iteration )
+  {
+    m_Lock.Lock();
+    this->CloseIteration();
+    if ( m_InLevel )
+    {
+      m_Levels.back().Iterations.push_back( PeriodRecord() );
+      m_Levels.back().Iterations.back().Index = iteration;
+      m_InIteration = true;
+      m_IterationStartWallTime = this->GetWallTime();
+      m_IterationStartCPUTime  = GetCPUTime();
+    }
+    m_Lock.Unlock();
+  }
+
+  /** End the current iteration. */
+  void EndIteration()
+  {
+    m_Lock.Lock();
+    this->CloseIteration();
+    m_Lock.Unlock();
+  }
+
+  /** Record a call of a stage. */
+  void AddStage( const std::string & stage, double wallTime, double cpuTime, unsigned long allocatedBytes )
+  {
+    m_Lock.Lock();
+    AccumulateStage( m_Total, stage, wallTime, cpuTime, allocatedBytes );
+    if ( m_InLevel )
+    {
+      AccumulateStage( m_Levels.back(), stage, wallTime, cpuTime, allocatedBytes );
+      if ( m_InIteration )
+        AccumulateStage( m_Levels.back().Iterations.back(), stage, wallTime, cpuTime, allocatedBytes );
+    }
+    m_Lock.Unlock();
+  }
+
+  /** Get the records of the levels. */
+  const std::vector<PeriodRecord> & GetLevels() const { return m_Levels; }
+
+  /** Get the stage totals. */
+  const StageMapType & GetTotalStages() const { return m_Total.Stages; }
+
+  /** Write the report as JSON. */
+  void WriteJSON( const std::string & fileName )
+  {
+    m_Lock.Lock();
+    this->CloseLevel();
+    m_Total.WallTime = this->GetWallTime() - m_StartWallTime;
+    m_Total.CPUTime  = GetCPUTime() - m_StartCPUTime;
+
+    std::ofstream file( fileName.c_str() );
+    if ( file )
+    {
+      file.precision( 9 );
+      file << "{\n";
+      file << "  \"wall_time\": " << m_Total.WallTime << ",\n";
+      file << "  \"cpu_time\": " << m_Total.CPUTime << ",\n";
+      file << "  \"allocated_bytes\": " << m_Total.AllocatedBytes << ",\n";
+      file << "  \"stages\": ";
+      WriteStages( file, m_Total.Stages, "  " );
+      file << ",\n  \"levels\": [";
+      for ( unsigned int l = 0; l < m_Levels.size(); l++ )
+      {
+        const PeriodRecord & level = m_Levels[l];
+        file << ( l ? ",\n" : "\n" );
+        file << "    {\n";
+        file << "      \"level\": " << level.Index << ",\n";
+        file << "      \"wall_time\": " << level.WallTime << ",\n";
+        file << "      \"cpu_time\": " << level.CPUTime << ",\n";
+        file << "      \"allocated_bytes\": " << level.AllocatedBytes << ",\n";
+        file << "      \"stages\": ";
+        WriteStages( file, level.Stages, "      " );
+        file << ",\n      \"iterations\": [";
+        for ( unsigned int i = 0; i < level.Iterations.size(); i++ )
+        {
+          const PeriodRecord & iteration = level.Iterations[i];
+          file << ( i ? ",\n" : "\n" );
+          file << "        { \"iteration\": " << iteration.Index
+               << ", \"wall_time\": " << iteration.WallTime
+               << ", \"cpu_time\": " << iteration.CPUTime
+               << ", \"allocated_bytes\": " << iteration.AllocatedBytes
+               << ", \"stages\": ";
+          WriteStages( file, iteration.Stages, "" );
+          file << " }";
+        }
+        file << ( level.Iterations.empty() ? "]\n" : "\n      ]\n" );
+        file << "    }";
+      }
+      file << ( m_Levels.empty() ? "]\n" : "\n  ]\n" );
+      file << "}\n";
+    }
+    m_Lock.Unlock();
+
+    if ( !file )
+    {
+      itkExceptionMacro( << "Could not write the profile " << fileName );
+    }
+  }
+
+  /** Current wall-clock time in seconds. */
+  double GetWallTime() const
+  {
+#if ITK_VERSION_MAJOR < 4
+    return m_Clock->GetTimeStamp();
+#else
+    return m_Clock->GetTimeInSeconds();
+#endif
+  }
+
+  /** Processor time used by the process in seconds. */
+  static double GetCPUTime()
+  {
+    return static_cast<double>( std::clock() ) / CLOCKS_PER_SEC;
+  }
+
+protected:
+  RegistrationProfiler()
+  {
+    m_Clock       = RealTimeClock::New();
+    m_InLevel     = false;
+    m_InIteration = false;
+    m_StartWallTime = this->GetWallTime();
+    m_StartCPUTime  = GetCPUTime();
+    m_LevelStartWallTime     = 0.0;
+    m_LevelStartCPUTime      = 0.0;
+    m_IterationStartWallTime = 0.0;
+    m_IterationStartCPUTime  = 0.0;
+  }
+  ~RegistrationProfiler() {}
+
+  void PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os,indent);
+    os << indent << "NumberOfLevels: " << m_Levels.size() << std::endl;
+    os << indent << "NumberOfStages: " << m_Total.Stages.size() << std::endl;
+  }
+
+private:
+  RegistrationProfiler(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  static void AccumulateStage( PeriodRecord & period, const std::string & stage,
+                               double wallTime, double cpuTime, unsigned long allocatedBytes )
+  {
+    StageRecord & record = period.Stages[stage];
+    record.Count++;
+    record.WallTime       += wallTime;
+    record.CPUTime        += cpuTime;
+    record.AllocatedBytes += allocatedBytes;
+    period.AllocatedBytes += allocatedBytes;
+  }
+
+  static void WriteStages( std::ostream & os, const StageMapType & stages, const std::string & indent )
+  {
+    const bool multiline = !indent.empty();
+    os << "{";
+    for ( StageMapType::const_iterator it = stages.begin(); it != stages.end(); ++it )
+    {
+      os << ( it == stages.begin() ? "" : "," );
+      if ( multiline )
+        os << "\n" << indent << "  ";
+      else
+        os << " ";
+      os << "\"" << it->first << "\": { \"count\": " << it->second.Count
+         << ", \"wall_time\": " << it->second.WallTime
+         << ", \"cpu_time\": " << it->second.CPUTime
+         << ", \"allocated_bytes\": " << it->second.AllocatedBytes << " }";
+    }
+    if ( multiline && !stages.empty() )
+      os << "\n" << indent;
+    else if ( !stages.empty() )
+      os << " ";
+    os << "}";
+  }
+
+  /** Must be called with the lock held. */
+  void CloseIteration()
+  {
+    if ( !m_InIteration )
+      return;
+    PeriodRecord & iteration = m_Levels.back().Iterations.back();
+    iteration.WallTime = this->GetWallTime() - m_IterationStartWallTime;
+    iteration.CPUTime  = GetCPUTime() - m_IterationStartCPUTime;
+    m_InIteration = false;
+  }
+
+  /** Must be called with the lock held. */
+  void CloseLevel()
+  {
+    this->CloseIteration();
+    if ( !m_InLevel )
+      return;
+    PeriodRecord & level = m_Levels.back();
+    level.WallTime = this->GetWallTime() - m_LevelStartWallTime;
+    level.CPUTime  = GetCPUTime() - m_LevelStartCPUTime;
+    m_InLevel = false;
+  }
+
+  RealTimeClock::Pointer     m_Clock;
+  SimpleFastMutexLock        m_Lock;
+
+  std::vector<PeriodRecord>  m_Levels;
+  PeriodRecord               m_Total;
+  bool                       m_InLevel;
+  bool                       m_InIteration;
+
+  double                     m_StartWallTime;
+  double                     m_StartCPUTime;
+  double                     m_LevelStartWallTime;
+  double                     m_LevelStartCPUTime;
+  double                     m_IterationStartWallTime;
+  double                     m_IterationStartCPUTime;
+};
+
+} // end namespace itk
+
+#endif
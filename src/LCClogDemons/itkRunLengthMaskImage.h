@@ -0,0 +1,100 @@
+#ifndef __itkRunLengthMaskImage_h
+#define __itkRunLengthMaskImage_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImage.h"
+
+#include <vector>
+
+namespace itk
+{
+/**
+ * \class RunLengthMaskImage
+ * \brief Compact storage of a binary mask as runs along the first axis.
+ *
+ * A voxel belongs to the mask if its value in the encoded image is greater
+ * than or equal to the threshold. Each run stores the index of its first voxel
+ * and its length along the first axis. The geometry of the encoded image is
+ * kept, so that Decode() gives back an image on the same grid with the value
+ * 1 inside the mask and 0 outside.
+ *
+ * Holding a mask this way costs a few bytes per run instead of one pixel per
+ * voxel, and the runs can be walked directly with GetRuns() without touching
+ * the background voxels.
+ */
+template <class TImage>
+class ITK_EXPORT RunLengthMaskImage : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef RunLengthMaskImage         Self;
+  typedef Object                     Superclass;
+  typedef SmartPointer<Self>         Pointer;
+  typedef SmartPointer<const Self>   ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( RunLengthMaskImage, Object );
+
+  /** Image types. */
+  typedef TImage                             ImageType;
+  typedef typename ImageType::Pointer        ImagePointer;
+  typedef typename ImageType::PixelType      PixelType;
+  typedef typename ImageType::IndexType      IndexType;
+  typedef typename ImageType::RegionType     RegionType;
+  typedef typename ImageType::SpacingType    SpacingType;
+  typedef typename ImageType::PointType      PointType;
+  typedef typename ImageType::DirectionType  DirectionType;
+
+  /** Run of consecutive mask voxels along the first axis. */
+  struct Run
+  {
+    IndexType      Index;
+    unsigned long  Length;
+  };
+  typedef std::vector<Run>                   RunContainerType;
+
+  /** Encode the voxels of the image above the threshold. */
+  void Encode( const ImageType * image, PixelType threshold );
+
+  /** Rebuild the mask as an image (1 inside, 0 outside). */
+  ImagePointer Decode() const;
+
+  /** Get the runs of the mask. */
+  const RunContainerType & GetRuns() const { return m_Runs; }
+
+  /** Get the number of voxels in the mask. */
+  unsigned long GetNumberOfMaskVoxels() const;
+
+  /** Get the geometry of the encoded image. */
+  const RegionType & GetRegion() const { return m_Region; }
+  const SpacingType & GetSpacing() const { return m_Spacing; }
+  const PointType & GetOrigin() const { return m_Origin; }
+  const DirectionType & GetDirection() const { return m_Direction; }
+
+protected:
+  RunLengthMaskImage() {}
+  ~RunLengthMaskImage() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+private:
+  RunLengthMaskImage(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  RunContainerType  m_Runs;
+  RegionType        m_Region;
+  SpacingType       m_Spacing;
+  PointType         m_Origin;
+  DirectionType     m_Direction;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkRunLengthMaskImage.txx"
+#endif
+
+#endif
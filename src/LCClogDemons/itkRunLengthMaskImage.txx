@@ -0,0 +1,106 @@
+#ifndef __itkRunLengthMaskImage_txx
+#define __itkRunLengthMaskImage_txx
+
+#include "itkRunLengthMaskImage.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include "itkImageLinearIteratorWithIndex.h"
+
+namespace itk
+{
+
+template <class TImage>
+void
+RunLengthMaskImage<TImage>
+::Encode( const ImageType * image, PixelType threshold )
+{
+    m_Region    = image->GetLargestPossibleRegion();
+    m_Spacing   = image->GetSpacing();
+    m_Origin    = image->GetOrigin();
+    m_Direction = image->GetDirection();
+    m_Runs.clear();
+
+    typedef ImageLinearConstIteratorWithIndex<ImageType> IteratorType;
+    IteratorType it( image, m_Region );
+    it.SetDirection( 0 );
+
+    for ( it.GoToBegin(); !it.IsAtEnd(); it.NextLine() )
+    {
+        bool inside = false;
+        while ( !it.IsAtEndOfLine() )
+        {
+            if ( it.Get() >= threshold )
+            {
+                if ( !inside )
+                {
+                    Run run;
+                    run.Index  = it.GetIndex();
+                    run.Length = 0;
+                    m_Runs.push_back( run );
+                    inside = true;
+                }
+                m_Runs.back().Length++;
+            }
+            else
+                inside = false;
+            ++it;
+        }
+    }
+
+    this->Modified();
+}
+
+
+template <class TImage>
+typename RunLengthMaskImage<TImage>::ImagePointer
+RunLengthMaskImage<TImage>
+::Decode() const
+{
+    ImagePointer image = ImageType::New();
+    image->SetRegions( m_Region );
+    image->SetSpacing( m_Spacing );
+    image->SetOrigin( m_Origin );
+    image->SetDirection( m_Direction );
+    image->Allocate();
+    image->FillBuffer( NumericTraits<PixelType>::Zero );
+
+    typedef ImageLinearIteratorWithIndex<ImageType> IteratorType;
+    IteratorType it( image, m_Region );
+    it.SetDirection( 0 );
+
+    for ( typename RunContainerType::const_iterator run = m_Runs.begin(); run != m_Runs.end(); ++run )
+    {
+        it.SetIndex( run->Index );
+        for ( unsigned long i = 0; i < run->Length; ++i, ++it )
+            it.Set( NumericTraits<PixelType>::One );
+    }
+
+    return image;
+}
+
+
+template <class TImage>
+unsigned long
+RunLengthMaskImage<TImage>
+::GetNumberOfMaskVoxels() const
+{
+    unsigned long count = 0;
+    for ( typename RunContainerType::const_iterator run = m_Runs.begin(); run != m_Runs.end(); ++run )
+        count += run->Length;
+    return count;
+}
+
+
+template <class TImage>
+void
+RunLengthMaskImage<TImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+    Superclass::PrintSelf(os,indent);
+    os << indent << "Region: " << m_Region << std::endl;
+    os << indent << "NumberOfRuns: " << m_Runs.size() << std::endl;
+    os << indent << "NumberOfMaskVoxels: " << this->GetNumberOfMaskVoxels() << std::endl;
+}
+
+} // end namespace itk
+
+#endif
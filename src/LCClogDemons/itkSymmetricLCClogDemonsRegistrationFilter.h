@@ -175,6 +175,8 @@ private:
   typedef typename MultiplyByConstantType::Pointer      MultiplyByConstantPointer;
   typedef typename AdderType::Pointer                   AdderPointer;
 
+  typedef typename Superclass::PlanarFieldType          PlanarFieldType;
+
   typename FiniteDifferenceFunctionType::Pointer        m_BackwardDifferenceFunction;
 
   MultiplyByConstantPointer                             m_Multiplier;
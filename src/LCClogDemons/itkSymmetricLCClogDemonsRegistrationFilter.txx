@@ -122,6 +122,9 @@ void
 SymmetricLCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::InitializeIteration()
 {
+  if ( this->GetProfiler() )
+    this->GetProfiler()->BeginIteration( this->GetElapsedIterations() );
+
   // update variables in the equation object
   DemonsRegistrationFunctionType *f = this->GetForwardRegistrationFunctionType();
 
@@ -131,10 +134,16 @@ SymmetricLCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
   f->SetDisplacementField( this->GetDeformationField() );
 #endif
 
-  f->SetSigma(this->GetSimilarityCriteriaStandardDeviations());
+  f->SetSigma(this->GetSimilarityCriteriaStandardDeviations().GetDataPointer());
   f->SetInverseDeformationField( this->GetInverseDeformationField() );
   f->SetSigmaI(this->GetSigmaI());
   f->SetBoundaryCheck(this->GetBoundaryCheck());
+  f->SetProfiler(this->GetProfiler());
+  f->SetNumberOfThreads(this->GetNumberOfThreads());
+
+  // The internal filters run with the threads of this filter
+  m_Multiplier->SetNumberOfThreads( this->GetNumberOfThreads() );
+  m_Adder->SetNumberOfThreads( this->GetNumberOfThreads() );
 
   if (this->GetUseMask())
    {
@@ -327,12 +336,37 @@ SymmetricLCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
 ::ApplyUpdate(const TimeStepType& dt)
 #endif
 {
+  RegistrationProfiler::ScopedTimer timer( this->GetProfiler(), "ApplyUpdate" );
   const DemonsRegistrationFunctionType *drfpf = this->GetForwardRegistrationFunctionType();
 
   this->SetRMSChange( drfpf->GetRMSChange() );
 
 
-  if ( this->m_NumberOfBCHApproximationTerms < 3 )
+  if ( this->m_NumberOfBCHApproximationTerms < 3 && this->GetUsePlanarFields() )
+    {
+    // Smoothing, time step and update on the planes of the update buffer:
+    // v += dt * K_fluid * u
+    if ( this->GetSmoothUpdateField() && this->GetRegularizationType() != 0 )
+      {
+      this->SmoothUpdateField();
+      }
+
+    PlanarFieldType * update = this->GetPlanarUpdate();
+    update->SetNumberOfThreads( this->GetNumberOfThreads() );
+    update->Scatter( this->GetUpdateBuffer() );
+
+    if ( this->GetSmoothUpdateField() && this->GetRegularizationType() == 0 )
+      {
+      RegistrationProfiler::ScopedTimer smoothTimer( this->GetProfiler(), "SmoothGivenField" );
+      double variances[FixedImageDimension];
+      this->GetSmoothingVariances( this->GetUpdateBuffer(), this->GetUpdateFieldStandardDeviations(), variances );
+      update->Smooth( variances, this->GetMaximumError(), this->GetMaximumKernelWidth() );
+      }
+
+    update->GatherAdd( this->GetOutput(), dt );
+    this->GetOutput()->Modified();
+    }
+  else if ( this->m_NumberOfBCHApproximationTerms < 3 )
     {
     // If we smooth the update buffer before applying it, then the are
     // approximating a viscuous problem as opposed to an elastic problem
@@ -408,6 +442,8 @@ SymmetricLCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
     
     typename BCHFilterType::Pointer bchfilter = BCHFilterType::New();
     bchfilter->SetNumberOfApproximationTerms( this->m_NumberOfBCHApproximationTerms );
+    bchfilter->SetNumberOfThreads( this->GetNumberOfThreads() );
+    bchfilter->SetUsePlanarFields( this->GetUsePlanarFields() );
 
     // First get Z( v, K_fluid * u_forward )
     bchfilter->SetInput( 0, this->GetOutput() );
@@ -424,6 +460,7 @@ SymmetricLCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
 
     typename OppositeFilterType::Pointer oppositefilter = OppositeFilterType::New();
     oppositefilter->SetInput( this->GetOutput() );
+    oppositefilter->SetNumberOfThreads( this->GetNumberOfThreads() );
     oppositefilter->InPlaceOn();
 
     bchfilter->SetInput( 0, oppositefilter->GetOutput() );
@@ -439,6 +476,7 @@ SymmetricLCClogDemonsRegistrationFilter<TFixedImage,TMovingImage,TField>
        VelocityFieldType, VelocityFieldType, VelocityFieldType>  SubtracterType;
 
     typename SubtracterType::Pointer subtracter = SubtracterType::New();
+    subtracter->SetNumberOfThreads( this->GetNumberOfThreads() );
     subtracter->SetInput( 0, Zf );
     subtracter->SetInput( 1, Zb );
 
@@ -3,6 +3,8 @@
 
 //sasdsadsad
 
+#include <algorithm>
+#include <sstream>
 #include <itkHistogramMatchingImageFilter.h>
 #include "itkLogDomainDemonsRegistrationFilter.h"
 #include "itkLCCDeformableRegistrationFilter.h"
@@ -12,6 +14,7 @@
 #include "itkMultiResolutionLCCDeformableRegistration.h"
 #include "rpiLCClogDemons.hxx"
 #include "itkDemonsCommandIterationUpdate.h"
+#include "itkExponentialDeformationFieldLogJacobianImageFilter.h"
 #include "itkStatisticsImageFilter.h"
 #include "itkDivideByConstantImageFilter.h"
 #include "itkImageFileWriter.h"
@@ -35,6 +38,9 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::LCClogDemons(vo
     this->m_SimilarityCriteriaStandardDeviation =3;
     this->m_SigmaI 				                =0.2;
     this->m_BCHExpansion                        = 2;
+    this->m_useHistogramMatching                = false;
+    this->m_UseMask                             = false;
+    this->m_verbosity                           = false;
 
     this->m_RegularizationType                  =0;
     this->m_HarmonicWeight                      =1e-3;
@@ -51,6 +57,30 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::LCClogDemons(vo
     this->m_displacementFieldTransform = DisplacementFieldTransformType::New();
 
     this->m_BoundaryCheck    = true;
+    this->m_TimeBudget       = 0.0;
+
+    this->m_ConvergenceWindowSize         = 5;
+    this->m_MetricConvergenceTolerance    = 0.0;
+    this->m_RMSChangeConvergenceTolerance = 0.0;
+    this->m_MinimumNumberOfIterations     = 0;
+
+    this->m_CheckpointInterval   = 0;
+    this->m_ResumeFromCheckpoint = false;
+
+    this->m_PrefetchPyramidLevels = false;
+
+    this->m_DiagnosticsInterval    = 1;
+    this->m_DiagnosticsSubsampling = 0;
+    this->m_FastDiagnostics        = false;
+
+    this->m_ComputeLogJacobian     = false;
+
+    this->m_UsePlanarFields        = false;
+
+    this->m_CompressMaskPyramid    = false;
+
+    this->m_NumberOfConcurrentRegistrations = 1;
+    this->m_NumberOfThreadsPerRegistration  = 0;
 }
 
 
@@ -318,6 +348,24 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetInitialTrans
 }
 
 
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+typename LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::LinearTransformPointerType
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetInitialLinearTransformation(void) const
+{
+    return this->m_initialLinearTransform;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetInitialLinearTransformation(LinearTransformType * transform)
+{
+    this->m_initialLinearTransform = transform;
+}
+
+
 template < class TFixedImage, class TMovingImage, class TTransformScalarType >
 void
 LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetTrueField(DisplacementFieldTransformType * transform)
@@ -364,6 +412,284 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetBoundaryChec
 }
 
 
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetTimeBudget(double value)
+{
+    if ( value>=0 )
+        this->m_TimeBudget = value;
+    else
+        throw std::runtime_error( "Time budget must be greater than or equal to 0." );
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+double
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetTimeBudget(void) const
+{
+    return this->m_TimeBudget;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetConvergenceWindowSize(unsigned int value)
+{
+    if ( value>0 )
+        this->m_ConvergenceWindowSize = value;
+    else
+        throw std::runtime_error( "Convergence window size must be greater than 0." );
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetConvergenceWindowSize(void) const
+{
+    return this->m_ConvergenceWindowSize;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetMetricConvergenceTolerance(double value)
+{
+    if ( value>=0 )
+        this->m_MetricConvergenceTolerance = value;
+    else
+        throw std::runtime_error( "Metric convergence tolerance must be greater than or equal to 0." );
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+double
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetMetricConvergenceTolerance(void) const
+{
+    return this->m_MetricConvergenceTolerance;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetRMSChangeConvergenceTolerance(double value)
+{
+    if ( value>=0 )
+        this->m_RMSChangeConvergenceTolerance = value;
+    else
+        throw std::runtime_error( "RMS change convergence tolerance must be greater than or equal to 0." );
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+double
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetRMSChangeConvergenceTolerance(void) const
+{
+    return this->m_RMSChangeConvergenceTolerance;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetMinimumNumberOfIterations(unsigned int value)
+{
+    this->m_MinimumNumberOfIterations = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetMinimumNumberOfIterations(void) const
+{
+    return this->m_MinimumNumberOfIterations;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetCheckpointFileName(const std::string & fileName)
+{
+    this->m_CheckpointFileName = fileName;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+std::string
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetCheckpointFileName(void) const
+{
+    return this->m_CheckpointFileName;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetCheckpointInterval(unsigned int value)
+{
+    this->m_CheckpointInterval = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetCheckpointInterval(void) const
+{
+    return this->m_CheckpointInterval;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetResumeFromCheckpoint(bool value)
+{
+    this->m_ResumeFromCheckpoint = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+bool
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetResumeFromCheckpoint(void) const
+{
+    return this->m_ResumeFromCheckpoint;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetProfileFileName(const std::string & fileName)
+{
+    this->m_ProfileFileName = fileName;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+std::string
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetProfileFileName(void) const
+{
+    return this->m_ProfileFileName;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetPrefetchPyramidLevels(bool value)
+{
+    this->m_PrefetchPyramidLevels = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+bool
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetPrefetchPyramidLevels(void) const
+{
+    return this->m_PrefetchPyramidLevels;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetDiagnosticsInterval(unsigned int value)
+{
+    if ( value>0 )
+        this->m_DiagnosticsInterval = value;
+    else
+        throw std::runtime_error( "Diagnostics interval must be greater than 0." );
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetDiagnosticsInterval(void) const
+{
+    return this->m_DiagnosticsInterval;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetDiagnosticsSubsampling(unsigned int value)
+{
+    this->m_DiagnosticsSubsampling = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetDiagnosticsSubsampling(void) const
+{
+    return this->m_DiagnosticsSubsampling;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetFastDiagnostics(bool value)
+{
+    this->m_FastDiagnostics = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+bool
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetFastDiagnostics(void) const
+{
+    return this->m_FastDiagnostics;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetNumberOfConcurrentRegistrations(unsigned int value)
+{
+    if ( value>0 )
+        this->m_NumberOfConcurrentRegistrations = value;
+    else
+        throw std::runtime_error( "Number of concurrent registrations must be greater than 0." );
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetNumberOfConcurrentRegistrations(void) const
+{
+    return this->m_NumberOfConcurrentRegistrations;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetNumberOfThreadsPerRegistration(unsigned int value)
+{
+    this->m_NumberOfThreadsPerRegistration = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+unsigned int
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetNumberOfThreadsPerRegistration(void) const
+{
+    return this->m_NumberOfThreadsPerRegistration;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+typename LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::TransformPointerType
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetBatchTransformation(unsigned int index) const
+{
+    if ( index>=this->m_batchTransforms.size() )
+        throw std::runtime_error( "Index of the batch transformation out of range." );
+    return this->m_batchTransforms[index];
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+typename LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::DisplacementFieldTransformPointerType
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetBatchDisplacementFieldTransformation(unsigned int index) const
+{
+    if ( index>=this->m_batchDisplacementFieldTransforms.size() )
+        throw std::runtime_error( "Index of the batch transformation out of range." );
+    return this->m_batchDisplacementFieldTransforms[index];
+}
+
+
 template < class TFixedImage, class TMovingImage, class TTransformScalarType >
 typename LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::DisplacementFieldTransformPointerType
 LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetDisplacementFieldTransformation(void) const
@@ -373,6 +699,63 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetDisplacement
 
 
 
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetComputeLogJacobian(bool value)
+{
+    this->m_ComputeLogJacobian = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+bool
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetComputeLogJacobian(void) const
+{
+    return this->m_ComputeLogJacobian;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetUsePlanarFields(bool value)
+{
+    this->m_UsePlanarFields = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+bool
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetUsePlanarFields(void) const
+{
+    return this->m_UsePlanarFields;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::SetCompressMaskPyramid(bool value)
+{
+    this->m_CompressMaskPyramid = value;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+bool
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetCompressMaskPyramid(void) const
+{
+    return this->m_CompressMaskPyramid;
+}
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+typename LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::LogJacobianImagePointerType
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::GetLogJacobian(void) const
+{
+    return this->m_logJacobian;
+}
+
+
+
 template < class TFixedImage, class TMovingImage, class TTransformScalarType >
 void
 LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::StartRegistration(void)
@@ -393,6 +776,9 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::StartRegistrati
     typedef  typename  TFixedImage::PixelType                                 PixelType;
     typedef  typename  TransformType::VectorFieldType                       FieldContainerType;
 
+    if ( this->m_initialTransform.IsNotNull() && this->m_initialLinearTransform.IsNotNull() )
+        throw std::runtime_error( "Cannot initialize with a stationary velocity field and a linear transformation." );
+
 
     // Local images
     typename  TFixedImage::ConstPointer   fixedImage  = this->m_fixedImage;
@@ -429,143 +815,23 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::StartRegistrati
 
 
   if ( this->m_updateRule == UPDATE_SYMMETRIC_LOCAL_LOG_DOMAIN)
-   	{
-		
-        typedef  typename  itk::MultiResolutionLCCDeformableRegistration< TFixedImage, TMovingImage, FieldContainerType, PixelType >
-            MultiResLocalRegistrationFilterType;
-        typedef  typename  itk::LCCDeformableRegistrationFilter< TFixedImage, TMovingImage, FieldContainerType>
-            BaseRegistrationFilterType;
-
-       
-
-		typename BaseRegistrationFilterType::Pointer filter;
-		typename MultiResLocalRegistrationFilterType::Pointer multires = MultiResLocalRegistrationFilterType::New();
-
-				
-
-                // Create the "actual" registration filter, and set it to the existing filter
-                typedef  typename  itk::SymmetricLCClogDemonsRegistrationFilter< TFixedImage, TMovingImage, FieldContainerType>
-                        ActualRegistrationFilterType;
-		typename ActualRegistrationFilterType::Pointer actualfilter = ActualRegistrationFilterType::New();
-                filter = actualfilter;
-	
-
-        multires->SetSimilarityCriteriaStandardDeviationsWorldUnit( this->m_SimilarityCriteriaStandardDeviation);
-		multires->SetSigmaI( this->m_SigmaI);
-        multires->SetBoundaryCheck(this->m_BoundaryCheck);
-
-        if (m_verbosity)
-		{	
-            typename DemonsCommandIterationUpdate<BaseRegistrationFilterType,MultiResLocalRegistrationFilterType,PixelType, TFixedImage::ImageDimension>::Pointer observer =
-                DemonsCommandIterationUpdate<BaseRegistrationFilterType,MultiResLocalRegistrationFilterType,PixelType, TFixedImage::ImageDimension>::New();
-
-			    if ( m_TrueField )
-			      {
-				      if (m_iterations.size() > 1)
-				        {		
-				        std::cout << "You cannot compare the results with a true field in a multiresolution setting yet." << std::endl;
-				        exit( EXIT_FAILURE );
-        				}
-
-                       observer->SetTrueField((m_TrueField->GetParametersAsVectorField()));
-      
-                              }
-
-
-			filter->AddObserver( itk::IterationEvent(), observer );
-			
-            typename DemonsCommandIterationUpdate<BaseRegistrationFilterType,MultiResLocalRegistrationFilterType,PixelType, TFixedImage::ImageDimension>::Pointer multiresobserver =
-                DemonsCommandIterationUpdate<BaseRegistrationFilterType,MultiResLocalRegistrationFilterType,PixelType, TFixedImage::ImageDimension>::New();
-		        multires->AddObserver( itk::IterationEvent(), multiresobserver );
-		}
-
-		multires->SetFixedImage(         fixedImage );
-		multires->SetMovingImage(        movingImage );
-		multires->SetRegistrationFilter( filter );
-		multires->SetNumberOfLevels(     this->m_iterations.size() );
-		multires->SetNumberOfIterations( &m_iterations[0] );
-
-        if (m_UseMask)
-          {
-           multires->UseMask(m_UseMask);
-           multires->SetMaskImage(this->m_MaskImage);
-          }
-        else  multires->UseMask(m_UseMask);
-
-
-
-		// Set the field interpolator
-        typedef  itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction< FieldContainerType, double >  FieldInterpolatorType;
-		typename FieldInterpolatorType::Pointer interpolator = FieldInterpolatorType::New();
-		multires->GetFieldExpander()->SetInterpolator( interpolator );
-
-
-
-        multires->SetRegularizationType(this->GetRegularizationType());
-        if (this->GetRegularizationType()==0)
-          {
-           // Set the standard deviation of the displacement field smoothing
-           if ( this->m_velocityFieldStandardDeviation >= 0.1 )
-             {
-		        multires->SetStandardDeviationsWorldUnit( this->m_velocityFieldStandardDeviation );
-		        multires->SmoothVelocityFieldOn();
-             }
-           else
-		        multires->SmoothVelocityFieldOff();
-        // Set the standard deviation of the update field smoothing
-           if ( this->m_updateFieldStandardDeviation >= 0.1 )
-            {
-               multires->SetUpdateFieldStandardDeviationsWorldUnit( this->m_updateFieldStandardDeviation );
-               multires->SmoothUpdateFieldOn();
-            }
-           else
-               multires->SmoothUpdateFieldOff();
-          }
-        if (this->GetRegularizationType()==1)
-          {
-            multires->SetHarmonicWeight(this->GetHarmonicWeight());
-            multires->SetBendingWeight(this->GetBendingWeight());
-          }
-
-    
-	        // Set the initial displacement field only if it exists
- 		 if (this->m_initialTransform.IsNotNull())
-    			{
-                    typename DisplacementFieldTransformType::Pointer transform = this->m_initialTransform;
-                    typename FieldContainerType::ConstPointer field            = transform->GetParametersAsVectorField();
-			        multires->SetArbitraryInitialVelocityField( const_cast<FieldContainerType *>(field.GetPointer()) );
-    			}	
-
-
-	      // Start the registration process
-		try
-		       {
-			        multires->UpdateLargestPossibleRegion();
-			 }
-		catch( itk::ExceptionObject& err )
-    			{
-       				 std::cout << err << std::endl;
-			        throw std::runtime_error( "Unexpected error." );
-    			}
-		
-        std::cout<<"Creating images"<<std::endl;
-
-		// Create the velocity field transform object
-		typename TransformType::Pointer stationaryVelocityFieldTransform = TransformType::New();
-		stationaryVelocityFieldTransform->SetParametersAsVectorField( static_cast<typename FieldContainerType::ConstPointer>( multires->GetVelocityField() ) );
-		this->m_transform = stationaryVelocityFieldTransform;
-
-
-		// Create the velocity field transform object
-		typename DisplacementFieldTransformType::Pointer displacementFieldTransform = DisplacementFieldTransformType::New();
-        displacementFieldTransform->SetParametersAsVectorField( static_cast<typename FieldContainerType::Pointer>( multires->GetDeformationField() ) );
-		this->m_displacementFieldTransform = displacementFieldTransform;
-
-		}
-
+    {
+        LCCRegistrationFilterPointerType multires = this->CreateLCCRegistrationFilter( fixedImage );
+
+        // Start the registration process
+        TransformPointerType                   transform;
+        DisplacementFieldTransformPointerType  displacementFieldTransform;
+        LogJacobianImagePointerType            logJacobian;
+        this->RunLCCRegistrationFilter( multires, movingImage, transform, displacementFieldTransform, logJacobian );
+        this->m_transform                  = transform;
+        this->m_displacementFieldTransform = displacementFieldTransform;
+        this->m_logJacobian                = logJacobian;
+    }
   else
 	
   {
+    if ( this->m_ComputeLogJacobian )
+        throw std::runtime_error( "The logJacobian map is only available with the LCC similarity." );
 
 	typedef  typename  itk::MultiResolutionLogDomainDeformableRegistration< TFixedImage, TMovingImage, FieldContainerType, PixelType >    MultiResRegistrationFilterType;
         typedef  typename  itk::LogDomainDeformableRegistrationFilter< TFixedImage, TMovingImage, FieldContainerType>			      BaseRegistrationFilterType;
@@ -643,6 +909,7 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::StartRegistrati
     multires->SetRegistrationFilter( filter );
     multires->SetNumberOfLevels(     this->m_iterations.size() );
     multires->SetNumberOfIterations( &m_iterations[0] );
+    multires->GetScheduler()->SetTimeBudget( this->m_TimeBudget );
 
 
     // Set the field interpolator
@@ -687,6 +954,28 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::StartRegistrati
         multires->SetArbitraryInitialVelocityField( const_cast<FieldContainerType *>(field.GetPointer()) );
     }
 
+    // Set the velocity field of the initial linear transformation
+    if (this->m_initialLinearTransform.IsNotNull())
+    {
+        typedef itk::TransformToVelocityFieldSource< FieldContainerType, double > FieldSourceType;
+        typename FieldSourceType::Pointer fieldSource = FieldSourceType::New();
+        fieldSource->SetTransform( this->m_initialLinearTransform );
+        fieldSource->SetOutputParametersFromImage( fixedImage );
+        try
+        {
+            fieldSource->Update();
+        }
+        catch( itk::ExceptionObject& err )
+        {
+            std::string message = "Could not compute the velocity field of the initial linear transformation: ";
+            message += err.GetDescription();
+            throw std::runtime_error( message );
+        }
+        typename FieldContainerType::Pointer field = fieldSource->GetOutput();
+        field->DisconnectPipeline();
+        multires->SetArbitraryInitialVelocityField( field );
+    }
+
 
     // Start the registration process
     try
@@ -715,6 +1004,365 @@ LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::StartRegistrati
 }
 
 
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+typename LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::LCCRegistrationFilterPointerType
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::CreateLCCRegistrationFilter(const TFixedImage * fixedImage,
+                                                                                           const std::string & metricsFileName) const
+{
+    typedef  typename  TFixedImage::PixelType                                         PixelType;
+    typedef  typename  itk::LCCDeformableRegistrationFilter< TFixedImage, TMovingImage, VelocityFieldType>
+            BaseRegistrationFilterType;
+    typedef  typename  itk::SymmetricLCClogDemonsRegistrationFilter< TFixedImage, TMovingImage, VelocityFieldType>
+            ActualRegistrationFilterType;
+    typedef  DemonsCommandIterationUpdate<BaseRegistrationFilterType, LCCRegistrationFilterType, PixelType, TFixedImage::ImageDimension>
+            ObserverType;
+
+    LCCRegistrationFilterPointerType multires = LCCRegistrationFilterType::New();
+
+    // Create the "actual" registration filter, and set it to the existing filter
+    typename ActualRegistrationFilterType::Pointer actualfilter = ActualRegistrationFilterType::New();
+    typename BaseRegistrationFilterType::Pointer   filter       = actualfilter;
+
+    multires->SetSimilarityCriteriaStandardDeviationsWorldUnit( this->m_SimilarityCriteriaStandardDeviation);
+    multires->SetSigmaI( this->m_SigmaI);
+    multires->SetBoundaryCheck(this->m_BoundaryCheck);
+
+    filter->SetConvergenceWindowSize(         this->m_ConvergenceWindowSize );
+    filter->SetMetricConvergenceTolerance(    this->m_MetricConvergenceTolerance );
+    filter->SetRMSChangeConvergenceTolerance( this->m_RMSChangeConvergenceTolerance );
+    filter->SetMinimumNumberOfIterations(     this->m_MinimumNumberOfIterations );
+    filter->SetUsePlanarFields(               this->m_UsePlanarFields );
+
+    if (m_verbosity)
+    {
+        typename ObserverType::Pointer observer = ObserverType::New();
+        observer->SetDiagnosticsInterval(  this->m_DiagnosticsInterval );
+        observer->SetSubsampling(          this->m_DiagnosticsSubsampling>0 ? this->m_DiagnosticsSubsampling :
+                                                                              ( this->m_FastDiagnostics ? 2 : 1 ) );
+        observer->SetApproximateQuantiles( this->m_FastDiagnostics );
+        observer->SetAsynchronous(         this->m_FastDiagnostics );
+        observer->SetFileName(             metricsFileName );
+
+        if ( m_TrueField )
+        {
+            if (m_iterations.size() > 1)
+                throw std::runtime_error( "You cannot compare the results with a true field in a multiresolution setting yet." );
+
+            observer->SetTrueField((m_TrueField->GetParametersAsVectorField()));
+        }
+
+        filter->AddObserver( itk::IterationEvent(), observer );
+        filter->AddObserver( itk::EndEvent(),       observer );
+
+        typename ObserverType::Pointer multiresobserver = ObserverType::New();
+        multiresobserver->SetFileName( "" );
+        multires->AddObserver( itk::IterationEvent(), multiresobserver );
+    }
+
+    multires->SetFixedImage(         fixedImage );
+    multires->SetRegistrationFilter( filter );
+    multires->SetNumberOfLevels(     this->m_iterations.size() );
+    multires->SetNumberOfIterations( &m_iterations[0] );
+    multires->GetScheduler()->SetTimeBudget( this->m_TimeBudget );
+
+    // Checkpoints
+    if ( this->m_ResumeFromCheckpoint && this->m_CheckpointFileName.empty() )
+        throw std::runtime_error( "A checkpoint file is needed to resume the registration." );
+    multires->SetCheckpointFileName(   this->m_CheckpointFileName );
+    multires->SetCheckpointInterval(   this->m_CheckpointInterval );
+    multires->SetResumeFromCheckpoint( this->m_ResumeFromCheckpoint );
+
+    // Profiling
+    if ( !this->m_ProfileFileName.empty() )
+        multires->SetProfiler( itk::RegistrationProfiler::New() );
+
+    // Compute the next pyramid level while the current one is registered
+    // (the levels are then generated one at a time)
+    multires->SetGeneratePyramidLevelsOnDemand( this->m_PrefetchPyramidLevels );
+    multires->SetPrefetchNextPyramidLevel(      this->m_PrefetchPyramidLevels );
+
+    // The displacement field comes with the logJacobian map from the same
+    // squarings: the final composition of the filter would be thrown away
+    multires->SetComposeFinalDeformationField( !this->m_ComputeLogJacobian );
+
+    multires->UseMask(m_UseMask);
+    if (m_UseMask)
+        multires->SetMaskImage(this->m_MaskImage);
+    multires->SetCompressMaskPyramid( this->m_CompressMaskPyramid );
+
+    // Set the field interpolator
+    typedef  itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction< VelocityFieldType, double >  FieldInterpolatorType;
+    typename FieldInterpolatorType::Pointer interpolator = FieldInterpolatorType::New();
+    multires->GetFieldExpander()->SetInterpolator( interpolator );
+
+    multires->SetRegularizationType(this->GetRegularizationType());
+    if (this->GetRegularizationType()==0)
+    {
+        // Set the standard deviation of the displacement field smoothing
+        if ( this->m_velocityFieldStandardDeviation >= 0.1 )
+        {
+            multires->SetStandardDeviationsWorldUnit( this->m_velocityFieldStandardDeviation );
+            multires->SmoothVelocityFieldOn();
+        }
+        else
+            multires->SmoothVelocityFieldOff();
+
+        // Set the standard deviation of the update field smoothing
+        if ( this->m_updateFieldStandardDeviation >= 0.1 )
+        {
+            multires->SetUpdateFieldStandardDeviationsWorldUnit( this->m_updateFieldStandardDeviation );
+            multires->SmoothUpdateFieldOn();
+        }
+        else
+            multires->SmoothUpdateFieldOff();
+    }
+    if (this->GetRegularizationType()==1)
+    {
+        multires->SetHarmonicWeight(this->GetHarmonicWeight());
+        multires->SetBendingWeight(this->GetBendingWeight());
+    }
+
+    // Set the initial displacement field only if it exists
+    if (this->m_initialTransform.IsNotNull())
+    {
+        typename DisplacementFieldTransformType::Pointer transform = this->m_initialTransform;
+        typename VelocityFieldType::ConstPointer field             = transform->GetParametersAsVectorField();
+        multires->SetArbitraryInitialVelocityField( const_cast<VelocityFieldType *>(field.GetPointer()) );
+    }
+
+    // The velocity field of the initial linear transformation is generated at the coarsest level
+    if (this->m_initialLinearTransform.IsNotNull())
+        multires->SetInitialLinearTransform( this->m_initialLinearTransform );
+
+    return multires;
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::RunLCCRegistrationFilter(LCCRegistrationFilterType * multires,
+                                                                                        const TMovingImage * movingImage,
+                                                                                        TransformPointerType & transform,
+                                                                                        DisplacementFieldTransformPointerType & displacementFieldTransform,
+                                                                                        LogJacobianImagePointerType & logJacobian) const
+{
+    multires->SetMovingImage( movingImage );
+
+    // Start the registration process
+    try
+    {
+        multires->UpdateLargestPossibleRegion();
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::cout << err << std::endl;
+        throw std::runtime_error( "Unexpected error." );
+    }
+
+    std::cout<<"Creating images"<<std::endl;
+
+    // The fields are detached from the filter, which may be run again
+    typename VelocityFieldType::Pointer deformationField;
+    typename VelocityFieldType::Pointer velocityField    = multires->GetVelocityField();
+
+    if ( this->m_ComputeLogJacobian )
+    {
+        // Displacement field and logJacobian map from the same squarings
+        typedef itk::ExponentialDeformationFieldLogJacobianImageFilter< VelocityFieldType, VelocityFieldType, LogJacobianImageType >
+                ExponentiatorType;
+        typename ExponentiatorType::Pointer exponentiator = ExponentiatorType::New();
+        exponentiator->SetInput( velocityField );
+        exponentiator->SetNumberOfThreads( multires->GetNumberOfThreads() );
+        try
+        {
+            itk::RegistrationProfiler::ScopedTimer timer( multires->GetProfiler(), "FinalExponential" );
+            exponentiator->Update();
+        }
+        catch( itk::ExceptionObject& err )
+        {
+            std::cout << err << std::endl;
+            throw std::runtime_error( "Could not compute the logJacobian map." );
+        }
+        deformationField = exponentiator->GetOutput();
+        deformationField->DisconnectPipeline();
+        logJacobian = exponentiator->GetLogJacobianOutput();
+        logJacobian->DisconnectPipeline();
+    }
+    else
+    {
+        deformationField = multires->GetDeformationField();
+        logJacobian      = NULL;
+    }
+    velocityField->DisconnectPipeline();
+
+    // Create the velocity field transform object
+    transform = TransformType::New();
+    transform->SetParametersAsVectorField( static_cast<typename VelocityFieldType::ConstPointer>( velocityField ) );
+
+    // Create the displacement field transform object
+    displacementFieldTransform = DisplacementFieldTransformType::New();
+    displacementFieldTransform->SetParametersAsVectorField( deformationField );
+
+    // Write the timings of the registration
+    if ( multires->GetProfiler() )
+    {
+        try
+        {
+            multires->GetProfiler()->WriteJSON( this->m_ProfileFileName );
+        }
+        catch( itk::ExceptionObject& err )
+        {
+            std::cout << err << std::endl;
+            throw std::runtime_error( "Could not write the profile file." );
+        }
+    }
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::StartBatchRegistration(const std::vector<MovingImagePointerType> & movingImages)
+{
+    // Check the parameters
+    if (this->m_fixedImage.IsNull())
+        throw std::runtime_error( "Fixed image has not been set." );
+    if ( this->m_updateRule != UPDATE_SYMMETRIC_LOCAL_LOG_DOMAIN )
+        throw std::runtime_error( "Batch registration is only available with the LCC similarity." );
+    if ( !this->m_CheckpointFileName.empty() || this->m_ResumeFromCheckpoint )
+        throw std::runtime_error( "Checkpoints are not supported by the batch registration." );
+    if ( !this->m_ProfileFileName.empty() )
+        throw std::runtime_error( "Profiling is not supported by the batch registration." );
+    if ( this->m_ComputeLogJacobian )
+        throw std::runtime_error( "The logJacobian map is not supported by the batch registration." );
+    if ( this->m_initialTransform.IsNotNull() && this->m_initialLinearTransform.IsNotNull() )
+        throw std::runtime_error( "Cannot initialize with a stationary velocity field and a linear transformation." );
+    for ( unsigned int i=0; i<movingImages.size(); i++ )
+        if ( movingImages[i].IsNull() )
+            throw std::runtime_error( "Moving image of the batch has not been set." );
+
+    this->m_batchTransforms.assign(                  movingImages.size(), TransformPointerType() );
+    this->m_batchDisplacementFieldTransforms.assign( movingImages.size(), DisplacementFieldTransformPointerType() );
+    if ( movingImages.empty() )
+        return;
+
+    const unsigned int numberOfWorkers = std::min<unsigned int>( this->m_NumberOfConcurrentRegistrations, movingImages.size() );
+
+    // Threads of each registration; the filters pass them on to their
+    // internal filters, the global default is left unchanged
+    int numberOfThreads = this->m_NumberOfThreadsPerRegistration;
+    if ( numberOfThreads==0 )
+        numberOfThreads = std::max( 1, itk::MultiThreader::GetGlobalDefaultNumberOfThreads() / static_cast<int>( numberOfWorkers ) );
+
+    BatchState state;
+    state.registration = this;
+    state.movingImages = &movingImages;
+    state.nextImage    = 0;
+
+    std::vector<BatchWorker> workers( numberOfWorkers );
+    try
+    {
+        // The fixed and mask pyramids are computed once, before the threads
+        // start, and shared by all the filters, which only generate the
+        // levels of their moving image. The verbose diagnostics of each
+        // worker go to their own csv file.
+        for ( unsigned int i=0; i<numberOfWorkers; i++ )
+        {
+            std::ostringstream metricsFileName;
+            metricsFileName << "metricvalues_" << i << ".csv";
+
+            workers[i].state  = &state;
+            workers[i].filter = this->CreateLCCRegistrationFilter( this->m_fixedImage, metricsFileName.str() );
+            workers[i].filter->SetNumberOfThreads( numberOfThreads );
+            workers[i].filter->GetRegistrationFilter()->SetNumberOfThreads( numberOfThreads );
+            workers[i].filter->GeneratePyramidLevelsOnDemandOn();
+            if ( i==0 )
+            {
+                workers[i].filter->KeepFixedImagePyramidOn();
+                workers[i].filter->UpdateFixedImagePyramid();
+                if ( this->m_UseMask )
+                    workers[i].filter->UpdateMaskPyramid();
+            }
+            else
+            {
+                workers[i].filter->ShareFixedImagePyramid( workers[0].filter );
+                if ( this->m_UseMask )
+                    workers[i].filter->ShareMaskPyramid( workers[0].filter );
+            }
+        }
+    }
+    catch( itk::ExceptionObject& err )
+    {
+        std::string message = "Could not compute the fixed image and mask pyramids: ";
+        message += err.GetDescription();
+        throw std::runtime_error( message );
+    }
+
+    // The first worker runs in the calling thread
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    std::vector<int> threadIds;
+    for ( unsigned int i=1; i<numberOfWorkers; i++ )
+        threadIds.push_back( threader->SpawnThread( BatchWorkerCallback, &workers[i] ) );
+    this->RunBatchWorker( workers[0] );
+    for ( unsigned int i=0; i<threadIds.size(); i++ )
+        threader->TerminateThread( threadIds[i] );
+
+    if ( !state.error.empty() )
+        throw std::runtime_error( state.error );
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+void
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::RunBatchWorker(BatchWorker & worker)
+{
+    BatchState & state = *worker.state;
+
+    while ( true )
+    {
+        // Take the next moving image, unless a registration failed
+        state.lock.Lock();
+        const unsigned int index = state.nextImage++;
+        const bool stop = !state.error.empty() || index>=state.movingImages->size();
+        state.lock.Unlock();
+        if ( stop )
+            return;
+
+        try
+        {
+            LogJacobianImagePointerType logJacobian;
+            this->RunLCCRegistrationFilter( worker.filter,
+                                            (*state.movingImages)[index],
+                                            this->m_batchTransforms[index],
+                                            this->m_batchDisplacementFieldTransforms[index],
+                                            logJacobian );
+        }
+        catch( std::exception & err )
+        {
+            state.lock.Lock();
+            if ( state.error.empty() )
+                state.error = err.what();
+            state.lock.Unlock();
+        }
+    }
+}
+
+
+
+template < class TFixedImage, class TMovingImage, class TTransformScalarType >
+ITK_THREAD_RETURN_TYPE
+LCClogDemons< TFixedImage, TMovingImage, TTransformScalarType >::BatchWorkerCallback(void * arg)
+{
+    itk::MultiThreader::ThreadInfoStruct * info = static_cast<itk::MultiThreader::ThreadInfoStruct *>( arg );
+    BatchWorker * worker = static_cast<BatchWorker *>( info->UserData );
+    worker->state->registration->RunBatchWorker( *worker );
+    return ITK_THREAD_RETURN_VALUE;
+}
+
+
 } // End of namespace
 
 
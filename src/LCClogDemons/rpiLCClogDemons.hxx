@@ -4,7 +4,10 @@
 
 
 #include <itkStationaryVelocityFieldTransform.h>
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
 #include <rpiDisplacementFieldTransform.h>
+#include "itkMultiResolutionLCCDeformableRegistration.h"
 #include "rpiRegistrationMethod.hxx"
 
 
@@ -74,6 +77,27 @@ public:
     typedef typename DisplacementFieldTransformType::Pointer
             DisplacementFieldTransformPointerType;
 
+    typedef itk::Transform< double, TFixedImage::ImageDimension, TFixedImage::ImageDimension >
+            LinearTransformType;
+
+    typedef typename LinearTransformType::Pointer
+            LinearTransformPointerType;
+
+    typedef typename TransformType::VectorFieldType
+            VelocityFieldType;
+
+    typedef itk::MultiResolutionLCCDeformableRegistration< TFixedImage, TMovingImage, VelocityFieldType, typename TFixedImage::PixelType >
+            LCCRegistrationFilterType;
+
+    typedef typename LCCRegistrationFilterType::Pointer
+            LCCRegistrationFilterPointerType;
+
+    typedef itk::Image< float, TFixedImage::ImageDimension >
+            LogJacobianImageType;
+
+    typedef typename LogJacobianImageType::Pointer
+            LogJacobianImagePointerType;
+
 
 protected:
 
@@ -161,6 +185,12 @@ protected:
     DisplacementFieldTransformPointerType                   m_initialTransform;
 
 
+    /**
+     * Initial linear transformation.
+     */
+    LinearTransformPointerType             m_initialLinearTransform;
+
+
     /**
      * Displacement field transformation
      */
@@ -192,6 +222,161 @@ protected:
 
     bool                                   m_BoundaryCheck;
 
+
+    /**
+      * Wall-clock time budget of the registration in seconds (0: no budget)
+      */
+
+    double                                 m_TimeBudget;
+
+
+    /**
+      * Convergence criteria of the LCC registration at each level
+      */
+
+    unsigned int                           m_ConvergenceWindowSize;
+    double                                 m_MetricConvergenceTolerance;
+    double                                 m_RMSChangeConvergenceTolerance;
+    unsigned int                           m_MinimumNumberOfIterations;
+
+
+    /**
+      * Checkpoint file, number of iterations between checkpoints and resume flag
+      */
+
+    std::string                            m_CheckpointFileName;
+    unsigned int                           m_CheckpointInterval;
+    bool                                   m_ResumeFromCheckpoint;
+
+
+    /**
+      * JSON file receiving the per-level and per-stage timings
+      */
+
+    std::string                            m_ProfileFileName;
+
+
+    /**
+      * Compute the next pyramid level while the current one is registered
+      */
+
+    bool                                   m_PrefetchPyramidLevels;
+
+
+    /**
+      * Diagnostics of the verbose mode: number of iterations between two
+      * evaluations, subsampling of the Jacobian statistics (0: automatic) and
+      * fast mode (histogram quantiles, evaluation in a background thread)
+      */
+
+    unsigned int                           m_DiagnosticsInterval;
+    unsigned int                           m_DiagnosticsSubsampling;
+    bool                                   m_FastDiagnostics;
+
+
+    /**
+      * Compute the logJacobian map with the output displacement field, and
+      * the resulting map
+      */
+
+    bool                                   m_ComputeLogJacobian;
+    LogJacobianImagePointerType            m_logJacobian;
+
+
+    /**
+      * Smooth and update the fields on planar fields (one plane per component)
+      */
+
+    bool                                   m_UsePlanarFields;
+
+
+    /**
+      * Store the mask pyramid as run-length encoded binary masks
+      */
+
+    bool                                   m_CompressMaskPyramid;
+
+
+    /**
+      * Number of registrations run at the same time by StartBatchRegistration
+      * and number of threads used by each of them (0: shared equally)
+      */
+
+    unsigned int                           m_NumberOfConcurrentRegistrations;
+    unsigned int                           m_NumberOfThreadsPerRegistration;
+
+
+    /**
+      * Output transformations of the batch registration
+      */
+
+    std::vector<TransformPointerType>                   m_batchTransforms;
+    std::vector<DisplacementFieldTransformPointerType>  m_batchDisplacementFieldTransforms;
+
+
+    /**
+     * Creates the multi-resolution LCC registration filter of the fixed
+     * image and sets it up with the parameters of this object.
+     * @param  fixedImage       fixed image
+     * @param  metricsFileName  csv file of the verbose diagnostics (empty: no file)
+     * @return registration filter
+     */
+    LCCRegistrationFilterPointerType       CreateLCCRegistrationFilter(const TFixedImage * fixedImage,
+                                                                       const std::string & metricsFileName = "metricvalues.csv") const;
+
+
+    /**
+     * Registers a moving image with a filter created by CreateLCCRegistrationFilter.
+     * The filter can be run again on another moving image.
+     * @param  filter                      registration filter
+     * @param  movingImage                 moving image
+     * @param  transform                   output stationary velocity field transformation
+     * @param  displacementFieldTransform  output displacement field transformation
+     * @param  logJacobian                 output logJacobian map, computed with the displacement
+     *                                     field if ComputeLogJacobian is on
+     */
+    void                                   RunLCCRegistrationFilter(LCCRegistrationFilterType * filter,
+                                                                    const TMovingImage * movingImage,
+                                                                    TransformPointerType & transform,
+                                                                    DisplacementFieldTransformPointerType & displacementFieldTransform,
+                                                                    LogJacobianImagePointerType & logJacobian) const;
+
+
+    /**
+     * State shared by the threads of a batch registration.
+     */
+    struct BatchState
+    {
+        LCClogDemons *                                registration;
+        const std::vector<MovingImagePointerType> *   movingImages;
+        unsigned int                                  nextImage;
+        std::string                                   error;
+        itk::SimpleFastMutexLock                      lock;
+    };
+
+
+    /**
+     * Registration thread of a batch registration.
+     */
+    struct BatchWorker
+    {
+        BatchState *                      state;
+        LCCRegistrationFilterPointerType  filter;
+    };
+
+
+    /**
+     * Registers moving images of the batch until there are none left.
+     * @param  worker  registration thread
+     */
+    void                                   RunBatchWorker(BatchWorker & worker);
+
+
+    /**
+     * Entry point of the registration threads of a batch registration.
+     */
+    static ITK_THREAD_RETURN_TYPE          BatchWorkerCallback(void * arg);
+
 public:
 
     /**
@@ -399,6 +584,21 @@ public:
     void                                   SetInitialTransformation(DisplacementFieldTransformType * transform);
 
 
+    /**
+     * Gets the initial linear transformation.
+     * @return  initial linear transformation
+     */
+    LinearTransformPointerType             GetInitialLinearTransformation(void) const;
+
+
+    /**
+     * Sets the initial linear transformation. Its stationary velocity field is
+     * generated on the grid of the coarsest level of the LCC registration.
+     * @param  transform  initial linear transformation
+     */
+    void                                   SetInitialLinearTransformation(LinearTransformType * transform);
+
+
     /**
      * Sets the true displcement field.
      * @param  transform  true field
@@ -413,11 +613,128 @@ public:
     DisplacementFieldTransformPointerType  GetDisplacementFieldTransformation(void) const;
 
 
+    /**
+     * Sets if the logJacobian map of the output transformation is computed
+     * with the displacement field, in the same scaling and squaring loop
+     * (LCC registration only).
+     * @param  value  true to compute the logJacobian map
+     */
+    void                                   SetComputeLogJacobian(bool value);
+
+
+    /**
+     * Is the logJacobian map computed with the displacement field?
+     * @return  true if the logJacobian map is computed
+     */
+    bool                                   GetComputeLogJacobian(void) const;
+
+
+    /**
+     * Gets the logJacobian map of the output transformation.
+     * @return  logJacobian map (NULL if ComputeLogJacobian is off)
+     */
+    LogJacobianImagePointerType            GetLogJacobian(void) const;
+
+
+    /**
+     * Sets if the smoothing, the update and the Lie brackets of the fields are
+     * computed on planar fields, with the components stored in separate
+     * contiguous planes (LCC registration only).
+     * @param  value  true to use planar fields
+     */
+    void                                   SetUsePlanarFields(bool value);
+
+
+    /**
+     * Are the fields smoothed and updated on planar fields?
+     * @return  true if planar fields are used
+     */
+    bool                                   GetUsePlanarFields(void) const;
+
+
+    /**
+     * Sets if the levels of the mask pyramid are stored as run-length encoded
+     * binary masks (LCC registration only). The levels are thresholded at 0.5
+     * instead of being kept as smoothed masks, which saves memory but may
+     * slightly change the result near the border of the mask.
+     * @param  value  true to compress the mask pyramid
+     */
+    void                                   SetCompressMaskPyramid(bool value);
+
+
+    /**
+     * Are the levels of the mask pyramid stored as binary run-length masks?
+     * @return  true if the mask pyramid is compressed
+     */
+    bool                                   GetCompressMaskPyramid(void) const;
+
+
     /**
      * Performs the image registration. Must be called before GetTransformation().
      */
     virtual void                           StartRegistration(void);
 
+
+    /**
+     * Registers several moving images to the fixed image (LCC registration
+     * only). The fixed pyramid is computed once, and each registration thread
+     * keeps its filters and their buffers from one moving image to the next.
+     * The moving image set with SetMovingImage is not used; the mask, if any,
+     * is used for all the moving images and its pyramid is also computed
+     * once. With verbosity on, the diagnostics of registration thread i are
+     * written to metricvalues_i.csv. Checkpoints are not supported.
+     * @param  movingImages  moving images
+     */
+    void                                   StartBatchRegistration(const std::vector<MovingImagePointerType> & movingImages);
+
+
+    /**
+     * Gets the output stationary velocity field transformation of a moving
+     * image of the last batch registration.
+     * @param  index  index of the moving image
+     * @return  stationary velocity field transformation
+     */
+    TransformPointerType                   GetBatchTransformation(unsigned int index) const;
+
+
+    /**
+     * Gets the output displacement field transformation of a moving image of
+     * the last batch registration.
+     * @param  index  index of the moving image
+     * @return  displacement field transformation
+     */
+    DisplacementFieldTransformPointerType  GetBatchDisplacementFieldTransformation(unsigned int index) const;
+
+
+    /**
+     * Sets the number of registrations run at the same time by
+     * StartBatchRegistration (default 1).
+     * @param  value  number of registrations
+     */
+    void                                   SetNumberOfConcurrentRegistrations(unsigned int value);
+
+
+    /**
+     * Gets the number of registrations run at the same time by StartBatchRegistration.
+     * @return  number of registrations
+     */
+    unsigned int                           GetNumberOfConcurrentRegistrations(void) const;
+
+
+    /**
+     * Sets the number of threads used by each registration of a batch
+     * (default 0: the threads are shared equally between the registrations).
+     * @param  value  number of threads
+     */
+    void                                   SetNumberOfThreadsPerRegistration(unsigned int value);
+
+
+    /**
+     * Gets the number of threads used by each registration of a batch.
+     * @return  number of threads
+     */
+    unsigned int                           GetNumberOfThreadsPerRegistration(void) const;
+
     /**
      * Enable the use of the mask
      * @param use mask
@@ -449,6 +766,179 @@ public:
      */
     bool                                  GetBoundaryCheck(void);
 
+    /**
+     * Sets the wall-clock time budget of the registration. The iterations of
+     * each level are reduced if needed to finish within the budget.
+     * @param  value  time budget in seconds (0 means no budget)
+     */
+    void                                   SetTimeBudget(double value);
+
+    /**
+     * Gets the wall-clock time budget of the registration.
+     * @return  time budget in seconds
+     */
+    double                                 GetTimeBudget(void) const;
+
+    /**
+     * Sets the number of iterations over which the relative change of the
+     * LCC metric is measured to test the convergence.
+     * @param  value  number of iterations
+     */
+    void                                   SetConvergenceWindowSize(unsigned int value);
+
+    /**
+     * Gets the number of iterations over which the relative change of the
+     * LCC metric is measured to test the convergence.
+     * @return  number of iterations
+     */
+    unsigned int                           GetConvergenceWindowSize(void) const;
+
+    /**
+     * Sets the relative change of the LCC metric over the convergence window
+     * below which a level stops.
+     * @param  value  tolerance (0 means not used)
+     */
+    void                                   SetMetricConvergenceTolerance(double value);
+
+    /**
+     * Gets the relative change of the LCC metric over the convergence window
+     * below which a level stops.
+     * @return  tolerance
+     */
+    double                                 GetMetricConvergenceTolerance(void) const;
+
+    /**
+     * Sets the RMS change of the velocity field below which a level stops.
+     * @param  value  tolerance (0 means not used)
+     */
+    void                                   SetRMSChangeConvergenceTolerance(double value);
+
+    /**
+     * Gets the RMS change of the velocity field below which a level stops.
+     * @return  tolerance
+     */
+    double                                 GetRMSChangeConvergenceTolerance(void) const;
+
+    /**
+     * Sets the number of iterations performed at each level before the
+     * convergence is tested.
+     * @param  value  number of iterations
+     */
+    void                                   SetMinimumNumberOfIterations(unsigned int value);
+
+    /**
+     * Gets the number of iterations performed at each level before the
+     * convergence is tested.
+     * @return  number of iterations
+     */
+    unsigned int                           GetMinimumNumberOfIterations(void) const;
+
+    /**
+     * Sets the checkpoint file. The velocity field and the current level are
+     * saved in it after each level of the LCC registration.
+     * @param  fileName  path of the checkpoint file (empty means no checkpoint)
+     */
+    void                                   SetCheckpointFileName(const std::string & fileName);
+
+    /**
+     * Gets the checkpoint file.
+     * @return  path of the checkpoint file
+     */
+    std::string                            GetCheckpointFileName(void) const;
+
+    /**
+     * Sets the number of iterations between two checkpoints within a level.
+     * @param  value  number of iterations (0 means at the end of each level only)
+     */
+    void                                   SetCheckpointInterval(unsigned int value);
+
+    /**
+     * Gets the number of iterations between two checkpoints within a level.
+     * @return  number of iterations
+     */
+    unsigned int                           GetCheckpointInterval(void) const;
+
+    /**
+     * Sets if the registration restarts from the checkpoint file.
+     * @param  value  true to resume from the checkpoint
+     */
+    void                                   SetResumeFromCheckpoint(bool value);
+
+    /**
+     * Does the registration restart from the checkpoint file?
+     * @return  true if the registration resumes from the checkpoint
+     */
+    bool                                   GetResumeFromCheckpoint(void) const;
+
+    /**
+     * Sets the profile file. The wall time, CPU time and allocated bytes of
+     * each level, iteration and stage of the LCC registration are written
+     * in it as JSON.
+     * @param  fileName  path of the profile file (empty means no profiling)
+     */
+    void                                   SetProfileFileName(const std::string & fileName);
+
+    /**
+     * Gets the profile file.
+     * @return  path of the profile file
+     */
+    std::string                            GetProfileFileName(void) const;
+
+    /**
+     * Sets if the next pyramid level is computed on a background thread while
+     * the current level is registered (LCC registration only). The levels are
+     * then generated one at a time instead of all beforehand.
+     * @param  value  true to prefetch the pyramid levels
+     */
+    void                                   SetPrefetchPyramidLevels(bool value);
+
+    /**
+     * Is the next pyramid level computed while the current level is registered?
+     * @return  true if the pyramid levels are prefetched
+     */
+    bool                                   GetPrefetchPyramidLevels(void) const;
+
+    /**
+     * Sets the number of iterations between two evaluations of the
+     * diagnostics printed in verbose mode (LCC registration only).
+     * @param  value  number of iterations (1: every iteration)
+     */
+    void                                   SetDiagnosticsInterval(unsigned int value);
+
+    /**
+     * Gets the number of iterations between two evaluations of the diagnostics.
+     * @return  number of iterations
+     */
+    unsigned int                           GetDiagnosticsInterval(void) const;
+
+    /**
+     * Sets the subsampling of the diagnostics: the Jacobian statistics and the
+     * distances to the true field are computed on one voxel out of value along
+     * each axis (LCC registration only).
+     * @param  value  subsampling (0: 2 with fast diagnostics, 1 otherwise)
+     */
+    void                                   SetDiagnosticsSubsampling(unsigned int value);
+
+    /**
+     * Gets the subsampling of the diagnostics.
+     * @return  subsampling (0: automatic)
+     */
+    unsigned int                           GetDiagnosticsSubsampling(void) const;
+
+    /**
+     * Sets if the diagnostics use approximate (histogram) quantiles and are
+     * evaluated on a copy of the velocity field in a background thread, so
+     * that the registration never waits for them (LCC registration only).
+     * @param  value  true for fast diagnostics
+     */
+    void                                   SetFastDiagnostics(bool value);
+
+    /**
+     * Are the diagnostics evaluated in fast mode?
+     * @return  true for fast diagnostics
+     */
+    bool                                   GetFastDiagnostics(void) const;
+
 };
 
 
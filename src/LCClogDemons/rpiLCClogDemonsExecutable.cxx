@@ -1,10 +1,35 @@
 #include <iostream>
 #include <cstdlib>
 #include <stdexcept>
+#include <list>
+#include <map>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+
+#ifndef _WIN32
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+#include <itkTimeProbe.h>
+#include <itksys/SystemTools.hxx>
+#include <itkWarpImageFilter.h>
+#include <itkImageFileWriter.h>
+#include <itkNearestNeighborInterpolateImageFunction.h>
+#include <itkLinearInterpolateImageFunction.h>
+#include <itkBSplineInterpolateImageFunction.h>
 
 #include <tclap/CmdLine.h>
 #include <rpiCommonTools.hxx>
 #include "rpiLCClogDemons.hxx"
+#include "itkRegistrationThreadPool.h"
+#include "itkTaskGroup.h"
 
 
 
@@ -27,6 +52,7 @@ struct Param{
     std::string  MaskImagePath;
     std::string  trueField;
     std::string  outputDisplacementFieldPath;
+    std::string  outputLogJacobianPath;
     std::string  intialLinearTransformPath;
     std::string  intialFieldTransformPath;
     std::string  iterations;
@@ -45,6 +71,25 @@ struct Param{
     unsigned int BCHExpansion;
     rpi::ImageInterpolatorType interpolatorType;
     bool         BoundaryCheck;
+    double       timeBudget;
+    unsigned int convergenceWindow;
+    double       convergenceMetricTolerance;
+    double       convergenceRMSTolerance;
+    unsigned int minIterations;
+    std::string  checkpointPath;
+    unsigned int checkpointInterval;
+    bool         resume;
+    bool         pipeline;
+    std::string  profilePath;
+    unsigned int diagnosticsInterval;
+    unsigned int diagnosticsSubsampling;
+    bool         fastDiagnostics;
+    bool         planarFields;
+    bool         compressMaskPyramid;
+    bool         noThreadPool;
+    std::string  batchListPath;
+    unsigned int concurrentRegistrations;
+    unsigned int threadsPerRegistration;
 
 };
 
@@ -52,11 +97,12 @@ struct Param{
 
 /**
  * Parses the command line arguments and deduces the corresponding Param structure.
- * @param  argc   number of arguments
- * @param  argv   array containing the arguments
- * @param  param  structure of parameters
+ * @param  argc         number of arguments
+ * @param  argv         array containing the arguments
+ * @param  param        structure of parameters
+ * @param  exitOnError  exit the program on a parsing error instead of throwing an exception
  */
-void parseParameters(int argc, char** argv, struct Param & param)
+void parseParameters(int argc, char** argv, struct Param & param, bool exitOnError = true)
 {
     // Program description
     std::string description = "\b\b\bDESCRIPTION\n";
@@ -106,6 +152,61 @@ void parseParameters(int argc, char** argv, struct Param & param)
     std::string des_iterations              = "Number of iterations per level of resolution (from coarse to fine levels). ";
     des_iterations                         += "Levels must be separated by \"x\" (default 30x20x10).";
 
+    std::string des_timeBudget              = "Wall-clock time budget of the registration in seconds, for all the update rules. If the ";
+    des_timeBudget                         += "requested iterations do not fit, they are allocated to the levels where they improve the ";
+    des_timeBudget                         += "metric the most per second (default 0: no budget).";
+
+    std::string des_convergenceWindow       = "Number of iterations over which the relative change of the LCC metric is measured (default 5).";
+
+    std::string des_convergenceMetricTol    = "A level stops when the relative change of the LCC metric over the convergence window ";
+    des_convergenceMetricTol               += "is below this value (default 0: not used).";
+
+    std::string des_convergenceRMSTol       = "A level stops when the RMS change of the velocity field is below this value (default 0: not used).";
+
+    std::string des_minIterations           = "Number of iterations of each level before the convergence is tested (default 0).";
+
+    std::string des_checkpoint              = "Path of the checkpoint file. The velocity field and the current level are saved ";
+    des_checkpoint                         += "after each level (LCC similarity only, default none).";
+
+    std::string des_checkpointInterval      = "Number of iterations between two checkpoints within a level (default 0: end of each level only).";
+
+    std::string des_resume                  = "Resume the registration from the checkpoint file.";
+
+    std::string des_pipeline                = "Read the input images concurrently, compute the next pyramid level while the current one ";
+    des_pipeline                           += "is registered, and write the outputs concurrently.";
+
+    std::string des_profile                 = "Path of a JSON file receiving the wall time, CPU time and allocated bytes of each ";
+    des_profile                            += "level, iteration and stage (LCC similarity only, default none).";
+
+    std::string des_diagnosticsInterval     = "Number of iterations between two evaluations of the verbose diagnostics (default 1).";
+
+    std::string des_diagnosticsSubsampling  = "The verbose diagnostics are computed on one voxel out of this value along each axis ";
+    des_diagnosticsSubsampling             += "(default 0: 2 with fast diagnostics, 1 otherwise).";
+
+    std::string des_fastDiagnostics         = "Evaluate the verbose diagnostics with histogram quantiles on a copy of the field in a ";
+    des_fastDiagnostics                    += "background thread, skipping iterations rather than slowing down the registration.";
+
+    std::string des_planarFields            = "Smooth and update the velocity field with its components stored in separate planes ";
+    des_planarFields                       += "(LCC similarity only).";
+
+    std::string des_compressMaskPyramid     = "Store the mask pyramid as run-length encoded binary masks to save memory (LCC similarity only). ";
+    des_compressMaskPyramid                += "The levels are thresholded at 0.5 instead of being smoothed masks, which may slightly change ";
+    des_compressMaskPyramid                += "the result near the border of the mask.";
+
+    std::string des_noThreadPool            = "Run the parallel loops of the registration kernels with threads created at each loop ";
+    des_noThreadPool                       += "instead of the persistent thread pool.";
+
+    std::string des_batchList               = "Path of a list of moving images registered to the fixed image in one run, replacing -m ";
+    des_batchList                          += "(LCC similarity only). The fixed and mask pyramids are computed once. Each line holds a ";
+    des_batchList                          += "moving image optionally followed by its output transformation, displacement field and image ";
+    des_batchList                          += "paths (\"-\": <moving image name>_stationary_velocity_field.mha, ";
+    des_batchList                          += "<moving image name>_displacement_field.mha and <moving image name>_output_image.nii.gz).";
+
+    std::string des_concurrentRegistrations = "Number of registrations of the batch run at the same time (default 1).";
+
+    std::string des_threadsPerRegistration  = "Number of threads of each registration of the batch (default 0: the threads are shared ";
+    des_threadsPerRegistration             += "equally between the concurrent registrations).";
+
     std::string des_initLinearTransform     = "Path to the initial linear transformation.";
 
     std::string des_initFieldTransform      = "Path to the initial stationary velocity field transformation.";
@@ -114,13 +215,16 @@ void parseParameters(int argc, char** argv, struct Param & param)
 
     std::string des_outputDisplacementField = "Path of the output displacement field transformation (default output_displacement_field.mha).";
 
+    std::string des_outputLogJacobian       = "Path of the output logJacobian map, computed with the displacement field in the same ";
+    des_outputLogJacobian                  += "scaling and squaring loop (LCC similarity only, default none).";
+
     std::string des_MaskImage               = "Path of the mask image.";
 
     std::string des_trueField		         = "Path of the true deformation field (default none).";
 
     std::string des_outputTransform         = "Path of the output stationary velocity field transformation (default output_stationary_velocity_field.mha).";
 
-    std::string des_movingImage             = "Path to the moving image.";
+    std::string des_movingImage             = "Path to the moving image (required unless --batch is given).";
 
     std::string des_fixedImage              = "Path to the fixed image.";
 
@@ -129,6 +233,7 @@ void parseParameters(int argc, char** argv, struct Param & param)
 
         // Define the command line parser
         TCLAP::CmdLine cmd( description, ' ', "1.0", true );
+        cmd.setExceptionHandling( exitOnError );
 
         // Set options
         TCLAP::ValueArg<unsigned int>  arg_interpolatorType( "", "interpolator-type", des_interpolatorType, false, 1, "int", cmd);
@@ -142,13 +247,33 @@ void parseParameters(int argc, char** argv, struct Param & param)
         TCLAP::ValueArg<double>        arg_maxStepLength( "l", "max-step-length", des_maxStepLength, false, 2.0, "double", cmd );
         TCLAP::ValueArg<unsigned int>  arg_updateRule( "r", "update-rule", des_updateRule, false, 1, "uint", cmd );
         TCLAP::ValueArg<std::string>   arg_iterations( "a", "iterations", des_iterations, false, "30x20x10", "uintxuintx...xuint", cmd );
+        TCLAP::ValueArg<double>        arg_timeBudget( "", "time-budget", des_timeBudget, false, 0.0, "double", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_convergenceWindow( "", "convergence-window", des_convergenceWindow, false, 5, "uint", cmd );
+        TCLAP::ValueArg<double>        arg_convergenceMetricTol( "", "convergence-metric-tolerance", des_convergenceMetricTol, false, 0.0, "double", cmd );
+        TCLAP::ValueArg<double>        arg_convergenceRMSTol( "", "convergence-rms-tolerance", des_convergenceRMSTol, false, 0.0, "double", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_minIterations( "", "min-iterations", des_minIterations, false, 0, "uint", cmd );
+        TCLAP::ValueArg<std::string>   arg_checkpoint( "", "checkpoint", des_checkpoint, false, "", "string", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_checkpointInterval( "", "checkpoint-interval", des_checkpointInterval, false, 0, "uint", cmd );
+        TCLAP::SwitchArg               arg_resume( "", "resume", des_resume, cmd, false );
+        TCLAP::SwitchArg               arg_pipeline( "", "pipeline", des_pipeline, cmd, false );
+        TCLAP::ValueArg<std::string>   arg_profile( "", "profile", des_profile, false, "", "string", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_diagnosticsInterval( "", "diagnostics-interval", des_diagnosticsInterval, false, 1, "uint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_diagnosticsSubsampling( "", "diagnostics-subsampling", des_diagnosticsSubsampling, false, 0, "uint", cmd );
+        TCLAP::SwitchArg               arg_fastDiagnostics( "", "fast-diagnostics", des_fastDiagnostics, cmd, false );
+        TCLAP::SwitchArg               arg_planarFields( "", "planar-fields", des_planarFields, cmd, false );
+        TCLAP::SwitchArg               arg_compressMaskPyramid( "", "compress-mask-pyramid", des_compressMaskPyramid, cmd, false );
+        TCLAP::SwitchArg               arg_noThreadPool( "", "no-thread-pool", des_noThreadPool, cmd, false );
+        TCLAP::ValueArg<std::string>   arg_batchList( "", "batch", des_batchList, false, "", "string", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_concurrentRegistrations( "", "concurrent-registrations", des_concurrentRegistrations, false, 1, "uint", cmd );
+        TCLAP::ValueArg<unsigned int>  arg_threadsPerRegistration( "", "threads-per-registration", des_threadsPerRegistration, false, 0, "uint", cmd );
         TCLAP::ValueArg<std::string>   arg_initLinearTransform( "", "initial-linear-transform", des_initLinearTransform, false, "", "string", cmd );
         TCLAP::ValueArg<std::string>   arg_initFieldTransform( "", "initial-transform", des_initFieldTransform,  false, "", "string", cmd );
         TCLAP::ValueArg<std::string>   arg_trueField( "T", "true-field", des_trueField,  false, "", "string", cmd );
         TCLAP::ValueArg<std::string>   arg_outputImage( "i", "output-image", des_outputImage, false, "output_image.nii.gz", "string", cmd );
         TCLAP::ValueArg<std::string>   arg_outputDisplacementField( "", "output-displacement-field", des_outputDisplacementField, false, "output_displacement_field.mha", "string", cmd );
+        TCLAP::ValueArg<std::string>   arg_outputLogJacobian( "", "output-log-jacobian", des_outputLogJacobian, false, "", "string", cmd );
         TCLAP::ValueArg<std::string>   arg_outputTransform( "t", "output-transform", des_outputTransform, false, "output_stationary_velocity_field.mha", "string", cmd );
-        TCLAP::ValueArg<std::string>   arg_movingImage( "m", "moving-image", des_movingImage, true, "", "string", cmd );
+        TCLAP::ValueArg<std::string>   arg_movingImage( "m", "moving-image", des_movingImage, false, "", "string", cmd );
         TCLAP::ValueArg<std::string>   arg_fixedImage( "f", "fixed-image", des_fixedImage, true, "", "string", cmd );
         TCLAP::ValueArg<std::string>   arg_MaskImage( "M", "mask-image", des_MaskImage, false, "", "string", cmd );
         TCLAP::ValueArg<double>        arg_SigmaI( "S", "sigma-I", des_SigmaI, false, 0.15, "double", cmd );
@@ -166,10 +291,30 @@ void parseParameters(int argc, char** argv, struct Param & param)
         param.outputTransformPath                      = arg_outputTransform.getValue();
         param.trueField		                           = arg_trueField.getValue();
         param.outputDisplacementFieldPath              = arg_outputDisplacementField.getValue();
+        param.outputLogJacobianPath                    = arg_outputLogJacobian.getValue();
         param.outputImagePath                          = arg_outputImage.getValue();
         param.intialLinearTransformPath                = arg_initLinearTransform.getValue();
         param.intialFieldTransformPath                 = arg_initFieldTransform.getValue();
         param.iterations                               = arg_iterations.getValue();
+        param.timeBudget                               = arg_timeBudget.getValue();
+        param.convergenceWindow                        = arg_convergenceWindow.getValue();
+        param.convergenceMetricTolerance               = arg_convergenceMetricTol.getValue();
+        param.convergenceRMSTolerance                  = arg_convergenceRMSTol.getValue();
+        param.minIterations                            = arg_minIterations.getValue();
+        param.checkpointPath                           = arg_checkpoint.getValue();
+        param.checkpointInterval                       = arg_checkpointInterval.getValue();
+        param.resume                                   = arg_resume.getValue();
+        param.pipeline                                 = arg_pipeline.getValue();
+        param.profilePath                              = arg_profile.getValue();
+        param.diagnosticsInterval                      = arg_diagnosticsInterval.getValue();
+        param.diagnosticsSubsampling                   = arg_diagnosticsSubsampling.getValue();
+        param.fastDiagnostics                          = arg_fastDiagnostics.getValue();
+        param.planarFields                             = arg_planarFields.getValue();
+        param.compressMaskPyramid                      = arg_compressMaskPyramid.getValue();
+        param.noThreadPool                             = arg_noThreadPool.getValue();
+        param.batchListPath                            = arg_batchList.getValue();
+        param.concurrentRegistrations                  = arg_concurrentRegistrations.getValue();
+        param.threadsPerRegistration                   = arg_threadsPerRegistration.getValue();
         param.updateRule                               = arg_updateRule.getValue();
         param.maximumUpdateStepLength                  = arg_maxStepLength.getValue();
         param.gradientType                             = arg_gradientType.getValue();
@@ -205,12 +350,174 @@ void parseParameters(int argc, char** argv, struct Param & param)
             param.RegularizationType = 1;
         else
             throw std::runtime_error("Regularization type not supported.");
+
+        // One moving image or a batch of moving images
+        if ( param.movingImagePath.empty() == param.batchListPath.empty() )
+            throw std::runtime_error("Either a moving image (-m) or a batch list (--batch) must be given.");
     }
     catch (TCLAP::ArgException &e)
     {
         std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
         throw std::runtime_error("Unable to parse the command line arguments.");
     }
+    catch (TCLAP::ExitException &)
+    {
+        throw std::runtime_error("No registration to run (help or version requested).");
+    }
+}
+
+
+
+/**
+ * Structure containing the parameters of the server mode.
+ */
+struct ServerParam{
+    std::string   endpoint;
+    unsigned int  cacheSize;
+    unsigned int  numberOfThreads;
+};
+
+
+
+/**
+ * Returns true if the command line asks for the server mode.
+ * @param  argc  number of arguments
+ * @param  argv  array containing the arguments
+ */
+bool isServerMode(int argc, char** argv)
+{
+    for ( int i=1; i<argc; i++ )
+        if ( std::string( argv[i] ).compare( "--server" )==0 )
+            return true;
+    return false;
+}
+
+
+
+/**
+ * Parses the command line arguments of the server mode. On an invalid
+ * command line, the usage is printed and an exception is thrown.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of server parameters
+ */
+void parseServerParameters(int argc, char** argv, struct ServerParam & param)
+{
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Server mode of the LCC log-Demons registration. Jobs are read one per line, either on the ";
+    description += "standard input or from the clients of a local UNIX socket. A job line holds the command line ";
+    description += "arguments of a registration (e.g. -f fixed.nii.gz -m moving.nii.gz -t svf.mha). The server ";
+    description += "answers each job with one line: \"OK <seconds> <output image> <output transform> ";
+    description += "<output displacement field>\" or \"ERROR <message>\". The line \"quit\" closes the current ";
+    description += "client and the line \"shutdown\" stops the server.";
+    description += "\nAuthors : Marco Lorenzi, Vincent Garcia and Tom Vercauteren";
+
+    // Option description
+    std::string des_server          = "Path of the UNIX socket to listen on, or \"-\" to read the jobs on the standard input.";
+    std::string des_cacheSize       = "Number of input images kept in memory between jobs (default 4).";
+    std::string des_numberOfThreads = "Number of threads shared by the jobs (default 0: number of processors).";
+
+    // Define the command line parser
+    TCLAP::CmdLine cmd( description, ' ', "1.0", true );
+    cmd.setExceptionHandling( false );
+
+    // Set options
+    TCLAP::ValueArg<unsigned int>  arg_numberOfThreads( "", "threads", des_numberOfThreads, false, 0, "uint", cmd );
+    TCLAP::ValueArg<unsigned int>  arg_cacheSize( "", "cache-size", des_cacheSize, false, 4, "uint", cmd );
+    TCLAP::ValueArg<std::string>   arg_server( "", "server", des_server, true, "", "string", cmd );
+
+    try {
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.endpoint        = arg_server.getValue();
+        param.cacheSize       = arg_cacheSize.getValue();
+        param.numberOfThreads = arg_numberOfThreads.getValue();
+    }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        cmd.getOutput()->usage( cmd );
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+    catch (TCLAP::ExitException &e)
+    {
+        // Help or version requested: the text was printed by the parser
+        exit( e.getExitStatus() );
+    }
+
+    if ( param.endpoint.empty() )
+    {
+        cmd.getOutput()->usage( cmd );
+        throw std::runtime_error("The server needs a socket path or \"-\".");
+    }
+}
+
+
+
+/**
+ * Splits a job line into arguments. Arguments are separated by white spaces
+ * and may be enclosed in double quotes.
+ * @param  line  job line
+ * @return arguments
+ */
+std::vector<std::string> splitJobLine(const std::string & line)
+{
+    std::vector<std::string> arguments;
+    std::string argument;
+    bool inArgument = false;
+    bool quoted     = false;
+
+    for ( std::string::size_type i=0; i<line.size(); i++ )
+    {
+        const char c = line[i];
+        if ( c=='"' )
+        {
+            quoted     = !quoted;
+            inArgument = true;
+        }
+        else if ( !quoted && ( c==' ' || c=='\t' || c=='\r' ) )
+        {
+            if ( inArgument )
+                arguments.push_back( argument );
+            argument.clear();
+            inArgument = false;
+        }
+        else
+        {
+            argument  += c;
+            inArgument = true;
+        }
+    }
+    if ( quoted )
+        throw std::runtime_error( "Unbalanced quotes in the job line." );
+    if ( inArgument )
+        arguments.push_back( argument );
+
+    return arguments;
+}
+
+
+
+/**
+ * Checks that the fixed and moving images can be registered.
+ * @param  param  parameters of the registration
+ */
+void checkImageInformation(const struct Param & param)
+{
+    itk::ImageIOBase::Pointer fixed_imageIO  = rpi::readImageInformation( param.fixedImagePath );
+    itk::ImageIOBase::Pointer moving_imageIO = rpi::readImageInformation( param.movingImagePath );
+
+    // Only 3D images are supported yet
+    if (  fixed_imageIO->GetNumberOfDimensions()!=3  &&  moving_imageIO->GetNumberOfDimensions()!=3  )
+        throw std::runtime_error( "Only images of dimension 3 are supported yet." );
+
+    // Only scalar images are supported yet
+    if (  fixed_imageIO->GetPixelType() != itk::ImageIOBase::SCALAR  ||  moving_imageIO->GetPixelType() != itk::ImageIOBase::SCALAR  )
+        throw std::runtime_error( "Only scalar images are supported yet." );
 }
 
 
@@ -254,19 +561,35 @@ void PrintParameters( std::string fixedImagePath,
         std::cout << "  Initial linear transform                     : " << initialLinearTransformPath << std::endl;
     if ( initialFieldTransformPath.compare("")!=0 )
         std::cout << "  Initial displacement field transform         : " << initialFieldTransformPath  << std::endl;
+    if ( registration->GetCheckpointFileName().compare("")!=0 )
+        std::cout << "  Checkpoint file                              : " << registration->GetCheckpointFileName()
+                  << ( registration->GetResumeFromCheckpoint() ? " (resume)" : "" ) << std::endl;
+    if ( registration->GetProfileFileName().compare("")!=0 )
+        std::cout << "  Profile file                                 : " << registration->GetProfileFileName() << std::endl;
     std::cout << std::endl;
 
     // Print method parameters
     std::cout << "METHOD PARAMETERS"                          << std::endl;
     std::cout << "  Iterations                                   : " << rpi::VectorToString<unsigned int>( registration->GetNumberOfIterations() )     << std::endl;
+    if ( registration->GetTimeBudget()>0 )
+        std::cout << "  Time budget                                  : " << registration->GetTimeBudget()                                 << " (seconds)" << std::endl;
 
 
     if(registration->GetUpdateRule() ==2)
       {
        std::cout << "  Similarity metric:                           : " << "LCC"                                                  << std::endl;
        std::cout << "  Similarity Criterion standard deviation      : " << registration->GetSimilarityCriteriaStandardDeviation()	    << " (world unit)" << std::endl;
+       if ( registration->GetMetricConvergenceTolerance()>0 || registration->GetRMSChangeConvergenceTolerance()>0 )
+         {
+         std::cout << "  Convergence window                           : " << registration->GetConvergenceWindowSize()          << std::endl;
+         std::cout << "  Convergence metric tolerance                 : " << registration->GetMetricConvergenceTolerance()     << std::endl;
+         std::cout << "  Convergence RMS tolerance                    : " << registration->GetRMSChangeConvergenceTolerance()  << std::endl;
+         std::cout << "  Minimum iterations per level                 : " << registration->GetMinimumNumberOfIterations()      << std::endl;
+         }
        std::cout << "  Trade-off parameter                          : " << registration->GetSigmaI()	    << std::endl;
        std::cout << "  Boundary Checking                            : " << rpi::BooleanToString(registration->GetBoundaryCheck())	                     << std::endl;
+       std::cout << "  Planar fields                                : " << rpi::BooleanToString(registration->GetUsePlanarFields())                     << std::endl;
+       std::cout << "  Compressed mask pyramid                      : " << rpi::BooleanToString(registration->GetCompressMaskPyramid())                 << std::endl;
       }
     else
       {
@@ -301,142 +624,453 @@ void PrintParameters( std::string fixedImagePath,
 
 
 /**
-  * Starts the image registration.
-  * @param   param  parameters needed for the image registration process
-  * @return  EXIT_SUCCESS if the registration succeded, EXIT_FAILURE otherwise
-  */
-template< class TFixedImage, class TMovingImage >
-int StartMainProgram(struct Param param)
+ * Warps the moving image with the displacement field onto the fixed image
+ * grid and writes it. The field is applied directly by a WarpImageFilter
+ * instead of going through a transform. The sinus cardinal interpolator is
+ * handled by rpi::resampleAndWriteImage.
+ * @param  fixedImage        fixed image
+ * @param  movingImage       moving image
+ * @param  transform         displacement field transformation
+ * @param  path              path of the output image
+ * @param  interpolatorType  type of image interpolator
+ */
+template< class TFixedImage, class TMovingImage, class TTransformScalarType >
+void warpAndWriteImage( TFixedImage * fixedImage,
+                        TMovingImage * movingImage,
+                        rpi::DisplacementFieldTransform< TTransformScalarType, TFixedImage::ImageDimension > * transform,
+                        std::string path,
+                        rpi::ImageInterpolatorType interpolatorType )
 {
+    typedef typename rpi::DisplacementFieldTransform< TTransformScalarType, TFixedImage::ImageDimension >::VectorFieldType
+            FieldType;
+    typedef itk::WarpImageFilter< TMovingImage, TMovingImage, FieldType >
+            WarperType;
+    typedef typename WarperType::InterpolatorType
+            InterpolatorType;
+
+    typename InterpolatorType::Pointer interpolator;
+    switch ( interpolatorType )
+    {
+    case rpi::INTERPOLATOR_NEAREST_NEIGHBOR:
+        interpolator = itk::NearestNeighborInterpolateImageFunction< TMovingImage, double >::New(); break;
+    case rpi::INTERPOLATOR_LINEAR:
+        interpolator = itk::LinearInterpolateImageFunction< TMovingImage, double >::New(); break;
+    case rpi::INTERPOLATOR_BSLPINE:
+        interpolator = itk::BSplineInterpolateImageFunction< TMovingImage, double >::New(); break;
+    default:
+        rpi::resampleAndWriteImage<TFixedImage, TMovingImage, TTransformScalarType>(
+                fixedImage, movingImage, transform, path, interpolatorType );
+        return;
+    }
 
-    typedef double
-            TransformScalarType;
+    typename FieldType::ConstPointer field = transform->GetParametersAsVectorField();
+
+    typename WarperType::Pointer warper = WarperType::New();
+    warper->SetInput(           movingImage );
+    warper->SetInterpolator(    interpolator );
+    warper->SetOutputOrigin(    fixedImage->GetOrigin() );
+    warper->SetOutputSpacing(   fixedImage->GetSpacing() );
+    warper->SetOutputDirection( fixedImage->GetDirection() );
+#if ITK_VERSION_MAJOR < 4
+    warper->SetDeformationField( const_cast< FieldType * >( field.GetPointer() ) );
+#else
+    warper->SetDisplacementField( const_cast< FieldType * >( field.GetPointer() ) );
+#endif
+
+    typedef itk::ImageFileWriter< TMovingImage > WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(    warper->GetOutput() );
+    writer->SetFileName( path );
+    try
+    {
+        writer->Update();
+    }
+    catch( itk::ExceptionObject & err )
+    {
+        std::string message = "Could not write the output image: ";
+        message += err.GetDescription();
+        throw std::runtime_error( message );
+    }
+}
 
-    typedef rpi::LCClogDemons< TFixedImage, TMovingImage, TransformScalarType >
-            RegistrationMethod;
 
-    typedef itk::Transform<double, 3, 3>
-            LinearTransformType;
 
-    typedef rpi::DisplacementFieldTransform< TransformScalarType, 3 >
-            FieldTransformType;
+/**
+ * Least recently used cache of images read from files. An image is read again
+ * if its file was modified since it was cached. The cache can be used by
+ * several threads.
+ */
+template< class TImage >
+class ImageCache
+{
 
+public:
 
-    // Creation of the registration object
-    RegistrationMethod * registration = new RegistrationMethod();
+    typedef typename TImage::Pointer ImagePointer;
 
-    try
+    ImageCache(unsigned int capacity) : m_Capacity(capacity)
     {
+    }
 
-        // Read input images
-        typename TFixedImage::Pointer  fixedImage  = rpi::readImage< TFixedImage >(  param.fixedImagePath );
-        typename TMovingImage::Pointer movingImage = rpi::readImage< TMovingImage >( param.movingImagePath );
+    /**
+     * Gets an image from the cache, or reads it.
+     * @param  path  path of the image
+     * @return image
+     */
+    ImagePointer Get(const std::string & path)
+    {
+        const long int modifiedTime = itksys::SystemTools::ModifiedTime( path.c_str() );
 
-        if (param.MaskImagePath.compare("")!=0)
-          {
-           typename TMovingImage::Pointer MaskImage = rpi::readImage< TMovingImage >( param.MaskImagePath );
-           registration->UseMask(true);
-           registration->SetMaskImage(MaskImage );
-          }
+        m_Lock.Lock();
+        typename std::list<Entry>::iterator it = m_Entries.begin();
+        while ( it!=m_Entries.end() && it->path.compare( path )!=0 )
+            ++it;
+        if ( it!=m_Entries.end() && it->modifiedTime==modifiedTime )
+        {
+            // Move the entry to the front
+            m_Entries.splice( m_Entries.begin(), m_Entries, it );
+            ImagePointer image = it->image;
+            m_Lock.Unlock();
+            return image;
+        }
+        if ( it!=m_Entries.end() )
+            m_Entries.erase( it );
+        m_Lock.Unlock();
+
+        // Read outside of the lock, so that several images can be read at once
+        ImagePointer image = rpi::readImage< TImage >( path );
+        if ( m_Capacity==0 )
+            return image;
+
+        m_Lock.Lock();
+        Entry entry;
+        entry.path         = path;
+        entry.modifiedTime = modifiedTime;
+        entry.image        = image;
+        m_Entries.push_front( entry );
+        while ( m_Entries.size()>m_Capacity )
+            m_Entries.pop_back();
+        m_Lock.Unlock();
+
+        return image;
+    }
+
+private:
+
+    struct Entry
+    {
+        std::string   path;
+        long int      modifiedTime;
+        ImagePointer  image;
+    };
+
+    unsigned int               m_Capacity;
+    std::list<Entry>           m_Entries;
+    itk::SimpleFastMutexLock   m_Lock;
+
+};
+
+
+
+/**
+ * Reads an image, through the image cache if any.
+ */
+template< class TImage >
+struct ReadImageTask{
+    std::string               path;
+    ImageCache< TImage > *    cache;
+    typename TImage::Pointer  image;
+
+    ReadImageTask(void) : cache(NULL)
+    {
+    }
+
+    static void Run(void * data)
+    {
+        ReadImageTask * task = static_cast<ReadImageTask *>( data );
+        if ( task->cache!=NULL )
+            task->image = task->cache->Get( task->path );
         else
-          registration->UseMask(false);
+            task->image = rpi::readImage< TImage >( task->path );
+    }
+};
 
-        // Set parameters
-        registration->SetFixedImage(                               fixedImage );
-        registration->SetMovingImage(                              movingImage );
 
 
-        registration->SetNumberOfIterations(                       rpi::StringToVector<unsigned int>( param.iterations ) );
-        registration->SetMaximumUpdateStepLength(                  param.maximumUpdateStepLength );
-        registration->SetSimilarityCriteriaStandardDeviation(      param.SimilarityCriteriaStandardDeviation );
-        registration->SetSigmaI(                                   param.SigmaI );
-        registration->SetRegularizationType(                       param.RegularizationType);
-        registration->SetBoundaryCheck(                            param.BoundaryCheck );
+/**
+ * Writes the stationary velocity field of a registration.
+ */
+template< class TRegistrationMethod, class TTransformScalarType, unsigned int Dimension >
+struct WriteStationaryVelocityFieldTask{
+    TRegistrationMethod * registration;
+    std::string           path;
+
+    static void Run(void * data)
+    {
+        WriteStationaryVelocityFieldTask * task = static_cast<WriteStationaryVelocityFieldTask *>( data );
+        rpi::writeStationaryVelocityFieldTransformation<TTransformScalarType, Dimension>(
+                task->registration->GetTransformation(),
+                task->path );
+    }
+};
+
+
+
+/**
+ * Copies a displacement field transformation. The field of the copy is a
+ * distinct data object grafted on the buffer of the original field, so that
+ * the copy can be written by an I/O thread while the original field is used
+ * by a pipeline of the main thread.
+ * @param  transform  displacement field transformation
+ * @return copy of the transformation
+ */
+template< class TTransformScalarType, unsigned int Dimension >
+typename rpi::DisplacementFieldTransform< TTransformScalarType, Dimension >::Pointer
+graftDisplacementFieldTransformation( rpi::DisplacementFieldTransform< TTransformScalarType, Dimension > * transform )
+{
+    typedef rpi::DisplacementFieldTransform< TTransformScalarType, Dimension >
+            TransformType;
+    typedef typename TransformType::VectorFieldType
+            FieldType;
+
+    typename FieldType::Pointer field = FieldType::New();
+    field->Graft( transform->GetParametersAsVectorField() );
+
+    typename TransformType::Pointer copy = TransformType::New();
+    copy->SetParametersAsVectorField( field );
+    return copy;
+}
+
+
+
+/**
+ * Writes a displacement field. The task holds its own copy of the
+ * transformation (see graftDisplacementFieldTransformation), made before the
+ * task is started.
+ */
+template< class TTransformScalarType, unsigned int Dimension >
+struct WriteDisplacementFieldTask{
+    typename rpi::DisplacementFieldTransform< TTransformScalarType, Dimension >::Pointer transform;
+    std::string                                                                          path;
+
+    static void Run(void * data)
+    {
+        WriteDisplacementFieldTask * task = static_cast<WriteDisplacementFieldTask *>( data );
+        rpi::writeDisplacementFieldTransformation<TTransformScalarType, Dimension>(
+                task->transform,
+                task->path );
+    }
+};
+
 
-        switch (param.RegularizationType)
-          {
-           case 0:
-            registration->SetUpdateFieldStandardDeviation(             param.updateFieldStandardDeviation );
-            registration->SetStationaryVelocityFieldStandardDeviation( param.stationaryVelocityFieldStandardDeviation ); break;
-           case 1:
-            registration->SetHarmonicWeight(                           param.HarmonicWeight );
-            registration->SetBendingWeight(                            param.BendingWeight ); break;
-           }
 
-        registration->SetVerbosity(                     	       param.verbose);
-        registration->SetNumberOfTermsBCHExpansion(                param.BCHExpansion );
+/**
+ * Writes the logJacobian map of a registration.
+ */
+template< class TRegistrationMethod >
+struct WriteLogJacobianTask{
+    TRegistrationMethod * registration;
+    std::string           path;
 
+    static void Run(void * data)
+    {
+        WriteLogJacobianTask * task = static_cast<WriteLogJacobianTask *>( data );
+        typedef itk::ImageFileWriter< typename TRegistrationMethod::LogJacobianImageType > WriterType;
+        typename WriterType::Pointer writer = WriterType::New();
+        writer->SetFileName( task->path );
+        writer->SetInput( task->registration->GetLogJacobian() );
+        writer->Update();
+    }
+};
 
 
-	 if ( param.trueField.compare("")!=0)
-	 	{
-         typename rpi::DisplacementFieldTransform<TransformScalarType,3>::Pointer TrueFieldImage = rpi::readDisplacementField<TransformScalarType>( param.trueField );
-         registration->SetTrueField( TrueFieldImage);
-		}
 
-        // Set update rule
-        switch( param.updateRule )
+/**
+  * Sets the parameters of a registration, except its images.
+  * @param   registration  registration object
+  * @param   param         parameters needed for the image registration process
+  */
+template< class TRegistrationMethod, class TTransformScalarType >
+void setRegistrationParameters(TRegistrationMethod * registration, const struct Param & param)
+{
+    typedef TRegistrationMethod
+            RegistrationMethod;
+
+    typedef TTransformScalarType
+            TransformScalarType;
+
+    typedef itk::Transform<double, 3, 3>
+            LinearTransformType;
+
+    typedef rpi::DisplacementFieldTransform< TransformScalarType, 3 >
+            FieldTransformType;
+
+    registration->SetNumberOfIterations(                       rpi::StringToVector<unsigned int>( param.iterations ) );
+    registration->SetTimeBudget(                               param.timeBudget );
+    registration->SetConvergenceWindowSize(                    param.convergenceWindow );
+    registration->SetMetricConvergenceTolerance(               param.convergenceMetricTolerance );
+    registration->SetRMSChangeConvergenceTolerance(            param.convergenceRMSTolerance );
+    registration->SetMinimumNumberOfIterations(                param.minIterations );
+    registration->SetCheckpointFileName(                       param.checkpointPath );
+    registration->SetCheckpointInterval(                       param.checkpointInterval );
+    registration->SetResumeFromCheckpoint(                     param.resume );
+    registration->SetPrefetchPyramidLevels(                    param.pipeline );
+    registration->SetProfileFileName(                          param.profilePath );
+    registration->SetMaximumUpdateStepLength(                  param.maximumUpdateStepLength );
+    registration->SetSimilarityCriteriaStandardDeviation(      param.SimilarityCriteriaStandardDeviation );
+    registration->SetSigmaI(                                   param.SigmaI );
+    registration->SetRegularizationType(                       param.RegularizationType);
+    registration->SetBoundaryCheck(                            param.BoundaryCheck );
+
+    switch (param.RegularizationType)
+      {
+       case 0:
+        registration->SetUpdateFieldStandardDeviation(             param.updateFieldStandardDeviation );
+        registration->SetStationaryVelocityFieldStandardDeviation( param.stationaryVelocityFieldStandardDeviation ); break;
+       case 1:
+        registration->SetHarmonicWeight(                           param.HarmonicWeight );
+        registration->SetBendingWeight(                            param.BendingWeight ); break;
+       }
+
+    registration->SetVerbosity(                     	       param.verbose);
+    registration->SetDiagnosticsInterval(                      param.diagnosticsInterval );
+    registration->SetDiagnosticsSubsampling(                   param.diagnosticsSubsampling );
+    registration->SetFastDiagnostics(                          param.fastDiagnostics );
+    registration->SetUsePlanarFields(                          param.planarFields );
+    registration->SetCompressMaskPyramid(                      param.compressMaskPyramid );
+    registration->SetComputeLogJacobian(                       !param.outputLogJacobianPath.empty() );
+    registration->SetNumberOfTermsBCHExpansion(                param.BCHExpansion );
+
+    if ( param.trueField.compare("")!=0 )
+    {
+        typename FieldTransformType::Pointer TrueFieldImage = rpi::readDisplacementField<TransformScalarType>( param.trueField );
+        registration->SetTrueField( TrueFieldImage );
+    }
+
+    // Set update rule
+    switch( param.updateRule )
+    {
+    case 0:
+        registration->SetUpdateRule(                               RegistrationMethod::UPDATE_LOG_DOMAIN );
+        registration->SetUseHistogramMatching(                     param.useHistogramMatching );
+        // Set gradient type
+        switch( param.gradientType )
         {
         case 0:
-            registration->SetUpdateRule(                               RegistrationMethod::UPDATE_LOG_DOMAIN );
-            registration->SetUseHistogramMatching(                     param.useHistogramMatching );
-            // Set gradient type
-            switch( param.gradientType )
-            {
-            case 0:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_SYMMETRIZED );         break;
-            case 1:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_FIXED_IMAGE );         break;
-            case 2:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_WARPED_MOVING_IMAGE ); break;
-            case 3:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_MAPPED_MOVING_IMAGE ); break;
-            default:
-                throw std::runtime_error( "Gradient type must fit in the range [0,3]." );
-            } break;
+            registration->SetGradientType( RegistrationMethod::GRADIENT_SYMMETRIZED );         break;
         case 1:
-            registration->SetUpdateRule(                               RegistrationMethod::UPDATE_SYMMETRIC_LOG_DOMAIN );
-            registration->SetUseHistogramMatching(                     param.useHistogramMatching );
-            // Set gradient type
-            switch( param.gradientType )
-            {
-            case 0:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_SYMMETRIZED );         break;
-            case 1:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_FIXED_IMAGE );         break;
-            case 2:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_WARPED_MOVING_IMAGE ); break;
-            case 3:
-                registration->SetGradientType( RegistrationMethod::GRADIENT_MAPPED_MOVING_IMAGE ); break;
-            default:
-                throw std::runtime_error( "Gradient type must fit in the range [0,3]." );
-            } break;
+            registration->SetGradientType( RegistrationMethod::GRADIENT_FIXED_IMAGE );         break;
         case 2:
-            registration->SetUpdateRule(   RegistrationMethod::UPDATE_SYMMETRIC_LOCAL_LOG_DOMAIN ); break;
+            registration->SetGradientType( RegistrationMethod::GRADIENT_WARPED_MOVING_IMAGE ); break;
+        case 3:
+            registration->SetGradientType( RegistrationMethod::GRADIENT_MAPPED_MOVING_IMAGE ); break;
         default:
-            throw std::runtime_error( "Update rule must fit in the range [0,2]." );
-        }
+            throw std::runtime_error( "Gradient type must fit in the range [0,3]." );
+        } break;
+    case 1:
+        registration->SetUpdateRule(                               RegistrationMethod::UPDATE_SYMMETRIC_LOG_DOMAIN );
+        registration->SetUseHistogramMatching(                     param.useHistogramMatching );
+        // Set gradient type
+        switch( param.gradientType )
+        {
+        case 0:
+            registration->SetGradientType( RegistrationMethod::GRADIENT_SYMMETRIZED );         break;
+        case 1:
+            registration->SetGradientType( RegistrationMethod::GRADIENT_FIXED_IMAGE );         break;
+        case 2:
+            registration->SetGradientType( RegistrationMethod::GRADIENT_WARPED_MOVING_IMAGE ); break;
+        case 3:
+            registration->SetGradientType( RegistrationMethod::GRADIENT_MAPPED_MOVING_IMAGE ); break;
+        default:
+            throw std::runtime_error( "Gradient type must fit in the range [0,3]." );
+        } break;
+    case 2:
+        registration->SetUpdateRule(   RegistrationMethod::UPDATE_SYMMETRIC_LOCAL_LOG_DOMAIN ); break;
+    default:
+        throw std::runtime_error( "Update rule must fit in the range [0,2]." );
+    }
+
+    // Initialize transformation
+    if ( param.intialFieldTransformPath.compare("")!=0  &&  param.intialLinearTransformPath.compare("")!=0 )
+    {
+        throw std::runtime_error( "Cannot initialize with a stationary velocity field and a linear transformation." );
+    }
+    else if ( param.intialFieldTransformPath.compare("")!=0 )
+    {
+        typename FieldTransformType::Pointer field = rpi::readDisplacementField<TransformScalarType>( param.intialFieldTransformPath );
+        registration->SetInitialTransformation( field );
+    }
+    else if ( param.intialLinearTransformPath.compare("")!=0 )
+    {
+        // The velocity field is generated by the registration on the grid it needs
+        typename LinearTransformType::Pointer linear = rpi::readLinearTransformation<double>( param.intialLinearTransformPath );
+        registration->SetInitialLinearTransformation( linear );
+    }
+}
 
 
 
+/**
+  * Registers the images and writes the outputs.
+  * @param   param        parameters needed for the image registration process
+  * @param   fixedCache   cache of fixed images (NULL: images are read from their file)
+  * @param   movingCache  cache of moving and mask images (NULL: images are read from their file)
+  */
+template< class TFixedImage, class TMovingImage >
+void RunRegistration(struct Param param,
+                     ImageCache< TFixedImage > * fixedCache,
+                     ImageCache< TMovingImage > * movingCache)
+{
 
+    typedef double
+            TransformScalarType;
 
-        // Initialize transformation
-        if ( param.intialFieldTransformPath.compare("")!=0  &&  param.intialLinearTransformPath.compare("")!=0 )
-        {
-            throw std::runtime_error( "Cannot initialize with a stationary velocity field and a linear transformation." );
-        }
-        else if ( param.intialFieldTransformPath.compare("")!=0 )
-        {
-            typename FieldTransformType::Pointer field = rpi::readDisplacementField<TransformScalarType>( param.intialFieldTransformPath );
-            registration->SetInitialTransformation( field );
-        }
-        else if ( param.intialLinearTransformPath.compare("")!=0 )
+    typedef rpi::LCClogDemons< TFixedImage, TMovingImage, TransformScalarType >
+            RegistrationMethod;
+
+    // Set for each job, so that the jobs of the server honour it too
+    itk::RegistrationThreadPool::SetGlobalEnabled( !param.noThreadPool );
+
+
+    // Creation of the registration object
+    RegistrationMethod * registration = new RegistrationMethod();
+
+    try
+    {
+
+        // Read input images, concurrently in pipeline mode
+        ReadImageTask< TFixedImage >  fixedTask;
+        ReadImageTask< TMovingImage > movingTask;
+        ReadImageTask< TMovingImage > maskTask;
+        fixedTask.path  = param.fixedImagePath;
+        movingTask.path = param.movingImagePath;
+        maskTask.path   = param.MaskImagePath;
+        fixedTask.cache  = fixedCache;
+        movingTask.cache = movingCache;
+        maskTask.cache   = movingCache;
         {
-            typename LinearTransformType::Pointer linear = rpi::readLinearTransformation<double>( param.intialLinearTransformPath );
-            typename FieldTransformType::Pointer  field  = rpi::linearToDisplacementFieldTransformation<double, TransformScalarType, TFixedImage>( fixedImage, linear );
-            registration->SetInitialTransformation( field );
+            itk::TaskGroup readers( param.pipeline );
+            readers.Run( ReadImageTask< TMovingImage >::Run, &movingTask );
+            if (param.MaskImagePath.compare("")!=0)
+                readers.Run( ReadImageTask< TMovingImage >::Run, &maskTask );
+            ReadImageTask< TFixedImage >::Run( &fixedTask );
+            readers.Join();
         }
+        typename TFixedImage::Pointer  fixedImage  = fixedTask.image;
+        typename TMovingImage::Pointer movingImage = movingTask.image;
+
+        if (param.MaskImagePath.compare("")!=0)
+          {
+           registration->UseMask(true);
+           registration->SetMaskImage(maskTask.image );
+          }
+        else
+          registration->UseMask(false);
+
+        // Set parameters
+        registration->SetFixedImage(                               fixedImage );
+        registration->SetMovingImage(                              movingImage );
+        setRegistrationParameters< RegistrationMethod, TransformScalarType >( registration, param );
 
 
         // Print parameters
@@ -464,84 +1098,551 @@ int StartMainProgram(struct Param param)
         std::cout << "OK" << std::endl;
 
 
+        // In pipeline mode, the fields are written on I/O threads while the
+        // output image is resampled and written
+        typedef WriteStationaryVelocityFieldTask<RegistrationMethod, TransformScalarType, TFixedImage::ImageDimension>
+                WriteStationaryVelocityFieldTaskType;
+        typedef WriteDisplacementFieldTask<TransformScalarType, TFixedImage::ImageDimension>
+                WriteDisplacementFieldTaskType;
+
+        WriteStationaryVelocityFieldTaskType velocityFieldTask;
+        velocityFieldTask.registration = registration;
+        velocityFieldTask.path         = param.outputTransformPath;
+
+        WriteDisplacementFieldTaskType displacementFieldTask;
+        // The displacement field is also warped on the main thread: the task
+        // writes a copy of it made here, before the I/O threads are started
+        displacementFieldTask.transform    = graftDisplacementFieldTransformation<TransformScalarType, TFixedImage::ImageDimension>(
+                registration->GetDisplacementFieldTransformation() );
+        displacementFieldTask.path         = param.outputDisplacementFieldPath;
+
+        typedef WriteLogJacobianTask<RegistrationMethod>
+                WriteLogJacobianTaskType;
+
+        WriteLogJacobianTaskType logJacobianTask;
+        logJacobianTask.registration = registration;
+        logJacobianTask.path         = param.outputLogJacobianPath;
+
+        itk::TaskGroup writers( param.pipeline );
+
         // Write stationary velocity field
         std::cout << "  Writing stationary velocity field     : " << std::flush;
-        rpi::writeStationaryVelocityFieldTransformation<TransformScalarType, TFixedImage::ImageDimension>(
-                registration->GetTransformation(),
-                param.outputTransformPath );
-        std::cout << "OK" << std::endl;
+        writers.Run( WriteStationaryVelocityFieldTaskType::Run, &velocityFieldTask );
+        std::cout << ( param.pipeline ? "started" : "OK" ) << std::endl;
 
 
         // Write displacement field
         std::cout << "  Writing displacement field            : " << std::flush;
-        rpi::writeDisplacementFieldTransformation<TransformScalarType, TFixedImage::ImageDimension>(
-                registration->GetDisplacementFieldTransformation(),
-                param.outputDisplacementFieldPath );
-        std::cout << "OK" << std::endl;
+        writers.Run( WriteDisplacementFieldTaskType::Run, &displacementFieldTask );
+        std::cout << ( param.pipeline ? "started" : "OK" ) << std::endl;
+
+
+        // Write logJacobian map
+        if ( !param.outputLogJacobianPath.empty() )
+        {
+            std::cout << "  Writing logJacobian map               : " << std::flush;
+            writers.Run( WriteLogJacobianTaskType::Run, &logJacobianTask );
+            std::cout << ( param.pipeline ? "started" : "OK" ) << std::endl;
+        }
 
 
         // Write the output image
         std::cout << "  Writing image                        : " << std::flush;
-        rpi::resampleAndWriteImage<TFixedImage, TMovingImage, TransformScalarType>(
+        warpAndWriteImage<TFixedImage, TMovingImage, TransformScalarType>(
 		    fixedImage,
                     movingImage,
                     registration->GetDisplacementFieldTransformation(),
                     param.outputImagePath,
                     param.interpolatorType	);
-        std::cout << "OK" << std::endl << std::endl;
+        std::cout << "OK" << std::endl;
+
+
+        // Wait for the fields
+        if ( param.pipeline )
+        {
+            std::cout << "  Writing fields                        : " << std::flush;
+            writers.Join();
+            std::cout << "OK" << std::endl;
+        }
+        else
+            writers.Join();
+        std::cout << std::endl;
     }
-    catch( std::exception& e )
+    catch( ... )
     {
-        std::cerr << e.what() << std::endl;
         delete registration;
-        return EXIT_FAILURE;
+        throw;
     };
 
 
     delete registration;
-    return EXIT_SUCCESS;
 }
 
 
 
 /**
- * Main function.
+ * Moving image of a batch registration and paths of its outputs.
  */
-int main(int argc, char** argv)
+struct BatchItem{
+    std::string  movingImagePath;
+    std::string  outputTransformPath;
+    std::string  outputDisplacementFieldPath;
+    std::string  outputImagePath;
+};
+
+
+
+/**
+ * Reads the list of a batch registration. Each line holds a moving image
+ * optionally followed by its output transformation, displacement field and
+ * image paths ("-" or missing: default path derived from the moving image
+ * name). Empty lines and lines starting with # are ignored.
+ * @param  path  path of the list
+ * @return moving images and their outputs
+ */
+std::vector<BatchItem> readBatchList(const std::string & path)
 {
-   // itk::MultiThreader::SetGlobalDefaultNumberOfThreads(1);
-    // Parse parameters
-    struct Param param;
-    parseParameters( argc, argv, param);
+    std::ifstream file( path.c_str() );
+    if ( !file )
+        throw std::runtime_error( "Could not read the batch list " + path + "." );
 
+    std::vector<BatchItem> items;
+    std::string line;
+    while ( std::getline( file, line ) )
+    {
+        std::vector<std::string> columns = splitJobLine( line );
+        if ( columns.empty() || columns[0].compare( 0, 1, "#" )==0 )
+            continue;
+        if ( columns.size()>4 )
+            throw std::runtime_error( "Too many columns in the batch list line: " + line );
+        columns.resize( 4, "-" );
+
+        const std::string name = itksys::SystemTools::GetFilenameWithoutExtension( columns[0] );
+        BatchItem item;
+        item.movingImagePath             = columns[0];
+        item.outputTransformPath         = columns[1].compare( "-" )!=0 ? columns[1] : name + "_stationary_velocity_field.mha";
+        item.outputDisplacementFieldPath = columns[2].compare( "-" )!=0 ? columns[2] : name + "_displacement_field.mha";
+        item.outputImagePath             = columns[3].compare( "-" )!=0 ? columns[3] : name + "_output_image.nii.gz";
+        items.push_back( item );
+    }
+
+    if ( items.empty() )
+        throw std::runtime_error( "The batch list " + path + " holds no moving image." );
+    return items;
+}
+
+
+
+/**
+  * Registers the moving images of a batch list to the fixed image and writes
+  * the outputs of each of them.
+  * @param   param  parameters needed for the image registration process
+  */
+template< class TFixedImage, class TMovingImage >
+void RunBatchRegistration(struct Param param)
+{
+
+    typedef double
+            TransformScalarType;
+
+    typedef rpi::LCClogDemons< TFixedImage, TMovingImage, TransformScalarType >
+            RegistrationMethod;
+
+    itk::RegistrationThreadPool::SetGlobalEnabled( !param.noThreadPool );
+
+    const std::vector<BatchItem> items = readBatchList( param.batchListPath );
+
+
+    // Creation of the registration object
+    RegistrationMethod * registration = new RegistrationMethod();
 
-    // Read image information
-    itk::ImageIOBase::Pointer fixed_imageIO;
-    itk::ImageIOBase::Pointer moving_imageIO;
     try
     {
-        fixed_imageIO  = rpi::readImageInformation( param.fixedImagePath );
-        moving_imageIO = rpi::readImageInformation( param.movingImagePath );
+
+        // Read input images
+        std::vector< typename TMovingImage::Pointer > movingImages;
+        for ( unsigned int i=0; i<items.size(); i++ )
+        {
+            struct Param itemParam = param;
+            itemParam.movingImagePath = items[i].movingImagePath;
+            checkImageInformation( itemParam );
+            movingImages.push_back( rpi::readImage< TMovingImage >( items[i].movingImagePath ) );
+        }
+        typename TFixedImage::Pointer fixedImage = rpi::readImage< TFixedImage >( param.fixedImagePath );
+
+        if (param.MaskImagePath.compare("")!=0)
+          {
+           registration->UseMask(true);
+           registration->SetMaskImage( rpi::readImage< TMovingImage >( param.MaskImagePath ) );
+          }
+        else
+          registration->UseMask(false);
+
+        // Set parameters
+        registration->SetFixedImage(                               fixedImage );
+        setRegistrationParameters< RegistrationMethod, TransformScalarType >( registration, param );
+        registration->SetNumberOfConcurrentRegistrations(          param.concurrentRegistrations );
+        registration->SetNumberOfThreadsPerRegistration(           param.threadsPerRegistration );
+
+
+        // Print parameters
+        PrintParameters< TFixedImage, TMovingImage, TransformScalarType >(
+                param.fixedImagePath,
+                param.batchListPath + " (batch)",
+                "see the batch list",
+                param.MaskImagePath,
+                "see the batch list",
+                "see the batch list",
+                param.intialLinearTransformPath,
+                param.intialFieldTransformPath,
+                param.RegularizationType,
+                param.interpolatorType,
+                registration );
+        std::cout << "  Moving images                         : " << items.size()                        << std::endl;
+        std::cout << "  Concurrent registrations              : " << param.concurrentRegistrations      << std::endl;
+        std::cout << std::endl;
+
+
+        // Display
+        std::cout << "STARTING MAIN PROGRAM" << std::endl;
+
+
+        // Start registration process
+        std::cout << "  Registering images                    : " << std::flush;
+        registration->StartBatchRegistration( movingImages );
+        std::cout << "OK" << std::endl;
+
+
+        // Write the outputs
+        for ( unsigned int i=0; i<items.size(); i++ )
+        {
+            std::cout << "  Writing outputs of " << items[i].movingImagePath << " : " << std::flush;
+            rpi::writeStationaryVelocityFieldTransformation<TransformScalarType, TFixedImage::ImageDimension>(
+                    registration->GetBatchTransformation( i ),
+                    items[i].outputTransformPath );
+            rpi::writeDisplacementFieldTransformation<TransformScalarType, TFixedImage::ImageDimension>(
+                    registration->GetBatchDisplacementFieldTransformation( i ),
+                    items[i].outputDisplacementFieldPath );
+            warpAndWriteImage<TFixedImage, TMovingImage, TransformScalarType>(
+                    fixedImage,
+                    movingImages[i],
+                    registration->GetBatchDisplacementFieldTransformation( i ),
+                    items[i].outputImagePath,
+                    param.interpolatorType );
+            std::cout << "OK" << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    catch( ... )
+    {
+        delete registration;
+        throw;
+    };
+
+
+    delete registration;
+}
+
+
+
+/**
+  * Starts the image registration.
+  * @param   param  parameters needed for the image registration process
+  * @return  EXIT_SUCCESS if the registration succeded, EXIT_FAILURE otherwise
+  */
+template< class TFixedImage, class TMovingImage >
+int StartMainProgram(struct Param param)
+{
+    try
+    {
+        if ( !param.batchListPath.empty() )
+            RunBatchRegistration< TFixedImage, TMovingImage >( param );
+        else
+            RunRegistration< TFixedImage, TMovingImage >( param, NULL, NULL );
     }
     catch( std::exception& e )
     {
-        std::cerr << "Error: " << e.what() << std::endl;
+        std::cerr << e.what() << std::endl;
         return EXIT_FAILURE;
+    };
+
+    return EXIT_SUCCESS;
+}
+
+
+
+/**
+ * Registration server. The server keeps the input images in a cache and runs
+ * the jobs one after the other, each job using all the threads.
+ */
+template< class TFixedImage, class TMovingImage >
+class RegistrationServer
+{
+
+public:
+
+    /** Action requested by a line sent to the server. */
+    enum LineAction { CONTINUE, QUIT, SHUTDOWN };
+
+    RegistrationServer(unsigned int cacheSize) : m_FixedCache(cacheSize), m_MovingCache(cacheSize)
+    {
     }
 
+    /**
+     * Handles a line sent to the server.
+     * @param  line      received line
+     * @param  response  response line (empty if nothing is to be sent back)
+     * @return action requested by the line
+     */
+    LineAction HandleLine(const std::string & line, std::string & response)
+    {
+        response.clear();
 
-    // Only 3D images are supported yet
-    if (  fixed_imageIO->GetNumberOfDimensions()!=3  &&  moving_imageIO->GetNumberOfDimensions()!=3  )
+        std::vector<std::string> arguments;
+        try
+        {
+            arguments = splitJobLine( line );
+        }
+        catch( std::exception& e )
+        {
+            response = std::string( "ERROR " ) + e.what();
+            return CONTINUE;
+        }
+
+        if ( arguments.empty() || arguments[0].compare( 0, 1, "#" )==0 )
+            return CONTINUE;
+        if ( arguments.size()==1 && arguments[0].compare( "quit" )==0 )
+            return QUIT;
+        if ( arguments.size()==1 && arguments[0].compare( "shutdown" )==0 )
+            return SHUTDOWN;
+
+        response = this->RunJob( arguments );
+        return CONTINUE;
+    }
+
+    /**
+     * Runs the jobs read on a stream. The registration messages are redirected
+     * to the standard error so that the output stream only holds the responses.
+     * @param  in   stream of jobs
+     * @param  out  stream of responses
+     */
+    void Serve(std::istream & in, std::ostream & out)
+    {
+        std::string line;
+        while ( std::getline( in, line ) )
+        {
+            std::streambuf * coutBuffer = std::cout.rdbuf( std::cerr.rdbuf() );
+            std::string response;
+            LineAction action = this->HandleLine( line, response );
+            std::cout.rdbuf( coutBuffer );
+
+            if ( !response.empty() )
+                out << response << std::endl;
+            if ( action!=CONTINUE )
+                break;
+        }
+    }
+
+private:
+
+    /**
+     * Runs a registration job.
+     * @param  arguments  command line arguments of the job
+     * @return response line
+     */
+    std::string RunJob(const std::vector<std::string> & arguments)
+    {
+        std::vector<char *> argv;
+        argv.push_back( const_cast<char *>( "rpiLCClogDemons" ) );
+        for ( unsigned int i=0; i<arguments.size(); i++ )
+            argv.push_back( const_cast<char *>( arguments[i].c_str() ) );
+
+        itk::TimeProbe clock;
+        clock.Start();
+        struct Param param;
+        try
+        {
+            parseParameters( static_cast<int>( argv.size() ), &argv[0], param, false );
+            if ( !param.batchListPath.empty() )
+                throw std::runtime_error( "Batch registrations are not supported by the server." );
+            checkImageInformation( param );
+            RunRegistration< TFixedImage, TMovingImage >( param, &m_FixedCache, &m_MovingCache );
+        }
+        catch( std::exception& e )
+        {
+            std::string message = e.what();
+            for ( std::string::size_type i=0; i<message.size(); i++ )
+                if ( message[i]=='\n' || message[i]=='\r' )
+                    message[i] = ' ';
+            return "ERROR " + message;
+        }
+        clock.Stop();
+
+        std::ostringstream response;
+        response << "OK "  << clock.GetTotal()
+                 << " \"" << param.outputImagePath             << "\""
+                 << " \"" << param.outputTransformPath         << "\""
+                 << " \"" << param.outputDisplacementFieldPath << "\"";
+        return response.str();
+    }
+
+    ImageCache< TFixedImage >   m_FixedCache;
+    ImageCache< TMovingImage >  m_MovingCache;
+
+};
+
+
+
+#ifndef _WIN32
+/**
+ * Serves the clients of a local UNIX socket, one after the other.
+ * @param  path    path of the socket
+ * @param  server  registration server
+ */
+template< class TFixedImage, class TMovingImage >
+void serveUnixSocket(const std::string & path, RegistrationServer< TFixedImage, TMovingImage > & server)
+{
+    typedef RegistrationServer< TFixedImage, TMovingImage > ServerType;
+
+    struct sockaddr_un address;
+    std::memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    if ( path.size()>=sizeof(address.sun_path) )
+        throw std::runtime_error( "The socket path is too long." );
+    std::strncpy( address.sun_path, path.c_str(), sizeof(address.sun_path)-1 );
+
+    int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( listener<0 )
+        throw std::runtime_error( "Could not create the socket." );
+
+    // A closed client must not kill the server
+    signal( SIGPIPE, SIG_IGN );
+
+    unlink( path.c_str() );
+    if ( bind( listener, reinterpret_cast<struct sockaddr *>( &address ), sizeof(address) )<0  ||  listen( listener, 8 )<0 )
+    {
+        close( listener );
+        throw std::runtime_error( "Could not listen on the socket " + path + "." );
+    }
+    std::cout << "Listening on " << path << std::endl;
+
+    bool shutdown = false;
+    while ( !shutdown )
     {
-        std::cerr << "Error: Only images of dimension 3 are supported yet." << std::endl;
+        int client = accept( listener, NULL, NULL );
+        if ( client<0 )
+            continue;
+
+        std::string pending;
+        char buffer[4096];
+        bool quit = false;
+        while ( !quit )
+        {
+            ssize_t length = recv( client, buffer, sizeof(buffer), 0 );
+            if ( length<=0 )
+                break;
+            pending.append( buffer, length );
+
+            std::string::size_type end;
+            while ( !quit && ( end = pending.find( '\n' ) )!=std::string::npos )
+            {
+                std::string line = pending.substr( 0, end );
+                pending.erase( 0, end+1 );
+
+                std::string response;
+                typename ServerType::LineAction action = server.HandleLine( line, response );
+                if ( !response.empty() )
+                {
+                    response += '\n';
+                    if ( send( client, response.c_str(), response.size(), 0 )<0 )
+                        quit = true;
+                }
+                if ( action==ServerType::SHUTDOWN )
+                    shutdown = true;
+                if ( action!=ServerType::CONTINUE )
+                    quit = true;
+            }
+        }
+        close( client );
+    }
+
+    close( listener );
+    unlink( path.c_str() );
+}
+#endif
+
+
+
+/**
+ * Starts the registration server.
+ * @param   param  parameters of the server
+ * @return  EXIT_SUCCESS if the server stopped normally, EXIT_FAILURE otherwise
+ */
+template< class TFixedImage, class TMovingImage >
+int StartServer(struct ServerParam param)
+{
+    // The threads are shared by the jobs
+    if ( param.numberOfThreads>0 )
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads( param.numberOfThreads );
+
+    RegistrationServer< TFixedImage, TMovingImage > server( param.cacheSize );
+    try
+    {
+        if ( param.endpoint.compare( "-" )==0 )
+            server.Serve( std::cin, std::cout );
+        else
+        {
+#ifndef _WIN32
+            serveUnixSocket< TFixedImage, TMovingImage >( param.endpoint, server );
+#else
+            throw std::runtime_error( "UNIX sockets are not supported on this platform, use \"--server -\"." );
+#endif
+        }
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
         return EXIT_FAILURE;
     }
 
+    return EXIT_SUCCESS;
+}
 
-    // Only scalar images are supported yet
-    if (  fixed_imageIO->GetPixelType() != itk::ImageIOBase::SCALAR  ||  moving_imageIO->GetPixelType() != itk::ImageIOBase::SCALAR  )
+
+
+/**
+ * Main function.
+ */
+int main(int argc, char** argv)
+{
+   // itk::MultiThreader::SetGlobalDefaultNumberOfThreads(1);
+    // Server mode
+    if ( isServerMode( argc, argv ) )
     {
-        std::cerr << "Error: Only scalar images are supported yet." << std::endl;
+        struct ServerParam serverParam;
+        try
+        {
+            parseServerParameters( argc, argv, serverParam );
+        }
+        catch( std::exception& e )
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return StartServer< itk::Image<double,3> , itk::Image<double,3> >( serverParam );
+    }
+
+    // Parse parameters and check the images
+    struct Param param;
+    try
+    {
+        parseParameters( argc, argv, param);
+        if ( param.batchListPath.empty() )
+            checkImageInformation( param );
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
         return EXIT_FAILURE;
     }
 
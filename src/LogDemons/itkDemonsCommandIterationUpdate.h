@@ -5,6 +5,7 @@
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
 #include <itkMinimumMaximumImageCalculator.h>
+#include <itkSimpleFastMutexLock.h>
 #include <itkTransformFileReader.h>
 #include <itkTransformToVelocityFieldSource.h>
 #include <itkVectorCentralDifferenceImageFunction.h>
@@ -12,11 +13,20 @@
 #include <itkWarpHarmonicEnergyCalculator.h>
 #include <itkWarpImageFilter.h>
 
+#include <vnl/vnl_det.h>
+
 #include <metaCommand.h>
 
+#include "itkExponentialDeformationFieldImageFilter2.h"
+#include "itkTaskGroup.h"
+
 #include <errno.h>
+#include <fstream>
 #include <iostream>
 #include <limits.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 
 template <class DeformableRegistrationType, class MultiResolutionRegistrationFilterType,class TPixel=float, unsigned int VImageDimension=3>
@@ -59,18 +69,69 @@ public:
      DeformationFieldType>                                WarpGradientCalculatorType;
 
   typedef typename WarpGradientCalculatorType::OutputType WarpGradientType;
+
+  typedef itk::ExponentialDeformationFieldImageFilter<
+     VelocityFieldType, DeformationFieldType>             FieldExponentiatorType;
    
   itkNewMacro( Self );
 
+  /** Number of iterations between two evaluations of the diagnostics
+   * (default 1: every iteration). */
+  itkSetClampMacro( DiagnosticsInterval, unsigned int, 1, itk::NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( DiagnosticsInterval, unsigned int );
+
+  /** The Jacobian statistics, the harmonic energy and the distances to the
+   * true field are computed on one voxel out of Subsampling along each axis
+   * (default 1: all the voxels, with the exact Jacobian filter). */
+  itkSetClampMacro( Subsampling, unsigned int, 1, itk::NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( Subsampling, unsigned int );
+
+  /** Use quantiles of a histogram of the Jacobian instead of the exact
+   * quantiles (one pass instead of four partial sorts). */
+  itkSetMacro( ApproximateQuantiles, bool );
+  itkGetConstMacro( ApproximateQuantiles, bool );
+  itkBooleanMacro( ApproximateQuantiles );
+
+  /** Evaluate the diagnostics on a copy of the velocity field in a
+   * background thread. An iteration whose diagnostics would have to wait
+   * for the previous ones is skipped, so that the optimizer never waits.
+   * Observe also the EndEvent of the registration filter: the last
+   * evaluation of each level is then joined when the level ends. */
+  itkSetMacro( Asynchronous, bool );
+  itkGetConstMacro( Asynchronous, bool );
+  itkBooleanMacro( Asynchronous );
+
+  /** Path of the csv file receiving the diagnostics (default
+   * "metricvalues.csv", empty: no file). The file is created by the first
+   * diagnostics, so the path must be set before the registration starts.
+   * Observers of registrations running at the same time need different
+   * paths. */
+  itkSetMacro( FileName, std::string );
+  itkGetConstMacro( FileName, std::string );
+
+  /** Number of diagnostics skipped because the previous ones were running. */
+  itkGetConstMacro( NumberOfSkippedEvaluations, unsigned int );
+
+
+  /** Statistics of a deformation field and, if a true field is given, its
+   * distances to the true field. */
+  struct FieldMetrics
+    {
+    double FieldDistance;          // RMS of |field - true field| (-1 without true field)
+    double FieldGradientDistance;  // RMS of the Frobenius norm of the Jacobian differences (-1 without true field)
+    double HarmonicEnergy;
+    double MinJacobian;
+    double Q002;
+    double Q01;
+    double Q99;
+    double Q998;
+    double MaxJacobian;
+    double JacobianBelowZero;      // fraction of the voxels with |Jac|<=0
+    };
 
   void SetTrueField( const DeformationFieldType * truefield)
     {
     m_TrueField = truefield;
-
-    m_TrueWarpGradientCalculator = WarpGradientCalculatorType::New();
-    m_TrueWarpGradientCalculator->SetInputImage( m_TrueField );
-    
-    m_CompWarpGradientCalculator =  WarpGradientCalculatorType::New();
     }
    
   void Execute(itk::Object *caller, const itk::EventObject & event)
@@ -80,6 +141,14 @@ public:
 
   void Execute(const itk::Object * object, const itk::EventObject & event)
     { 
+    // The diagnostics running in the background are joined at the end of
+    // each level, so that they are reported before the next level starts
+    if ( itk::EndEvent().CheckEvent( &event ) )
+      {
+      this->Wait();
+      return;
+      }
+
       if( !(itk::IterationEvent().CheckEvent( &event )) )
       {
       return;
@@ -93,15 +162,27 @@ public:
          dynamic_cast< const LogDomainDeformableRegistrationFilterType * >( object ) )
       {
       iter = filter->GetElapsedIterations() - 1;
+      if ( iter % m_DiagnosticsInterval != 0 )
+        {
+        return;
+        }
       metricbefore = filter->GetMetric();
+      if ( m_Asynchronous )
+        {
+        this->StartEvaluation( const_cast<LogDomainDeformableRegistrationFilterType *>
+                               (filter)->GetVelocityField(), iter, metricbefore );
+        return;
+        }
       deffield = const_cast<LogDomainDeformableRegistrationFilterType *>
         (filter)->GetDeformationField();
       }
     else if ( const MultiResRegistrationFilterType * multiresfilter = 
               dynamic_cast< const MultiResRegistrationFilterType * >( object ) )
       {
+      m_ReportLock.Lock();
       std::cout<<"Finished Multi-resolution iteration :"<<multiresfilter->GetCurrentLevel()-1<<std::endl;
       std::cout<<"=============================="<<std::endl<<std::endl;
+      m_ReportLock.Unlock();
       }
     else
       {
@@ -110,182 +191,453 @@ public:
 
     if (deffield)
       {
-      std::cout<<iter<<": Metric "<<metricbefore<<" - ";
-  
-      double fieldDist = -1.0;
-      double fieldGradDist = -1.0;
-      double tmp;
-      if (m_TrueField)
+      const FieldMetrics metrics = ComputeFieldMetrics( deffield, m_TrueField,
+                                                        m_Subsampling, m_ApproximateQuantiles );
+      this->Report( iter, metricbefore, metrics );
+      }
+    }
+
+  /** Waits for the diagnostics running in the background thread, if any. */
+  void Wait()
+    {
+    m_Evaluation.Wait();
+    }
+
+  /** Prints the diagnostics of an iteration and writes them in the csv
+   * file. Called by the registration thread or the background thread. */
+  void Report( unsigned int iter, double metricbefore, const FieldMetrics & metrics )
+    {
+    m_ReportLock.Lock();
+
+    std::cout<<iter<<": Metric "<<metricbefore<<" - ";
+
+    if (m_TrueField)
+      {
+      std::cout<<"d(.,true) "<<metrics.FieldDistance<<" - ";
+      std::cout<<"d(.,Jac(true)) "<<metrics.FieldGradientDistance<<" - ";
+      }
+
+    std::cout<<"harmo. "<<metrics.HarmonicEnergy<<" - ";
+
+    std::cout<<"max|Jac| "<<metrics.MaxJacobian<<" - "
+             <<"min|Jac| "<<metrics.MinJacobian<<" - "
+             <<"ratio(|Jac|<=0) "<<metrics.JacobianBelowZero<<std::endl;
+    
+    
+    if ( !m_headerwritten && !this->m_Fid.is_open() && !m_FileName.empty() )
+      {
+      this->m_Fid.open( m_FileName.c_str() );
+      }
+
+    if (this->m_Fid.is_open())
+      {
+      if (! m_headerwritten)
         {
-        typedef itk::ImageRegionConstIteratorWithIndex<DeformationFieldType>
-           FieldIteratorType;
-        FieldIteratorType currIter(
-           deffield, deffield->GetLargestPossibleRegion() );
-        FieldIteratorType trueIter(
-           m_TrueField, deffield->GetLargestPossibleRegion() );
+        this->m_Fid<<"Iteration"
+                   <<", MSE before"
+                   <<", Harmonic energy"
+                   <<", min|Jac|"
+                   <<", 0.2% |Jac|"
+                   <<", 01% |Jac|"
+                   <<", 99% |Jac|"
+                   <<", 99.8% |Jac|"
+                   <<", max|Jac|"
+                   <<", ratio(|Jac|<=0)";
         
-        m_CompWarpGradientCalculator->SetInputImage( deffield );
-        
-        fieldDist = 0.0;
-        fieldGradDist = 0.0;
-        for ( currIter.GoToBegin(), trueIter.GoToBegin();
-              ! currIter.IsAtEnd(); ++currIter, ++trueIter )
+        if (m_TrueField)
           {
-          fieldDist += (currIter.Value() - trueIter.Value()).GetSquaredNorm();
-  
-          // No need to add Id matrix here as we do a substraction
-          tmp = (
-             ( m_CompWarpGradientCalculator->EvaluateAtIndex(currIter.GetIndex())
-               -m_TrueWarpGradientCalculator->EvaluateAtIndex(trueIter.GetIndex())
-                ).GetVnlMatrix() ).frobenius_norm();
-          fieldGradDist += tmp*tmp;
+          this->m_Fid<<", dist(warp,true warp)"
+                     <<", dist(Jac,true Jac)";
           }
-        fieldDist = sqrt( fieldDist/ (double)(
-                             deffield->GetLargestPossibleRegion().GetNumberOfPixels()) );
-        fieldGradDist = sqrt( fieldGradDist/ (double)(
-                                 deffield->GetLargestPossibleRegion().GetNumberOfPixels()) );
+              
+        this->m_Fid<<std::endl;
         
-        std::cout<<"d(.,true) "<<fieldDist<<" - ";
-        std::cout<<"d(.,Jac(true)) "<<fieldGradDist<<" - ";
+        m_headerwritten = true;
         }
-          
-      m_HarmonicEnergyCalculator->SetImage( deffield );
-      m_HarmonicEnergyCalculator->Compute();
-      const double harmonicEnergy
-         = m_HarmonicEnergyCalculator->GetHarmonicEnergy();
-      std::cout<<"harmo. "<<harmonicEnergy<<" - ";
-      
-      
-      m_JacobianFilter->SetInput( deffield );
-      m_JacobianFilter->UpdateLargestPossibleRegion();
-      
-      
-      const unsigned int numPix = m_JacobianFilter->
-         GetOutput()->GetLargestPossibleRegion().GetNumberOfPixels();
+           
+      this->m_Fid<<iter
+                 <<", "<<metricbefore
+                 <<", "<<metrics.HarmonicEnergy
+                 <<", "<<metrics.MinJacobian
+                 <<", "<<metrics.Q002
+                 <<", "<<metrics.Q01
+                 <<", "<<metrics.Q99
+                 <<", "<<metrics.Q998
+                 <<", "<<metrics.MaxJacobian
+                 <<", "<<metrics.JacobianBelowZero;
       
-      TPixel* pix_start = m_JacobianFilter->GetOutput()->GetBufferPointer();
-      TPixel* pix_end = pix_start + numPix;
-      
-      TPixel* jac_ptr;
-      
-      // Get percentage of det(Jac) below 0
-      unsigned int jacBelowZero(0u);
-      for (jac_ptr=pix_start; jac_ptr!=pix_end; ++jac_ptr)
+      if (m_TrueField)
         {
-        if ( *jac_ptr<=0.0 ) ++jacBelowZero;
+        this->m_Fid<<", "<<metrics.FieldDistance
+                   <<", "<<metrics.FieldGradientDistance;
         }
-      const double jacBelowZeroPrc = static_cast<double>(jacBelowZero)
-         / static_cast<double>(numPix);
-      
-      
-      // Get min an max jac
-      const double minJac = *(std::min_element (pix_start, pix_end));
-      const double maxJac = *(std::max_element (pix_start, pix_end));
-      
-      // Get some quantiles
-      // We don't need the jacobian image
-      // we can modify/sort it in place
-      jac_ptr = pix_start + static_cast<unsigned int>(0.002*numPix);
-      std::nth_element(pix_start, jac_ptr, pix_end);
-      const double Q002 = *jac_ptr;
-  
-      jac_ptr = pix_start + static_cast<unsigned int>(0.01*numPix);
-      std::nth_element(pix_start, jac_ptr, pix_end);
-      const double Q01 = *jac_ptr;
-      
-      jac_ptr = pix_start + static_cast<unsigned int>(0.99*numPix);
-      std::nth_element(pix_start, jac_ptr, pix_end);
-      const double Q99 = *jac_ptr;
-      
-      jac_ptr = pix_start + static_cast<unsigned int>(0.998*numPix);
-      std::nth_element(pix_start, jac_ptr, pix_end);
-      const double Q998 = *jac_ptr;
-      
-      
-      std::cout<<"max|Jac| "<<maxJac<<" - "
-               <<"min|Jac| "<<minJac<<" - "
-               <<"ratio(|Jac|<=0) "<<jacBelowZeroPrc<<std::endl;
       
+      this->m_Fid<<std::endl;
+      }
+
+    m_ReportLock.Unlock();
+    }
+
+
+  /** Computes the statistics of a deformation field and its distances to
+   * the true field, if not NULL. Also used to validate final fields outside
+   * of the iterations. With a subsampling above 1, the statistics are
+   * computed on one voxel out of subsampling along each axis, from central
+   * differences of the field. With approximateQuantiles, the quantiles of
+   * the Jacobian are read from a histogram. */
+  static FieldMetrics ComputeFieldMetrics( const DeformationFieldType * deffield,
+                                           const DeformationFieldType * truefield,
+                                           unsigned int subsampling = 1,
+                                           bool approximateQuantiles = false,
+                                           int numberOfThreads = 0 )
+    {
+    if ( subsampling > 1 )
+      {
+      return ComputeSubsampledFieldMetrics( deffield, truefield, subsampling, approximateQuantiles );
+      }
+
+    FieldMetrics metrics;
+    metrics.FieldDistance = -1.0;
+    metrics.FieldGradientDistance = -1.0;
+
+    double tmp;
+    if (truefield)
+      {
+      typedef itk::ImageRegionConstIteratorWithIndex<DeformationFieldType>
+         FieldIteratorType;
+      FieldIteratorType currIter(
+         deffield, deffield->GetLargestPossibleRegion() );
+      FieldIteratorType trueIter(
+         truefield, deffield->GetLargestPossibleRegion() );
+
+      typename WarpGradientCalculatorType::Pointer trueWarpGradientCalculator = WarpGradientCalculatorType::New();
+      trueWarpGradientCalculator->SetInputImage( truefield );
+      typename WarpGradientCalculatorType::Pointer compWarpGradientCalculator = WarpGradientCalculatorType::New();
+      compWarpGradientCalculator->SetInputImage( deffield );
       
-      if (this->m_Fid.is_open())
+      double fieldDist = 0.0;
+      double fieldGradDist = 0.0;
+      for ( currIter.GoToBegin(), trueIter.GoToBegin();
+            ! currIter.IsAtEnd(); ++currIter, ++trueIter )
         {
-        if (! m_headerwritten)
+        fieldDist += (currIter.Value() - trueIter.Value()).GetSquaredNorm();
+
+        // No need to add Id matrix here as we do a substraction
+        tmp = (
+           ( compWarpGradientCalculator->EvaluateAtIndex(currIter.GetIndex())
+             -trueWarpGradientCalculator->EvaluateAtIndex(trueIter.GetIndex())
+              ).GetVnlMatrix() ).frobenius_norm();
+        fieldGradDist += tmp*tmp;
+        }
+      metrics.FieldDistance = sqrt( fieldDist/ (double)(
+                           deffield->GetLargestPossibleRegion().GetNumberOfPixels()) );
+      metrics.FieldGradientDistance = sqrt( fieldGradDist/ (double)(
+                               deffield->GetLargestPossibleRegion().GetNumberOfPixels()) );
+      }
+
+    typename HarmonicEnergyCalculatorType::Pointer harmonicEnergyCalculator = HarmonicEnergyCalculatorType::New();
+    harmonicEnergyCalculator->SetImage( deffield );
+    harmonicEnergyCalculator->Compute();
+    metrics.HarmonicEnergy = harmonicEnergyCalculator->GetHarmonicEnergy();
+    
+    typename JacobianFilterType::Pointer jacobianFilter = JacobianFilterType::New();
+    jacobianFilter->SetUseImageSpacing( true );
+    jacobianFilter->SetInput( deffield );
+    if ( numberOfThreads > 0 )
+      {
+      jacobianFilter->SetNumberOfThreads( numberOfThreads );
+      }
+    jacobianFilter->UpdateLargestPossibleRegion();
+    
+    const unsigned int numPix = jacobianFilter->
+       GetOutput()->GetLargestPossibleRegion().GetNumberOfPixels();
+    
+    // We don't need the jacobian image
+    // we can modify/sort it in place
+    TPixel* pix_start = jacobianFilter->GetOutput()->GetBufferPointer();
+    ComputeJacobianStatistics( pix_start, pix_start + numPix, approximateQuantiles, metrics );
+
+    return metrics;
+    }
+
+  /** Computes the field metrics on one voxel out of subsampling along each
+   * axis. The gradients are central differences, as for the distance of
+   * the Jacobians to the true field. */
+  static FieldMetrics ComputeSubsampledFieldMetrics( const DeformationFieldType * deffield,
+                                                     const DeformationFieldType * truefield,
+                                                     unsigned int subsampling,
+                                                     bool approximateQuantiles )
+    {
+    FieldMetrics metrics;
+    metrics.FieldDistance = -1.0;
+    metrics.FieldGradientDistance = -1.0;
+
+    typename WarpGradientCalculatorType::Pointer compWarpGradientCalculator = WarpGradientCalculatorType::New();
+    compWarpGradientCalculator->SetInputImage( deffield );
+    typename WarpGradientCalculatorType::Pointer trueWarpGradientCalculator = WarpGradientCalculatorType::New();
+    if (truefield)
+      {
+      trueWarpGradientCalculator->SetInputImage( truefield );
+      }
+
+    const typename DeformationFieldType::RegionType region = deffield->GetLargestPossibleRegion();
+    const typename DeformationFieldType::IndexType  start  = region.GetIndex();
+    const typename DeformationFieldType::SizeType   size   = region.GetSize();
+    typename DeformationFieldType::IndexType        index  = start;
+
+    std::vector<TPixel> jacobians;
+    double fieldDist = 0.0;
+    double fieldGradDist = 0.0;
+    double energy = 0.0;
+    double tmp;
+
+    while ( true )
+      {
+      const WarpGradientType gradient = compWarpGradientCalculator->EvaluateAtIndex( index );
+
+      tmp = gradient.GetVnlMatrix().frobenius_norm();
+      energy += tmp*tmp;
+
+      vnl_matrix_fixed<double,VImageDimension,VImageDimension> jacobian;
+      for ( unsigned int i=0; i<VImageDimension; i++ )
+        {
+        for ( unsigned int j=0; j<VImageDimension; j++ )
           {
-          this->m_Fid<<"Iteration"
-                     <<", MSE before"
-                     <<", Harmonic energy"
-                     <<", min|Jac|"
-                     <<", 0.2% |Jac|"
-                     <<", 01% |Jac|"
-                     <<", 99% |Jac|"
-                     <<", 99.8% |Jac|"
-                     <<", max|Jac|"
-                     <<", ratio(|Jac|<=0)";
-          
-          if (m_TrueField)
-            {
-            this->m_Fid<<", dist(warp,true warp)"
-                       <<", dist(Jac,true Jac)";
-            }
-                
-          this->m_Fid<<std::endl;
-          
-          m_headerwritten = true;
+          jacobian(i,j) = gradient(i,j) + ( i==j ? 1.0 : 0.0 );
           }
-             
-        this->m_Fid<<iter
-                   <<", "<<metricbefore
-                   <<", "<<harmonicEnergy
-                   <<", "<<minJac
-                   <<", "<<Q002
-                   <<", "<<Q01
-                   <<", "<<Q99
-                   <<", "<<Q998
-                   <<", "<<maxJac
-                   <<", "<<jacBelowZeroPrc;
-        
-        if (m_TrueField)
+        }
+      jacobians.push_back( static_cast<TPixel>( vnl_det( jacobian ) ) );
+
+      if (truefield)
+        {
+        fieldDist += (deffield->GetPixel(index) - truefield->GetPixel(index)).GetSquaredNorm();
+        tmp = ( ( gradient - trueWarpGradientCalculator->EvaluateAtIndex(index) ).GetVnlMatrix() ).frobenius_norm();
+        fieldGradDist += tmp*tmp;
+        }
+
+      // Next sampled voxel
+      unsigned int d = 0;
+      for ( ; d<VImageDimension; d++ )
+        {
+        index[d] += subsampling;
+        if ( index[d] < start[d] + static_cast<typename DeformationFieldType::IndexValueType>( size[d] ) )
           {
-          this->m_Fid<<", "<<fieldDist
-                     <<", "<<fieldGradDist;
+          break;
           }
-        
-        this->m_Fid<<std::endl;
+        index[d] = start[d];
+        }
+      if ( d == VImageDimension )
+        {
+        break;
+        }
+      }
+
+    const double numberOfSamples = static_cast<double>( jacobians.size() );
+    metrics.HarmonicEnergy = energy / numberOfSamples;
+    if (truefield)
+      {
+      metrics.FieldDistance = sqrt( fieldDist / numberOfSamples );
+      metrics.FieldGradientDistance = sqrt( fieldGradDist / numberOfSamples );
+      }
+
+    ComputeJacobianStatistics( &jacobians[0], &jacobians[0] + jacobians.size(), approximateQuantiles, metrics );
+
+    return metrics;
+    }
+
+  /** Computes the extrema, the quantiles and the fraction of non positive
+   * values of the Jacobian. The values may be reordered. */
+  static void ComputeJacobianStatistics( TPixel * pix_start, TPixel * pix_end,
+                                         bool approximateQuantiles, FieldMetrics & metrics )
+    {
+    const unsigned int numPix = pix_end - pix_start;
+    TPixel* jac_ptr;
+
+    // Get percentage of det(Jac) below 0
+    unsigned int jacBelowZero(0u);
+    for (jac_ptr=pix_start; jac_ptr!=pix_end; ++jac_ptr)
+      {
+      if ( *jac_ptr<=0.0 ) ++jacBelowZero;
+      }
+    metrics.JacobianBelowZero = static_cast<double>(jacBelowZero)
+       / static_cast<double>(numPix);
+    
+    // Get min an max jac
+    metrics.MinJacobian = *(std::min_element (pix_start, pix_end));
+    metrics.MaxJacobian = *(std::max_element (pix_start, pix_end));
+
+    if ( approximateQuantiles )
+      {
+      // One pass to build a histogram between min and max, the quantiles
+      // are interpolated within their bin
+      const unsigned int numBins = 4096;
+      const double binWidth = ( metrics.MaxJacobian - metrics.MinJacobian ) / numBins;
+      if ( binWidth <= 0.0 )
+        {
+        metrics.Q002 = metrics.Q01 = metrics.Q99 = metrics.Q998 = metrics.MinJacobian;
+        return;
         }
+
+      std::vector<unsigned int> histogram( numBins, 0u );
+      for (jac_ptr=pix_start; jac_ptr!=pix_end; ++jac_ptr)
+        {
+        const unsigned int bin = static_cast<unsigned int>( ( *jac_ptr - metrics.MinJacobian ) / binWidth );
+        ++histogram[ std::min( bin, numBins-1 ) ];
+        }
+
+      metrics.Q002 = HistogramQuantile( histogram, 0.002*numPix, metrics.MinJacobian, binWidth );
+      metrics.Q01  = HistogramQuantile( histogram, 0.01*numPix,  metrics.MinJacobian, binWidth );
+      metrics.Q99  = HistogramQuantile( histogram, 0.99*numPix,  metrics.MinJacobian, binWidth );
+      metrics.Q998 = HistogramQuantile( histogram, 0.998*numPix, metrics.MinJacobian, binWidth );
+      return;
       }
+
+    // Get some quantiles
+    jac_ptr = pix_start + static_cast<unsigned int>(0.002*numPix);
+    std::nth_element(pix_start, jac_ptr, pix_end);
+    metrics.Q002 = *jac_ptr;
+
+    jac_ptr = pix_start + static_cast<unsigned int>(0.01*numPix);
+    std::nth_element(pix_start, jac_ptr, pix_end);
+    metrics.Q01 = *jac_ptr;
+    
+    jac_ptr = pix_start + static_cast<unsigned int>(0.99*numPix);
+    std::nth_element(pix_start, jac_ptr, pix_end);
+    metrics.Q99 = *jac_ptr;
+    
+    jac_ptr = pix_start + static_cast<unsigned int>(0.998*numPix);
+    std::nth_element(pix_start, jac_ptr, pix_end);
+    metrics.Q998 = *jac_ptr;
     }
    
 protected:   
   DemonsCommandIterationUpdate() :
-    m_Fid( "metricvalues.csv" ),
+    m_FileName( "metricvalues.csv" ),
     m_headerwritten(false)
     {
-    m_JacobianFilter = JacobianFilterType::New();
-    m_JacobianFilter->SetUseImageSpacing( true );
-    m_JacobianFilter->ReleaseDataFlagOn();
-    
-    m_Minmaxfilter = MinMaxFilterType::New();
-    
-    m_HarmonicEnergyCalculator = HarmonicEnergyCalculatorType::New();
-    
     m_TrueField = 0;
-    m_TrueWarpGradientCalculator = 0;
-    m_CompWarpGradientCalculator = 0;
+    m_DiagnosticsInterval = 1;
+    m_Subsampling = 1;
+    m_ApproximateQuantiles = false;
+    m_Asynchronous = false;
+    m_NumberOfSkippedEvaluations = 0;
+    m_Running = false;
+    m_SnapshotIteration = 0;
+    m_SnapshotMetric = 0.0;
     };
 
   ~DemonsCommandIterationUpdate()
     {
+    this->Wait();
     this->m_Fid.close();
     }
 
+  /** Value of the histogram quantile of rank position, interpolated within its bin. */
+  static double HistogramQuantile( const std::vector<unsigned int> & histogram, double position,
+                                   double minimum, double binWidth )
+    {
+    double cumulated = 0.0;
+    for ( unsigned int bin=0; bin<histogram.size(); bin++ )
+      {
+      if ( cumulated + histogram[bin] > position )
+        {
+        return minimum + binWidth * ( bin + ( position - cumulated ) / histogram[bin] );
+        }
+      cumulated += histogram[bin];
+      }
+    return minimum + binWidth * histogram.size();
+    }
+
+  /** Copies the velocity field and evaluates the diagnostics of the copy in
+   * the background thread, unless the previous evaluation is still running. */
+  void StartEvaluation( const VelocityFieldType * velocity, unsigned int iter, double metricbefore )
+    {
+    m_Lock.Lock();
+    const bool running = m_Running;
+    m_Lock.Unlock();
+    if ( running )
+      {
+      ++m_NumberOfSkippedEvaluations;
+      return;
+      }
+    this->Wait();
+
+    // The snapshot buffer is reused until the size of the field changes
+    if ( !m_Snapshot ||
+         m_Snapshot->GetLargestPossibleRegion() != velocity->GetLargestPossibleRegion() )
+      {
+      m_Snapshot = VelocityFieldType::New();
+      m_Snapshot->CopyInformation( velocity );
+      m_Snapshot->SetRegions( velocity->GetLargestPossibleRegion() );
+      m_Snapshot->Allocate();
+      }
+    else
+      {
+      m_Snapshot->CopyInformation( velocity );
+      }
+    std::copy( velocity->GetBufferPointer(),
+               velocity->GetBufferPointer() + velocity->GetLargestPossibleRegion().GetNumberOfPixels(),
+               m_Snapshot->GetBufferPointer() );
+    m_Snapshot->Modified();
+
+    m_SnapshotIteration = iter;
+    m_SnapshotMetric    = metricbefore;
+    m_Running           = true;
+    m_Evaluation.Run( EvaluationTask, this );
+    }
+
+  /** Evaluates the diagnostics of the snapshot on a single thread. */
+  void EvaluateSnapshot()
+    {
+    try
+      {
+      if ( !m_Exponentiator )
+        {
+        m_Exponentiator = FieldExponentiatorType::New();
+        m_Exponentiator->ComputeInverseOff();
+        m_Exponentiator->SetNumberOfThreads( 1 );
+        }
+      m_Exponentiator->SetInput( m_Snapshot );
+      m_Exponentiator->UpdateLargestPossibleRegion();
+
+      const FieldMetrics metrics = ComputeFieldMetrics( m_Exponentiator->GetOutput(), m_TrueField,
+                                                        m_Subsampling, m_ApproximateQuantiles, 1 );
+      this->Report( m_SnapshotIteration, m_SnapshotMetric, metrics );
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      std::cerr << err << std::endl;
+      }
+
+    m_Lock.Lock();
+    m_Running = false;
+    m_Lock.Unlock();
+    }
+
+  static void EvaluationTask( void * data )
+    {
+    static_cast<Self *>( data )->EvaluateSnapshot();
+    }
+
 private:
+  std::string m_FileName;
   std::ofstream m_Fid;
   bool m_headerwritten;
-  typename JacobianFilterType::Pointer m_JacobianFilter;
-  typename MinMaxFilterType::Pointer m_Minmaxfilter;
-  typename HarmonicEnergyCalculatorType::Pointer m_HarmonicEnergyCalculator;
   typename DeformationFieldType::ConstPointer m_TrueField;
-  typename WarpGradientCalculatorType::Pointer m_TrueWarpGradientCalculator;
-  typename WarpGradientCalculatorType::Pointer m_CompWarpGradientCalculator;
-};
 
+  unsigned int m_DiagnosticsInterval;
+  unsigned int m_Subsampling;
+  bool m_ApproximateQuantiles;
+  bool m_Asynchronous;
+  unsigned int m_NumberOfSkippedEvaluations;
+
+  // Background evaluation
+  itk::TaskGroup m_Evaluation;
+  itk::SimpleFastMutexLock m_Lock;
+  itk::SimpleFastMutexLock m_ReportLock;
+  bool m_Running;
+  typename VelocityFieldType::Pointer m_Snapshot;
+  typename FieldExponentiatorType::Pointer m_Exponentiator;
+  unsigned int m_SnapshotIteration;
+  double m_SnapshotMetric;
+};
@@ -67,6 +67,10 @@ DisplacementFieldCompositionFilter<TInputImage, TOutputImage>
     itkExceptionMacro(<< "Warper not set");
     }
 
+  // The internal filters run with the threads of this filter
+  m_Warper->SetNumberOfThreads( this->GetNumberOfThreads() );
+  m_Adder->SetNumberOfThreads( this->GetNumberOfThreads() );
+
   // Set up mini-pipeline
   m_Warper->SetInput( leftField );
 #if (ITK_VERSION_MAJOR < 4)
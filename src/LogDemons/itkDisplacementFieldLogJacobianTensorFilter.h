@@ -0,0 +1,145 @@
+#ifndef __itkDisplacementFieldLogJacobianTensorFilter_h
+#define __itkDisplacementFieldLogJacobianTensorFilter_h
+
+#include <itkImageToImageFilter.h>
+#include <itkVectorCentralDifferenceImageFunction.h>
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class DisplacementFieldLogJacobianTensorFilter
+ * \brief Compute the principal matrix logarithm of the Jacobian of a
+ * 3D displacement field at every voxel.
+ *
+ * Given a displacement field df representing the transformation
+ * f = Id + df, the Jacobian Jac(f)(p) = Id + Jac(df)(p) is estimated with
+ * central differences and its matrix logarithm is computed with the
+ * fixed-size kernels of vnl_sd_matrix_tools (inverse scaling and squaring
+ * followed by a Pade approximation). The result is a log-Jacobian tensor
+ * map suitable for tensor-based morphometry.
+ *
+ * The output pixel type must be a vector type with 9 components; the
+ * logarithm is stored row by row. Voxels where the Jacobian determinant is
+ * not positive have no real logarithm: they are set to zero and counted in
+ * NumberOfFoldedVoxels.
+ *
+ * Computations are done in double precision whatever the pixel types.
+ */
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT DisplacementFieldLogJacobianTensorFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef DisplacementFieldLogJacobianTensorFilter      Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef SmartPointer<Self>                            Pointer;
+  typedef SmartPointer<const Self>                      ConstPointer;
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                           InputFieldType;
+  typedef typename InputFieldType::PixelType    InputFieldPixelType;
+  typedef typename InputFieldType::Pointer      InputFieldPointer;
+  typedef typename InputFieldType::ConstPointer InputFieldConstPointer;
+
+  typedef TOutputImage                           OutputImageType;
+  typedef typename OutputImageType::PixelType    OutputPixelType;
+  typedef typename OutputImageType::Pointer      OutputImagePointer;
+  typedef typename OutputImageType::RegionType   OutputImageRegionType;
+  typedef typename OutputPixelType::ValueType    OutputValueType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( DisplacementFieldLogJacobianTensorFilter, ImageToImageFilter );
+
+  /** Gradient calculator type. */
+  typedef itk::VectorCentralDifferenceImageFunction<InputFieldType>
+  InputFieldGradientCalculatorType;
+
+  /** Gradient type. */
+  typedef typename InputFieldGradientCalculatorType::OutputType
+  InputFieldGradientType;
+
+  /** ImageDimension constants */
+  itkStaticConstMacro( InputFieldDimension, unsigned int,
+                       TInputImage::ImageDimension);
+  itkStaticConstMacro( OutputImageDimension, unsigned int,
+                       TOutputImage::ImageDimension);
+  itkStaticConstMacro( InputFieldPixelDimension, unsigned int,
+                       InputFieldPixelType::Dimension );
+  itkStaticConstMacro( OutputPixelDimension, unsigned int,
+                       OutputPixelType::Dimension );
+
+  /** Set/Get the precision of the square roots used to compute the
+   * logarithm (default: 1e-11). */
+  itkSetMacro( SquareRootPrecision, double );
+  itkGetConstMacro( SquareRootPrecision, double );
+
+  /** Set/Get the order of the Pade approximation of the logarithm
+   * (1, 2 or 3, default: 1). */
+  itkSetClampMacro( NumberOfPadeApproximationTerms, int, 1, 3 );
+  itkGetConstMacro( NumberOfPadeApproximationTerms, int );
+
+  /** Number of voxels with a non-positive Jacobian determinant found
+   * during the last update. */
+  itkGetConstMacro( NumberOfFoldedVoxels, unsigned long );
+
+  /** The central differences need a one voxel margin around the output
+   * requested region.
+   *
+   * \sa ImageToImageFilter::GenerateInputRequestedRegion() */
+  virtual void GenerateInputRequestedRegion()
+  throw (InvalidRequestedRegionError);
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(SameDimensionCheck1,
+                  (Concept::SameDimension<InputFieldDimension, OutputImageDimension> ) );
+  itkConceptMacro(SameDimensionCheck2,
+                  (Concept::SameDimension<InputFieldDimension, InputFieldPixelDimension> ) );
+  itkConceptMacro(ThreeDimensionCheck,
+                  (Concept::SameDimension<InputFieldDimension, 3> ) );
+  itkConceptMacro(NineComponentsCheck,
+                  (Concept::SameDimension<OutputPixelDimension, 9> ) );
+  /** End concept checking */
+#endif
+protected:
+  DisplacementFieldLogJacobianTensorFilter();
+  ~DisplacementFieldLogJacobianTensorFilter()
+  {
+  };
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  void BeforeThreadedGenerateData();
+
+  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread, ThreadIdType threadId );
+
+  void AfterThreadedGenerateData();
+
+private:
+  DisplacementFieldLogJacobianTensorFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                           // purposely not implemented
+
+  typename InputFieldGradientCalculatorType::Pointer m_GradientCalculator;
+
+  double m_SquareRootPrecision;
+  int    m_NumberOfPadeApproximationTerms;
+
+  unsigned long              m_NumberOfFoldedVoxels;
+  std::vector<unsigned long> m_ThreadNumberOfFoldedVoxels;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkDisplacementFieldLogJacobianTensorFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef __itkDisplacementFieldLogJacobianTensorFilter_txx
+#define __itkDisplacementFieldLogJacobianTensorFilter_txx
+#include "itkDisplacementFieldLogJacobianTensorFilter.h"
+
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkImageRegionIterator.h>
+#include <itkProgressReporter.h>
+
+#include "vnl_sd_matrix_tools.h"
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TInputImage, class TOutputImage>
+DisplacementFieldLogJacobianTensorFilter<TInputImage, TOutputImage>
+::DisplacementFieldLogJacobianTensorFilter()
+{
+  m_GradientCalculator = InputFieldGradientCalculatorType::New();
+
+  m_SquareRootPrecision = 1e-11;
+  m_NumberOfPadeApproximationTerms = 1;
+  m_NumberOfFoldedVoxels = 0;
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogJacobianTensorFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "SquareRootPrecision: " << m_SquareRootPrecision << std::endl;
+  os << indent << "NumberOfPadeApproximationTerms: " << m_NumberOfPadeApproximationTerms << std::endl;
+  os << indent << "NumberOfFoldedVoxels: " << m_NumberOfFoldedVoxels << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogJacobianTensorFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+throw (InvalidRequestedRegionError)
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  InputFieldPointer inputPtr = const_cast<InputFieldType *>( this->GetInput() );
+
+  if( !inputPtr )
+    {
+    return;
+    }
+
+  // Central differences have a radius of one
+  typename TInputImage::RegionType inputRequestedRegion = inputPtr->GetRequestedRegion();
+  inputRequestedRegion.PadByRadius( 1 );
+
+  // crop the input requested region at the input's largest possible region
+  if( inputRequestedRegion.Crop(inputPtr->GetLargestPossibleRegion() ) )
+    {
+    inputPtr->SetRequestedRegion( inputRequestedRegion );
+    }
+  else
+    {
+    // store what we tried to request (prior to trying to crop)
+    inputPtr->SetRequestedRegion( inputRequestedRegion );
+
+    // build an exception
+    InvalidRequestedRegionError e(__FILE__, __LINE__);
+    e.SetLocation(ITK_LOCATION);
+    e.SetDescription("Requested region is (at least partially) outside the largest possible region.");
+    e.SetDataObject(inputPtr);
+    throw e;
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogJacobianTensorFilter<TInputImage, TOutputImage>
+::BeforeThreadedGenerateData()
+{
+  m_GradientCalculator->SetInputImage( this->GetInput() );
+
+  m_ThreadNumberOfFoldedVoxels.assign( this->GetNumberOfThreads(), 0 );
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogJacobianTensorFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData( const OutputImageRegionType & outputRegionForThread,
+                        ThreadIdType threadId)
+{
+  typedef vnl_matrix_fixed<double, 3, 3> MatrixType;
+
+  InputFieldConstPointer inputPtr = this->GetInput();
+  OutputImagePointer     outputPtr = this->GetOutput();
+
+  ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels() );
+
+  typedef ImageRegionConstIteratorWithIndex<InputFieldType> InputFieldIteratorType;
+  typedef ImageRegionIterator<OutputImageType>              OutputImageIteratorType;
+  InputFieldIteratorType  inputIter(  inputPtr,  outputRegionForThread );
+  OutputImageIteratorType outputIter( outputPtr, outputRegionForThread );
+
+  InputFieldGradientType grad;
+  MatrixType             jac;
+  MatrixType             logjac;
+  unsigned long          numFolded = 0;
+
+  while( !inputIter.IsAtEnd() )
+    {
+    grad = m_GradientCalculator->EvaluateAtIndex( inputIter.GetIndex() );
+
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      for( unsigned int j = 0; j < 3; j++ )
+        {
+        jac(i, j) = grad(i, j);
+        }
+      jac(i, i) += 1.0;
+      }
+
+    OutputPixelType & outVal = outputIter.Value();
+    if( sdtools::GetDeterminant(jac) > 0.0 )
+      {
+      logjac = sdtools::GetLogarithm( jac, m_SquareRootPrecision, m_NumberOfPadeApproximationTerms );
+      for( unsigned int i = 0; i < 3; i++ )
+        {
+        for( unsigned int j = 0; j < 3; j++ )
+          {
+          outVal[3 * i + j] = static_cast<OutputValueType>( logjac(i, j) );
+          }
+        }
+      }
+    else
+      {
+      outVal.Fill( NumericTraits<OutputValueType>::Zero );
+      ++numFolded;
+      }
+
+    ++inputIter;
+    ++outputIter;
+    progress.CompletedPixel(); // potential exception thrown here
+    }
+
+  m_ThreadNumberOfFoldedVoxels[threadId] = numFolded;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementFieldLogJacobianTensorFilter<TInputImage, TOutputImage>
+::AfterThreadedGenerateData()
+{
+  m_NumberOfFoldedVoxels = 0;
+  for( unsigned int i = 0; i < m_ThreadNumberOfFoldedVoxels.size(); i++ )
+    {
+    m_NumberOfFoldedVoxels += m_ThreadNumberOfFoldedVoxels[i];
+    }
+}
+
+} // end namespace itk
+
+#endif
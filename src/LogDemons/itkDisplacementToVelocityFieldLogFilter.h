@@ -17,6 +17,11 @@ namespace itk
  * M. N. Bossa, S. Olmos Gasso."A new algorithm for the computation of the group
  * logarithm of diffeomorphisms". In Proc. MFCA 2008.
  *
+ * The iterations stop either after NumberOfIterations steps or as soon as the
+ * RMS norm of the update field delta_n = exp(-v_n) o Phi - Id falls below
+ * Tolerance. An IterationEvent is invoked after each step; observers can query
+ * GetCurrentRMSUpdate() and GetCurrentMaxUpdate() to monitor the residual.
+ *
  * \author Pierre Fillard, INRIA Paris
  */
 
@@ -36,6 +41,10 @@ public:
   typedef TInputImage  InputImageType;
   typedef TOutputImage OutputImageType;
 
+  /** Image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TOutputImage::ImageDimension);
+
   typedef VelocityFieldBCHCompositionFilter<OutputImageType, OutputImageType> BCHFilterType;
   typedef VelocityFieldExponentialComposedWithDisplacementFieldFilter<TOutputImage, TInputImage, TInputImage>
   ExponentialCompositionFilterType;
@@ -49,6 +58,18 @@ public:
 
   itkGetMacro(ElapsedIterations, unsigned int);
 
+  /**
+   *  Set/Get the tolerance on the RMS norm of the update field below which
+   *  the iterations are stopped (default: 0, i.e. always run
+   *  NumberOfIterations iterations).
+   */
+  itkSetMacro(Tolerance, double);
+  itkGetConstMacro(Tolerance, double);
+
+  /** Get the RMS and maximum norm of the last update field. */
+  itkGetConstMacro(CurrentRMSUpdate, double);
+  itkGetConstMacro(CurrentMaxUpdate, double);
+
   /**
    *  Set/Get the number of integration steps when computing the exponential
    *  of the velocity field (default: 500).
@@ -86,15 +107,16 @@ public:
 
   void SetSigma(double sigma)
   {
-    m_LeftSmootherX->SetSigma(sigma);
-    m_LeftSmootherY->SetSigma(sigma);
-    m_RightSmootherX->SetSigma(sigma);
-    m_RightSmootherY->SetSigma(sigma);
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      m_LeftSmoothers[d]->SetSigma(sigma);
+      m_RightSmoothers[d]->SetSigma(sigma);
+      }
   }
 
   double GetSigma(void) const
   {
-    return m_LeftSmootherX->GetSigma();
+    return m_LeftSmoothers[0]->GetSigma();
   }
 
 protected:
@@ -105,6 +127,13 @@ protected:
 
   void GenerateData(void);
 
+  /** Compute the RMS and maximum norm of the update field. */
+  void ComputeUpdateNorms(const InputImageType *update);
+
+  /** Chain the separable smoothers along every image direction. */
+  typename InputImageType::Pointer SmoothField(typename GaussianFilterType::Pointer *smoothers,
+                                               InputImageType *field);
+
 private:
   DisplacementToVelocityFieldLogFilter(const Self &);
   void operator=(const Self &);
@@ -112,12 +141,14 @@ private:
   unsigned int m_NumberOfIterations;
   unsigned int m_ElapsedIterations;
 
+  double m_Tolerance;
+  double m_CurrentRMSUpdate;
+  double m_CurrentMaxUpdate;
+
   typename ExponentialCompositionFilterType::Pointer m_ExpComp;
   typename BCHFilterType::Pointer m_BCHCalculator;
-  typename GaussianFilterType::Pointer m_LeftSmootherX;
-  typename GaussianFilterType::Pointer m_LeftSmootherY;
-  typename GaussianFilterType::Pointer m_RightSmootherX;
-  typename GaussianFilterType::Pointer m_RightSmootherY;
+  typename GaussianFilterType::Pointer m_LeftSmoothers[ImageDimension];
+  typename GaussianFilterType::Pointer m_RightSmoothers[ImageDimension];
 
   bool m_SmoothVelocityField;
 };
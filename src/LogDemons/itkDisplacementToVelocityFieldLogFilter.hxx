@@ -4,6 +4,7 @@
 #include "itkDisplacementToVelocityFieldLogFilter.h"
 
 #include "itkProgressReporter.h"
+#include "itkImageRegionConstIterator.h"
 
 #include "itkImage.h"
 #include "itkImageFileWriter.h"
@@ -17,37 +18,76 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
   m_NumberOfIterations  = 10;
   m_ElapsedIterations   = 0;
   m_SmoothVelocityField = false;
+  m_Tolerance           = 0.0;
+  m_CurrentRMSUpdate    = 0.0;
+  m_CurrentMaxUpdate    = 0.0;
   m_ExpComp       = ExponentialCompositionFilterType::New();
   m_BCHCalculator = BCHFilterType::New();
-  m_LeftSmootherX      = GaussianFilterType::New();
-  m_LeftSmootherY      = GaussianFilterType::New();
-  m_RightSmootherX     = GaussianFilterType::New();
-  m_RightSmootherY     = GaussianFilterType::New();
 
   m_ExpComp->ComputeInverseOn();
   m_ExpComp->SetNumberOfIntegrationSteps(500);
 
   m_BCHCalculator->SetNumberOfApproximationTerms(3);
 
-  m_LeftSmootherX->SetDirection(0);
-  m_LeftSmootherY->SetDirection(1);
-  m_RightSmootherX->SetDirection(0);
-  m_RightSmootherY->SetDirection(1);
-
-  m_LeftSmootherX->SetOrder(GaussianFilterType::ZeroOrder);
-  m_LeftSmootherY->SetOrder(GaussianFilterType::ZeroOrder);
-  m_RightSmootherX->SetOrder(GaussianFilterType::ZeroOrder);
-  m_RightSmootherY->SetOrder(GaussianFilterType::ZeroOrder);
-
-  m_LeftSmootherX->SetNormalizeAcrossScale(false);
-  m_LeftSmootherY->SetNormalizeAcrossScale(false);
-  m_RightSmootherX->SetNormalizeAcrossScale(false);
-  m_RightSmootherY->SetNormalizeAcrossScale(false);
-
-  m_LeftSmootherX->SetSigma(2.0);
-  m_LeftSmootherY->SetSigma(2.0);
-  m_RightSmootherX->SetSigma(2.0);
-  m_RightSmootherY->SetSigma(2.0);
+  // One separable smoother per image direction, chained in SmoothField()
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    m_LeftSmoothers[d]  = GaussianFilterType::New();
+    m_RightSmoothers[d] = GaussianFilterType::New();
+
+    m_LeftSmoothers[d]->SetDirection(d);
+    m_RightSmoothers[d]->SetDirection(d);
+
+    m_LeftSmoothers[d]->SetOrder(GaussianFilterType::ZeroOrder);
+    m_RightSmoothers[d]->SetOrder(GaussianFilterType::ZeroOrder);
+
+    m_LeftSmoothers[d]->SetNormalizeAcrossScale(false);
+    m_RightSmoothers[d]->SetNormalizeAcrossScale(false);
+
+    m_LeftSmoothers[d]->SetSigma(2.0);
+    m_RightSmoothers[d]->SetSigma(2.0);
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+typename DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>::InputImageType::Pointer
+DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::SmoothField(typename GaussianFilterType::Pointer *smoothers, InputImageType *field)
+{
+  smoothers[0]->SetInput(field);
+  for( unsigned int d = 1; d < ImageDimension; d++ )
+    {
+    smoothers[d]->SetInput( smoothers[d - 1]->GetOutput() );
+    }
+
+  return smoothers[ImageDimension - 1]->GetOutput();
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::ComputeUpdateNorms(const InputImageType *update)
+{
+  typedef ImageRegionConstIterator<InputImageType> ConstIteratorType;
+
+  double       sumNorm2 = 0.0;
+  double       maxNorm2 = 0.0;
+  unsigned int numPix = 0;
+
+  ConstIteratorType it( update, update->GetRequestedRegion() );
+  for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    const double norm2 = it.Get().GetSquaredNorm();
+    sumNorm2 += norm2;
+    if( norm2 > maxNorm2 )
+      {
+      maxNorm2 = norm2;
+      }
+    ++numPix;
+    }
+
+  m_CurrentRMSUpdate = ( numPix > 0 ) ? vcl_sqrt( sumNorm2 / numPix ) : 0.0;
+  m_CurrentMaxUpdate = vcl_sqrt(maxNorm2);
 }
 
 template <class TInputImage, class TOutputImage>
@@ -62,6 +102,8 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
   typename InputImageType::Pointer current = const_cast<InputImageType *>( this->GetInput() );
 
   m_ElapsedIterations   = 0;
+  m_CurrentRMSUpdate    = 0.0;
+  m_CurrentMaxUpdate    = 0.0;
 
   ProgressReporter progress(this, 0, m_NumberOfIterations);
   for( unsigned int i = 0; i < m_NumberOfIterations; i++ )
@@ -75,19 +117,21 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
     typename InputImageType::Pointer leftField  = m_ExpComp->GetOutput();
     typename InputImageType::Pointer rightField = current;
 
+    // delta_n vanishes when exp(v_n) = Phi: its norm is the residual
+    this->ComputeUpdateNorms(leftField);
+
+    if( m_CurrentRMSUpdate < m_Tolerance )
+      {
+      this->InvokeEvent( IterationEvent() );
+      break;
+      }
+
     // Smoothing helps stabilizing the computation
     // This was not in Bossa's paper
     if( m_SmoothVelocityField )
       {
-      m_LeftSmootherX->SetInput(leftField);
-      m_LeftSmootherY->SetInput( m_LeftSmootherX->GetOutput() );
-
-      leftField = m_LeftSmootherY->GetOutput();
-
-      m_RightSmootherX->SetInput(rightField);
-      m_RightSmootherY->SetInput( m_RightSmootherX->GetOutput() );
-
-      rightField = m_RightSmootherY->GetOutput();
+      leftField  = this->SmoothField(m_LeftSmoothers, leftField);
+      rightField = this->SmoothField(m_RightSmoothers, rightField);
       }
 
     // Still following Bossa's notation
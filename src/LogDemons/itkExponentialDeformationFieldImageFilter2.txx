@@ -67,6 +67,15 @@ ExponentialDeformationFieldImageFilter<TInputImage,TOutputImage>
 {
   itkDebugMacro(<<"Actually executing");
 
+  // The internal filters run with the threads of this filter
+  const int numberOfThreads = this->GetNumberOfThreads();
+  m_Multiplier->SetNumberOfThreads( numberOfThreads );
+  m_Caster->SetNumberOfThreads( numberOfThreads );
+  m_Oppositer->SetNumberOfThreads( numberOfThreads );
+  m_Divider->SetNumberOfThreads( numberOfThreads );
+  m_Warper->SetNumberOfThreads( numberOfThreads );
+  m_Adder->SetNumberOfThreads( numberOfThreads );
+
   m_Multiplier->SetInput(this->GetInput());
   m_Multiplier->SetConstant(m_MultiplicativeFactor);
   m_Multiplier->Update();
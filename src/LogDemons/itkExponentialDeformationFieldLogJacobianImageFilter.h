@@ -0,0 +1,197 @@
+#ifndef __itkExponentialDeformationFieldLogJacobianImageFilter_h
+#define __itkExponentialDeformationFieldLogJacobianImageFilter_h
+
+#include <itkImageToImageFilter.h>
+#include <itkImage.h>
+#include <itkMatrix.h>
+#include "itkRegistrationThreadPool.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class ExponentialDeformationFieldLogJacobianImageFilter
+ * \brief Computes the exponential of a stationary velocity field and the
+ * logarithm of its Jacobian determinant in a single scaling and squaring loop.
+ *
+ * The velocity field is scaled by \f$ 2^{-N} \f$, the first order
+ * approximations exp(v0) = Id + v0 and log|Jac(exp(v0))| = div(v0) are
+ * computed, and both are carried through the same N squarings:
+ *
+ *    \f[
+ *      \phi_{i+1} = \phi_i + \phi_i \circ ( Id + \phi_i ), \qquad
+ *      |J_{i+1}| = |J_i| \; |J_i| \circ ( Id + \phi_i )
+ *    \f]
+ *
+ * The displacement and the Jacobian determinant are interpolated at the same
+ * warped point, so that the linear interpolation weights are computed once
+ * for both. The recursion of the determinant is the one of the SVFLogJacobian
+ * tool (Lorenzi et al., "LCC-Demons: A robust and accurate symmetric
+ * diffeomorphic registration algorithm", NeuroImage 2013), and the
+ * displacement is the one of ExponentialDeformationFieldImageFilter: out of
+ * the image, the fields are extrapolated with their nearest value.
+ *
+ * The first output is the displacement field, the second output (see
+ * GetLogJacobianOutput) is the logJacobian map. Both are computed on the
+ * largest possible region of the input.
+ *
+ * \ingroup ImageToImageFilter
+ */
+template <class TInputImage, class TOutputImage,
+          class TLogJacobianImage = Image<float, TInputImage::ImageDimension> >
+class ITK_EXPORT ExponentialDeformationFieldLogJacobianImageFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef ExponentialDeformationFieldLogJacobianImageFilter Self;
+  typedef ImageToImageFilter<TInputImage,TOutputImage>      Superclass;
+  typedef SmartPointer<Self>                                Pointer;
+  typedef SmartPointer<const Self>                          ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(ExponentialDeformationFieldLogJacobianImageFilter, ImageToImageFilter);
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                                  InputImageType;
+  typedef typename InputImageType::Pointer             InputImagePointer;
+  typedef typename InputImageType::ConstPointer        InputImageConstPointer;
+  typedef typename InputImageType::PixelType           InputPixelType;
+
+  typedef TOutputImage                                 OutputImageType;
+  typedef typename OutputImageType::Pointer            OutputImagePointer;
+  typedef typename OutputImageType::PixelType          OutputPixelType;
+  typedef typename OutputPixelType::ValueType          OutputValueType;
+  typedef typename OutputImageType::RegionType         OutputImageRegionType;
+
+  typedef TLogJacobianImage                            LogJacobianImageType;
+  typedef typename LogJacobianImageType::Pointer       LogJacobianImagePointer;
+  typedef typename LogJacobianImageType::PixelType     LogJacobianPixelType;
+
+  /** Image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TInputImage::ImageDimension);
+  itkStaticConstMacro(OutputImageDimension, unsigned int,
+                      TOutputImage::ImageDimension);
+  itkStaticConstMacro(LogJacobianImageDimension, unsigned int,
+                      TLogJacobianImage::ImageDimension);
+  itkStaticConstMacro(PixelDimension, unsigned int,
+                      InputPixelType::Dimension);
+  itkStaticConstMacro(OutputPixelDimension, unsigned int,
+                      OutputPixelType::Dimension);
+
+  /** Specify the maximum number of iterations. */
+  itkSetMacro(MaximumNumberOfIterations, unsigned int);
+  itkGetConstMacro(MaximumNumberOfIterations, unsigned int);
+
+  /** If AutomaticNumberOfIterations is off, the number of iterations is
+   * given by MaximumNumberOfIterations. If it is on, it is the lowest
+   * number such that the scaled field is below half a voxel, within
+   * MaximumNumberOfIterations. */
+  itkSetMacro(AutomaticNumberOfIterations, bool);
+  itkGetConstMacro(AutomaticNumberOfIterations, bool);
+  itkBooleanMacro(AutomaticNumberOfIterations);
+
+  /** Multiplicative factor of the input velocity field. */
+  itkSetMacro(MultiplicativeFactor, double);
+  itkGetConstMacro(MultiplicativeFactor, double);
+
+  /** Number of squarings of the last update. */
+  itkGetConstMacro(NumberOfIterations, unsigned int);
+
+  /** Get the logJacobian map (second output). */
+  LogJacobianImageType * GetLogJacobianOutput();
+
+  /** Create the outputs: displacement field and logJacobian map. */
+#if (ITK_VERSION_MAJOR < 4)
+  virtual DataObject::Pointer MakeOutput(unsigned int idx);
+#else
+  typedef ProcessObject::DataObjectPointerArraySizeType DataObjectPointerArraySizeType;
+  using Superclass::MakeOutput;
+  virtual DataObject::Pointer MakeOutput(DataObjectPointerArraySizeType idx);
+#endif
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(SameDimensionCheck1,
+                  (Concept::SameDimension<ImageDimension,OutputImageDimension>));
+  itkConceptMacro(SameDimensionCheck2,
+                  (Concept::SameDimension<ImageDimension,PixelDimension>));
+  itkConceptMacro(SameDimensionCheck3,
+                  (Concept::SameDimension<ImageDimension,OutputPixelDimension>));
+  itkConceptMacro(SameDimensionCheck4,
+                  (Concept::SameDimension<ImageDimension,LogJacobianImageDimension>));
+  /** End concept checking */
+#endif
+
+protected:
+  ExponentialDeformationFieldLogJacobianImageFilter();
+  virtual ~ExponentialDeformationFieldLogJacobianImageFilter() {};
+
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The whole input is needed and the whole outputs are computed. */
+  virtual void GenerateInputRequestedRegion();
+  virtual void EnlargeOutputRequestedRegion(DataObject * output);
+
+  /** GenerateData() */
+  void GenerateData();
+
+  /** Steps of the computation, each run on all the threads. */
+  typedef enum {
+    MaximumNormStep,   // maximum squared norm of the input
+    ScalingStep,       // v0 = v / 2^N
+    DivergenceStep,    // |J0| = exp(div(v0))
+    SquaringStep,      // composition of the field and of the Jacobian with themselves
+    LogarithmStep      // log|J|
+  } StepType;
+
+  /** Runs a step on the voxels [begin,end) of the image. */
+  void ThreadedStep(StepType step, SizeValueType begin, SizeValueType end, unsigned int threadId);
+
+  /** Runs a step on all the threads of the global RegistrationThreadPool. */
+  void RunStep(StepType step);
+
+  static void StepCallback(void * data, SizeValueType begin, SizeValueType end, ThreadIdType threadId);
+
+private:
+  ExponentialDeformationFieldLogJacobianImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  bool                                m_AutomaticNumberOfIterations;
+  unsigned int                        m_MaximumNumberOfIterations;
+  double                              m_MultiplicativeFactor;
+  unsigned int                        m_NumberOfIterations;
+
+  // Ping-pong buffers of the squarings, kept between updates
+  OutputImagePointer                  m_TemporaryField;
+  std::vector<LogJacobianPixelType>   m_TemporaryJacobian;
+
+  // State of the current step
+  StepType                            m_Step;
+  double                              m_Scale;
+  std::vector<double>                 m_ThreadMaximumNorm;
+  const OutputPixelType *             m_CurrentField;
+  OutputPixelType *                   m_NextField;
+  const LogJacobianPixelType *        m_CurrentJacobian;
+  LogJacobianPixelType *              m_NextJacobian;
+
+  // Geometry of the field
+  SizeValueType                       m_Size[ImageDimension];
+  SizeValueType                       m_Stride[ImageDimension];
+  SizeValueType                       m_NumberOfPixels;
+  double                              m_Spacing[ImageDimension];
+  Matrix<double, ImageDimension, ImageDimension> m_PhysicalToIndex;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkExponentialDeformationFieldLogJacobianImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,395 @@
+#ifndef __itkExponentialDeformationFieldLogJacobianImageFilter_txx
+#define __itkExponentialDeformationFieldLogJacobianImageFilter_txx
+
+#include "itkExponentialDeformationFieldLogJacobianImageFilter.h"
+
+#include <itkProgressReporter.h>
+#include <vnl/vnl_math.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+
+/**
+ * Initialize new instance
+ */
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::ExponentialDeformationFieldLogJacobianImageFilter()
+{
+  m_AutomaticNumberOfIterations = true;
+  m_MaximumNumberOfIterations = 20;
+  m_MultiplicativeFactor = 1.0;
+  m_NumberOfIterations = 0;
+
+  m_Step = MaximumNormStep;
+  m_Scale = 1.0;
+  m_CurrentField = 0;
+  m_NextField = 0;
+  m_CurrentJacobian = 0;
+  m_NextJacobian = 0;
+  m_NumberOfPixels = 0;
+
+  this->SetNumberOfRequiredOutputs( 2 );
+  this->SetNthOutput( 1, this->MakeOutput( 1 ) );
+}
+
+
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+DataObject::Pointer
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+#if (ITK_VERSION_MAJOR < 4)
+::MakeOutput(unsigned int idx)
+#else
+::MakeOutput(DataObjectPointerArraySizeType idx)
+#endif
+{
+  if ( idx == 1 )
+    {
+    return static_cast<DataObject *>( LogJacobianImageType::New().GetPointer() );
+    }
+  return static_cast<DataObject *>( OutputImageType::New().GetPointer() );
+}
+
+
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+typename ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::LogJacobianImageType *
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::GetLogJacobianOutput()
+{
+  return dynamic_cast<LogJacobianImageType *>( this->ProcessObject::GetOutput( 1 ) );
+}
+
+
+/**
+ * Print out a description of self
+ */
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+void
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os,indent);
+
+  os << indent << "AutomaticNumberOfIterations: "
+     << m_AutomaticNumberOfIterations << std::endl;
+  os << indent << "MaximumNumberOfIterations:   "
+     << m_MaximumNumberOfIterations << std::endl;
+  os << indent << "MultiplicativeFactor:        "
+     << m_MultiplicativeFactor << std::endl;
+  os << indent << "NumberOfIterations:          "
+     << m_NumberOfIterations << std::endl;
+}
+
+
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+void
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  InputImagePointer inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  if ( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+void
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+  Superclass::EnlargeOutputRequestedRegion( output );
+
+  this->GetOutput()->SetRequestedRegionToLargestPossibleRegion();
+  this->GetLogJacobianOutput()->SetRequestedRegionToLargestPossibleRegion();
+}
+
+
+/**
+ * GenerateData
+ */
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+void
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::GenerateData()
+{
+  itkDebugMacro(<<"Actually executing");
+
+  InputImageConstPointer  inputPtr       = this->GetInput();
+  OutputImagePointer      fieldPtr       = this->GetOutput();
+  LogJacobianImagePointer logJacobianPtr = this->GetLogJacobianOutput();
+
+  fieldPtr->SetBufferedRegion( fieldPtr->GetRequestedRegion() );
+  fieldPtr->Allocate();
+  logJacobianPtr->SetBufferedRegion( logJacobianPtr->GetRequestedRegion() );
+  logJacobianPtr->Allocate();
+
+  // Geometry of the field
+  const typename InputImageType::RegionType region = inputPtr->GetLargestPossibleRegion();
+  Matrix<double, ImageDimension, ImageDimension> indexToPhysical;
+  double minpixelspacing = inputPtr->GetSpacing()[0];
+  m_NumberOfPixels = 1;
+  for ( unsigned int d=0; d<ImageDimension; d++ )
+    {
+    m_Size[d]    = region.GetSize()[d];
+    m_Stride[d]  = m_NumberOfPixels;
+    m_Spacing[d] = inputPtr->GetSpacing()[d];
+    m_NumberOfPixels *= m_Size[d];
+    minpixelspacing = vnl_math_min( minpixelspacing, m_Spacing[d] );
+    for ( unsigned int j=0; j<ImageDimension; j++ )
+      {
+      indexToPhysical(j,d) = inputPtr->GetDirection()(j,d) * m_Spacing[d];
+      }
+    }
+  m_PhysicalToIndex = indexToPhysical.GetInverse();
+
+  // Number of squarings: max(norm(v)/2^N) < 0.5*pixelspacing, as for
+  // ExponentialDeformationFieldImageFilter
+  unsigned int numiter = 0;
+  if( m_AutomaticNumberOfIterations )
+    {
+    this->RunStep( MaximumNormStep );
+    double maxnorm2 = *std::max_element( m_ThreadMaximumNorm.begin(), m_ThreadMaximumNorm.end() );
+    maxnorm2 *= vnl_math_sqr( m_MultiplicativeFactor );
+    maxnorm2 /= vnl_math_sqr( minpixelspacing );
+
+    const double numiterfloat = 2.0 + 0.5 * vcl_log(maxnorm2)/vnl_math::ln2;
+    if( numiterfloat >= 0.0 )
+      {
+      numiter = vnl_math_min( static_cast<unsigned int>(numiterfloat + 1.0),
+                              m_MaximumNumberOfIterations );
+      }
+    }
+  else
+    {
+    numiter = m_MaximumNumberOfIterations;
+    }
+  m_NumberOfIterations = numiter;
+
+  ProgressReporter progress(this, 0, numiter+2, numiter+2);
+
+  // First order approximations
+  m_Scale = m_MultiplicativeFactor / static_cast<double>( 1u << numiter );
+  m_NextField = fieldPtr->GetBufferPointer();
+  this->RunStep( ScalingStep );
+
+  m_CurrentField = fieldPtr->GetBufferPointer();
+  m_NextJacobian = logJacobianPtr->GetBufferPointer();
+  this->RunStep( DivergenceStep );
+  progress.CompletedPixel();
+
+  // The squarings alternate between the outputs and the temporary buffers
+  if ( numiter > 0 )
+    {
+    if ( !m_TemporaryField ||
+         m_TemporaryField->GetLargestPossibleRegion() != region )
+      {
+      m_TemporaryField = OutputImageType::New();
+      m_TemporaryField->SetRegions( region );
+      m_TemporaryField->Allocate();
+      }
+    m_TemporaryJacobian.resize( m_NumberOfPixels );
+    }
+
+  OutputPixelType *      fields[2]    = { fieldPtr->GetBufferPointer(), 0 };
+  LogJacobianPixelType * jacobians[2] = { logJacobianPtr->GetBufferPointer(), 0 };
+  if ( numiter > 0 )
+    {
+    fields[1]    = m_TemporaryField->GetBufferPointer();
+    jacobians[1] = &m_TemporaryJacobian[0];
+    }
+
+  unsigned int current = 0;
+  for( unsigned int i=0; i<numiter; i++ )
+    {
+    m_CurrentField    = fields[current];
+    m_CurrentJacobian = jacobians[current];
+    m_NextField       = fields[1-current];
+    m_NextJacobian    = jacobians[1-current];
+    this->RunStep( SquaringStep );
+    current = 1 - current;
+    progress.CompletedPixel();
+    }
+
+  if ( current != 0 )
+    {
+    std::copy( fields[1], fields[1] + m_NumberOfPixels, fields[0] );
+    std::copy( jacobians[1], jacobians[1] + m_NumberOfPixels, jacobians[0] );
+    }
+
+  // logJacobian map
+  m_NextJacobian = jacobians[0];
+  this->RunStep( LogarithmStep );
+  progress.CompletedPixel();
+}
+
+
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+void
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::RunStep(StepType step)
+{
+  m_Step = step;
+
+  m_ThreadMaximumNorm.assign( this->GetNumberOfThreads(), 0.0 );
+  RegistrationThreadPool::GetGlobalPool()->ParallelFor( m_NumberOfPixels, this->GetNumberOfThreads(),
+                                                        Self::StepCallback, this );
+}
+
+
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+void
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::StepCallback(void * data, SizeValueType begin, SizeValueType end, ThreadIdType threadId)
+{
+  Self * filter = static_cast<Self *>( data );
+  filter->ThreadedStep( filter->m_Step, begin, end, threadId );
+}
+
+
+template <class TInputImage, class TOutputImage, class TLogJacobianImage>
+void
+ExponentialDeformationFieldLogJacobianImageFilter<TInputImage, TOutputImage, TLogJacobianImage>
+::ThreadedStep(StepType step, SizeValueType begin, SizeValueType end, unsigned int threadId)
+{
+  const InputPixelType * input = this->GetInput()->GetBufferPointer();
+
+  switch ( step )
+    {
+    case MaximumNormStep:
+      {
+      double maxnorm2 = 0.0;
+      for ( SizeValueType k=begin; k<end; k++ )
+        {
+        maxnorm2 = vnl_math_max( maxnorm2, static_cast<double>( input[k].GetSquaredNorm() ) );
+        }
+      m_ThreadMaximumNorm[threadId] = vnl_math_max( m_ThreadMaximumNorm[threadId], maxnorm2 );
+      return;
+      }
+
+    case ScalingStep:
+      for ( SizeValueType k=begin; k<end; k++ )
+        {
+        for ( unsigned int d=0; d<ImageDimension; d++ )
+          {
+          m_NextField[k][d] = static_cast<OutputValueType>( m_Scale * input[k][d] );
+          }
+        }
+      return;
+
+    case LogarithmStep:
+      for ( SizeValueType k=begin; k<end; k++ )
+        {
+        m_NextJacobian[k] = static_cast<LogJacobianPixelType>( vcl_log( static_cast<double>( m_NextJacobian[k] ) ) );
+        }
+      return;
+
+    default:
+      break;
+    }
+
+  // The divergence and the squarings need the index of the voxels
+  SizeValueType index[ImageDimension];
+  for ( unsigned int d=0; d<ImageDimension; d++ )
+    {
+    index[d] = ( begin / m_Stride[d] ) % m_Size[d];
+    }
+
+  for ( SizeValueType k=begin; k<end; k++ )
+    {
+    if ( step == DivergenceStep )
+      {
+      // Central differences, with zero flux at the borders as DerivativeImageFilter
+      double divergence = 0.0;
+      for ( unsigned int d=0; d<ImageDimension; d++ )
+        {
+        const SizeValueType lower = index[d] > 0             ? k - m_Stride[d] : k;
+        const SizeValueType upper = index[d] + 1 < m_Size[d] ? k + m_Stride[d] : k;
+        divergence += ( m_CurrentField[upper][d] - m_CurrentField[lower][d] ) / ( 2.0 * m_Spacing[d] );
+        }
+      m_NextJacobian[k] = static_cast<LogJacobianPixelType>( vcl_exp( divergence ) );
+      }
+    else
+      {
+      // Warped point, clamped to the image (nearest neighbor extrapolation)
+      const OutputPixelType & u = m_CurrentField[k];
+      SizeValueType base = 0;
+      SizeValueType upperOffset[ImageDimension];
+      double        fraction[ImageDimension];
+      for ( unsigned int d=0; d<ImageDimension; d++ )
+        {
+        double c = static_cast<double>( index[d] );
+        for ( unsigned int j=0; j<ImageDimension; j++ )
+          {
+          c += m_PhysicalToIndex(d,j) * u[j];
+          }
+        c = vnl_math_max( 0.0, vnl_math_min( c, static_cast<double>( m_Size[d] - 1 ) ) );
+        const SizeValueType lower = static_cast<SizeValueType>( c );
+        fraction[d]    = c - lower;
+        upperOffset[d] = lower + 1 < m_Size[d] ? m_Stride[d] : 0;
+        base += lower * m_Stride[d];
+        }
+
+      // Linear interpolation of the field and of the Jacobian with the same weights
+      double interpolatedField[ImageDimension];
+      double interpolatedJacobian = 0.0;
+      for ( unsigned int d=0; d<ImageDimension; d++ )
+        {
+        interpolatedField[d] = 0.0;
+        }
+      for ( unsigned int corner=0; corner < (1u << ImageDimension); corner++ )
+        {
+        double        weight = 1.0;
+        SizeValueType offset = base;
+        for ( unsigned int d=0; d<ImageDimension; d++ )
+          {
+          if ( corner & (1u << d) )
+            {
+            weight *= fraction[d];
+            offset += upperOffset[d];
+            }
+          else
+            {
+            weight *= 1.0 - fraction[d];
+            }
+          }
+        if ( weight == 0.0 )
+          {
+          continue;
+          }
+        for ( unsigned int d=0; d<ImageDimension; d++ )
+          {
+          interpolatedField[d] += weight * m_CurrentField[offset][d];
+          }
+        interpolatedJacobian += weight * m_CurrentJacobian[offset];
+        }
+
+      for ( unsigned int d=0; d<ImageDimension; d++ )
+        {
+        m_NextField[k][d] = static_cast<OutputValueType>( u[d] + interpolatedField[d] );
+        }
+      m_NextJacobian[k] = static_cast<LogJacobianPixelType>( m_CurrentJacobian[k] * interpolatedJacobian );
+      }
+
+    // Next voxel
+    for ( unsigned int d=0; d<ImageDimension; d++ )
+      {
+      if ( ++index[d] < m_Size[d] )
+        {
+        break;
+        }
+      index[d] = 0;
+      }
+    }
+}
+
+} // end namespace itk
+
+#endif
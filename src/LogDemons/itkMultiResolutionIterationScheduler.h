@@ -0,0 +1,339 @@
+#ifndef __itkMultiResolutionIterationScheduler_h
+#define __itkMultiResolutionIterationScheduler_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkRealTimeClock.h"
+#include "vnl/vnl_math.h"
+
+#include <vector>
+
+namespace itk
+{
+/**
+ * \class MultiResolutionIterationScheduler
+ * \brief Fits the iterations of a multi-resolution registration into a
+ * wall-clock time budget.
+ *
+ * The scheduler is driven by the multi-resolution registration filters:
+ * Start() is called with the requested number of iterations and the number
+ * of voxels of each level, StartLevel() returns the number of iterations
+ * allotted to a level, IterationDone() is called after each iteration and
+ * EndLevel() after each level.
+ *
+ * The cost of an iteration is measured at each level and extrapolated to the
+ * finer levels proportionally to their number of voxels. At the beginning of
+ * each level, if the requested iterations of the remaining levels do not fit
+ * in the remaining time, the time is allocated level by level: each level
+ * first gets MinimumNumberOfIterations, then the remaining time goes, one
+ * iteration at a time, to the level where the next iteration is expected to
+ * improve the metric the most per second. The improvement of the k-th
+ * iteration of a level is modelled as decay^k, where the decay is measured
+ * from the metric values given to IterationDone() (ImprovementDecay until a
+ * level has been measured), so that iterations move towards the cheap levels
+ * until their improvement has decayed by the ratio of the costs. No level
+ * gets more than its requested iterations.
+ *
+ * While a level runs, IterationDone() asks to stop it as soon as continuing
+ * would not leave enough time for the minimum iterations of the next levels.
+ * The allocation is recomputed at each level, so that time freed by levels
+ * that stop early (e.g. on convergence) is given to the following levels.
+ *
+ * With a time budget of 0 (default), the requested iterations are used as is.
+ */
+class MultiResolutionIterationScheduler : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef MultiResolutionIterationScheduler  Self;
+  typedef Object                             Superclass;
+  typedef SmartPointer<Self>                 Pointer;
+  typedef SmartPointer<const Self>           ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( MultiResolutionIterationScheduler, Object );
+
+  /** Set/Get the time budget in seconds (0: no budget). */
+  itkSetMacro( TimeBudget, double );
+  itkGetConstMacro( TimeBudget, double );
+
+  /** Set/Get the minimum number of iterations kept for each level when the
+   * budget is short (default: 1). */
+  itkSetMacro( MinimumNumberOfIterations, unsigned int );
+  itkGetConstMacro( MinimumNumberOfIterations, unsigned int );
+
+  /** Set/Get the ratio between the metric improvements of two successive
+   * iterations of a level, used to allocate the iterations until it has
+   * been measured on a level (default: 0.9). */
+  itkSetClampMacro( ImprovementDecay, double, 0.5, 0.99 );
+  itkGetConstMacro( ImprovementDecay, double );
+
+  /** Get the number of iterations allotted to each level by the last
+   * allocation. */
+  const std::vector<unsigned int> & GetAllottedIterations() const
+  {
+    return m_AllottedIterations;
+  }
+
+  /** Get the measured cost of an iteration at each level (seconds, 0 if the
+   * level was not run). */
+  const std::vector<double> & GetSecondsPerIteration() const
+  {
+    return m_SecondsPerIteration;
+  }
+
+  /** Get the number of iterations performed at each level. */
+  const std::vector<unsigned int> & GetNumberOfElapsedIterations() const
+  {
+    return m_ElapsedIterations;
+  }
+
+  /** Start the schedule of a registration. */
+  void Start( const std::vector<unsigned int> & requestedIterations,
+              const std::vector<double> & numberOfVoxels )
+  {
+    m_RequestedIterations = requestedIterations;
+    m_NumberOfVoxels      = numberOfVoxels;
+    m_SecondsPerIteration.assign( requestedIterations.size(), 0.0 );
+    m_ElapsedIterations.assign( requestedIterations.size(), 0 );
+    m_AllottedIterations = requestedIterations;
+    m_MeasuredDecay.assign( requestedIterations.size(), 0.0 );
+    m_FirstImprovement.assign( requestedIterations.size(), 0.0 );
+    m_LastImprovement.assign( requestedIterations.size(), 0.0 );
+    m_NumberOfImprovements.assign( requestedIterations.size(), 0 );
+    m_LastMetric = 0.0;
+    m_CurrentLevel = 0;
+    m_StartTime    = this->GetTime();
+  }
+
+  /** Start a level and get the number of iterations allotted to it. */
+  unsigned int StartLevel( unsigned int level )
+  {
+    m_CurrentLevel   = level;
+    m_LevelStartTime = this->GetTime();
+
+    const unsigned int requested = m_RequestedIterations[level];
+    if ( m_TimeBudget <= 0.0 )
+      return requested;
+
+    const double remainingTime = m_TimeBudget - this->GetElapsedTime();
+    if ( remainingTime <= 0.0 )
+      return 0;
+
+    // Unknown cost: the level is bounded by IterationDone()
+    if ( this->EstimateSecondsPerIteration( level ) <= 0.0 )
+      return requested;
+
+    double requestedTime = 0.0;
+    for ( unsigned int l = level; l < m_RequestedIterations.size(); l++ )
+      requestedTime += m_RequestedIterations[l] * this->EstimateSecondsPerIteration( l );
+
+    if ( requestedTime <= remainingTime )
+      return requested;
+
+    this->AllocateIterations( level, remainingTime );
+    return m_AllottedIterations[level];
+  }
+
+  /** Record an iteration. Returns true if the current level must stop to
+   * respect the time budget. */
+  bool IterationDone()
+  {
+    return this->RecordIteration();
+  }
+
+  /** Record an iteration and the metric it reached, which measures how fast
+   * the improvements of the level decay. */
+  bool IterationDone( double metric )
+  {
+    const unsigned int level = m_CurrentLevel;
+    if ( m_ElapsedIterations[level] > 0 )
+    {
+      const double improvement = vnl_math_abs( metric - m_LastMetric );
+      if ( m_NumberOfImprovements[level] == 0 )
+        m_FirstImprovement[level] = improvement;
+      m_LastImprovement[level] = improvement;
+      m_NumberOfImprovements[level]++;
+
+      // Geometric mean of the ratio of two successive improvements
+      if ( m_NumberOfImprovements[level] >= 3 &&
+           m_FirstImprovement[level] > 0.0 && m_LastImprovement[level] > 0.0 )
+      {
+        const double decay = vcl_pow( m_LastImprovement[level] / m_FirstImprovement[level],
+                                      1.0 / ( m_NumberOfImprovements[level] - 1 ) );
+        m_MeasuredDecay[level] = vnl_math_max( 0.5, vnl_math_min( 0.99, decay ) );
+      }
+    }
+    m_LastMetric = metric;
+    return this->RecordIteration();
+  }
+
+  /** End the current level. */
+  void EndLevel()
+  {
+    const unsigned int level = m_CurrentLevel;
+    if ( m_ElapsedIterations[level] > 0 )
+      m_SecondsPerIteration[level] = ( this->GetTime() - m_LevelStartTime ) / m_ElapsedIterations[level];
+  }
+
+  /** Return true if the time budget is spent. */
+  bool IsTimeBudgetExhausted() const
+  {
+    return m_TimeBudget > 0.0 && this->GetElapsedTime() >= m_TimeBudget;
+  }
+
+  /** Get the time elapsed since Start() in seconds. */
+  double GetElapsedTime() const
+  {
+    return this->GetTime() - m_StartTime;
+  }
+
+  /** Estimate the cost of an iteration at a level from the last measured
+   * level (0 if nothing was measured yet). */
+  double EstimateSecondsPerIteration( unsigned int level ) const
+  {
+    if ( m_SecondsPerIteration[level] > 0.0 )
+      return m_SecondsPerIteration[level];
+
+    for ( int l = static_cast<int>( level ) - 1; l >= 0; l-- )
+    {
+      if ( m_SecondsPerIteration[l] > 0.0 && m_NumberOfVoxels[l] > 0.0 )
+        return m_SecondsPerIteration[l] * m_NumberOfVoxels[level] / m_NumberOfVoxels[l];
+    }
+    return 0.0;
+  }
+
+  /** Ratio between the improvements of two successive iterations, measured
+   * on the last level that gave metric values (ImprovementDecay if none). */
+  double EstimateImprovementDecay() const
+  {
+    for ( int l = static_cast<int>( m_CurrentLevel ); l >= 0; l-- )
+    {
+      if ( l < static_cast<int>( m_MeasuredDecay.size() ) && m_MeasuredDecay[l] > 0.0 )
+        return m_MeasuredDecay[l];
+    }
+    return m_ImprovementDecay;
+  }
+
+protected:
+  MultiResolutionIterationScheduler()
+  {
+    m_TimeBudget                = 0.0;
+    m_MinimumNumberOfIterations = 1;
+    m_ImprovementDecay          = 0.9;
+    m_CurrentLevel              = 0;
+    m_StartTime                 = 0.0;
+    m_LevelStartTime            = 0.0;
+    m_LastMetric                = 0.0;
+    m_Clock                     = RealTimeClock::New();
+  }
+  ~MultiResolutionIterationScheduler() {}
+
+  void PrintSelf(std::ostream& os, Indent indent) const
+  {
+    Superclass::PrintSelf(os,indent);
+    os << indent << "TimeBudget: " << m_TimeBudget << std::endl;
+    os << indent << "MinimumNumberOfIterations: " << m_MinimumNumberOfIterations << std::endl;
+    os << indent << "ImprovementDecay: " << m_ImprovementDecay << std::endl;
+  }
+
+  /** Allocate the remaining time to the levels from the given one: each
+   * level gets its minimum, then each iteration goes to the level with the
+   * largest expected improvement per second decay^k / cost, as long as it
+   * fits in the remaining time. */
+  void AllocateIterations( unsigned int level, double remainingTime )
+  {
+    const unsigned int numberOfLevels = m_RequestedIterations.size();
+    const double       decay          = this->EstimateImprovementDecay();
+
+    std::vector<double> cost( numberOfLevels, 0.0 );
+    std::vector<double> value( numberOfLevels, 0.0 );
+    for ( unsigned int l = level; l < numberOfLevels; l++ )
+    {
+      cost[l] = this->EstimateSecondsPerIteration( l );
+      m_AllottedIterations[l] = vnl_math_min( m_RequestedIterations[l], m_MinimumNumberOfIterations );
+      remainingTime -= m_AllottedIterations[l] * cost[l];
+      value[l] = vcl_pow( decay, static_cast<double>( m_AllottedIterations[l] ) );
+    }
+
+    while ( true )
+    {
+      int best = -1;
+      for ( unsigned int l = level; l < numberOfLevels; l++ )
+      {
+        if ( m_AllottedIterations[l] >= m_RequestedIterations[l] || cost[l] > remainingTime )
+          continue;
+        if ( best < 0 || value[l] * cost[best] > value[best] * cost[l] )
+          best = l;
+      }
+      if ( best < 0 )
+        break;
+
+      m_AllottedIterations[best]++;
+      remainingTime -= cost[best];
+      value[best]   *= decay;
+    }
+  }
+
+  /** Count an iteration of the current level and check the time left. */
+  bool RecordIteration()
+  {
+    const unsigned int level = m_CurrentLevel;
+    m_ElapsedIterations[level]++;
+    m_SecondsPerIteration[level] = ( this->GetTime() - m_LevelStartTime ) / m_ElapsedIterations[level];
+
+    if ( m_TimeBudget <= 0.0 || m_ElapsedIterations[level] < m_MinimumNumberOfIterations )
+      return false;
+
+    // Time needed by the next iteration and the minimum of the next levels
+    double reservedTime = m_SecondsPerIteration[level];
+    for ( unsigned int l = level + 1; l < m_RequestedIterations.size(); l++ )
+      reservedTime += vnl_math_min( m_RequestedIterations[l], m_MinimumNumberOfIterations ) *
+                      this->EstimateSecondsPerIteration( l );
+
+    return this->GetElapsedTime() + reservedTime > m_TimeBudget;
+  }
+
+  /** Current wall-clock time in seconds. */
+  double GetTime() const
+  {
+#if ITK_VERSION_MAJOR < 4
+    return m_Clock->GetTimeStamp();
+#else
+    return m_Clock->GetTimeInSeconds();
+#endif
+  }
+
+private:
+  MultiResolutionIterationScheduler(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  double                     m_TimeBudget;
+  unsigned int               m_MinimumNumberOfIterations;
+  double                     m_ImprovementDecay;
+
+  std::vector<unsigned int>  m_RequestedIterations;
+  std::vector<double>        m_NumberOfVoxels;
+  std::vector<double>        m_SecondsPerIteration;
+  std::vector<unsigned int>  m_ElapsedIterations;
+  std::vector<unsigned int>  m_AllottedIterations;
+
+  // Decay of the metric improvements within each level
+  std::vector<double>        m_MeasuredDecay;
+  std::vector<double>        m_FirstImprovement;
+  std::vector<double>        m_LastImprovement;
+  std::vector<unsigned int>  m_NumberOfImprovements;
+  double                     m_LastMetric;
+
+  unsigned int               m_CurrentLevel;
+  double                     m_StartTime;
+  double                     m_LevelStartTime;
+  RealTimeClock::Pointer     m_Clock;
+};
+
+} // end namespace itk
+
+#endif
@@ -8,6 +8,8 @@
 #include "itkLogDomainDemonsRegistrationFilter.h"
 #include "itkMultiResolutionPyramidImageFilter.h"
 #include "itkVectorResampleImageFilter.h"
+#include "itkMultiResolutionIterationScheduler.h"
+#include "itkCommand.h"
 
 #include <vector>
 
@@ -52,6 +54,11 @@ namespace itk
  * and moving images. A VectorExpandImageFilter is used to upsample
  * the velocity field as we move from a coarse to fine solution.
  *
+ * The number of iterations of each level is given by a
+ * MultiResolutionIterationScheduler, that can share a time budget between
+ * the levels according to their measured cost and metric improvements, and
+ * stop a level that would overrun it.
+ *
  * This class is templated over the fixed image type, the moving image type,
  * and the velocity/deformation Field type.
  *
@@ -137,6 +144,10 @@ public:
   FieldExpanderType;
   typedef typename FieldExpanderType::Pointer FieldExpanderPointer;
 
+  /** The iteration scheduler type. */
+  typedef MultiResolutionIterationScheduler    SchedulerType;
+  typedef SchedulerType::Pointer               SchedulerPointer;
+
   /** Set the fixed image. */
   virtual void SetFixedImage( const FixedImageType * ptr );
 
@@ -267,6 +278,11 @@ public:
     return &(m_NumberOfIterations[0]);
   }
 
+  /** Set/Get the scheduler that fits the iterations of each level into a
+   * wall-clock time budget. */
+  itkSetObjectMacro( Scheduler, SchedulerType );
+  itkGetObjectMacro( Scheduler, SchedulerType );
+
   /** Stop the registration after the current iteration. */
   virtual void StopRegistration();
   
@@ -402,6 +418,13 @@ protected:
   /** This method returns true to indicate that the registration should
    * terminate at the current resolution level. */
   virtual bool Halt();
+
+  /** Called after each iteration of the registration filter to let the
+   * scheduler stop the current level. */
+  virtual void RegistrationIterationUpdate();
+
+  /** Number of voxels of each level of the fixed image pyramid. */
+  std::vector<double> GetNumberOfVoxelsPerLevel() const;
   
   
 
@@ -423,6 +446,9 @@ private:
   bool m_StopRegistrationFlag;
 
   FieldExponentiatorPointer m_Exponentiator;
+
+  /** Iteration scheduler */
+  SchedulerPointer          m_Scheduler;
  
   /**
    * Regularization type.
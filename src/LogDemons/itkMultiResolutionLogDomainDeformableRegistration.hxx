@@ -66,6 +66,8 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
 
   m_Exponentiator = FieldExponentiatorType::New();
 
+  m_Scheduler = SchedulerType::New();
+
   m_RegularizationType = 1;
 
   m_HarmonicWeight   = 1e-4;
@@ -441,6 +443,8 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
 
   os << indent << "StopRegistrationFlag: ";
   os << m_StopRegistrationFlag << std::endl;
+  os << indent << "Scheduler: ";
+  os << m_Scheduler.GetPointer() << std::endl;
 
   os << indent << "Exponentiator: ";
   os << m_Exponentiator << std::endl;
@@ -612,6 +616,15 @@ else if (m_RegularizationType==1)
    m_RegistrationFilter->SetBendingWeight(this->m_BendingWeight);
   }
 
+  // The scheduler gives the number of iterations of each level and is
+  // notified of each iteration of the registration filter
+  m_Scheduler->Start( m_NumberOfIterations, this->GetNumberOfVoxelsPerLevel() );
+
+  typedef SimpleMemberCommand<Self> SchedulerCommandType;
+  typename SchedulerCommandType::Pointer schedulerCommand = SchedulerCommandType::New();
+  schedulerCommand->SetCallbackFunction( this, &Self::RegistrationIterationUpdate );
+  unsigned long schedulerTag = m_RegistrationFilter->AddObserver( IterationEvent(), schedulerCommand );
+
   while( !this->Halt() )
     {
 
@@ -649,7 +662,7 @@ else if (m_RegularizationType==1)
     m_RegistrationFilter->SetFixedImage( m_FixedImagePyramid->GetOutput(fixedLevel) );
 
     m_RegistrationFilter->SetNumberOfIterations(
-      m_NumberOfIterations[m_CurrentLevel] );
+      m_Scheduler->StartLevel( m_CurrentLevel ) );
 
     // Resolution
     double resolution = 1;
@@ -691,10 +704,25 @@ else if (m_RegularizationType==1)
       }
 
     // compute new velocity field
-    m_RegistrationFilter->UpdateLargestPossibleRegion();
+    try
+      {
+      m_RegistrationFilter->UpdateLargestPossibleRegion();
+      }
+    catch( ... )
+      {
+      m_RegistrationFilter->RemoveObserver( schedulerTag );
+      throw;
+      }
     tempField = m_RegistrationFilter->GetOutput();
     tempField->DisconnectPipeline();
 
+    // Skip the remaining levels once the time budget is spent
+    m_Scheduler->EndLevel();
+    if( m_Scheduler->IsTimeBudgetExhausted() )
+      {
+      m_StopRegistrationFlag = true;
+      }
+
     // Increment level counter.
     m_CurrentLevel++;
     movingLevel = vnl_math_min( (int) m_CurrentLevel,
@@ -717,6 +745,8 @@ else if (m_RegularizationType==1)
 
     } // while not Halt()
 
+  m_RegistrationFilter->RemoveObserver( schedulerTag );
+
   if( !lastShrinkFactorsAllOnes )
     {
     // Some of the last shrink factors are not one
@@ -752,6 +782,39 @@ else if (m_RegularizationType==1)
 
 }
 
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::RegistrationIterationUpdate()
+{
+  // Stop the current level if it would overrun the time budget
+  if( m_Scheduler->IterationDone( m_RegistrationFilter->GetMetric() ) )
+    {
+    m_RegistrationFilter->StopRegistration();
+    }
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+std::vector<double>
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::GetNumberOfVoxelsPerLevel() const
+{
+  const typename FixedImageType::SizeType & size =
+    this->GetFixedImage()->GetLargestPossibleRegion().GetSize();
+
+  std::vector<double> numberOfVoxels( m_NumberOfLevels, 1.0 );
+  for( unsigned int level = 0; level < m_NumberOfLevels; level++ )
+    {
+    const unsigned int fixedLevel = vnl_math_min( level, m_FixedImagePyramid->GetNumberOfLevels() - 1 );
+    for( unsigned int idim = 0; idim < ImageDimension; idim++ )
+      {
+      const double factor = m_FixedImagePyramid->GetSchedule()[fixedLevel][idim];
+      numberOfVoxels[level] *= vnl_math_max( 1.0, vcl_floor( size[idim] / factor ) );
+      }
+    }
+  return numberOfVoxels;
+}
+
 template <class TFixedImage, class TMovingImage, class TField, class TRealType>
 void
 MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
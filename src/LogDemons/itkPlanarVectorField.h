@@ -0,0 +1,189 @@
+#ifndef __itkPlanarVectorField_h
+#define __itkPlanarVectorField_h
+
+#include <itkObject.h>
+#include <itkObjectFactory.h>
+#include <itkImage.h>
+#include <itkImportImageContainer.h>
+#include <itkMultiThreader.h>
+#include "itkRegistrationThreadPool.h"
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class PlanarVectorField
+ * \brief Vector field stored as one plane per component (structure of arrays).
+ *
+ * Image<Vector<T,N>,N> interleaves the components of each voxel, so that the
+ * loops over the voxels of one component are strided. PlanarVectorField
+ * stores the N components in N contiguous planes of the size of the image,
+ * which makes the inner loops of the separable smoothing, of the update and
+ * of the Lie bracket unit-stride in every direction.
+ *
+ * The planes are converted from and to the ITK field at the boundaries of the
+ * pipeline by threaded Scatter and Gather (GatherAdd fuses the conversion with
+ * the update v += s*u). Each plane can be viewed without copy as a scalar
+ * ITK image (GetComponentImage). The buffer is kept when the size of the
+ * field does not change, so that an object reused across iterations does not
+ * allocate.
+ *
+ * The kernels follow the ITK filters they replace:
+ * - Smooth: VectorNeighborhoodOperatorImageFilter with a GaussianOperator
+ *   along each axis, with zero flux boundaries;
+ * - ComputeLieBracket: VelocityFieldLieBracketFilter, with the central
+ *   differences of VectorCentralDifferenceImageFunction (zero on the border
+ *   and oriented by the image direction).
+ *
+ * All the kernels are run on NumberOfThreads threads of the global
+ * RegistrationThreadPool.
+ */
+template <class TField>
+class ITK_EXPORT PlanarVectorField : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef PlanarVectorField           Self;
+  typedef Object                      Superclass;
+  typedef SmartPointer<Self>          Pointer;
+  typedef SmartPointer<const Self>    ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( PlanarVectorField, Object );
+
+  /** Some convenient typedefs. */
+  typedef TField                                 FieldType;
+  typedef typename FieldType::PixelType          PixelType;
+  typedef typename PixelType::ValueType          ValueType;
+  typedef typename FieldType::RegionType         RegionType;
+  typedef typename FieldType::SpacingType        SpacingType;
+  typedef typename FieldType::PointType          PointType;
+  typedef typename FieldType::DirectionType      DirectionType;
+
+  /** ImageDimension constants */
+  itkStaticConstMacro( ImageDimension, unsigned int, TField::ImageDimension );
+  itkStaticConstMacro( PixelDimension, unsigned int, PixelType::Dimension );
+
+  /** Scalar image viewing one component plane. */
+  typedef Image<ValueType, ImageDimension>       ComponentImageType;
+  typedef typename ComponentImageType::Pointer   ComponentImagePointer;
+
+  /** Number of threads of the kernels. */
+  itkSetMacro( NumberOfThreads, ThreadIdType );
+  itkGetConstMacro( NumberOfThreads, ThreadIdType );
+
+  /** Geometry of the field. */
+  itkGetConstReferenceMacro( Region, RegionType );
+  itkGetConstReferenceMacro( Spacing, SpacingType );
+  itkGetConstReferenceMacro( Origin, PointType );
+  itkGetConstReferenceMacro( Direction, DirectionType );
+  SizeValueType GetNumberOfPixels() const { return m_NumberOfPixels; }
+
+  /** Copy the geometry of an ITK field (buffered region) or of another
+   * planar field, and allocate the planes if the size changed. */
+  void CopyInformation( const FieldType * field );
+  void CopyInformation( const Self * field );
+
+  /** Pointer to the plane of a component. */
+  ValueType * GetComponentBuffer( unsigned int component )
+    { return &m_Buffer[component * m_NumberOfPixels]; }
+  const ValueType * GetComponentBuffer( unsigned int component ) const
+    { return &m_Buffer[component * m_NumberOfPixels]; }
+
+  /** Scalar image sharing the plane of a component (no copy). The image
+   * is only valid until the planes are reallocated. */
+  ComponentImagePointer GetComponentImage( unsigned int component );
+
+  /** Copy an ITK field into the planes (geometry included). */
+  void Scatter( const FieldType * field );
+
+  /** Copy the planes into an ITK field buffered on the same region. */
+  void Gather( FieldType * field );
+
+  /** field += scale * planes, for an ITK field buffered on the same region. */
+  void GatherAdd( FieldType * field, double scale );
+
+  /** this += scale * field. */
+  void AddScaled( const Self * field, double scale );
+
+  /** Separable Gaussian smoothing of each component, with the variances in
+   * voxel units, as GaussianOperator. */
+  void Smooth( const double variance[ImageDimension], double maximumError, unsigned int maximumKernelWidth );
+
+  /** this = [left,right] = Jac(left).right - Jac(right).left */
+  void ComputeLieBracket( const Self * left, const Self * right );
+
+protected:
+  PlanarVectorField();
+  ~PlanarVectorField() {};
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Kernels, each run on all the threads over a range of work items. */
+  typedef enum {
+    ScatterStep,       // voxels
+    GatherStep,        // voxels
+    GatherAddStep,     // voxels
+    AddScaledStep,     // voxels
+    SmoothLineStep,    // lines along the first axis
+    SmoothBlockStep,   // blocks of rows along the other axes
+    LieBracketStep     // lines along the first axis
+  } StepType;
+
+  void RunStep( StepType step, SizeValueType numberOfWorkItems );
+  static void StepCallback( void * data, SizeValueType begin, SizeValueType end, ThreadIdType threadId );
+  void ThreadedStep( StepType step, SizeValueType begin, SizeValueType end, ThreadIdType threadId );
+
+  void SmoothLines( SizeValueType begin, SizeValueType end, ThreadIdType threadId );
+  void SmoothBlocks( SizeValueType begin, SizeValueType end, ThreadIdType threadId );
+  void LieBracketLines( SizeValueType begin, SizeValueType end );
+  void LieBracketRange( SizeValueType k, SizeValueType count,
+                        const SizeValueType lower[ImageDimension],
+                        const SizeValueType upper[ImageDimension],
+                        const double factor[ImageDimension] );
+
+private:
+  PlanarVectorField(const Self &); // purposely not implemented
+  void operator=(const Self &);    // purposely not implemented
+
+  void Allocate();
+
+  ThreadIdType                 m_NumberOfThreads;
+
+  // Geometry and planes
+  RegionType                   m_Region;
+  SpacingType                  m_Spacing;
+  PointType                    m_Origin;
+  DirectionType                m_Direction;
+  bool                         m_DirectionIsIdentity;
+  SizeValueType                m_Size[ImageDimension];
+  SizeValueType                m_Stride[ImageDimension];
+  SizeValueType                m_NumberOfPixels;
+  std::vector<ValueType>       m_Buffer;
+
+  // State of the current step
+  StepType                     m_Step;
+  const PixelType *            m_ConstField;
+  PixelType *                  m_Field;
+  const Self *                 m_Left;
+  const Self *                 m_Right;
+  double                       m_Scale;
+  unsigned int                 m_Axis;
+  SizeValueType                m_BlockWidth;
+  std::vector<ValueType>       m_Kernel;
+  std::vector< std::vector<ValueType> > m_ThreadScratch;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkPlanarVectorField.hxx"
+#endif
+
+#endif
@@ -0,0 +1,577 @@
+#ifndef __itkPlanarVectorField_txx
+#define __itkPlanarVectorField_txx
+#include "itkPlanarVectorField.h"
+
+#include <itkGaussianOperator.h>
+#include <algorithm>
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TField>
+PlanarVectorField<TField>
+::PlanarVectorField()
+{
+  m_NumberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  m_Spacing.Fill( 1.0 );
+  m_Origin.Fill( 0.0 );
+  m_Direction.SetIdentity();
+  m_DirectionIsIdentity = true;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    m_Size[d] = 0;
+    m_Stride[d] = 0;
+    }
+  m_NumberOfPixels = 0;
+
+  m_Step = ScatterStep;
+  m_ConstField = 0;
+  m_Field = 0;
+  m_Left = 0;
+  m_Right = 0;
+  m_Scale = 1.0;
+  m_Axis = 0;
+  m_BlockWidth = 1;
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TField>
+void
+PlanarVectorField<TField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfThreads: " << m_NumberOfThreads << std::endl;
+  os << indent << "Region: " << m_Region << std::endl;
+  os << indent << "Spacing: " << m_Spacing << std::endl;
+  os << indent << "Origin: " << m_Origin << std::endl;
+  os << indent << "Direction: " << m_Direction << std::endl;
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::CopyInformation( const FieldType * field )
+{
+  m_Region    = field->GetBufferedRegion();
+  m_Spacing   = field->GetSpacing();
+  m_Origin    = field->GetOrigin();
+  m_Direction = field->GetDirection();
+  this->Allocate();
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::CopyInformation( const Self * field )
+{
+  m_Region    = field->m_Region;
+  m_Spacing   = field->m_Spacing;
+  m_Origin    = field->m_Origin;
+  m_Direction = field->m_Direction;
+  this->Allocate();
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::Allocate()
+{
+  m_NumberOfPixels = 1;
+  m_DirectionIsIdentity = true;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    m_Size[d]   = m_Region.GetSize()[d];
+    m_Stride[d] = m_NumberOfPixels;
+    m_NumberOfPixels *= m_Size[d];
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      if( m_Direction(d,j) != ( d == j ? 1.0 : 0.0 ) )
+        {
+        m_DirectionIsIdentity = false;
+        }
+      }
+    }
+
+  // resize() keeps the buffer when the size does not grow
+  m_Buffer.resize( m_NumberOfPixels * PixelDimension );
+}
+
+
+template <class TField>
+typename PlanarVectorField<TField>::ComponentImagePointer
+PlanarVectorField<TField>
+::GetComponentImage( unsigned int component )
+{
+  typedef typename ComponentImageType::PixelContainer ContainerType;
+  typename ContainerType::Pointer container = ContainerType::New();
+  container->SetImportPointer( this->GetComponentBuffer( component ), m_NumberOfPixels, false );
+
+  ComponentImagePointer image = ComponentImageType::New();
+  image->SetRegions( m_Region );
+  image->SetSpacing( m_Spacing );
+  image->SetOrigin( m_Origin );
+  image->SetDirection( m_Direction );
+  image->SetPixelContainer( container );
+  return image;
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::Scatter( const FieldType * field )
+{
+  this->CopyInformation( field );
+  m_ConstField = field->GetBufferPointer();
+  this->RunStep( ScatterStep, m_NumberOfPixels );
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::Gather( FieldType * field )
+{
+  if( field->GetBufferedRegion().GetNumberOfPixels() != m_NumberOfPixels )
+    {
+    itkExceptionMacro( << "The field and the planes have different sizes" );
+    }
+  m_Field = field->GetBufferPointer();
+  this->RunStep( GatherStep, m_NumberOfPixels );
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::GatherAdd( FieldType * field, double scale )
+{
+  if( field->GetBufferedRegion().GetNumberOfPixels() != m_NumberOfPixels )
+    {
+    itkExceptionMacro( << "The field and the planes have different sizes" );
+    }
+  m_Field = field->GetBufferPointer();
+  m_Scale = scale;
+  this->RunStep( GatherAddStep, m_NumberOfPixels );
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::AddScaled( const Self * field, double scale )
+{
+  if( field->m_NumberOfPixels != m_NumberOfPixels )
+    {
+    itkExceptionMacro( << "The planar fields have different sizes" );
+    }
+  m_Left  = field;
+  m_Scale = scale;
+  this->RunStep( AddScaledStep, m_NumberOfPixels );
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::Smooth( const double variance[ImageDimension], double maximumError, unsigned int maximumKernelWidth )
+{
+  if( !m_NumberOfPixels )
+    {
+    return;
+    }
+
+  for( unsigned int axis = 0; axis < ImageDimension; axis++ )
+    {
+    // Coefficients of the operator, contiguous along its direction
+    GaussianOperator<ValueType, ImageDimension> oper;
+    oper.SetDirection( 0 );
+    oper.SetVariance( variance[axis] );
+    oper.SetMaximumError( maximumError );
+    oper.SetMaximumKernelWidth( maximumKernelWidth );
+    oper.CreateDirectional();
+    m_Kernel.assign( oper.Begin(), oper.End() );
+    const SizeValueType radius = ( m_Kernel.size() - 1 ) / 2;
+
+    m_Axis = axis;
+    SizeValueType scratchSize;
+    if( axis == 0 )
+      {
+      scratchSize = m_Size[0] + 2 * radius;
+      }
+    else
+      {
+      m_BlockWidth = std::min<SizeValueType>( m_Stride[axis], 256 );
+      scratchSize = m_Size[axis] * m_BlockWidth;
+      }
+
+    m_ThreadScratch.resize( m_NumberOfThreads );
+    for( ThreadIdType t = 0; t < m_NumberOfThreads; t++ )
+      {
+      if( m_ThreadScratch[t].size() < scratchSize )
+        {
+        m_ThreadScratch[t].resize( scratchSize );
+        }
+      }
+
+    if( axis == 0 )
+      {
+      this->RunStep( SmoothLineStep, m_NumberOfPixels / m_Size[0] );
+      }
+    else
+      {
+      const SizeValueType blocksPerRow = ( m_Stride[axis] + m_BlockWidth - 1 ) / m_BlockWidth;
+      const SizeValueType outer = m_NumberOfPixels / ( m_Stride[axis] * m_Size[axis] );
+      this->RunStep( SmoothBlockStep, outer * blocksPerRow );
+      }
+    }
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::ComputeLieBracket( const Self * left, const Self * right )
+{
+  if( left == this || right == this )
+    {
+    itkExceptionMacro( << "The Lie bracket cannot be computed in place" );
+    }
+  if( left->m_NumberOfPixels != right->m_NumberOfPixels )
+    {
+    itkExceptionMacro( << "The planar fields have different sizes" );
+    }
+
+  this->CopyInformation( left );
+  if( !m_NumberOfPixels )
+    {
+    return;
+    }
+  m_Left  = left;
+  m_Right = right;
+  this->RunStep( LieBracketStep, m_NumberOfPixels / m_Size[0] );
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::RunStep( StepType step, SizeValueType numberOfWorkItems )
+{
+  m_Step = step;
+  RegistrationThreadPool::GetGlobalPool()->ParallelFor( numberOfWorkItems, m_NumberOfThreads,
+                                                        Self::StepCallback, this );
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::StepCallback( void * data, SizeValueType begin, SizeValueType end, ThreadIdType threadId )
+{
+  Self * self = static_cast<Self *>( data );
+  self->ThreadedStep( self->m_Step, begin, end, threadId );
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::ThreadedStep( StepType step, SizeValueType begin, SizeValueType end, ThreadIdType threadId )
+{
+  switch( step )
+    {
+    case ScatterStep:
+      for( unsigned int c = 0; c < PixelDimension; c++ )
+        {
+        ValueType * plane = this->GetComponentBuffer( c );
+        for( SizeValueType k = begin; k < end; k++ )
+          {
+          plane[k] = m_ConstField[k][c];
+          }
+        }
+      break;
+
+    case GatherStep:
+      for( unsigned int c = 0; c < PixelDimension; c++ )
+        {
+        const ValueType * plane = this->GetComponentBuffer( c );
+        for( SizeValueType k = begin; k < end; k++ )
+          {
+          m_Field[k][c] = plane[k];
+          }
+        }
+      break;
+
+    case GatherAddStep:
+      {
+      const ValueType scale = static_cast<ValueType>( m_Scale );
+      for( unsigned int c = 0; c < PixelDimension; c++ )
+        {
+        const ValueType * plane = this->GetComponentBuffer( c );
+        for( SizeValueType k = begin; k < end; k++ )
+          {
+          m_Field[k][c] += scale * plane[k];
+          }
+        }
+      break;
+      }
+
+    case AddScaledStep:
+      {
+      const ValueType scale = static_cast<ValueType>( m_Scale );
+      for( unsigned int c = 0; c < PixelDimension; c++ )
+        {
+        ValueType *       plane = this->GetComponentBuffer( c );
+        const ValueType * other = m_Left->GetComponentBuffer( c );
+        for( SizeValueType k = begin; k < end; k++ )
+          {
+          plane[k] += scale * other[k];
+          }
+        }
+      break;
+      }
+
+    case SmoothLineStep:
+      this->SmoothLines( begin, end, threadId );
+      break;
+
+    case SmoothBlockStep:
+      this->SmoothBlocks( begin, end, threadId );
+      break;
+
+    case LieBracketStep:
+      this->LieBracketLines( begin, end );
+      break;
+    }
+}
+
+
+/**
+ * Smoothing along the first axis: each line is copied with its borders
+ * replicated (zero flux), and the kernel is accumulated over the whole line.
+ */
+template <class TField>
+void
+PlanarVectorField<TField>
+::SmoothLines( SizeValueType begin, SizeValueType end, ThreadIdType threadId )
+{
+  const SizeValueType n      = m_Size[0];
+  const SizeValueType width  = m_Kernel.size();
+  const SizeValueType radius = ( width - 1 ) / 2;
+  const ValueType *   kernel = &m_Kernel[0];
+  ValueType *         padded = &m_ThreadScratch[threadId][0];
+
+  for( unsigned int c = 0; c < PixelDimension; c++ )
+    {
+    ValueType * plane = this->GetComponentBuffer( c );
+    for( SizeValueType line = begin; line < end; line++ )
+      {
+      ValueType * values = plane + line * n;
+      std::fill( padded, padded + radius, values[0] );
+      std::copy( values, values + n, padded + radius );
+      std::fill( padded + radius + n, padded + 2 * radius + n, values[n-1] );
+
+      std::fill( values, values + n, ValueType(0) );
+      for( SizeValueType k = 0; k < width; k++ )
+        {
+        const ValueType   coefficient = kernel[k];
+        const ValueType * shifted     = padded + k;
+        for( SizeValueType x = 0; x < n; x++ )
+          {
+          values[x] += coefficient * shifted[x];
+          }
+        }
+      }
+    }
+}
+
+
+/**
+ * Smoothing along the other axes: a block of BlockWidth consecutive voxels of
+ * each row along the axis is copied, and the kernel combines whole rows of the
+ * block, clamped at the borders (zero flux).
+ */
+template <class TField>
+void
+PlanarVectorField<TField>
+::SmoothBlocks( SizeValueType begin, SizeValueType end, ThreadIdType threadId )
+{
+  const SizeValueType n            = m_Size[m_Axis];
+  const SizeValueType stride       = m_Stride[m_Axis];
+  const SizeValueType blockWidth   = m_BlockWidth;
+  const SizeValueType blocksPerRow = ( stride + blockWidth - 1 ) / blockWidth;
+  const SizeValueType width        = m_Kernel.size();
+  const long          radius       = static_cast<long>( ( width - 1 ) / 2 );
+  const ValueType *   kernel       = &m_Kernel[0];
+  ValueType *         block        = &m_ThreadScratch[threadId][0];
+
+  for( SizeValueType item = begin; item < end; item++ )
+    {
+    const SizeValueType outer = item / blocksPerRow;
+    const SizeValueType first = ( item % blocksPerRow ) * blockWidth;
+    const SizeValueType count = std::min( blockWidth, stride - first );
+    const SizeValueType base  = outer * stride * n + first;
+
+    for( unsigned int c = 0; c < PixelDimension; c++ )
+      {
+      ValueType * values = this->GetComponentBuffer( c ) + base;
+      for( SizeValueType j = 0; j < n; j++ )
+        {
+        std::copy( values + j * stride, values + j * stride + count, block + j * blockWidth );
+        }
+
+      for( SizeValueType j = 0; j < n; j++ )
+        {
+        ValueType * row = values + j * stride;
+        std::fill( row, row + count, ValueType(0) );
+        for( SizeValueType k = 0; k < width; k++ )
+          {
+          const long source = std::max( 0L, std::min( static_cast<long>( j ) + static_cast<long>( k ) - radius,
+                                                      static_cast<long>( n ) - 1 ) );
+          const ValueType   coefficient = kernel[k];
+          const ValueType * shifted     = block + source * blockWidth;
+          for( SizeValueType i = 0; i < count; i++ )
+            {
+            row[i] += coefficient * shifted[i];
+            }
+          }
+        }
+      }
+    }
+}
+
+
+/**
+ * Lie bracket of the lines along the first axis: the differences along the
+ * other axes are the same for a whole line, and only its two end voxels need
+ * the border case of the first axis.
+ */
+template <class TField>
+void
+PlanarVectorField<TField>
+::LieBracketLines( SizeValueType begin, SizeValueType end )
+{
+  const SizeValueType n = m_Size[0];
+
+  SizeValueType lower[ImageDimension];
+  SizeValueType upper[ImageDimension];
+  double        factor[ImageDimension];
+
+  for( SizeValueType line = begin; line < end; line++ )
+    {
+    const SizeValueType first = line * n;
+    for( unsigned int d = 1; d < ImageDimension; d++ )
+      {
+      const SizeValueType index = ( first / m_Stride[d] ) % m_Size[d];
+      const bool inside = index > 0 && index + 1 < m_Size[d];
+      lower[d]  = inside ? m_Stride[d] : 0;
+      upper[d]  = inside ? m_Stride[d] : 0;
+      factor[d] = inside ? 0.5 / m_Spacing[d] : 0.0;
+      }
+
+    // End voxels: zero derivative along the first axis
+    lower[0] = 0;
+    upper[0] = 0;
+    factor[0] = 0.0;
+    this->LieBracketRange( first, 1, lower, upper, factor );
+    if( n > 1 )
+      {
+      this->LieBracketRange( first + n - 1, 1, lower, upper, factor );
+      }
+
+    // Interior of the line
+    if( n > 2 )
+      {
+      lower[0] = 1;
+      upper[0] = 1;
+      factor[0] = 0.5 / m_Spacing[0];
+      this->LieBracketRange( first + 1, n - 2, lower, upper, factor );
+      }
+    }
+}
+
+
+template <class TField>
+void
+PlanarVectorField<TField>
+::LieBracketRange( SizeValueType first, SizeValueType count,
+                   const SizeValueType lower[ImageDimension],
+                   const SizeValueType upper[ImageDimension],
+                   const double factor[ImageDimension] )
+{
+  const ValueType * left[ImageDimension];
+  const ValueType * right[ImageDimension];
+  ValueType *       output[ImageDimension];
+  for( unsigned int c = 0; c < ImageDimension; c++ )
+    {
+    left[c]   = m_Left->GetComponentBuffer( c );
+    right[c]  = m_Right->GetComponentBuffer( c );
+    output[c] = this->GetComponentBuffer( c );
+    }
+
+  double leftgrad[ImageDimension][ImageDimension];
+  double rightgrad[ImageDimension][ImageDimension];
+
+  for( SizeValueType k = first; k < first + count; k++ )
+    {
+    // Central differences of each component along each axis
+    for( unsigned int c = 0; c < ImageDimension; c++ )
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        leftgrad[c][d]  = ( left[c][k + upper[d]]  - left[c][k - lower[d]] )  * factor[d];
+        rightgrad[c][d] = ( right[c][k + upper[d]] - right[c][k - lower[d]] ) * factor[d];
+        }
+      }
+
+    // Physical derivatives, as VectorCentralDifferenceImageFunction
+    if( !m_DirectionIsIdentity )
+      {
+      for( unsigned int c = 0; c < ImageDimension; c++ )
+        {
+        double l[ImageDimension], r[ImageDimension];
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          l[i] = 0.0;
+          r[i] = 0.0;
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            l[i] += m_Direction(i,j) * leftgrad[c][j];
+            r[i] += m_Direction(i,j) * rightgrad[c][j];
+            }
+          }
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          leftgrad[c][i]  = l[i];
+          rightgrad[c][i] = r[i];
+          }
+        }
+      }
+
+    for( unsigned int c = 0; c < ImageDimension; c++ )
+      {
+      double value = 0.0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        value += leftgrad[c][d] * right[d][k] - rightgrad[c][d] * left[d][k];
+        }
+      output[c][k] = static_cast<ValueType>( value );
+      }
+    }
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,462 @@
+#ifndef __itkRegistrationThreadPool_h
+#define __itkRegistrationThreadPool_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkSimpleMutexLock.h"
+#include "itkConditionVariable.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/**
+ * \class RegistrationThreadPool
+ * \brief Persistent worker threads running the parallel loops of the
+ * registration kernels.
+ *
+ * MultiThreader::SingleMethodExecute creates and joins its threads at each
+ * call, and an iteration of the registration runs dozens of short parallel
+ * loops. The pool keeps its workers asleep between the loops, so that a loop
+ * only costs a wake-up and a join on a condition variable.
+ *
+ * ParallelFor( n, threads, function, data ) calls function( data, begin, end,
+ * threadId ) on ranges covering [0,n), with threadId in [0,threads): the
+ * calling thread is the slot 0 and the workers the other slots. The range
+ * is first divided in one contiguous part per slot; each slot then takes
+ * chunks of GrainSize items from its own part, and steals the second half of
+ * the largest remaining part of another slot when its own is exhausted, so
+ * that uneven work items (e.g. masked voxels, image borders) are balanced.
+ * A slot may thus be called several times per loop: per thread results must
+ * be accumulated, not assigned.
+ *
+ * Loops are run one at a time. A loop started while another one is running
+ * (from a concurrent registration, or from inside a loop) falls back to
+ * MultiThreader::SingleMethodExecute, with one contiguous range per thread,
+ * as does every loop when the pool is disabled (SetGlobalEnabled).
+ *
+ * The parallel loops of the registration filters use the global pool
+ * (GetGlobalPool). ITK's own filters keep their MultiThreader.
+ */
+class RegistrationThreadPool : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef RegistrationThreadPool     Self;
+  typedef Object                     Superclass;
+  typedef SmartPointer<Self>         Pointer;
+  typedef SmartPointer<const Self>   ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( RegistrationThreadPool, Object );
+
+  /** Body of a parallel loop, called on the work items [begin,end). */
+  typedef void (*RangeFunctionType)( void * data, SizeValueType begin, SizeValueType end, ThreadIdType threadId );
+
+  /** Pool shared by all the registration filters. Its workers are created
+   * at the first parallel loop. */
+  static Self * GetGlobalPool()
+    {
+    static Pointer pool = Self::New();
+    return pool;
+    }
+
+  /** Set/Get whether the parallel loops are run on the pool (default) or
+   * with MultiThreader::SingleMethodExecute. */
+  static void SetGlobalEnabled( bool enabled ) { GlobalEnabledFlag() = enabled; }
+  static bool GetGlobalEnabled() { return GlobalEnabledFlag(); }
+
+  /** Run the body on [0,numberOfWorkItems) with numberOfThreads threads.
+   * The items are taken by chunks of grainSize (0: automatic). */
+  void ParallelFor( SizeValueType numberOfWorkItems, ThreadIdType numberOfThreads,
+                    RangeFunctionType function, void * data, SizeValueType grainSize = 0 )
+    {
+    if( numberOfWorkItems == 0 )
+      {
+      return;
+      }
+    numberOfThreads = std::max<ThreadIdType>( 1, std::min<ThreadIdType>( numberOfThreads, ITK_MAX_THREADS ) );
+    if( numberOfWorkItems < numberOfThreads )
+      {
+      numberOfThreads = static_cast<ThreadIdType>( numberOfWorkItems );
+      }
+    if( numberOfThreads == 1 )
+      {
+      function( data, 0, numberOfWorkItems, 0 );
+      return;
+      }
+
+    // Another loop is running, or the pool is disabled
+    m_Mutex.Lock();
+    const bool available = !m_Busy && GetGlobalEnabled();
+    if( available )
+      {
+      m_Busy = true;
+      }
+    else
+      {
+      m_NumberOfForkJoinLoops++;
+      }
+    m_Mutex.Unlock();
+    if( !available )
+      {
+      Self::ForkJoin( numberOfWorkItems, numberOfThreads, function, data );
+      return;
+      }
+
+    // The workers are only created or added between two loops
+    this->StartWorkers( numberOfThreads - 1 );
+
+    m_Function       = function;
+    m_Data           = data;
+    m_GrainSize      = grainSize > 0 ? grainSize
+                                     : std::max<SizeValueType>( 1, numberOfWorkItems / ( 8 * numberOfThreads ) );
+    m_NumberOfSlots  = numberOfThreads;
+    m_Error.clear();
+    for( ThreadIdType s = 0; s < numberOfThreads; s++ )
+      {
+      m_Slots[s]->Begin = ( numberOfWorkItems * s ) / numberOfThreads;
+      m_Slots[s]->End   = ( numberOfWorkItems * ( s + 1 ) ) / numberOfThreads;
+      }
+
+    m_Mutex.Lock();
+    m_NumberOfPendingWorkers = numberOfThreads - 1;
+    m_Generation++;
+    m_WorkAvailable->Broadcast();
+    m_Mutex.Unlock();
+
+    this->RunSlot( 0 );
+
+    m_Mutex.Lock();
+    while( m_NumberOfPendingWorkers > 0 )
+      {
+      m_WorkDone->Wait( &m_Mutex );
+      }
+    m_Busy = false;
+    m_NumberOfPoolLoops++;
+    const std::string error = m_Error;
+    m_Mutex.Unlock();
+
+    if( !error.empty() )
+      {
+      itkExceptionMacro( << error );
+      }
+    }
+
+  /** Number of worker threads (the calling thread is not counted). */
+  ThreadIdType GetNumberOfWorkers() const { return static_cast<ThreadIdType>( m_Workers.size() ); }
+
+  /** Number of loops run on the pool and with fork/join since the creation. */
+  unsigned long GetNumberOfPoolLoops() const { return m_NumberOfPoolLoops; }
+  unsigned long GetNumberOfForkJoinLoops() const { return m_NumberOfForkJoinLoops; }
+
+  /** Same loop with MultiThreader::SingleMethodExecute: one contiguous range
+   * per thread, the threads being created and joined by the call. */
+  static void ForkJoin( SizeValueType numberOfWorkItems, ThreadIdType numberOfThreads,
+                        RangeFunctionType function, void * data )
+    {
+    ForkJoinLoop loop;
+    loop.NumberOfWorkItems = numberOfWorkItems;
+    loop.Function          = function;
+    loop.Data              = data;
+
+    MultiThreader::Pointer threader = MultiThreader::New();
+    threader->SetNumberOfThreads( numberOfThreads );
+    threader->SetSingleMethod( Self::ForkJoinCallback, &loop );
+    threader->SingleMethodExecute();
+    }
+
+protected:
+  RegistrationThreadPool()
+    {
+    m_Threader               = MultiThreader::New();
+    m_WorkAvailable          = ConditionVariable::New();
+    m_WorkDone               = ConditionVariable::New();
+    m_Busy                   = false;
+    m_Stop                   = false;
+    m_Generation             = 0;
+    m_NumberOfPendingWorkers = 0;
+    m_NumberOfSlots          = 0;
+    m_Function               = 0;
+    m_Data                   = 0;
+    m_GrainSize              = 1;
+    m_NumberOfPoolLoops      = 0;
+    m_NumberOfForkJoinLoops  = 0;
+    }
+
+  ~RegistrationThreadPool()
+    {
+    m_Mutex.Lock();
+    m_Stop = true;
+    m_WorkAvailable->Broadcast();
+    m_Mutex.Unlock();
+
+    for( unsigned int w = 0; w < m_Workers.size(); w++ )
+      {
+      m_Threader->TerminateThread( m_Workers[w]->ThreadId );
+      delete m_Workers[w];
+      }
+    for( unsigned int s = 0; s < m_Slots.size(); s++ )
+      {
+      delete m_Slots[s];
+      }
+    }
+
+  void PrintSelf( std::ostream& os, Indent indent ) const
+    {
+    Superclass::PrintSelf( os, indent );
+    os << indent << "NumberOfWorkers: " << m_Workers.size() << std::endl;
+    os << indent << "NumberOfPoolLoops: " << m_NumberOfPoolLoops << std::endl;
+    os << indent << "NumberOfForkJoinLoops: " << m_NumberOfForkJoinLoops << std::endl;
+    }
+
+private:
+  RegistrationThreadPool(const Self &); // purposely not implemented
+  void operator=(const Self &);         // purposely not implemented
+
+  /** Remaining work items of a slot. */
+  struct Slot
+  {
+    SimpleFastMutexLock  Lock;
+    SizeValueType        Begin;
+    SizeValueType        End;
+  };
+
+  /** Worker thread and its slot. */
+  struct Worker
+  {
+    Self *        Pool;
+    ThreadIdType  Slot;
+    unsigned long Generation;
+    int           ThreadId;
+  };
+
+  /** Loop run with SingleMethodExecute. */
+  struct ForkJoinLoop
+  {
+    SizeValueType      NumberOfWorkItems;
+    RangeFunctionType  Function;
+    void *             Data;
+  };
+
+  static bool & GlobalEnabledFlag()
+    {
+    static bool enabled = true;
+    return enabled;
+    }
+
+  /** Creates the missing workers, between two loops. */
+  void StartWorkers( ThreadIdType numberOfWorkers )
+    {
+    while( m_Slots.size() < numberOfWorkers + 1u )
+      {
+      Slot * slot = new Slot;
+      slot->Begin = 0;
+      slot->End   = 0;
+      m_Slots.push_back( slot );
+      }
+    while( m_Workers.size() < numberOfWorkers )
+      {
+      Worker * worker  = new Worker;
+      worker->Pool     = this;
+      worker->Slot     = static_cast<ThreadIdType>( m_Workers.size() + 1 );
+      worker->Generation = m_Generation;
+      worker->ThreadId = m_Threader->SpawnThread( Self::WorkerCallback, worker );
+      m_Workers.push_back( worker );
+      }
+    }
+
+  static ITK_THREAD_RETURN_TYPE WorkerCallback( void * arg )
+    {
+    MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+    Worker * worker = static_cast<Worker *>( info->UserData );
+    worker->Pool->WorkerLoop( worker->Slot, worker->Generation );
+    return ITK_THREAD_RETURN_VALUE;
+    }
+
+  /** Sleeps until a loop needs the slot, runs it, and signals its end. The
+   * generation is the one of the last loop before the worker was created,
+   * so that a worker started late does not miss its first loop. */
+  void WorkerLoop( ThreadIdType slot, unsigned long generation )
+    {
+    m_Mutex.Lock();
+    while( true )
+      {
+      while( !m_Stop && m_Generation == generation )
+        {
+        m_WorkAvailable->Wait( &m_Mutex );
+        }
+      if( m_Stop )
+        {
+        break;
+        }
+      generation = m_Generation;
+      if( slot >= m_NumberOfSlots )
+        {
+        continue;
+        }
+      m_Mutex.Unlock();
+
+      this->RunSlot( slot );
+
+      m_Mutex.Lock();
+      if( --m_NumberOfPendingWorkers == 0 )
+        {
+        m_WorkDone->Signal();
+        }
+      }
+    m_Mutex.Unlock();
+    }
+
+  /** Runs the chunks of a slot, then steals from the others. */
+  void RunSlot( ThreadIdType slot )
+    {
+    try
+      {
+      SizeValueType begin, end;
+      while( this->TakeChunk( slot, begin, end ) || this->Steal( slot, begin, end ) )
+        {
+        m_Function( m_Data, begin, end, slot );
+        }
+      }
+    catch( ExceptionObject & err )
+      {
+      this->SetError( err.GetDescription() );
+      }
+    catch( std::exception & err )
+      {
+      this->SetError( err.what() );
+      }
+    }
+
+  bool TakeChunk( ThreadIdType slot, SizeValueType & begin, SizeValueType & end )
+    {
+    Slot * own = m_Slots[slot];
+    own->Lock.Lock();
+    begin = own->Begin;
+    end   = std::min( own->End, begin + m_GrainSize );
+    own->Begin = end;
+    own->Lock.Unlock();
+    return begin < end;
+    }
+
+  /** Moves the second half of the largest remaining part of the other
+   * slots to the slot, and takes its first chunk. */
+  bool Steal( ThreadIdType slot, SizeValueType & begin, SizeValueType & end )
+    {
+    while( true )
+      {
+      ThreadIdType  victim    = slot;
+      SizeValueType remaining = 0;
+      for( ThreadIdType s = 0; s < m_NumberOfSlots; s++ )
+        {
+        if( s == slot )
+          {
+          continue;
+          }
+        m_Slots[s]->Lock.Lock();
+        const SizeValueType r = m_Slots[s]->End > m_Slots[s]->Begin ? m_Slots[s]->End - m_Slots[s]->Begin : 0;
+        m_Slots[s]->Lock.Unlock();
+        if( r > remaining )
+          {
+          victim    = s;
+          remaining = r;
+          }
+        }
+      if( remaining == 0 )
+        {
+        return false;
+        }
+
+      SizeValueType stolenBegin = 0, stolenEnd = 0;
+      Slot * other = m_Slots[victim];
+      other->Lock.Lock();
+      if( other->End > other->Begin )
+        {
+        stolenEnd   = other->End;
+        stolenBegin = other->Begin + ( other->End - other->Begin ) / 2;
+        other->End  = stolenBegin;
+        }
+      other->Lock.Unlock();
+
+      if( stolenBegin < stolenEnd )
+        {
+        Slot * own = m_Slots[slot];
+        own->Lock.Lock();
+        own->Begin = stolenBegin;
+        own->End   = stolenEnd;
+        own->Lock.Unlock();
+        return this->TakeChunk( slot, begin, end );
+        }
+      }
+    }
+
+  void SetError( const std::string & error )
+    {
+    m_Mutex.Lock();
+    if( m_Error.empty() )
+      {
+      m_Error = error;
+      }
+    m_Mutex.Unlock();
+    }
+
+  static ITK_THREAD_RETURN_TYPE ForkJoinCallback( void * arg )
+    {
+    MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+    const ForkJoinLoop * loop = static_cast<const ForkJoinLoop *>( info->UserData );
+
+    // Contiguous ranges of work items
+    const SizeValueType numberOfThreads = info->NumberOfThreads;
+    const SizeValueType threadId        = info->ThreadID;
+    const SizeValueType begin = ( loop->NumberOfWorkItems * threadId ) / numberOfThreads;
+    const SizeValueType end   = ( loop->NumberOfWorkItems * ( threadId + 1 ) ) / numberOfThreads;
+
+    if( begin < end )
+      {
+      loop->Function( loop->Data, begin, end, info->ThreadID );
+      }
+    return ITK_THREAD_RETURN_VALUE;
+    }
+
+  // Workers
+  MultiThreader::Pointer       m_Threader;
+  std::vector<Worker *>        m_Workers;
+  std::vector<Slot *>          m_Slots;
+
+  // Synchronization of the loops
+  SimpleMutexLock              m_Mutex;
+  ConditionVariable::Pointer   m_WorkAvailable;
+  ConditionVariable::Pointer   m_WorkDone;
+  bool                         m_Busy;
+  bool                         m_Stop;
+  unsigned long                m_Generation;
+  ThreadIdType                 m_NumberOfPendingWorkers;
+
+  // Current loop
+  ThreadIdType                 m_NumberOfSlots;
+  RangeFunctionType            m_Function;
+  void *                       m_Data;
+  SizeValueType                m_GrainSize;
+  std::string                  m_Error;
+
+  // Statistics
+  unsigned long                m_NumberOfPoolLoops;
+  unsigned long                m_NumberOfForkJoinLoops;
+};
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef __itkTaskGroup_h
+#define __itkTaskGroup_h
+
+#include "itkMacro.h"
+#include "itkMultiThreader.h"
+
+#include <list>
+#include <stdexcept>
+#include <string>
+
+namespace itk
+{
+
+/**
+ * \class TaskGroup
+ * \brief Group of tasks run on their own threads, or in the calling thread
+ * when the group is not asynchronous.
+ *
+ * Run( function, data ) calls function( data ) on a new thread; Wait()
+ * joins all the tasks started since the last Wait and returns the first
+ * error they threw (empty if none), Join() throws it as a
+ * std::runtime_error. The destructor waits for the tasks and ignores their
+ * errors. The data of a task must stay valid until it is joined.
+ *
+ * Used for the overlapped reads and writes of the command line tools and
+ * for the background diagnostics of the registration.
+ */
+class TaskGroup
+{
+public:
+
+  typedef void (*TaskFunction)(void *);
+
+  TaskGroup(bool asynchronous = true) : m_Asynchronous(asynchronous)
+    {
+    m_Threader = MultiThreader::New();
+    }
+
+  ~TaskGroup()
+    {
+    this->Wait();
+    }
+
+  /** Whether the tasks run on their own threads. */
+  bool GetAsynchronous() const
+    {
+    return m_Asynchronous;
+    }
+
+  /** Whether tasks were started since the last Wait. */
+  bool IsEmpty() const
+    {
+    return m_Tasks.empty();
+    }
+
+  /**
+   * Runs a task.
+   * @param  function  task function
+   * @param  data      argument of the task function
+   */
+  void Run(TaskFunction function, void * data)
+    {
+    m_Tasks.push_back( Task() );
+    Task & task    = m_Tasks.back();
+    task.function  = function;
+    task.data      = data;
+    task.threadId  = -1;
+
+    if ( m_Asynchronous )
+      {
+      task.threadId = m_Threader->SpawnThread( TaskGroup::ThreadCallback, &task );
+      }
+    else
+      {
+      TaskGroup::Execute( task );
+      }
+    }
+
+  /**
+   * Waits for all the tasks.
+   * @return the first error of the tasks (empty if none)
+   */
+  std::string Wait()
+    {
+    std::string error;
+    for ( std::list<Task>::iterator it=m_Tasks.begin(); it!=m_Tasks.end(); ++it )
+      {
+      if ( it->threadId>=0 )
+        {
+        m_Threader->TerminateThread( it->threadId );
+        }
+      if ( error.empty() )
+        {
+        error = it->error;
+        }
+      }
+    m_Tasks.clear();
+    return error;
+    }
+
+  /**
+   * Waits for all the tasks and throws the first error.
+   */
+  void Join()
+    {
+    const std::string error = this->Wait();
+    if ( !error.empty() )
+      {
+      throw std::runtime_error( error );
+      }
+    }
+
+private:
+
+  TaskGroup(const TaskGroup &);      // purposely not implemented
+  void operator=(const TaskGroup &); // purposely not implemented
+
+  struct Task
+    {
+    TaskFunction  function;
+    void *        data;
+    int           threadId;
+    std::string   error;
+    };
+
+  static void Execute(Task & task)
+    {
+    try
+      {
+      task.function( task.data );
+      }
+    catch( ExceptionObject & err )
+      {
+      task.error = err.GetDescription();
+      }
+    catch( std::exception & err )
+      {
+      task.error = err.what();
+      }
+    }
+
+  static ITK_THREAD_RETURN_TYPE ThreadCallback(void * arg)
+    {
+    MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+    TaskGroup::Execute( *static_cast<Task *>( info->UserData ) );
+    return ITK_THREAD_RETURN_VALUE;
+    }
+
+  bool                    m_Asynchronous;
+  MultiThreader::Pointer  m_Threader;
+  std::list<Task>         m_Tasks;
+};
+
+} // end namespace itk
+
+#endif
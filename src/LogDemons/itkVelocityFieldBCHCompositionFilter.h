@@ -5,6 +5,7 @@
 #include <itkNaryAddImageFilter.h>
 #include <itkVelocityFieldLieBracketFilter.h>
 #include <itkMultiplyImageFilter.h>
+#include <itkPlanarVectorField.h>
 
 namespace itk
 {
@@ -29,8 +30,13 @@ namespace itk
  * The number of approximation terms to used in the BCH approximation is set via
  * SetNumberOfApproximationTerms method.
  *
+ * If UsePlanarFields is on, the Lie brackets of the 3 and 4 terms
+ * approximations are computed on planar copies of the fields (see
+ * PlanarVectorField) instead of the mini-pipeline of ITK filters.
+ *
  * \warning This filter assumes that the input field type and velocity field type
- * both have the same number of dimensions.
+ * both have the same number of dimensions. The planar computation assumes
+ * that they are the same type.
  *
  * \author Florence Dru, INRIA and Tom Vercauteren, MKT
  */
@@ -65,6 +71,11 @@ public:
   /** Set/Get the NumberOfApproximationTerms used in the BCH approximation. */
   itkSetMacro( NumberOfApproximationTerms, unsigned int );
   itkGetConstMacro( NumberOfApproximationTerms, unsigned int );
+
+  /** Set/Get whether the Lie brackets are computed on planar fields (default off). */
+  itkSetMacro( UsePlanarFields, bool );
+  itkGetConstMacro( UsePlanarFields, bool );
+  itkBooleanMacro( UsePlanarFields );
 protected:
   VelocityFieldBCHCompositionFilter();
   ~VelocityFieldBCHCompositionFilter()
@@ -77,6 +88,9 @@ protected:
    */
   void GenerateData();
 
+  /** BCH approximation computed on planar fields. */
+  void GeneratePlanarData();
+
   /** Adder type. */
   typedef NaryAddImageFilter<InputFieldType, InputFieldType> AdderType;
   typedef typename AdderType::Pointer                        AdderPointer;
@@ -90,6 +104,10 @@ protected:
           itk::Image<double,InputFieldType::ImageDimension>, InputFieldType> MultiplierType;
   typedef typename MultiplierType::Pointer                                   MultiplierPointer;
 
+  /** Planar field type. */
+  typedef PlanarVectorField<InputFieldType>    PlanarFieldType;
+  typedef typename PlanarFieldType::Pointer    PlanarFieldPointer;
+
   /** Set/Get the adder. */
   itkSetObjectMacro( Adder, AdderType );
   itkGetObjectMacro( Adder, AdderType );
@@ -129,6 +147,13 @@ private:
   MultiplierPointer       m_MultiplierByTwelfth;
   unsigned int            m_NumberOfApproximationTerms;
 
+  // Planar fields, kept between updates
+  bool                    m_UsePlanarFields;
+  PlanarFieldPointer      m_PlanarLeft;
+  PlanarFieldPointer      m_PlanarRight;
+  PlanarFieldPointer      m_PlanarFirstOrder;
+  PlanarFieldPointer      m_PlanarSecondOrder;
+
 };
 
 } // end namespace itk
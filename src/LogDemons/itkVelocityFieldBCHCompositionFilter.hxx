@@ -36,6 +36,12 @@ VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
 
   m_MultiplierByHalf->SetConstant( 0.5 );
   m_MultiplierByTwelfth->SetConstant( 1.0 / 12.0 );
+
+  m_UsePlanarFields = false;
+  m_PlanarLeft = PlanarFieldType::New();
+  m_PlanarRight = PlanarFieldType::New();
+  m_PlanarFirstOrder = PlanarFieldType::New();
+  m_PlanarSecondOrder = PlanarFieldType::New();
 }
 
 /**
@@ -54,6 +60,7 @@ VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
   os << indent << "MultiplierByHalf: " << m_MultiplierByHalf << std::endl;
   os << indent << "MultiplierByTwelfth: " << m_MultiplierByTwelfth << std::endl;
   os << indent << "NumberOfApproximationTerms: " << m_NumberOfApproximationTerms << std::endl;
+  os << indent << "UsePlanarFields: " << m_UsePlanarFields << std::endl;
 }
 
 /**
@@ -64,6 +71,21 @@ void
 VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
 ::GenerateData()
 {
+  // The internal filters run with the threads of this filter
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+  m_Adder->SetNumberOfThreads( numberOfThreads );
+  m_LieBracketFilterFirstOrder->SetNumberOfThreads( numberOfThreads );
+  m_LieBracketFilterSecondOrder->SetNumberOfThreads( numberOfThreads );
+  m_MultiplierByHalf->SetNumberOfThreads( numberOfThreads );
+  m_MultiplierByTwelfth->SetNumberOfThreads( numberOfThreads );
+
+  if( m_UsePlanarFields
+      && ( m_NumberOfApproximationTerms == 3 || m_NumberOfApproximationTerms == 4 ) )
+    {
+    this->GeneratePlanarData();
+    return;
+    }
+
   InputFieldConstPointer leftField = this->GetInput(0);
   InputFieldConstPointer rightField = this->GetInput(1);
 
@@ -156,6 +178,43 @@ VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
   this->GraftOutput( m_Adder->GetOutput() );
 }
 
+/**
+ * GeneratePlanarData()
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
+::GeneratePlanarData()
+{
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+  m_PlanarLeft->SetNumberOfThreads( numberOfThreads );
+  m_PlanarRight->SetNumberOfThreads( numberOfThreads );
+  m_PlanarFirstOrder->SetNumberOfThreads( numberOfThreads );
+  m_PlanarSecondOrder->SetNumberOfThreads( numberOfThreads );
+
+  // The inputs are copied before the output is allocated, so that the
+  // output can be grafted on the first input
+  m_PlanarLeft->Scatter( this->GetInput(0) );
+  m_PlanarRight->Scatter( this->GetInput(1) );
+
+  // liebracket(lf,rf)
+  m_PlanarFirstOrder->ComputeLieBracket( m_PlanarLeft, m_PlanarRight );
+
+  // lf + rf + 0.5*liebracket(lf,rf)
+  m_PlanarRight->AddScaled( m_PlanarLeft, 1.0 );
+  m_PlanarRight->AddScaled( m_PlanarFirstOrder, 0.5 );
+
+  if( m_NumberOfApproximationTerms == 4 )
+    {
+    // + (1/12)*liebracket(lf,*liebracket(lf,rf)), as the filters above
+    m_PlanarSecondOrder->ComputeLieBracket( m_PlanarLeft, m_PlanarFirstOrder );
+    m_PlanarRight->AddScaled( m_PlanarSecondOrder, 1.0 / 12.0 );
+    }
+
+  this->AllocateOutputs();
+  m_PlanarRight->Gather( this->GetOutput() );
+}
+
 } // end namespace itk
 
 #endif
@@ -0,0 +1,173 @@
+#ifndef __itkVelocityFieldUpsampleImageFilter_h
+#define __itkVelocityFieldUpsampleImageFilter_h
+
+#include <itkImageToImageFilter.h>
+#include <vnl/vnl_math.h>
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class VelocityFieldUpsampleImageFilter
+ * \brief Linearly resample a vector field onto a grid with the same
+ * orientation, typically the next level of a dyadic pyramid, and scale it.
+ *
+ * Because both grids share the same direction, the continuous input index of
+ * an output voxel is an affine function of its index along each axis
+ * separately. The input indices and linear weights are therefore computed once
+ * per axis, and each output vector is the tensor-product combination of the
+ * 2^N neighbouring input vectors, multiplied by the scale factor in the same
+ * sweep. Outside of the input, the nearest input vector is used, as with
+ * VectorLinearInterpolateNearestNeighborExtrapolateImageFunction.
+ *
+ * This is the fast path of VectorResampleImageFilter for moving a velocity
+ * field from one level of a MultiResolutionPyramidImageFilter to the next,
+ * followed by a MultiplyByConstantImageFilter. If the directions differ,
+ * an exception is thrown and the generic resampler must be used instead.
+ *
+ * \warning This filter assumes that the input and output field types have
+ * the same number of dimensions.
+ */
+template <class TInputImage, class TOutputImage = TInputImage>
+class ITK_EXPORT VelocityFieldUpsampleImageFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef VelocityFieldUpsampleImageFilter              Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef SmartPointer<Self>                            Pointer;
+  typedef SmartPointer<const Self>                      ConstPointer;
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                           InputFieldType;
+  typedef typename InputFieldType::PixelType    InputFieldPixelType;
+  typedef typename InputFieldType::Pointer      InputFieldPointer;
+  typedef typename InputFieldType::ConstPointer InputFieldConstPointer;
+  typedef typename InputFieldType::RegionType   InputFieldRegionType;
+  typedef typename InputFieldType::OffsetValueType OffsetValueType;
+
+  typedef TOutputImage                           OutputFieldType;
+  typedef typename OutputFieldType::PixelType    OutputFieldPixelType;
+  typedef typename OutputFieldType::Pointer      OutputFieldPointer;
+  typedef typename OutputFieldType::RegionType   OutputFieldRegionType;
+  typedef typename OutputFieldType::SizeType     SizeType;
+  typedef typename OutputFieldType::IndexType    IndexType;
+  typedef typename OutputFieldType::PointType    PointType;
+  typedef typename OutputFieldType::SpacingType  SpacingType;
+  typedef typename OutputFieldType::DirectionType DirectionType;
+  typedef typename OutputFieldPixelType::ValueType OutputFieldValueType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( VelocityFieldUpsampleImageFilter, ImageToImageFilter );
+
+  /** ImageDimension constants */
+  itkStaticConstMacro( InputFieldDimension, unsigned int,
+                       TInputImage::ImageDimension);
+  itkStaticConstMacro( OutputFieldDimension, unsigned int,
+                       TOutputImage::ImageDimension);
+  itkStaticConstMacro( OutputFieldPixelDimension, unsigned int,
+                       OutputFieldPixelType::Dimension );
+
+  /** Set/Get the geometry of the output grid. */
+  itkSetMacro( Size, SizeType );
+  itkGetConstReferenceMacro( Size, SizeType );
+  itkSetMacro( OutputStartIndex, IndexType );
+  itkGetConstReferenceMacro( OutputStartIndex, IndexType );
+  itkSetMacro( OutputOrigin, PointType );
+  itkGetConstReferenceMacro( OutputOrigin, PointType );
+  itkSetMacro( OutputSpacing, SpacingType );
+  itkGetConstReferenceMacro( OutputSpacing, SpacingType );
+  itkSetMacro( OutputDirection, DirectionType );
+  itkGetConstReferenceMacro( OutputDirection, DirectionType );
+
+  /** Take the output grid from an image. */
+  template <class TReferenceImage>
+  void SetOutputParametersFromImage( const TReferenceImage * image )
+  {
+    this->SetSize( image->GetLargestPossibleRegion().GetSize() );
+    this->SetOutputStartIndex( image->GetLargestPossibleRegion().GetIndex() );
+    this->SetOutputOrigin( image->GetOrigin() );
+    this->SetOutputSpacing( image->GetSpacing() );
+    this->SetOutputDirection( image->GetDirection() );
+  }
+
+  /** Set/Get the factor applied to the resampled vectors (default 1). */
+  itkSetMacro( Scale, double );
+  itkGetConstMacro( Scale, double );
+
+  /** Return true if the field can be resampled by this filter onto the grid
+   * of the reference image, i.e. if both grids have the same direction. */
+  template <class TReferenceImage>
+  static bool CanResample( const InputFieldType * field, const TReferenceImage * image )
+  {
+    for( unsigned int i = 0; i < InputFieldDimension; i++ )
+      {
+      for( unsigned int j = 0; j < InputFieldDimension; j++ )
+        {
+        if( vnl_math_abs( field->GetDirection()[i][j] - image->GetDirection()[i][j] ) > 1e-6 )
+          {
+          return false;
+          }
+        }
+      }
+    return true;
+  }
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(SameDimensionCheck1,
+                  (Concept::SameDimension<InputFieldDimension, OutputFieldDimension> ) );
+  /** End concept checking */
+#endif
+protected:
+  VelocityFieldUpsampleImageFilter();
+  ~VelocityFieldUpsampleImageFilter()
+  {
+  };
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The output grid is given by the Output* parameters. */
+  virtual void GenerateOutputInformation();
+
+  /** The whole input is needed. */
+  virtual void GenerateInputRequestedRegion();
+
+  /** Compute the per-axis interpolation tables. */
+  void BeforeThreadedGenerateData();
+
+  /** Resample and scale the output region of the thread. */
+  void ThreadedGenerateData(const OutputFieldRegionType& outputRegionForThread, ThreadIdType threadId );
+
+private:
+  VelocityFieldUpsampleImageFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                   // purposely not implemented
+
+  SizeType       m_Size;
+  IndexType      m_OutputStartIndex;
+  PointType      m_OutputOrigin;
+  SpacingType    m_OutputSpacing;
+  DirectionType  m_OutputDirection;
+  double         m_Scale;
+
+  /** Per axis, for each output index: buffer offsets of the lower and upper
+   * input neighbours along that axis, and weight of the upper one. */
+  std::vector<OffsetValueType>  m_LowerOffset[OutputFieldDimension];
+  std::vector<OffsetValueType>  m_UpperOffset[OutputFieldDimension];
+  std::vector<double>           m_UpperWeight[OutputFieldDimension];
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVelocityFieldUpsampleImageFilter.hxx"
+#endif
+
+#endif
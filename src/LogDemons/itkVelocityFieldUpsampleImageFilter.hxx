@@ -0,0 +1,212 @@
+#ifndef __itkVelocityFieldUpsampleImageFilter_txx
+#define __itkVelocityFieldUpsampleImageFilter_txx
+#include "itkVelocityFieldUpsampleImageFilter.h"
+
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkProgressReporter.h>
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TInputImage, class TOutputImage>
+VelocityFieldUpsampleImageFilter<TInputImage, TOutputImage>
+::VelocityFieldUpsampleImageFilter()
+{
+  m_Size.Fill( 0 );
+  m_OutputStartIndex.Fill( 0 );
+  m_OutputOrigin.Fill( 0.0 );
+  m_OutputSpacing.Fill( 1.0 );
+  m_OutputDirection.SetIdentity();
+  m_Scale = 1.0;
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldUpsampleImageFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "Size: " << m_Size << std::endl;
+  os << indent << "OutputStartIndex: " << m_OutputStartIndex << std::endl;
+  os << indent << "OutputOrigin: " << m_OutputOrigin << std::endl;
+  os << indent << "OutputSpacing: " << m_OutputSpacing << std::endl;
+  os << indent << "OutputDirection: " << m_OutputDirection << std::endl;
+  os << indent << "Scale: " << m_Scale << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldUpsampleImageFilter<TInputImage, TOutputImage>
+::GenerateOutputInformation()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateOutputInformation();
+
+  OutputFieldPointer outputPtr = this->GetOutput();
+  if( !outputPtr )
+    {
+    return;
+    }
+
+  OutputFieldRegionType outputLargestPossibleRegion;
+  outputLargestPossibleRegion.SetSize( m_Size );
+  outputLargestPossibleRegion.SetIndex( m_OutputStartIndex );
+
+  outputPtr->SetLargestPossibleRegion( outputLargestPossibleRegion );
+  outputPtr->SetOrigin( m_OutputOrigin );
+  outputPtr->SetSpacing( m_OutputSpacing );
+  outputPtr->SetDirection( m_OutputDirection );
+}
+
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldUpsampleImageFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  InputFieldPointer inputPtr = const_cast<InputFieldType *>( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldUpsampleImageFilter<TInputImage, TOutputImage>
+::BeforeThreadedGenerateData()
+{
+  InputFieldConstPointer inputPtr = this->GetInput();
+
+  if( !CanResample( inputPtr.GetPointer(), this->GetOutput() ) )
+    {
+    itkExceptionMacro( << "Input and output directions differ, use a VectorResampleImageFilter instead" );
+    }
+
+  const InputFieldRegionType & bufferedRegion = inputPtr->GetBufferedRegion();
+  const OffsetValueType * offsetTable = inputPtr->GetOffsetTable();
+
+  // Same direction: the continuous input index along axis d only depends
+  // on the output index along axis d
+  const DirectionType & direction = inputPtr->GetDirection();
+  const PointType & inputOrigin = inputPtr->GetOrigin();
+  const SpacingType & inputSpacing = inputPtr->GetSpacing();
+
+  for( unsigned int d = 0; d < OutputFieldDimension; d++ )
+    {
+    double shift = 0.0;
+    for( unsigned int k = 0; k < OutputFieldDimension; k++ )
+      {
+      // The inverse of a direction matrix is its transpose
+      shift += direction[k][d] * ( m_OutputOrigin[k] - inputOrigin[k] );
+      }
+    shift /= inputSpacing[d];
+    const double ratio = m_OutputSpacing[d] / inputSpacing[d];
+
+    const long first = bufferedRegion.GetIndex()[d];
+    const long last  = first + static_cast<long>( bufferedRegion.GetSize()[d] ) - 1;
+
+    m_LowerOffset[d].resize( m_Size[d] );
+    m_UpperOffset[d].resize( m_Size[d] );
+    m_UpperWeight[d].resize( m_Size[d] );
+
+    for( unsigned long i = 0; i < m_Size[d]; i++ )
+      {
+      double cindex = shift + ratio * static_cast<double>( m_OutputStartIndex[d] + static_cast<long>( i ) );
+
+      // Nearest neighbour extrapolation
+      cindex = vnl_math_max( cindex, static_cast<double>( first ) );
+      cindex = vnl_math_min( cindex, static_cast<double>( last ) );
+
+      long lower = static_cast<long>( vcl_floor( cindex ) );
+      long upper = vnl_math_min( lower + 1, last );
+
+      m_LowerOffset[d][i] = ( lower - first ) * offsetTable[d];
+      m_UpperOffset[d][i] = ( upper - first ) * offsetTable[d];
+      m_UpperWeight[d][i] = cindex - static_cast<double>( lower );
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldUpsampleImageFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData(const OutputFieldRegionType& outputRegionForThread, ThreadIdType threadId )
+{
+  InputFieldConstPointer inputPtr = this->GetInput();
+  OutputFieldPointer outputPtr = this->GetOutput();
+
+  const InputFieldPixelType * inputBuffer = inputPtr->GetBufferPointer();
+  const unsigned int numberOfCorners = 1u << OutputFieldDimension;
+
+  ImageRegionIteratorWithIndex<OutputFieldType> outputIt( outputPtr, outputRegionForThread );
+
+  // support progress methods/callbacks
+  ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels() );
+
+  double sum[OutputFieldPixelDimension];
+  OutputFieldPixelType outputPixel;
+
+  for( outputIt.GoToBegin(); !outputIt.IsAtEnd(); ++outputIt )
+    {
+    const IndexType index = outputIt.GetIndex();
+
+    for( unsigned int k = 0; k < OutputFieldPixelDimension; k++ )
+      {
+      sum[k] = 0.0;
+      }
+
+    // Tensor product of the per-axis linear weights
+    for( unsigned int corner = 0; corner < numberOfCorners; corner++ )
+      {
+      double          weight = 1.0;
+      OffsetValueType offset = 0;
+      for( unsigned int d = 0; d < OutputFieldDimension; d++ )
+        {
+        const unsigned long i = index[d] - m_OutputStartIndex[d];
+        if( corner & ( 1u << d ) )
+          {
+          weight *= m_UpperWeight[d][i];
+          offset += m_UpperOffset[d][i];
+          }
+        else
+          {
+          weight *= 1.0 - m_UpperWeight[d][i];
+          offset += m_LowerOffset[d][i];
+          }
+        }
+
+      if( weight == 0.0 )
+        {
+        continue;
+        }
+
+      const InputFieldPixelType & value = inputBuffer[offset];
+      for( unsigned int k = 0; k < OutputFieldPixelDimension; k++ )
+        {
+        sum[k] += weight * value[k];
+        }
+      }
+
+    for( unsigned int k = 0; k < OutputFieldPixelDimension; k++ )
+      {
+      outputPixel[k] = static_cast<OutputFieldValueType>( m_Scale * sum[k] );
+      }
+    outputIt.Set( outputPixel );
+
+    progress.CompletedPixel();
+    }
+}
+
+} // end namespace itk
+
+#endif
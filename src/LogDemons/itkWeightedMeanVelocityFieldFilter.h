@@ -0,0 +1,118 @@
+#ifndef __itkWeightedMeanVelocityFieldFilter_h
+#define __itkWeightedMeanVelocityFieldFilter_h
+
+#include <itkImageToImageFilter.h>
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class WeightedMeanVelocityFieldFilter
+ * \brief Compute the weighted arithmetic mean of N stationary velocity fields.
+ *
+ * The Log-Euclidean barycenter of the diffeomorphisms exp(v_i) is the
+ * exponential of the weighted mean of their velocity fields, which makes this
+ * filter the field counterpart of sdtools::GetLogEuclideanBarycenter.
+ *
+ * The mean is accumulated in double precision whatever the pixel types. Each
+ * thread walks its output region once per input, so that only one input is
+ * touched at a time. The filter does not enlarge the requested region: when
+ * it is fed by ImageFileReaders and followed by a streaming writer (see
+ * ImageFileWriter::SetNumberOfStreamDivisions), every input is read slab by
+ * slab and the whole set of fields never needs to be held in memory.
+ *
+ * If NormalizeWeights is on (default), the weights are divided by their sum.
+ * If no weights are given, all fields have the same weight.
+ *
+ * \warning All the inputs must share the same largest possible region.
+ */
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT WeightedMeanVelocityFieldFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef WeightedMeanVelocityFieldFilter               Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef SmartPointer<Self>                            Pointer;
+  typedef SmartPointer<const Self>                      ConstPointer;
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                           InputFieldType;
+  typedef typename InputFieldType::PixelType    InputFieldPixelType;
+  typedef typename InputFieldType::ConstPointer InputFieldConstPointer;
+
+  typedef TOutputImage                           OutputFieldType;
+  typedef typename OutputFieldType::PixelType    OutputFieldPixelType;
+  typedef typename OutputFieldType::Pointer      OutputFieldPointer;
+  typedef typename OutputFieldType::RegionType   OutputFieldRegionType;
+  typedef typename OutputFieldPixelType::ValueType OutputFieldValueType;
+
+  typedef std::vector<double> WeightsType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( WeightedMeanVelocityFieldFilter, ImageToImageFilter );
+
+  /** ImageDimension constants */
+  itkStaticConstMacro( InputFieldPixelDimension, unsigned int,
+                       InputFieldPixelType::Dimension );
+  itkStaticConstMacro( OutputFieldPixelDimension, unsigned int,
+                       OutputFieldPixelType::Dimension );
+
+  /** Set/Get the weight of each input field. */
+  void SetWeights( const WeightsType & weights )
+  {
+    m_Weights = weights;
+    this->Modified();
+  }
+
+  const WeightsType & GetWeights() const
+  {
+    return m_Weights;
+  }
+
+  /** Divide the weights by their sum (default: on). */
+  itkSetMacro( NormalizeWeights, bool );
+  itkGetConstMacro( NormalizeWeights, bool );
+  itkBooleanMacro( NormalizeWeights );
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(SamePixelDimensionCheck,
+                  (Concept::SameDimension<InputFieldPixelDimension, OutputFieldPixelDimension> ) );
+  /** End concept checking */
+#endif
+protected:
+  WeightedMeanVelocityFieldFilter();
+  ~WeightedMeanVelocityFieldFilter()
+  {
+  };
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  void BeforeThreadedGenerateData();
+
+  void ThreadedGenerateData(const OutputFieldRegionType& outputRegionForThread, ThreadIdType threadId );
+
+private:
+  WeightedMeanVelocityFieldFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                  // purposely not implemented
+
+  WeightsType m_Weights;
+  WeightsType m_ActualWeights;
+  bool        m_NormalizeWeights;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkWeightedMeanVelocityFieldFilter.hxx"
+#endif
+
+#endif
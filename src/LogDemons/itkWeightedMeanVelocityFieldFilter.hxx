@@ -0,0 +1,150 @@
+#ifndef __itkWeightedMeanVelocityFieldFilter_txx
+#define __itkWeightedMeanVelocityFieldFilter_txx
+#include "itkWeightedMeanVelocityFieldFilter.h"
+
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIterator.h>
+#include <itkProgressReporter.h>
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TInputImage, class TOutputImage>
+WeightedMeanVelocityFieldFilter<TInputImage, TOutputImage>
+::WeightedMeanVelocityFieldFilter()
+{
+  m_NormalizeWeights = true;
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedMeanVelocityFieldFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "NumberOfWeights: " << m_Weights.size() << std::endl;
+  os << indent << "NormalizeWeights: " << (m_NormalizeWeights ? "On" : "Off") << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedMeanVelocityFieldFilter<TInputImage, TOutputImage>
+::BeforeThreadedGenerateData()
+{
+  const unsigned int numInputs = this->GetNumberOfInputs();
+
+  if( numInputs == 0 )
+    {
+    itkExceptionMacro( << "No input velocity field" );
+    }
+
+  // Check that all the fields are defined on the same grid
+  for( unsigned int i = 1; i < numInputs; i++ )
+    {
+    if( this->GetInput(i)->GetLargestPossibleRegion() != this->GetInput(0)->GetLargestPossibleRegion() )
+      {
+      itkExceptionMacro( << "Input velocity field " << i << " does not have the same size as the first one" );
+      }
+    }
+
+  // Compute the actual weights
+  if( m_Weights.empty() )
+    {
+    m_ActualWeights.assign( numInputs, 1.0 );
+    }
+  else if( m_Weights.size() == numInputs )
+    {
+    m_ActualWeights = m_Weights;
+    }
+  else
+    {
+    itkExceptionMacro( << "Number of weights (" << m_Weights.size()
+                       << ") is different from the number of inputs (" << numInputs << ")" );
+    }
+
+  if( m_NormalizeWeights || m_Weights.empty() )
+    {
+    double sum = 0.0;
+    for( unsigned int i = 0; i < numInputs; i++ )
+      {
+      sum += m_ActualWeights[i];
+      }
+
+    if( sum == 0.0 )
+      {
+      itkExceptionMacro( << "Sum of weights is zero" );
+      }
+
+    for( unsigned int i = 0; i < numInputs; i++ )
+      {
+      m_ActualWeights[i] /= sum;
+      }
+    }
+}
+
+/**
+ * ThreadedGenerateData()
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedMeanVelocityFieldFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData( const OutputFieldRegionType & outputRegionForThread,
+                        ThreadIdType threadId)
+{
+  const unsigned int numInputs = this->GetNumberOfInputs();
+  const unsigned int numComponents = OutputFieldPixelDimension;
+
+  ProgressReporter progress(this, threadId, numInputs + 1);
+
+  typedef ImageRegionConstIterator<InputFieldType> InputFieldIteratorType;
+  typedef ImageRegionIterator<OutputFieldType>     OutputFieldIteratorType;
+
+  // Double precision accumulator for the region of this thread
+  std::vector<double> accumulator( outputRegionForThread.GetNumberOfPixels() * numComponents, 0.0 );
+
+  for( unsigned int i = 0; i < numInputs; i++ )
+    {
+    const double weight = m_ActualWeights[i];
+
+    InputFieldIteratorType inputIter( this->GetInput(i), outputRegionForThread );
+
+    double *acc = &accumulator[0];
+    for( inputIter.GoToBegin(); !inputIter.IsAtEnd(); ++inputIter )
+      {
+      const InputFieldPixelType & val = inputIter.Value();
+      for( unsigned int d = 0; d < numComponents; d++ )
+        {
+        acc[d] += weight * val[d];
+        }
+      acc += numComponents;
+      }
+
+    progress.CompletedPixel(); // not really a pixel but an input field
+    }
+
+  OutputFieldIteratorType outputIter( this->GetOutput(), outputRegionForThread );
+
+  const double *acc = &accumulator[0];
+  for( outputIter.GoToBegin(); !outputIter.IsAtEnd(); ++outputIter )
+    {
+    OutputFieldPixelType & outVal = outputIter.Value();
+    for( unsigned int d = 0; d < numComponents; d++ )
+      {
+      outVal[d] = static_cast<OutputFieldValueType>( acc[d] );
+      }
+    acc += numComponents;
+    }
+
+  progress.CompletedPixel();
+}
+
+} // end namespace itk
+
+#endif
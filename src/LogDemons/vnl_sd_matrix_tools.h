@@ -2,6 +2,7 @@
 #define __vnl_sd_matrix_tools_h
 
 #include <vnl/vnl_matrix.h>
+#include <vnl/vnl_matrix_fixed.h>
 #include <vector>
 
 /**
@@ -67,6 +68,33 @@ vnl_matrix<T> GetGroupBarycenter(const std::vector<vnl_matrix<T> > & matrices, c
 template <class T>
 vnl_matrix<T> GetArithmeticBarycenter(const std::vector<vnl_matrix<T> > & matrices, const std::vector<T> & weights);
 
+/**
+ * Fixed-size 3x3 versions of the functions above. They follow the same
+ * algorithms but work on stack-allocated matrices, use closed-form
+ * determinants and inverses, and never print warnings, so that they can be
+ * called at every voxel of a field from several threads. numApprox must be
+ * 1, 2 or 3: it is asserted, not checked, so the callers validate it once.
+ **/
+template <class T>
+vnl_matrix_fixed<T, 3, 3> GetInverse(const vnl_matrix_fixed<T, 3, 3> & m);
+
+template <class T>
+T GetDeterminant(const vnl_matrix_fixed<T, 3, 3> & m);
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3> GetSquareRoot(const vnl_matrix_fixed<T, 3, 3> & m, const T precision,
+                                        vnl_matrix_fixed<T, 3, 3> & resultM);
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3> GetPadeLogarithm(const vnl_matrix_fixed<T, 3, 3> & m, const int numApprox);
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3> GetLogarithm(const vnl_matrix_fixed<T, 3, 3> & m, const T square_root_precision = 1e-11,
+                                       const int numApprox = 1);
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3> GetExponential(const vnl_matrix_fixed<T, 3, 3> & m, const int numApprox = 3);
+
 } // end namespace
 
 #include "vnl_sd_matrix_tools.hxx"
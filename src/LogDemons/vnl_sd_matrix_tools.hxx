@@ -3,6 +3,7 @@
 
 #include "vnl_sd_matrix_tools.h"
 
+#include <cassert>
 #include <exception>
 #include <vnl/vnl_math.h>
 #include <vnl/algo/vnl_determinant.h>
@@ -472,6 +473,229 @@ GetArithmeticBarycenter(const std::vector<vnl_matrix<T> > & matrices,
   return bar;
 }
 
+template <class T>
+T
+GetDeterminant(const vnl_matrix_fixed<T, 3, 3> & m)
+{
+  return m(0, 0) * ( m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1) )
+         - m(0, 1) * ( m(1, 0) * m(2, 2) - m(1, 2) * m(2, 0) )
+         + m(0, 2) * ( m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0) );
+}
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3>
+GetInverse(const vnl_matrix_fixed<T, 3, 3> & m)
+{
+  const T                   invdet = static_cast<T>(1.0) / GetDeterminant(m);
+  vnl_matrix_fixed<T, 3, 3> invmat;
+
+  invmat(0, 0) = (m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1) ) * invdet;
+  invmat(0, 1) = (m(2, 1) * m(0, 2) - m(2, 2) * m(0, 1) ) * invdet;
+  invmat(0, 2) = (m(0, 1) * m(1, 2) - m(0, 2) * m(1, 1) ) * invdet;
+  invmat(1, 0) = (m(1, 2) * m(2, 0) - m(1, 0) * m(2, 2) ) * invdet;
+  invmat(1, 1) = (m(0, 0) * m(2, 2) - m(0, 2) * m(2, 0) ) * invdet;
+  invmat(1, 2) = (m(1, 0) * m(0, 2) - m(1, 2) * m(0, 0) ) * invdet;
+  invmat(2, 0) = (m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0) ) * invdet;
+  invmat(2, 1) = (m(0, 1) * m(2, 0) - m(0, 0) * m(2, 1) ) * invdet;
+  invmat(2, 2) = (m(0, 0) * m(1, 1) - m(0, 1) * m(1, 0) ) * invdet;
+  return invmat;
+}
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3>
+GetSquareRoot(const vnl_matrix_fixed<T, 3, 3> & m,
+              const T precision,
+              vnl_matrix_fixed<T, 3, 3> & resultM)
+{
+  // Same product form Denman-Beavers iteration as the vnl_matrix version
+  unsigned int       niter = 1;
+  const unsigned int niterMax = 100;
+
+  vnl_matrix_fixed<T, 3, 3> Mk( m );
+  vnl_matrix_fixed<T, 3, 3> Yk( m );
+  vnl_matrix_fixed<T, 3, 3> invMk;
+
+  vnl_matrix_fixed<T, 3, 3> Id;
+  Id.set_identity();
+
+  T energy = (Yk * Yk - m).frobenius_norm();
+
+  while( (niter <= niterMax) && (energy > precision) )
+    {
+    const T gamma = vcl_pow(vcl_abs(GetDeterminant(Mk) ), -1.0 / 6.0 );
+    const T gamma2 = gamma * gamma;
+    invMk = GetInverse(Mk);
+
+    Yk = Yk * (Id + invMk / gamma2) * (static_cast<T>(0.5) * gamma);
+    Mk = ( Id + (Mk * gamma2 + invMk / gamma2) * static_cast<T>(0.5) ) * static_cast<T>(0.5);
+
+    energy = (Yk * Yk - m).frobenius_norm();
+
+    ++niter;
+    }
+
+  resultM = Mk;
+  return Yk;
+}
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3>
+GetPadeLogarithm(const vnl_matrix_fixed<T, 3, 3> & m,
+                 const int numApprox)
+{
+  // The order is validated by the callers (the filters clamp it), so it is
+  // only asserted here rather than checked at every voxel.
+  //
+  // Unlike the vnl_matrix version, there is no check that \|m-Id\| <= 0.5:
+  // GetLogarithm only calls this function once the square roots have brought
+  // the matrix within 0.005 of Id. If they did not converge (real negative
+  // eigenvalues), the vnl_matrix version returned m itself, which is not a
+  // better estimate of the logarithm than the Pade approximant.
+  assert( numApprox >= 1 && numApprox <= 3 );
+
+  vnl_matrix_fixed<T, 3, 3> Id;
+  Id.set_identity();
+
+  const vnl_matrix_fixed<T, 3, 3> diff = Id - m;
+  vnl_matrix_fixed<T, 3, 3>       interm2, interm3;
+
+  switch( numApprox )
+    {
+    case 1:
+      {
+      interm2 = -diff;
+      interm3 = Id - diff * static_cast<T>(0.5);
+      break;
+      }
+    case 2:
+      {
+      const vnl_matrix_fixed<T, 3, 3> sqr = diff * diff;
+
+      interm2 = sqr * static_cast<T>(0.5) - diff;
+      interm3 = Id - diff + sqr;
+      break;
+      }
+    default: // 3
+      {
+      const vnl_matrix_fixed<T, 3, 3> sqr  = diff * diff;
+      const vnl_matrix_fixed<T, 3, 3> cube = sqr * diff;
+
+      const T tmpcst = 11.0 / 60.0;
+
+      interm2 = sqr + cube * tmpcst - diff;
+      interm3 = Id - diff * static_cast<T>(1.5) + sqr * static_cast<T>(0.6) - cube * static_cast<T>(0.05);
+      break;
+      }
+    }
+
+  return interm2 * GetInverse(interm3);
+}
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3>
+GetLogarithm(const vnl_matrix_fixed<T, 3, 3> & m,
+             const T square_root_precision,
+             const int numApprox)
+{
+  T factor = 1.0;
+
+  vnl_matrix_fixed<T, 3, 3> Id;
+  Id.set_identity();
+  vnl_matrix_fixed<T, 3, 3> resultM;
+
+  const unsigned int niterMax = 100;
+  unsigned int       niter = 1;
+
+  vnl_matrix_fixed<T, 3, 3> Yi( m );
+  T                         energy = (Yi - Id).frobenius_norm();
+  vnl_matrix_fixed<T, 3, 3> matrix_sum( static_cast<T>(0.0) );
+
+  while( (energy > 0.005) && (niter <= niterMax) )
+    {
+    Yi = GetSquareRoot(Yi, square_root_precision, resultM);
+
+    matrix_sum += (Id - resultM) * factor;
+
+    energy = (Yi - Id).frobenius_norm();
+
+    factor *= 2.0;
+    ++niter;
+    }
+
+  return GetPadeLogarithm(Yi, numApprox) * factor + matrix_sum;
+}
+
+template <class T>
+vnl_matrix_fixed<T, 3, 3>
+GetExponential(const vnl_matrix_fixed<T, 3, 3> & m,
+               const int numApprox)
+{
+  assert( numApprox >= 1 && numApprox <= 3 );
+
+  vnl_matrix_fixed<T, 3, 3> Id;
+  Id.set_identity();
+  vnl_matrix_fixed<T, 3, 3> interm2, interm3;
+
+  const T norm = m.frobenius_norm();
+  int     k;
+
+  if( norm > 1 )
+    {
+    k = 1 + static_cast<int>( vcl_ceil( vcl_log(norm) / vnl_math::ln2 ) );
+    }
+  else if( norm > 0.5 )
+    {
+    k = 1;
+    }
+  else
+    {
+    k = 0;
+    }
+
+  // Set factor to 2^k
+  const T                   factor(1 << k);
+  vnl_matrix_fixed<T, 3, 3> interm = m / factor;
+
+  switch( numApprox )
+    {
+    case 1:
+      {
+      interm2 = Id + interm * static_cast<T>(0.5);
+      interm3 = Id - interm * static_cast<T>(0.5);
+      break;
+      }
+    case 2:
+      {
+      const vnl_matrix_fixed<T, 3, 3> sqr = interm * interm;
+
+      const T tmpcst = 1.0 / 12.0;
+
+      interm2 = Id + interm * static_cast<T>(0.5) + sqr * tmpcst;
+      interm3 = Id - interm * static_cast<T>(0.5) + sqr * tmpcst;
+      break;
+      }
+    default: // 3
+      {
+      const vnl_matrix_fixed<T, 3, 3> sqr  = interm * interm;
+      const vnl_matrix_fixed<T, 3, 3> cube = sqr * interm;
+
+      const T tmpcst = 1.0 / 120.0;
+
+      interm2 = Id + interm * static_cast<T>(0.5) + sqr * static_cast<T>(0.1) + cube * tmpcst;
+      interm3 = Id - interm * static_cast<T>(0.5) + sqr * static_cast<T>(0.1) - cube * tmpcst;
+      break;
+      }
+    }
+
+  interm = interm2 * GetInverse(interm3);
+  for( int i = 1; i <= k; ++i )
+    {
+    interm = interm * interm;
+    }
+
+  return interm;
+}
+
 } // end namespace
 
 #endif
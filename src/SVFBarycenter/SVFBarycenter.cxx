@@ -0,0 +1,218 @@
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkWeightedMeanVelocityFieldFilter.h"
+#include <tclap/CmdLine.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+/*
+ * The program computes the Log-Euclidean barycenter of a set of deformations parametrized
+ * by stationary velocity fields (SVF), i.e. the weighted mean of the SVFs:
+ *
+ *   v_mean = sum_i w_i v_i / sum_i w_i     and     exp(v_mean) is the barycenter of the exp(v_i)
+ *
+ * This is the core step of Log-Euclidean template building.
+ *
+ * The SVFs are averaged in double precision by a threaded filter and the output is written
+ * in several stream divisions (slabs). For formats that support streamed reading (e.g. mha,
+ * nrrd or uncompressed nii), every input is only read slab by slab, so that averaging
+ * hundreds of large SVFs only requires about one field in memory.
+ *
+ * The input SVFs are given either on the command line or in a text file containing one
+ * path per line, optionally followed by the weight of that field.
+ */
+
+
+/**
+ * Structure containing the input parameters.
+ */
+struct Param{
+    std::vector<std::string>  SVFImages;
+    std::string               SVFList;
+    std::vector<double>       Weights;
+    std::string               OutputImage;
+    unsigned int              NumberOfStreamDivisions;
+    };
+
+
+/**
+ * Parses the command line arguments and deduces the corresponding Param structure.
+ * @param  argc   number of arguments
+ * @param  argv   array containing the arguments
+ * @param  param  structure of parameters
+ */
+void parseParameters(int argc, char** argv, struct Param & param)
+{
+
+    // Program description
+    std::string description = "\b\b\bDESCRIPTION\n";
+    description += "Streamed Log-Euclidean barycenter (weighted mean) of stationary velocity fields";
+
+    try {
+
+        // Define the command line parser
+        TCLAP::CmdLine cmd( description, ' ', "1.0", true);
+
+        TCLAP::MultiArg<std::string>  arg_SVFImages( "i", "input-svf", "Path to an input stationary velocity field (repeat for each field)", false, "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_SVFList( "l", "input-list", "Path to a text file listing the input stationary velocity fields, one per line, optionally followed by a weight (weights are given for every field or for none)", false, "", "string", cmd );
+        TCLAP::MultiArg<double>       arg_Weights( "w", "weight", "Weight of the corresponding input given with -i (default: uniform weights)", false, "double", cmd );
+        TCLAP::ValueArg<std::string>  arg_OutputImage( "o", "output-svf", "Path of the output mean stationary velocity field (default MeanSVF.mha).", false, "MeanSVF.mha", "string", cmd );
+        TCLAP::ValueArg<unsigned int> arg_NumberOfStreamDivisions( "d", "stream-divisions", "Number of slabs used to stream the computation (default 0: as many as input fields)", false, 0, "uint", cmd );
+
+        // Parse the command line
+        cmd.parse( argc, argv );
+
+        // Set the parameters
+        param.SVFImages                    = arg_SVFImages.getValue();
+        param.SVFList                      = arg_SVFList.getValue();
+        param.Weights                      = arg_Weights.getValue();
+        param.OutputImage                  = arg_OutputImage.getValue();
+        param.NumberOfStreamDivisions      = arg_NumberOfStreamDivisions.getValue();
+        }
+    catch (TCLAP::ArgException &e)
+    {
+        std::cerr << "Error: " << e.error() << " for argument " << e.argId() << std::endl;
+        throw std::runtime_error("Unable to parse the command line arguments.");
+    }
+}
+
+
+/**
+ * Appends the fields (and weights) listed in a text file to the parameters.
+ * Weights are either given for every field (with -w for the fields of -i and
+ * on each line of the list) or for none of them (uniform weights).
+ * @param  param  structure of parameters
+ */
+void readFieldList(struct Param & param)
+{
+    std::ifstream list( param.SVFList.c_str() );
+    if ( !list )
+        throw std::runtime_error("Unable to open the list of input fields.");
+
+    const unsigned int numberOfCommandLineFields = param.SVFImages.size();
+    if ( !param.Weights.empty() && param.Weights.size()!=numberOfCommandLineFields )
+        throw std::runtime_error("The number of weights given with -w is different from the number of fields given with -i.");
+
+    std::vector<double> listWeights;
+    unsigned int numberOfListFields = 0;
+    std::string line;
+    while ( std::getline(list, line) )
+    {
+        std::istringstream stream(line);
+        std::string path;
+        double weight;
+        if ( !(stream >> path) || path[0]=='#' )
+            continue;
+
+        param.SVFImages.push_back(path);
+        numberOfListFields++;
+        if ( stream >> weight )
+            listWeights.push_back(weight);
+    }
+
+    const bool commandLineWeighted = !param.Weights.empty() || numberOfCommandLineFields==0;
+    const bool listWeighted        = listWeights.size()==numberOfListFields;
+    if ( listWeights.empty() && param.Weights.empty() )
+        return;
+    if ( !commandLineWeighted || !listWeighted )
+        throw std::runtime_error("Weights must be given for every field or for none: with -w for the fields of -i "
+                                 "and after the path on each line of the list.");
+
+    param.Weights.insert( param.Weights.end(), listWeights.begin(), listWeights.end() );
+}
+
+
+/**
+  * Prints parameters.
+  * @param  param  structure of parameters
+  */
+void PrintParameters( const struct Param & param )
+{
+
+    // Print I/O parameters
+    std::cout << std::endl;
+    std::cout << "I/O PARAMETERS"                  << std::endl;
+    std::cout << "  Number of input SVFs           : " << param.SVFImages.size() << std::endl;
+    std::cout << "  Weights                        : " << (param.Weights.empty() ? "uniform" : "user defined") << std::endl;
+    std::cout << "  Output image path              : " << param.OutputImage << std::endl;
+    std::cout << "  Stream divisions               : " << param.NumberOfStreamDivisions << std::endl;
+    std::cout << std::endl;
+}
+
+
+int main( int argc, char ** argv )
+{
+
+  //Parsing initial parameters
+  struct Param param;
+  try
+  {
+    parseParameters( argc, argv, param);
+    if ( param.SVFList!="" )
+      readFieldList( param );
+  }
+  catch( std::exception& e )
+  {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if ( param.SVFImages.empty() )
+  {
+    std::cerr << "Error: no input stationary velocity field." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if ( !param.Weights.empty() && param.Weights.size()!=param.SVFImages.size() )
+  {
+    std::cerr << "Error: number of weights (" << param.Weights.size()
+              << ") is different from the number of fields (" << param.SVFImages.size() << ")." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // One slab per input keeps the sum of the slabs held by the readers about one field
+  if ( param.NumberOfStreamDivisions==0 )
+    param.NumberOfStreamDivisions = param.SVFImages.size();
+
+  PrintParameters( param );
+
+  //Definition of the type:
+  typedef itk::Vector<float,3>  VectorPixelType;
+  typedef itk::Image<VectorPixelType,3> VectorImageType;
+
+  typedef itk::ImageFileReader< VectorImageType >  VectorReaderType;
+  typedef itk::WeightedMeanVelocityFieldFilter< VectorImageType, VectorImageType > MeanFilterType;
+  typedef itk::ImageFileWriter< VectorImageType > VectorWriterType;
+
+  MeanFilterType::Pointer mean = MeanFilterType::New();
+  mean->SetWeights( param.Weights );
+
+  // The readers only produce the slab requested by the writer
+  std::vector<VectorReaderType::Pointer> readers( param.SVFImages.size() );
+  for ( unsigned int i=0; i<param.SVFImages.size(); ++i )
+  {
+    readers[i] = VectorReaderType::New();
+    readers[i]->SetFileName( param.SVFImages[i] );
+    readers[i]->ReleaseDataFlagOn();
+    mean->SetInput( i, readers[i]->GetOutput() );
+  }
+
+  VectorWriterType::Pointer writer = VectorWriterType::New();
+  writer->SetInput( mean->GetOutput() );
+  writer->SetFileName( param.OutputImage );
+  writer->SetNumberOfStreamDivisions( param.NumberOfStreamDivisions );
+
+  try
+  {
+    writer->Update();
+  }
+  catch( itk::ExceptionObject& err )
+  {
+    std::cerr << "Error: " << err << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
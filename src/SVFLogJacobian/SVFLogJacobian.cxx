@@ -1,20 +1,17 @@
 #include "itkImage.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
-#include "itkDerivativeImageFilter.h"
-#include "itkVectorIndexSelectionCastImageFilter.h"
-#include "itkAddImageFilter.h"
-#include "itkMultiplyImageFilter.h"
-#include <vnl/vnl_math.h>
-#include <itkImageRegionIterator.h>
-#include <itkDivideByConstantImageFilter.h>
-#include <itkWarpVectorImageFilter.h>
-#include <itkWarpImageFilter.h>
-#include <itkWarpVectorImageFilter.h>
 #include "string.h"
+#include <itksys/SystemTools.hxx>
+#include <itksys/Glob.hxx>
 #include <tclap/CmdLine.h>
-#include <itkExpImageFilter.h>
-#include <itkLogImageFilter.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "SVFLogJacobian.h"
+#include "itkDisplacementFieldLogJacobianTensorFilter.h"
+#include "itkTaskGroup.h"
 
 /*
  * The program implements the iterative computation of the logJacobian scalar map of a deformation field 
@@ -33,6 +30,16 @@
  * The program requires the input SVF image path and the output logJacobian map path. 
  * It is possible to provide a Mask for the computation of scaling step (useful to control boundaries),
  * and to provide a scaling factor for the input SVF.
+ *
+ * In batch mode, the SVFs are given by a list file or a glob pattern. One computation object is
+ * shared by all the SVFs so that its buffers are reused, the next SVF is read while the current
+ * one is computed, and each map is written while the next one is computed.
+ *
+ * Given a label image, the count, mean, standard deviation, quantiles and volume change of the
+ * logJacobian in each label are written to a CSV file, and writing the maps can be skipped.
+ *
+ * The full log-Jacobian tensor map log(Jac(exp(v))) (9 components, row by row) can also be written
+ * for tensor-based morphometry. It is computed from the displacement field of the scaling and squaring loop.
  */
 
 
@@ -41,10 +48,19 @@
  */
 struct Param{
     std::string  SVFImage;
+    std::string  SVFList;
+    std::string  SVFGlob;
+    std::string  OutputDirectory;
+    std::string  OutputSuffix;
     std::string  Mask;
+    std::string  Labels;
+    std::string  OutputStatistics;
     std::string  OutputImage;
+    std::string  OutputDisplacement;
+    std::string  OutputTensor;
     float ScalingFactor;
     bool  NumericalScheme;
+    bool  NoOutputImage;
     };
 
 
@@ -67,9 +83,18 @@ void parseParameters(int argc, char** argv, struct Param & param)
         // Define the command line parser
         TCLAP::CmdLine cmd( description, ' ', "1.0", true);
 
-        TCLAP::ValueArg<std::string>  arg_SVFImage( "i", "input-svf", "Path to the input stationary velocity field", true, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_SVFImage( "i", "input-svf", "Path to the input stationary velocity field", false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_SVFList( "l", "input-list", "Batch mode: path to a text file listing the input stationary velocity fields, one per line, optionally followed by a scaling factor, a mask and an output path (\"-\" for the defaults)", false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_SVFGlob( "g", "input-glob", "Batch mode: glob pattern of the input stationary velocity fields, e.g. \"svf/*.mha\"", false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_OutputDirectory( "", "output-directory", "Batch mode: directory of the output LogJacobian maps (default: directory of each input)", false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_OutputSuffix( "", "output-suffix", "Batch mode: suffix replacing the extension of the inputs in the output paths (default _LogJacobian.mha)", false, "_LogJacobian.mha", "string", cmd );
         TCLAP::ValueArg<std::string>  arg_OutputImage( "o", "output-svf", "Path of the output LogJacobian map (default LogJacobian.mha).", false, "LogJacobian.mha", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_OutputDisplacement( "d", "output-displacement", "Path of the output displacement field exp(svf), computed in the same scaling and squaring loop as the LogJacobian map (default none).", false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_OutputTensor( "t", "output-tensor", "Path of the output log-Jacobian tensor map log(Jac(exp(svf))), 9 components stored row by row, zero where the Jacobian determinant is not positive (default none).", false, "", "string", cmd );
         TCLAP::ValueArg<std::string>  arg_Mask( "m", "mask", "Path to the mask (default whole image)", false, "null", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_Labels( "L", "labels", "Path to a label image: the statistics of the LogJacobian in each label (except 0) are written to --output-statistics (default none)", false, "", "string", cmd );
+        TCLAP::ValueArg<std::string>  arg_OutputStatistics( "", "output-statistics", "Path of the CSV file of the label statistics (default LogJacobianStatistics.csv)", false, "LogJacobianStatistics.csv", "string", cmd );
+        TCLAP::SwitchArg              arg_NoOutputImage( "", "no-map", "Do not write the LogJacobian maps (with --labels, only the statistics are written)", cmd, false );
         TCLAP::ValueArg<double>  arg_ScalingFactor( "s", "scaling-factor", "Scaling factor for the input velocity field (default 1)", false, 1.0, "double", cmd );
 	TCLAP::ValueArg<double>  arg_NumericalScheme( "z", "numerical-scheme", "Numerical scheme for the exponential: 0 Scaling and squarings (default), 1 Forward Euler", false, 0.0, "bool", cmd );
 
@@ -79,8 +104,17 @@ void parseParameters(int argc, char** argv, struct Param & param)
 
         // Set the parameters
         param.SVFImage                     = arg_SVFImage.getValue();
+        param.SVFList                      = arg_SVFList.getValue();
+        param.SVFGlob                      = arg_SVFGlob.getValue();
+        param.OutputDirectory              = arg_OutputDirectory.getValue();
+        param.OutputSuffix                 = arg_OutputSuffix.getValue();
         param.OutputImage                  = arg_OutputImage.getValue();
+        param.OutputDisplacement           = arg_OutputDisplacement.getValue();
+        param.OutputTensor                 = arg_OutputTensor.getValue();
         param.Mask                         = arg_Mask.getValue();
+        param.Labels                       = arg_Labels.getValue();
+        param.OutputStatistics             = arg_OutputStatistics.getValue();
+        param.NoOutputImage                = arg_NoOutputImage.getValue();
         param.ScalingFactor                = arg_ScalingFactor.getValue();
 	param.NumericalScheme              = arg_NumericalScheme.getValue();
         }
@@ -119,344 +153,477 @@ void PrintParameters( std::string SVFImage,
 }
 
 
-int main( int argc, char ** argv )
+/**
+ * Writes the header of the CSV file of the label statistics.
+ * @param  stream  output stream
+ */
+void writeStatisticsHeader(std::ostream & stream)
 {
-  
-  //Parsing initial parameters
-  struct Param param;
-  parseParameters( argc, argv, param);
+    stream << "svf,label,count,mean,std,min,q05,q25,median,q75,q95,max,volume_change,non_finite" << std::endl;
+}
 
-  //Definition of the type:  
-  typedef itk::Vector<float,3>  VectorPixelType;
-  typedef itk::Image<VectorPixelType,3> VectorImageType;	
-  typedef itk::Image<float,3> ImageType;
 
-  //Definition of Reader and Writer Classes:
-  typedef itk::ImageFileReader< ImageType >  ScalarReaderType;
-  typedef itk::ImageFileReader< VectorImageType >  VectorReaderType;
+/**
+ * Writes the label statistics of a SVF, one CSV line per label.
+ * @param  stream      output stream
+ * @param  svf         path to the SVF
+ * @param  statistics  statistics of the labels
+ */
+void writeStatistics(std::ostream & stream, const std::string & svf, const std::vector<LogJacobianLabelStatistics> & statistics)
+{
+    for ( unsigned int i=0; i<statistics.size(); i++ )
+    {
+        const LogJacobianLabelStatistics & s = statistics[i];
+        stream << svf << "," << s.label << "," << s.count << "," << s.mean << "," << s.std << ","
+               << s.min << "," << s.q05 << "," << s.q25 << "," << s.median << "," << s.q75 << ","
+               << s.q95 << "," << s.max << "," << s.volumeChange << "," << s.nonFinite << std::endl;
+    }
+}
 
-  ScalarReaderType::Pointer readerMask = ScalarReaderType::New();
-  VectorReaderType::Pointer reader1  = VectorReaderType::New();
 
-  float mult=param.ScalingFactor;
-  try
-  {
-   reader1->SetFileName(param.SVFImage);
-   reader1->Update();
-  }
-  catch 
-   (TCLAP::ArgException &e)
-  {
-   std::cerr << "Error: " << e.what() << std::endl;
-   return EXIT_FAILURE;
-  }
+/**
+ * Input and output of one SVF of the batch mode.
+ */
+struct BatchItem{
+    std::string  SVFImage;
+    std::string  Mask;
+    std::string  OutputImage;
+    float        ScalingFactor;
+    };
 
-  typedef itk::ImageRegionIterator<VectorImageType> IteratorType;  
-  
-  VectorImageType::Pointer Out1=VectorImageType::New();
-  Out1->SetRegions(reader1->GetOutput()->GetLargestPossibleRegion() );
-  Out1->SetSpacing( reader1->GetOutput()->GetSpacing() );
-  Out1->SetOrigin( reader1->GetOutput()->GetOrigin() );
-  Out1->SetDirection( reader1->GetOutput()->GetDirection() );
-  Out1->Allocate();
-  
-  IteratorType out1(Out1,reader1->GetOutput()->GetLargestPossibleRegion());
- 
-  typedef itk::Index<3> IndexType;
-  itk::Vector<float,3> Vect;  
-  
-  for (out1.GoToBegin();!out1.IsAtEnd();++out1 ) 
-    {
-      Vect.Fill(0);
-      const IndexType index=out1.GetIndex();
-      Vect= mult*(reader1->GetOutput()->GetPixel( index ));
-      out1.Set( Vect);
-    }
 
-  double minpixelspacing = Out1->GetSpacing()[0];
-  for (unsigned int i = 0; i<3; ++i)
-  {
-   if ( Out1->GetSpacing()[i] < minpixelspacing )
-     minpixelspacing = Out1->GetSpacing()[i];
-  }
+/**
+ * Deduces the default output path of an input SVF in batch mode.
+ * @param  svf    path to the input SVF
+ * @param  param  structure of parameters
+ * @return the output path
+ */
+std::string defaultOutputPath(const std::string & svf, const struct Param & param)
+{
+    std::string name = itksys::SystemTools::GetFilenameName( svf );
+    if ( name.size()>3 && name.compare( name.size()-3, 3, ".gz" )==0 )
+      name.erase( name.size()-3 );
+    name = itksys::SystemTools::GetFilenameWithoutLastExtension( name ) + param.OutputSuffix;
 
-   
-  IteratorType InputIt (Out1, Out1->GetRequestedRegion());
+    std::string directory = param.OutputDirectory.empty() ? itksys::SystemTools::GetFilenamePath( svf ) : param.OutputDirectory;
+    return directory.empty() ? name : directory + "/" + name;
+}
 
-  float norm2,maxnorm2=0;
-   
-  if (param.Mask!="null")
-   try
+
+/**
+ * Lists the SVFs of the batch mode, from the list file then the glob pattern.
+ * @param  param  structure of parameters
+ * @return the items of the batch
+ */
+std::vector<BatchItem> readBatchItems(const struct Param & param)
+{
+    std::vector<BatchItem> items;
+
+    if ( param.SVFList!="" )
     {
-     readerMask->SetFileName(param.Mask);
-     readerMask->Update();	
+        std::ifstream list( param.SVFList.c_str() );
+        if ( !list )
+            throw std::runtime_error("Unable to open the list of input fields.");
+
+        std::string line;
+        while ( std::getline(list, line) )
+        {
+            std::istringstream stream(line);
+            std::string path, scaling, mask, output;
+            if ( !(stream >> path) || path[0]=='#' )
+                continue;
+            stream >> scaling >> mask >> output;
+
+            BatchItem item;
+            item.SVFImage      = path;
+            item.ScalingFactor = param.ScalingFactor;
+            if ( scaling!="" && scaling!="-" )
+            {
+                std::istringstream value(scaling);
+                if ( !(value >> item.ScalingFactor) )
+                    throw std::runtime_error("Invalid scaling factor \"" + scaling + "\" in the list of input fields.");
+            }
+            item.Mask        = ( mask!="" && mask!="-" ) ? mask : param.Mask;
+            item.OutputImage = ( output!="" && output!="-" ) ? output : defaultOutputPath( path, param );
+            items.push_back(item);
+        }
     }
-   catch(TCLAP::ArgException &e)
+
+    if ( param.SVFGlob!="" )
     {
-     std::cerr << "Error: " << e.what() << std::endl;
-     return EXIT_FAILURE;
-    }
+        itksys::Glob glob;
+        if ( !glob.FindFiles( param.SVFGlob ) )
+            throw std::runtime_error("Invalid glob pattern \"" + param.SVFGlob + "\".");
 
-  /* 
-   *   Evaluate the maximum norm in the region of interest
-   */
-  
-  for( InputIt.GoToBegin(); !InputIt.IsAtEnd(); ++InputIt )
-  {
-   if ((param.Mask!="null"))
-   { if (readerMask->GetOutput()->GetPixel(InputIt.GetIndex())>0)
-     {
-      norm2 = InputIt.Get().GetSquaredNorm();
-      if (maxnorm2<norm2) 
-       maxnorm2=norm2;
-     }
-   }  
-   else 
-   {
-     norm2 = InputIt.Get().GetSquaredNorm();
-     if (maxnorm2<norm2) 
-       maxnorm2=norm2;
+        std::vector<std::string> files = glob.GetFiles();
+        std::sort( files.begin(), files.end() );
+        for ( unsigned int i=0; i<files.size(); i++ )
+        {
+            BatchItem item;
+            item.SVFImage      = files[i];
+            item.Mask          = param.Mask;
+            item.ScalingFactor = param.ScalingFactor;
+            item.OutputImage   = defaultOutputPath( files[i], param );
+            items.push_back(item);
+        }
     }
-   }
 
-  maxnorm2 /= vnl_math_sqr(minpixelspacing);
+    return items;
+}
 
 
-  /**
-    *    Evaluate the number numiter of iterations required 
-   **/
+typedef SVFLogJacobianComputer::VectorImageType  BatchVectorImageType;
+typedef SVFLogJacobianComputer::ImageType        BatchImageType;
 
- float divider;
- unsigned int numiter;
 
-  if (param.NumericalScheme==1)
+/**
+ * Reads the SVF and the mask of a batch item. The mask of the previous item
+ * is reused when it has the same path.
+ */
+struct ReadItemTask{
+    const BatchItem *               item;
+    std::string                     previousMaskPath;
+    BatchImageType::Pointer         previousMask;
+    BatchVectorImageType::Pointer   svf;
+    BatchImageType::Pointer         mask;
+
+    static void Run(void * data)
     {
-  /**
-   * Forward Euler: maxnorm(v)/numiter<0.5
-   **/
-      numiter = floor(2*sqrt(maxnorm2)+0.5);
-      divider=numiter;
+        ReadItemTask * task = static_cast<ReadItemTask *>( data );
+        task->svf  = NULL;
+        task->mask = NULL;
+
+        typedef itk::ImageFileReader< BatchVectorImageType > VectorReaderType;
+        VectorReaderType::Pointer reader = VectorReaderType::New();
+        reader->SetFileName( task->item->SVFImage );
+        reader->Update();
+        task->svf = reader->GetOutput();
+
+        if ( task->item->Mask!="null" )
+        {
+            if ( task->item->Mask==task->previousMaskPath && task->previousMask )
+                task->mask = task->previousMask;
+            else
+            {
+                typedef itk::ImageFileReader< BatchImageType > ScalarReaderType;
+                ScalarReaderType::Pointer readerMask = ScalarReaderType::New();
+                readerMask->SetFileName( task->item->Mask );
+                readerMask->Update();
+                task->mask = readerMask->GetOutput();
+            }
+        }
     }
-  else
-   {
-  /**
-   *  Scaling and Squaring: maxnorm(v)/2^numiter<0.5
-   **/
-    numiter = static_cast<unsigned int> (2.0 + 0.5 * vcl_log(maxnorm2)/vnl_math::ln2+0.5);
-    divider = static_cast<float>(1<<numiter);
-   }
+};
 
-  
-  /**
-    *     Scale the input SVF 
-   **/
-  typedef itk::DivideByConstantImageFilter<VectorImageType,float,VectorImageType> DividerType;
-  DividerType::Pointer Divider=DividerType::New();
-  Divider->SetInput(Out1);
-  Divider->SetConstant(divider );
-  Divider->Update();
 
+/**
+ * Writes the LogJacobian map of a batch item.
+ */
+struct WriteItemTask{
+    const BatchItem *           item;
+    BatchImageType::Pointer     logJacobian;
 
-  /**
-    *     Initialize the iterative computation 
-   **/
+    static void Run(void * data)
+    {
+        WriteItemTask * task = static_cast<WriteItemTask *>( data );
+        typedef itk::ImageFileWriter< BatchImageType > ImageWriterType;
+        ImageWriterType::Pointer writer = ImageWriterType::New();
+        writer->SetInput( task->logJacobian );
+        writer->SetFileName( task->item->OutputImage );
+        writer->Update();
+        task->logJacobian = NULL;
+    }
+};
 
 
-  typedef itk::AddImageFilter<VectorImageType,VectorImageType,VectorImageType> AdderType;
-  AdderType::Pointer Adder=AdderType::New();  
-  
-  VectorImageType::Pointer Vect1=VectorImageType::New();
-  Vect1=Divider->GetOutput();
+/**
+ * Computes the LogJacobian maps of the batch mode. An item that fails is
+ * reported and skipped.
+ * @param  items       items of the batch
+ * @param  param       structure of parameters
+ * @param  labels      label image of the statistics (NULL for none)
+ * @param  statistics  stream receiving the label statistics (NULL for none)
+ * @return the number of items that failed
+ */
+unsigned int runBatch(const std::vector<BatchItem> & items,
+                      const struct Param & param,
+                      const SVFLogJacobianComputer::LabelImageType * labels,
+                      std::ostream * statistics)
+{
+    SVFLogJacobianComputer computer;
+    computer.SetLabelImage( labels );
 
-  VectorImageType::Pointer warpedIm=VectorImageType::New();
-   
-  typedef itk::AddImageFilter<ImageType,ImageType,ImageType> AddImgFilterType;
-  AddImgFilterType::Pointer Add=AddImgFilterType::New();
+    // Two read slots: one being computed, one being prefetched
+    ReadItemTask     reads[2];
+    WriteItemTask    write;
+    itk::TaskGroup   reader, writer;
+    const BatchItem * written = NULL;
+    unsigned int failures = 0;
 
-  /**
-    *     Initial step: compute Div(v0)~logJac(v0) 
-   **/
+    reads[0].item = &items[0];
+    reader.Run( ReadItemTask::Run, &reads[0] );
 
-  
-  typedef itk::VectorIndexSelectionCastImageFilter< VectorImageType,ImageType> FilterType;
-  FilterType::Pointer componentExtractor0 = FilterType::New();
-  componentExtractor0->SetIndex( 0 );
-  FilterType::Pointer componentExtractor1 = FilterType::New();
-  componentExtractor1->SetIndex( 1);
-  FilterType::Pointer componentExtractor2 = FilterType::New();
-  componentExtractor2->SetIndex( 2 );
+    for ( unsigned int i=0; i<items.size(); i++ )
+    {
+        ReadItemTask & current = reads[i%2];
+        std::string error = reader.Wait();
 
-  componentExtractor0->SetInput( Vect1 );
-  componentExtractor1->SetInput( Vect1 );
-  componentExtractor2->SetInput( Vect1 );
+        // Prefetch the next item
+        if ( i+1<items.size() )
+        {
+            ReadItemTask & next   = reads[(i+1)%2];
+            next.item             = &items[i+1];
+            next.previousMaskPath = items[i].Mask;
+            next.previousMask     = current.mask;
+            reader.Run( ReadItemTask::Run, &next );
+        }
 
-  // Compute partial derivatives
+        BatchImageType::Pointer logJacobian;
+        if ( error.empty() )
+        {
+            try
+            {
+                logJacobian = computer.Compute( current.svf, current.mask, current.item->ScalingFactor, param.NumericalScheme );
+            }
+            catch( itk::ExceptionObject & err )
+            {
+                error = err.GetDescription();
+            }
+            catch( std::exception & err )
+            {
+                error = err.what();
+            }
+        }
+        current.svf = NULL;
 
-  typedef itk::DerivativeImageFilter<
-             ImageType, ImageType > DerivativeFilterType;
+        if ( !error.empty() )
+        {
+            std::cerr << "Error: " << current.item->SVFImage << ": " << error << std::endl;
+            failures++;
+            continue;
+        }
 
-  DerivativeFilterType::Pointer derivative0=DerivativeFilterType::New();
-  DerivativeFilterType::Pointer derivative1=DerivativeFilterType::New();
-  DerivativeFilterType::Pointer derivative2=DerivativeFilterType::New();
+        if ( statistics )
+            writeStatistics( *statistics, current.item->SVFImage, computer.GetLabelStatistics() );
 
-  derivative0->SetOrder(1);
-  derivative0->SetDirection(0);
+        std::cout << "  " << current.item->SVFImage << " -> "
+                  << ( param.NoOutputImage ? std::string("statistics") : current.item->OutputImage )
+                  << " (" << computer.GetNumberOfIterations() << " iterations)" << std::endl;
+        if ( param.NoOutputImage )
+            continue;
 
-  derivative1->SetOrder(1);
-  derivative1->SetDirection(1);
+        // Write the map while the next item is computed
+        std::string writeError = writer.Wait();
+        if ( !writeError.empty() )
+        {
+            std::cerr << "Error: " << written->OutputImage << ": " << writeError << std::endl;
+            failures++;
+        }
+        write.item        = current.item;
+        write.logJacobian = logJacobian;
+        written           = current.item;
+        writer.Run( WriteItemTask::Run, &write );
+    }
 
-  derivative2->SetOrder(1);
-  derivative2->SetDirection(2);
+    std::string writeError = writer.Wait();
+    if ( !writeError.empty() )
+    {
+        std::cerr << "Error: " << written->OutputImage << ": " << writeError << std::endl;
+        failures++;
+    }
+    return failures;
+}
 
-  derivative0->SetInput(componentExtractor0->GetOutput());
-  derivative1->SetInput(componentExtractor1->GetOutput());
-  derivative2->SetInput(componentExtractor2->GetOutput());
 
-  derivative0->Update();
-  derivative1->Update();
-  derivative2->Update();
+int main( int argc, char ** argv )
+{
   
-  AddImgFilterType::Pointer addFilter = AddImgFilterType::New();
-  addFilter->SetInput1( derivative0->GetOutput() );
-  addFilter->SetInput2( derivative1->GetOutput() );
-  addFilter->Update();
+  //Parsing initial parameters
+  struct Param param;
+  parseParameters( argc, argv, param);
 
-  AddImgFilterType::Pointer addFilter1 = AddImgFilterType::New();
-  addFilter1->SetInput1( derivative2->GetOutput() );
-  addFilter1->SetInput2(addFilter->GetOutput());
-  addFilter1->Update();
+  if (param.NoOutputImage && param.Labels=="")
+   {
+    std::cerr << "Error: --no-map requires a label image (-L)." << std::endl;
+    return EXIT_FAILURE;
+   }
 
-  ImageType::Pointer Image=addFilter1->GetOutput();
+  // Label image and statistics file
+  typedef itk::ImageFileReader< SVFLogJacobianComputer::LabelImageType > LabelReaderType;
+  SVFLogJacobianComputer::LabelImageType::Pointer labels;
+  std::ofstream statistics;
+  if (param.Labels!="")
+   {
+    try
+     {
+      LabelReaderType::Pointer readerLabels = LabelReaderType::New();
+      readerLabels->SetFileName(param.Labels);
+      readerLabels->Update();
+      labels = readerLabels->GetOutput();
+     }
+    catch( itk::ExceptionObject& e )
+     {
+      std::cerr << "Error: " << e.GetDescription() << std::endl;
+      return EXIT_FAILURE;
+     }
 
-    typedef itk::AddImageFilter<VectorImageType,VectorImageType,VectorImageType> AdderType;
-  AdderType::Pointer VectorAdder=AdderType::New();  
+    statistics.open( param.OutputStatistics.c_str() );
+    if (!statistics)
+     {
+      std::cerr << "Error: unable to open " << param.OutputStatistics << "." << std::endl;
+      return EXIT_FAILURE;
+     }
+    writeStatisticsHeader( statistics );
+   }
 
+  if (param.SVFList!="" || param.SVFGlob!="")
+   {
+    if (param.SVFImage!="" || !param.OutputDisplacement.empty() || !param.OutputTensor.empty())
+     {
+      std::cerr << "Error: the batch mode (-l, -g) cannot be combined with -i, -d or -t." << std::endl;
+      return EXIT_FAILURE;
+     }
 
-typedef itk::WarpVectorImageFilter<VectorImageType,VectorImageType,VectorImageType> WarperType;
+    std::vector<BatchItem> items;
+    try
+     {
+      items = readBatchItems( param );
+     }
+    catch( std::exception& e )
+     {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return EXIT_FAILURE;
+     }
+    if (items.empty())
+     {
+      std::cerr << "Error: no input stationary velocity field." << std::endl;
+      return EXIT_FAILURE;
+     }
 
-  WarperType::Pointer VectorWarper=WarperType::New();
-  VectorWarper->SetOutputOrigin(Out1->GetOrigin());
-  VectorWarper->SetOutputSpacing(Out1->GetSpacing());
-  VectorWarper->SetOutputDirection(Out1->GetDirection());
-//  VectorWarper->SetEdgePaddingValue(1); 
+    if (param.OutputDirectory!="" && !itksys::SystemTools::MakeDirectory( param.OutputDirectory.c_str() ))
+     {
+      std::cerr << "Error: unable to create the output directory " << param.OutputDirectory << "." << std::endl;
+      return EXIT_FAILURE;
+     }
 
-  typedef itk::ExpImageFilter<ImageType,ImageType> ExpImageFilterType;
-  ExpImageFilterType::Pointer ExpImage=ExpImageFilterType::New();
+    const unsigned int failures = runBatch( items, param, labels, labels ? &statistics : NULL );
+    std::cout << items.size()-failures << " of " << items.size() << " LogJacobian maps computed." << std::endl;
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+   }
 
-  typedef itk::LogImageFilter<ImageType,ImageType> LogImageFilterType;
-  LogImageFilterType::Pointer LogImage=LogImageFilterType::New();
+  if (param.SVFImage=="")
+   {
+    std::cerr << "Error: an input stationary velocity field (-i) or a batch (-l, -g) is required." << std::endl;
+    return EXIT_FAILURE;
+   }
 
+  //Definition of the type:  
+  typedef itk::Vector<float,3>  VectorPixelType;
+  typedef itk::Image<VectorPixelType,3> VectorImageType;	
+  typedef itk::Image<float,3> ImageType;
 
-  ExpImage->SetInput(Image);
-  ExpImage->Update();
+  //Definition of Reader and Writer Classes:
+  typedef itk::ImageFileReader< ImageType >  ScalarReaderType;
+  typedef itk::ImageFileReader< VectorImageType >  VectorReaderType;
 
-  typedef itk::WarpImageFilter<ImageType,ImageType,VectorImageType> WarpImgType;
-  WarpImgType::Pointer WarpImg=WarpImgType::New();
+  ScalarReaderType::Pointer readerMask = ScalarReaderType::New();
+  VectorReaderType::Pointer reader1  = VectorReaderType::New();
 
-  WarpImg->SetOutputOrigin(Vect1->GetOrigin());
-  WarpImg->SetOutputSpacing(Vect1->GetSpacing());
-  WarpImg->SetOutputDirection(Vect1->GetDirection());
-  WarpImg->SetEdgePaddingValue(1); 
+  float mult=param.ScalingFactor;
+  try
+  {
+   reader1->SetFileName(param.SVFImage);
+   reader1->Update();
+  }
+  catch 
+   (TCLAP::ArgException &e)
+  {
+   std::cerr << "Error: " << e.what() << std::endl;
+   return EXIT_FAILURE;
+  }
 
-   VectorImageType::Pointer WarpedIm=VectorImageType::New();
-  
-   if (param.NumericalScheme==1)
-     {  
-      /**
-        * Iterative step Forward Euler: compute numiter times logJac(exp(vi))=logJac(exp(vi-1))|exp(v0)+logJac(exp(vi-1)) 
-       **/
-      for( int i=0; i<numiter; i++ )
-        {
-         WarpImg->SetInput(Image);
-         VectorWarper->SetInput(Vect1);
-         
-         if (i==0)
-	   {
-	    WarpImg->SetDisplacementField(Vect1);
-	   }
-	  else
-           {
-	    WarpImg->SetDisplacementField(VectorAdder->GetOutput());
-	   }
-
-	  WarpImg->SetOutputOrigin(Vect1->GetOrigin());
-          WarpImg->SetOutputSpacing(Vect1->GetSpacing());
-          WarpImg->SetOutputDirection(Vect1->GetDirection());
-          WarpImg->UpdateLargestPossibleRegion();
-          
-          Add->SetInput1(WarpImg->GetOutput());
- 
-	  if (i==0)
-	    {
-	     Add->SetInput2(Image);
-	     VectorWarper->SetDisplacementField(Vect1);
-	    }
-          else
-	    {
-	     Add->SetInput2(Add->GetOutput());
-	     VectorWarper->SetDisplacementField(VectorAdder->GetOutput());
-            }
-	  
-	  Add->Update();
-          VectorWarper->GetOutput()->SetRequestedRegion(Vect1->GetRequestedRegion());
-          VectorWarper->Update();
-          WarpedIm = VectorWarper->GetOutput();
-          WarpedIm->DisconnectPipeline();
-           
-          VectorAdder->SetInput1(Vect1);
-	  VectorAdder->SetInput2(WarpedIm);
-	  VectorAdder->GetOutput()->SetRequestedRegion(Vect1->GetRequestedRegion() );
-	  VectorAdder->Update(); 
-
-	}
-      }
-   else
-      {
-  /**
-    *     Iterative step Scaling and Squaring: compute numiter times logJac(exp(vi))=log[det(Jac(exp(vi-1)))|exp(vi-1)]+log[det(Jac(exp(vi-1)))] 
-   **/
-      for( int i=0; i<numiter; i++ )
-	{
-         WarpImg->SetInput(ExpImage->GetOutput());
-         WarpImg->SetDisplacementField(Vect1);
-         WarpImg->Update();
-
-         LogImage->SetInput(WarpImg->GetOutput());
-         LogImage->Update();
-
-         Add->SetInput1(LogImage->GetOutput());
-         Add->SetInput2(Image);
-         Add->Update();
-
-         VectorWarper->SetInput(Vect1); 
-         VectorWarper->SetDisplacementField(Vect1); 
-         VectorWarper->GetOutput()->SetRequestedRegion(Vect1->GetRequestedRegion());
-         VectorWarper->Update();
-   
-         WarpedIm= VectorWarper->GetOutput(); 
-         WarpedIm->DisconnectPipeline();
-
-         VectorAdder->SetInput1(Vect1);
-         VectorAdder->SetInput2(WarpedIm);
-         VectorAdder->GetOutput()->SetRequestedRegion(Vect1->GetRequestedRegion());
-         VectorAdder->Update();
-     
-
-         Vect1=VectorAdder->GetOutput();
-         Vect1->DisconnectPipeline();
-         Image=Add->GetOutput();
-         Image->DisconnectPipeline();
-         ExpImage->SetInput(Add->GetOutput());
-         ExpImage->Update();
-        }
-      }
+  if (param.Mask!="null")
+   try
+    {
+     readerMask->SetFileName(param.Mask);
+     readerMask->Update();	
+    }
+   catch(TCLAP::ArgException &e)
+    {
+     std::cerr << "Error: " << e.what() << std::endl;
+     return EXIT_FAILURE;
+    }
 
-  typedef itk::ImageFileWriter<ImageType> ImageWriterType;
-  ImageWriterType::Pointer WriterImg=ImageWriterType::New();
+  if ((!param.OutputDisplacement.empty() || !param.OutputTensor.empty()) && param.NumericalScheme)
+   {
+    std::cerr << "Error: the displacement field and the tensor map are only computed with scaling and squarings." << std::endl;
+    return EXIT_FAILURE;
+   }
 
-  WriterImg->SetInput(Add->GetOutput());
-  WriterImg->SetFileName(param.OutputImage);
-  WriterImg->Update();
+  VectorImageType::Pointer Displacement;
+  ImageType::Pointer LogJacobian;
+  SVFLogJacobianComputer Computer;
+  try
+   {
+    Computer.SetLabelImage(labels);
+    LogJacobian = Computer.Compute( reader1->GetOutput(),
+                                    param.Mask!="null" ? readerMask->GetOutput() : NULL,
+                                    mult,
+                                    param.NumericalScheme,
+                                    param.OutputDisplacement.empty() && param.OutputTensor.empty() ? NULL : &Displacement );
+   }
+  catch( std::exception& e )
+   {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+   }
+
+  if (labels)
+    writeStatistics( statistics, param.SVFImage, Computer.GetLabelStatistics() );
+
+  if (!param.NoOutputImage)
+   {
+    typedef itk::ImageFileWriter<ImageType> ImageWriterType;
+    ImageWriterType::Pointer WriterImg=ImageWriterType::New();
+
+    WriterImg->SetInput(LogJacobian);
+    WriterImg->SetFileName(param.OutputImage);
+    WriterImg->Update();
+   }
+
+  if (!param.OutputTensor.empty())
+   {
+    typedef itk::Image<itk::Vector<float,9>,3> TensorImageType;
+    typedef itk::DisplacementFieldLogJacobianTensorFilter<VectorImageType,TensorImageType> TensorFilterType;
+    TensorFilterType::Pointer TensorFilter=TensorFilterType::New();
+    TensorFilter->SetInput(Displacement);
+
+    typedef itk::ImageFileWriter<TensorImageType> TensorWriterType;
+    TensorWriterType::Pointer WriterTensor=TensorWriterType::New();
+    WriterTensor->SetInput(TensorFilter->GetOutput());
+    WriterTensor->SetFileName(param.OutputTensor);
+    try
+     {
+      WriterTensor->Update();
+     }
+    catch( itk::ExceptionObject& e )
+     {
+      std::cerr << "Error: " << e.GetDescription() << std::endl;
+      return EXIT_FAILURE;
+     }
+    if (TensorFilter->GetNumberOfFoldedVoxels()>0)
+      std::cout << "  " << TensorFilter->GetNumberOfFoldedVoxels()
+                << " voxels with a non-positive Jacobian determinant have a zero log-Jacobian tensor." << std::endl;
+   }
+
+  if (Displacement && !param.OutputDisplacement.empty())
+   {
+    typedef itk::ImageFileWriter<VectorImageType> VectorWriterType;
+    VectorWriterType::Pointer WriterDisplacement=VectorWriterType::New();
+    WriterDisplacement->SetInput(Displacement);
+    WriterDisplacement->SetFileName(param.OutputDisplacement);
+    WriterDisplacement->Update();
+   }
 
 
   return EXIT_SUCCESS;
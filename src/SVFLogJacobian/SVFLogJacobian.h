@@ -0,0 +1,633 @@
+#ifndef __SVFLogJacobian_h
+#define __SVFLogJacobian_h
+
+#include "itkImage.h"
+#include "itkMatrix.h"
+#include "itkMultiThreader.h"
+#include <vnl/vnl_math.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include "itkExponentialDeformationFieldLogJacobianImageFilter.h"
+#include "itkRegistrationThreadPool.h"
+
+/*
+ * Iterative computation of the logJacobian scalar map of a deformation field
+ * parametrized by a stationary velocity field (SVF), see SVFLogJacobian.cxx.
+ * The computation is kept apart from the command line tool so that it can be
+ * called on fields in memory (e.g. by the benchmarks).
+ */
+
+
+/**
+ * Statistics of the logJacobian map in a labelled region. The quantiles are
+ * interpolated in a histogram of the values of the region, and the volume
+ * change is mean(|Jac|)-1. Non finite values (e.g. from folded voxels) are
+ * only counted.
+ */
+struct LogJacobianLabelStatistics{
+    unsigned int  label;
+    size_t        count;
+    size_t        nonFinite;
+    double        mean;
+    double        std;
+    double        min;
+    double        q05;
+    double        q25;
+    double        median;
+    double        q75;
+    double        q95;
+    double        max;
+    double        volumeChange;
+    };
+
+
+/**
+ * Computes logJacobian maps of stationary velocity fields. All the steps are
+ * run on raw buffers by all the threads: the scaling is fused with the
+ * divergence, and the forward Euler iterations interpolate the divergence and
+ * the velocity field with the same weights, alternating between two buffers.
+ * The buffers and the exponentiation filter are kept between calls, so that
+ * an object computing the maps of many fields of the same size allocates
+ * nothing but the returned images.
+ *
+ * Given a label image, the statistics of the map in each label (except 0) are
+ * computed by two threaded reductions over the map, with per-thread moments
+ * and histograms.
+ */
+class SVFLogJacobianComputer
+{
+public:
+
+  typedef itk::Vector<float,3>                     VectorPixelType;
+  typedef itk::Image<VectorPixelType,3>            VectorImageType;
+  typedef itk::Image<float,3>                      ImageType;
+  typedef itk::Image<unsigned int,3>               LabelImageType;
+  typedef itk::ExponentialDeformationFieldLogJacobianImageFilter<VectorImageType,VectorImageType,ImageType>
+                                                   ExponentiatorType;
+
+  SVFLogJacobianComputer()
+  {
+    m_NumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    m_Exponentiator = ExponentiatorType::New();
+    m_Exponentiator->AutomaticNumberOfIterationsOff();
+    m_NumberOfIterations = 0;
+    m_Step = MaximumNormStep;
+    m_Input = 0;
+    m_Mask = 0;
+    m_Scale = 1.0;
+    m_CurrentDisplacement = 0;
+    m_NextDisplacement = 0;
+    m_LogJacobian = 0;
+    m_UpdateDisplacement = false;
+    m_NumberOfPixels = 0;
+    m_NumberOfLabelledPixels = 0;
+    m_StatisticsInput = 0;
+  }
+
+  /** Number of threads of all the steps. */
+  void SetNumberOfThreads( unsigned int n ) { m_NumberOfThreads = std::max( 1u, n ); }
+  unsigned int GetNumberOfThreads() const   { return m_NumberOfThreads; }
+
+  /** Number of iterations of the last computation. */
+  unsigned int GetNumberOfIterations() const { return m_NumberOfIterations; }
+
+  /** Number of histogram bins per label for the quantiles. */
+  static const unsigned int NumberOfHistogramBins = 1024;
+
+  /**
+   * Sets the label image of the statistics (NULL: no statistics). It must have
+   * the size of the velocity fields, and is indexed once for all the fields.
+   */
+  void SetLabelImage( const LabelImageType * labels );
+
+  /** Statistics of each label for the last computation, by increasing label. */
+  const std::vector<LogJacobianLabelStatistics> & GetLabelStatistics() const { return m_LabelStatistics; }
+
+  /**
+   * Computes the logJacobian map of the exponential of a stationary velocity field.
+   * @param  svf              input stationary velocity field
+   * @param  mask             mask restricting the computation of the scaling step (NULL for the whole image)
+   * @param  mult             scaling factor for the input velocity field
+   * @param  numericalScheme  numerical scheme for the exponential: false scaling and squarings, true forward Euler
+   * @param  displacement     if not NULL and with scaling and squarings, receives the displacement field
+   *                          exp(mult*svf) computed in the same loop as the logJacobian map
+   * @return the logJacobian map
+   */
+  ImageType::Pointer Compute( const VectorImageType * svf,
+                              const ImageType * mask,
+                              float mult,
+                              bool numericalScheme,
+                              VectorImageType::Pointer * displacement = NULL );
+
+private:
+
+  typedef enum {
+    MaximumNormStep,   // maximum squared norm of the input in the mask
+    DivergenceStep,    // v0 = s*v and div(v0)
+    EulerStep,         // logJac += div(v0)o(Id+u), u = v0 + v0o(Id+u)
+    MomentsStep,       // count, sums, min and max of each label
+    HistogramStep      // histogram of each label between its min and max
+  } StepType;
+
+  ImageType::Pointer ComputeMap( const VectorImageType * svf,
+                                 const ImageType * mask,
+                                 float mult,
+                                 bool numericalScheme,
+                                 VectorImageType::Pointer * displacement );
+  void ComputeLabelStatistics( const ImageType * logJacobian );
+
+  void RunStep( StepType step );
+  static void StepCallback( void * data, itk::SizeValueType begin, itk::SizeValueType end, itk::ThreadIdType threadId );
+  void ThreadedStep( size_t begin, size_t end, unsigned int threadId );
+
+  unsigned int                       m_NumberOfThreads;
+  ExponentiatorType::Pointer         m_Exponentiator;
+  unsigned int                       m_NumberOfIterations;
+
+  // Buffers of the forward Euler scheme, kept between calls
+  std::vector<VectorPixelType>       m_Velocity;
+  std::vector<VectorPixelType>       m_Displacement[2];
+  std::vector<float>                 m_Divergence;
+
+  // State of the current step
+  StepType                           m_Step;
+  const VectorPixelType *            m_Input;
+  const float *                      m_Mask;
+  double                             m_Scale;
+  std::vector<double>                m_ThreadMaximumNorm;
+  const VectorPixelType *            m_CurrentDisplacement;
+  VectorPixelType *                  m_NextDisplacement;
+  float *                            m_LogJacobian;
+  bool                               m_UpdateDisplacement;
+
+  // Labels: dense index of the label of each voxel (-1 for the background)
+  LabelImageType::ConstPointer       m_LabelImage;
+  std::vector<int>                   m_LabelIndex;
+  std::vector<unsigned int>          m_LabelValues;
+  size_t                             m_NumberOfLabelledPixels;
+  std::vector<LogJacobianLabelStatistics> m_LabelStatistics;
+
+  // Per-thread reductions of the statistics (thread-major)
+  const float *                      m_StatisticsInput;
+  std::vector<double>                m_ThreadSums;        // sum, sum of squares, sum of exp
+  std::vector<size_t>                m_ThreadCounts;      // finite and non finite values
+  std::vector<float>                 m_ThreadMinimum;
+  std::vector<float>                 m_ThreadMaximum;
+  std::vector<unsigned int>          m_ThreadHistograms;
+  std::vector<double>                m_HistogramOrigin;
+  std::vector<double>                m_HistogramScale;
+
+  // Geometry of the field
+  size_t                             m_Size[3];
+  size_t                             m_Stride[3];
+  size_t                             m_NumberOfPixels;
+  double                             m_Spacing[3];
+  itk::Matrix<double,3,3>            m_PhysicalToIndex;
+};
+
+
+inline SVFLogJacobianComputer::ImageType::Pointer
+SVFLogJacobianComputer::Compute( const VectorImageType * svf,
+                                 const ImageType * mask,
+                                 float mult,
+                                 bool numericalScheme,
+                                 VectorImageType::Pointer * displacement )
+{
+  if ( m_LabelImage && m_LabelImage->GetBufferedRegion() != svf->GetLargestPossibleRegion() )
+    throw std::runtime_error( "The label image and the velocity field must have the same size." );
+
+  ImageType::Pointer logJacobian = this->ComputeMap( svf, mask, mult, numericalScheme, displacement );
+
+  m_LabelStatistics.clear();
+  if ( m_LabelImage )
+    this->ComputeLabelStatistics( logJacobian );
+  return logJacobian;
+}
+
+
+inline void SVFLogJacobianComputer::SetLabelImage( const LabelImageType * labels )
+{
+  m_LabelImage = labels;
+  m_LabelIndex.clear();
+  m_LabelValues.clear();
+  m_NumberOfLabelledPixels = 0;
+  if ( !labels )
+    return;
+
+  const unsigned int * buffer = labels->GetBufferPointer();
+  const size_t numberOfPixels = labels->GetBufferedRegion().GetNumberOfPixels();
+
+  // Labels present in the image, by increasing value
+  for ( size_t k=0; k<numberOfPixels; k++ )
+    if ( buffer[k] && ( m_LabelValues.empty() || m_LabelValues.back()!=buffer[k] ) )
+      m_LabelValues.push_back( buffer[k] );
+  std::sort( m_LabelValues.begin(), m_LabelValues.end() );
+  m_LabelValues.erase( std::unique( m_LabelValues.begin(), m_LabelValues.end() ), m_LabelValues.end() );
+
+  m_LabelIndex.resize( numberOfPixels );
+  for ( size_t k=0; k<numberOfPixels; k++ )
+   {
+    if ( buffer[k] )
+     {
+      m_LabelIndex[k] = static_cast<int>( std::lower_bound( m_LabelValues.begin(), m_LabelValues.end(), buffer[k] ) - m_LabelValues.begin() );
+      m_NumberOfLabelledPixels++;
+     }
+    else
+      m_LabelIndex[k] = -1;
+   }
+}
+
+
+inline void SVFLogJacobianComputer::ComputeLabelStatistics( const ImageType * logJacobian )
+{
+  const size_t numberOfLabels  = m_LabelValues.size();
+  const size_t numberOfThreads = m_NumberOfThreads;
+  m_StatisticsInput = logJacobian->GetBufferPointer();
+
+  // Moments, minimum and maximum
+  m_ThreadSums.assign( numberOfThreads * numberOfLabels * 3, 0.0 );
+  m_ThreadCounts.assign( numberOfThreads * numberOfLabels * 2, 0 );
+  m_ThreadMinimum.assign( numberOfThreads * numberOfLabels, std::numeric_limits<float>::max() );
+  m_ThreadMaximum.assign( numberOfThreads * numberOfLabels, -std::numeric_limits<float>::max() );
+  this->RunStep( MomentsStep );
+
+  m_LabelStatistics.resize( numberOfLabels );
+  m_HistogramOrigin.resize( numberOfLabels );
+  m_HistogramScale.resize( numberOfLabels );
+  for ( size_t l=0; l<numberOfLabels; l++ )
+   {
+    LogJacobianLabelStatistics & statistics = m_LabelStatistics[l];
+    double sum = 0.0, sum2 = 0.0, sumExp = 0.0;
+    statistics.label     = m_LabelValues[l];
+    statistics.count     = 0;
+    statistics.nonFinite = 0;
+    statistics.min       = std::numeric_limits<float>::max();
+    statistics.max       = -std::numeric_limits<float>::max();
+    for ( size_t t=0; t<numberOfThreads; t++ )
+     {
+      const size_t i = t * numberOfLabels + l;
+      sum    += m_ThreadSums[3*i];
+      sum2   += m_ThreadSums[3*i+1];
+      sumExp += m_ThreadSums[3*i+2];
+      statistics.count     += m_ThreadCounts[2*i];
+      statistics.nonFinite += m_ThreadCounts[2*i+1];
+      statistics.min = std::min( statistics.min, static_cast<double>( m_ThreadMinimum[i] ) );
+      statistics.max = std::max( statistics.max, static_cast<double>( m_ThreadMaximum[i] ) );
+     }
+
+    const double n = static_cast<double>( std::max<size_t>( statistics.count, 1 ) );
+    statistics.mean         = sum / n;
+    statistics.std          = std::sqrt( std::max( 0.0, sum2 / n - vnl_math_sqr( statistics.mean ) ) );
+    statistics.volumeChange = sumExp / n - 1.0;
+    if ( !statistics.count )
+      statistics.min = statistics.max = 0.0;
+
+    m_HistogramOrigin[l] = statistics.min;
+    m_HistogramScale[l]  = statistics.max > statistics.min ?
+                           NumberOfHistogramBins / ( statistics.max - statistics.min ) : 0.0;
+   }
+
+  // Histograms between the minimum and the maximum of each label
+  m_ThreadHistograms.assign( numberOfThreads * numberOfLabels * NumberOfHistogramBins, 0 );
+  this->RunStep( HistogramStep );
+
+  std::vector<double> histogram( NumberOfHistogramBins );
+  const double quantiles[5] = { 0.05, 0.25, 0.5, 0.75, 0.95 };
+  for ( size_t l=0; l<numberOfLabels; l++ )
+   {
+    LogJacobianLabelStatistics & statistics = m_LabelStatistics[l];
+    std::fill( histogram.begin(), histogram.end(), 0.0 );
+    for ( size_t t=0; t<numberOfThreads; t++ )
+     {
+      const unsigned int * threadHistogram = &m_ThreadHistograms[( t * numberOfLabels + l ) * NumberOfHistogramBins];
+      for ( unsigned int b=0; b<NumberOfHistogramBins; b++ )
+        histogram[b] += threadHistogram[b];
+     }
+
+    // Quantiles interpolated linearly in their bin
+    double values[5];
+    const double width = m_HistogramScale[l] > 0 ? 1.0 / m_HistogramScale[l] : 0.0;
+    for ( unsigned int q=0; q<5; q++ )
+     {
+      const double target = quantiles[q] * statistics.count;
+      double cumulated = 0.0;
+      unsigned int b = 0;
+      while ( b+1<NumberOfHistogramBins && cumulated + histogram[b] < target )
+        cumulated += histogram[b++];
+      const double fraction = histogram[b]>0 ? ( target - cumulated ) / histogram[b] : 0.0;
+      values[q] = std::min( statistics.max, statistics.min + ( b + fraction ) * width );
+     }
+    statistics.q05    = values[0];
+    statistics.q25    = values[1];
+    statistics.median = values[2];
+    statistics.q75    = values[3];
+    statistics.q95    = values[4];
+   }
+}
+
+
+inline SVFLogJacobianComputer::ImageType::Pointer
+SVFLogJacobianComputer::ComputeMap( const VectorImageType * svf,
+                                    const ImageType * mask,
+                                    float mult,
+                                    bool numericalScheme,
+                                    VectorImageType::Pointer * displacement )
+{
+  // Geometry of the field
+  const VectorImageType::RegionType region = svf->GetLargestPossibleRegion();
+  if ( svf->GetBufferedRegion() != region )
+    throw std::runtime_error( "The velocity field must be buffered on its largest possible region." );
+  if ( mask && mask->GetBufferedRegion() != region )
+    throw std::runtime_error( "The mask and the velocity field must have the same size." );
+
+  itk::Matrix<double,3,3> indexToPhysical;
+  double minpixelspacing = svf->GetSpacing()[0];
+  m_NumberOfPixels = 1;
+  for (unsigned int d = 0; d<3; ++d)
+  {
+   m_Size[d]    = region.GetSize()[d];
+   m_Stride[d]  = m_NumberOfPixels;
+   m_Spacing[d] = svf->GetSpacing()[d];
+   m_NumberOfPixels *= m_Size[d];
+   if ( m_Spacing[d] < minpixelspacing )
+     minpixelspacing = m_Spacing[d];
+   for (unsigned int j = 0; j<3; ++j)
+     indexToPhysical(j,d) = svf->GetDirection()(j,d) * m_Spacing[d];
+  }
+  m_PhysicalToIndex = indexToPhysical.GetInverse();
+
+  m_Input = svf->GetBufferPointer();
+  m_Mask  = mask ? mask->GetBufferPointer() : 0;
+
+
+  /* 
+   *   Evaluate the maximum norm in the region of interest
+   */
+
+  this->RunStep( MaximumNormStep );
+  double maxnorm2 = *std::max_element( m_ThreadMaximumNorm.begin(), m_ThreadMaximumNorm.end() );
+  maxnorm2 *= vnl_math_sqr( mult );
+  maxnorm2 /= vnl_math_sqr( minpixelspacing );
+
+
+  /**
+    *    Evaluate the number numiter of iterations required 
+   **/
+
+  unsigned int numiter = 0;
+  if (numericalScheme==1)
+   {
+  /**
+   * Forward Euler: maxnorm(v)/numiter<0.5
+   **/
+    numiter = static_cast<unsigned int>( floor(2*sqrt(maxnorm2)+0.5) );
+   }
+  else if (maxnorm2 > 0)
+   {
+  /**
+   *  Scaling and Squaring: maxnorm(v)/2^numiter<0.5
+   **/
+    const double numiterfloat = 2.0 + 0.5 * vcl_log(maxnorm2)/vnl_math::ln2+0.5;
+    if (numiterfloat > 0)
+      numiter = static_cast<unsigned int>( numiterfloat );
+   }
+  m_NumberOfIterations = numiter;
+
+
+  if (numericalScheme==0)
+   {
+  /**
+    *     Scaling and Squaring of the displacement and of the Jacobian in a single loop
+   **/
+    m_Exponentiator->SetInput(svf);
+    m_Exponentiator->SetMultiplicativeFactor(mult);
+    m_Exponentiator->SetMaximumNumberOfIterations(numiter);
+    m_Exponentiator->SetNumberOfThreads(m_NumberOfThreads);
+    m_Exponentiator->Update();
+
+    if (displacement)
+     {
+      *displacement = m_Exponentiator->GetOutput();
+      (*displacement)->DisconnectPipeline();
+     }
+
+    ImageType::Pointer logJacobian = m_Exponentiator->GetLogJacobianOutput();
+    logJacobian->DisconnectPipeline();
+    return logJacobian;
+   }
+
+
+  /**
+    *     Forward Euler: v0 = v/numiter, logJac(exp(v0)) ~ Div(v0), then numiter times
+    *     logJac(exp(vi)) = Div(v0)|exp(vi-1) + logJac(exp(vi-1))
+   **/
+
+  ImageType::Pointer logJacobian = ImageType::New();
+  logJacobian->CopyInformation( svf );
+  logJacobian->SetRegions( region );
+  logJacobian->Allocate();
+
+  m_Velocity.resize( m_NumberOfPixels );
+  m_Divergence.resize( m_NumberOfPixels );
+  m_Scale       = mult / static_cast<double>( std::max( numiter, 1u ) );
+  m_LogJacobian = logJacobian->GetBufferPointer();
+  this->RunStep( DivergenceStep );
+
+  if ( numiter > 1 )
+   {
+    m_Displacement[0].resize( m_NumberOfPixels );
+    m_Displacement[1].resize( m_NumberOfPixels );
+   }
+
+  // The first displacement is v0, then the buffers alternate
+  m_CurrentDisplacement = &m_Velocity[0];
+  for( unsigned int i=0; i<numiter; i++ )
+   {
+    m_UpdateDisplacement = ( i+1 < numiter );
+    m_NextDisplacement   = m_UpdateDisplacement ? &m_Displacement[i%2][0] : 0;
+    this->RunStep( EulerStep );
+    m_CurrentDisplacement = m_NextDisplacement;
+   }
+
+  return logJacobian;
+}
+
+
+inline void SVFLogJacobianComputer::RunStep( StepType step )
+{
+  m_Step = step;
+  m_ThreadMaximumNorm.assign( m_NumberOfThreads, 0.0 );
+  itk::RegistrationThreadPool::GetGlobalPool()->ParallelFor( m_NumberOfPixels, m_NumberOfThreads,
+                                                             SVFLogJacobianComputer::StepCallback, this );
+}
+
+
+inline void SVFLogJacobianComputer::StepCallback( void * data, itk::SizeValueType begin, itk::SizeValueType end,
+                                                  itk::ThreadIdType threadId )
+{
+  static_cast<SVFLogJacobianComputer *>( data )->ThreadedStep( begin, end, threadId );
+}
+
+
+inline void SVFLogJacobianComputer::ThreadedStep( size_t begin, size_t end, unsigned int threadId )
+{
+  if ( m_Step == MaximumNormStep )
+   {
+    double maxnorm2 = 0.0;
+    for ( size_t k=begin; k<end; k++ )
+      if ( !m_Mask || m_Mask[k]>0 )
+        maxnorm2 = std::max( maxnorm2, static_cast<double>( m_Input[k].GetSquaredNorm() ) );
+    m_ThreadMaximumNorm[threadId] = std::max( m_ThreadMaximumNorm[threadId], maxnorm2 );
+    return;
+   }
+
+  if ( m_Step == MomentsStep )
+   {
+    const size_t numberOfLabels = m_LabelValues.size();
+    double * sums     = &m_ThreadSums[3 * threadId * numberOfLabels];
+    size_t * counts   = &m_ThreadCounts[2 * threadId * numberOfLabels];
+    float *  minimum  = &m_ThreadMinimum[threadId * numberOfLabels];
+    float *  maximum  = &m_ThreadMaximum[threadId * numberOfLabels];
+    for ( size_t k=begin; k<end; k++ )
+     {
+      const int l = m_LabelIndex[k];
+      if ( l<0 )
+        continue;
+      const float value = m_StatisticsInput[k];
+      if ( !vnl_math_isfinite( value ) )
+       {
+        counts[2*l+1]++;
+        continue;
+       }
+      counts[2*l]++;
+      sums[3*l]   += value;
+      sums[3*l+1] += value * value;
+      sums[3*l+2] += std::exp( static_cast<double>( value ) );
+      minimum[l] = std::min( minimum[l], value );
+      maximum[l] = std::max( maximum[l], value );
+     }
+    return;
+   }
+
+  if ( m_Step == HistogramStep )
+   {
+    const size_t numberOfLabels = m_LabelValues.size();
+    unsigned int * histograms = &m_ThreadHistograms[threadId * numberOfLabels * NumberOfHistogramBins];
+    for ( size_t k=begin; k<end; k++ )
+     {
+      const int l = m_LabelIndex[k];
+      if ( l<0 || !vnl_math_isfinite( m_StatisticsInput[k] ) )
+        continue;
+      const double bin = ( m_StatisticsInput[k] - m_HistogramOrigin[l] ) * m_HistogramScale[l];
+      histograms[l * NumberOfHistogramBins + std::min( static_cast<unsigned int>( bin ), NumberOfHistogramBins-1 )]++;
+     }
+    return;
+   }
+
+  size_t index[3];
+  for ( unsigned int d=0; d<3; d++ )
+    index[d] = ( begin / m_Stride[d] ) % m_Size[d];
+
+  for ( size_t k=begin; k<end; k++ )
+   {
+    if ( m_Step == DivergenceStep )
+     {
+      // Scaling, and central differences with zero flux at the borders as DerivativeImageFilter
+      double divergence = 0.0;
+      for ( unsigned int d=0; d<3; d++ )
+       {
+        const size_t lower = index[d] > 0             ? k - m_Stride[d] : k;
+        const size_t upper = index[d] + 1 < m_Size[d] ? k + m_Stride[d] : k;
+        divergence += ( m_Input[upper][d] - m_Input[lower][d] ) / ( 2.0 * m_Spacing[d] );
+        m_Velocity[k][d] = static_cast<float>( m_Scale * m_Input[k][d] );
+       }
+      m_Divergence[k]  = static_cast<float>( m_Scale * divergence );
+      m_LogJacobian[k] = m_Divergence[k];
+     }
+    else
+     {
+      // Warped point; as WarpImageFilter, points farther than half a voxel
+      // out of the image take the padding values (0 for the field, 1 for
+      // the divergence)
+      const VectorPixelType & u = m_CurrentDisplacement[k];
+      bool   inside = true;
+      size_t base = 0;
+      size_t upperOffset[3];
+      double fraction[3];
+      for ( unsigned int d=0; d<3 && inside; d++ )
+       {
+        double c = static_cast<double>( index[d] );
+        for ( unsigned int j=0; j<3; j++ )
+          c += m_PhysicalToIndex(d,j) * u[j];
+        if ( c < -0.5 || c >= m_Size[d] - 0.5 )
+          inside = false;
+        c = std::max( 0.0, std::min( c, static_cast<double>( m_Size[d] - 1 ) ) );
+        const size_t lower = static_cast<size_t>( c );
+        fraction[d]    = c - lower;
+        upperOffset[d] = lower + 1 < m_Size[d] ? m_Stride[d] : 0;
+        base += lower * m_Stride[d];
+       }
+
+      double interpolatedVelocity[3] = { 0.0, 0.0, 0.0 };
+      double interpolatedDivergence  = 1.0;
+      if ( inside )
+       {
+        // Linear interpolation of the velocity and of the divergence with the same weights
+        interpolatedDivergence = 0.0;
+        for ( unsigned int corner=0; corner<8; corner++ )
+         {
+          double weight = 1.0;
+          size_t offset = base;
+          for ( unsigned int d=0; d<3; d++ )
+           {
+            if ( corner & (1u << d) )
+             {
+              weight *= fraction[d];
+              offset += upperOffset[d];
+             }
+            else
+              weight *= 1.0 - fraction[d];
+           }
+          if ( weight == 0.0 )
+            continue;
+          for ( unsigned int d=0; d<3; d++ )
+            interpolatedVelocity[d] += weight * m_Velocity[offset][d];
+          interpolatedDivergence += weight * m_Divergence[offset];
+         }
+       }
+
+      m_LogJacobian[k] += static_cast<float>( interpolatedDivergence );
+      if ( m_UpdateDisplacement )
+        for ( unsigned int d=0; d<3; d++ )
+          m_NextDisplacement[k][d] = static_cast<float>( m_Velocity[k][d] + interpolatedVelocity[d] );
+     }
+
+    // Next voxel
+    for ( unsigned int d=0; d<3; d++ )
+     {
+      if ( ++index[d] < m_Size[d] )
+        break;
+      index[d] = 0;
+     }
+   }
+}
+
+
+/**
+ * Computes the logJacobian map of the exponential of a stationary velocity field
+ * (see SVFLogJacobianComputer::Compute, which keeps its buffers between calls).
+ */
+inline itk::Image<float,3>::Pointer ComputeSVFLogJacobian( const itk::Image<itk::Vector<float,3>,3> * svf,
+                                                           const itk::Image<float,3> * mask,
+                                                           float mult,
+                                                           bool numericalScheme,
+                                                           itk::Image<itk::Vector<float,3>,3>::Pointer * displacement = NULL )
+{
+  SVFLogJacobianComputer computer;
+  return computer.Compute( svf, mask, mult, numericalScheme, displacement );
+}
+
+#endif